@@ -20,6 +20,7 @@
 #include <getopt.h>
 #endif
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -32,18 +33,24 @@
 #include <openssl/pem.h>
 #include <openssl/sha.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 #include <unistd.h>
 
 #include "ccan/endian/endian.h"
 #include "container.c"
 #include "container.h"
+#include "libstbcontainer.h"
+#include "timings.h"
 
 #define CONTAINER_HDR 0
 #define PREFIX_HDR 1
@@ -55,195 +62,52 @@ bool verbose = false;
 bool debug = false;
 int wrap = 100;
 
-void usage(int status);
+struct stb_ctx *stb;
 
-unsigned char *calc_hash(uint8_t hash_alg,
-			 const unsigned char *data, size_t len,
-			 unsigned char *md)
-{
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	uint32_t md_len = SHA512_DIGEST_LENGTH;
-	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-	const EVP_MD* alg;
-
-	switch (hash_alg) {
-	case HASH_ALG_SHA512:
-		alg = EVP_sha512();
-		break;
-	case HASH_ALG_SHA3_512:
-		alg = EVP_sha3_512();
-		break;
-	default:
-		return NULL;
-	}
-	EVP_DigestInit_ex(ctx, alg, NULL);
-	EVP_DigestUpdate(ctx, data, len);
-	EVP_DigestFinal_ex(ctx, md, &md_len);
-	EVP_MD_CTX_destroy(ctx);
-	return md;
-#else
-	return NULL;
-#endif
-}
+void usage(int status);
 
 void getPublicKeyRaw(ecc_key_t *pubkeyraw, char *inFile)
 {
-	EVP_PKEY* pkey;
-	unsigned char pubkeyData[1 + 2 * EC_COORDBYTES];
-
-	FILE *fp = fopen(inFile, "r");
-	if (!fp)
-		die(EX_NOINPUT, "Cannot open key file: %s: %s", inFile, strerror(errno));
-
-	if ((pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL))) {
-		debug_msg("File \"%s\" is a PEM private key", inFile);
-		fclose(fp);
-	} else {
-		fclose(fp);
-		fp = fopen(inFile, "r");
-		if ((pkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL))) {
-			debug_msg("File \"%s\" is a PEM public key", inFile);
-		}
-		fclose(fp);
-	}
-
-	if (pkey) {
-		EC_KEY *key;
-		const EC_GROUP *ecgrp;
-		const EC_POINT *ecpoint;
-		BIGNUM *pubkeyBN;
-
-		key = EVP_PKEY_get1_EC_KEY(pkey);
-		if (!key)
-			die(EX_SOFTWARE, "%s", "Cannot EVP_PKEY_get1_EC_KEY");
-
-		ecgrp = EC_KEY_get0_group(key);
-		if (!ecgrp)
-			die(EX_SOFTWARE, "%s", "Cannot EC_KEY_get0_group");
-
-		ecpoint = EC_KEY_get0_public_key(key);
-		if (!ecpoint)
-			die(EX_SOFTWARE, "%s", "Cannot EC_KEY_get0_public_key");
-
-		pubkeyBN = EC_POINT_point2bn(ecgrp, ecpoint, POINT_CONVERSION_UNCOMPRESSED,
-				NULL, NULL);
-		BN_bn2bin(pubkeyBN, pubkeyData);
-
-		BN_free(pubkeyBN);
-		EC_KEY_free(key);
-		EVP_PKEY_free(pkey);
-	}
-	else {
-		/* The file is not a public or private key in PEM format. So we check if
-		 * it is a p521 pubkey in RAW format, in which case it will be 133 bytes
-		 * with a leading byte of 0x04, indicating an uncompressed key. */
-		int fdin, r;
-		struct stat s;
-		void *infile = NULL;
-
-		fdin = open(inFile, O_RDONLY);
-		if (fdin <= 0)
-			die(EX_NOINPUT, "Cannot open key file: %s: %s", inFile, strerror(errno));
-
-		r = fstat(fdin, &s);
-		if (r != 0)
-			die(EX_NOINPUT, "Cannot stat key file: %s", inFile);
-
-		if (s.st_size == 1 + 2 * EC_COORDBYTES) {
-			infile = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fdin, 0);
-			if (infile == MAP_FAILED)
-				die(EX_OSERR, "Cannot mmap file at fd: %d, size: %lu (%s)",
-						fdin, s.st_size, strerror(errno));
-		}
-		close(fdin);
-
-		if (!infile || (*(unsigned char*) infile != 0x04)) {
-			die(EX_DATAERR,
-					"File \"%s\" is not in expected format (private or public key in PEM, or public key RAW)",
-					inFile);
-		} else
-			debug_msg("File \"%s\" is a RAW public key", inFile);
-
-		memcpy(pubkeyData, infile, sizeof(ecc_key_t) + 1);
-	}
-
-	// Remove the leading byte
-	memcpy(*pubkeyraw, &pubkeyData[1], sizeof(ecc_key_t));
-
-	return;
+	int t = timings_begin("read keys");
+	int r = stb_get_public_key_raw(stb, inFile, pubkeyraw);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	timings_end(t, 0);
+	debug_msg("File \"%s\" is a public or private key", inFile);
 }
 
 int readBinaryFile(unsigned char *data,
 		   size_t *length,
 		   const char *filename)
 {
-	int sRc = 0;
-	size_t sBytes = 0;
-
-	FILE *sFile = fopen(filename, "rb");
-	if (NULL == sFile)
-	{
-		printf("**** ERROR: Unable to open file : %s\n", filename);
-		sRc = 1;
-	}
-
-	/* Verify we have enough space */
-	if (0 == sRc)
-	{
-		sRc = fseek(sFile, 0, SEEK_END);
-		if (-1 == sRc) {
-			printf("**** ERROR : Unable to find end of : %s\n", filename);
-			sRc = 1;
-		}
-	}
-
-	if (0 == sRc)
-	{
-		long sLen = ftell(sFile);
-		if (-1 == sLen)
-		{
-			printf("**** ERROR : Unable to determine length of %s\n", filename);
-			sRc = 1;
-		}
-		else if (*length < (size_t)sLen)
-		{
-			printf("**** ERROR : Not enough space for contents of file E:%lu A:%lu : %s\n",
-			       (size_t)sLen, *length, filename);
-			sRc = 1;
-		}
-		else
-		{
-			*length = (size_t)sLen;
-		}
-	}
+	int t = timings_begin("read files");
+	int r = stb_read_file(stb, filename, data, length);
+	if (r)
+		printf("**** ERROR: %s\n", stb_ctx_error(stb));
+	timings_end(t, r ? 0 : *length);
+	return r != STB_OK;
+}
 
-	if (0 == sRc)
-	{
-		fseek(sFile, 0, SEEK_SET);
 
-		sBytes = fread(data, 1, *length, sFile);
-		if (sBytes != *length)
-		{
-			printf("**** ERROR: Failure reading from file : %s\n", filename);
-			sRc = 1;
-		}
-	}
-	if (NULL != sFile) {
-		if (fclose(sFile)) {
-			printf("**** ERROR: Failure closing file : %s\n", filename);
-			if (0 == sRc) sRc = 1;
-		}
-	}
-	return sRc;
+void sigToRaw(ecc_signature_t *sigraw, const unsigned char *sig, size_t len,
+	      const char *name)
+{
+	int r = stb_sig_to_raw(stb, sig, len, sigraw);
+	if (r)
+		die(stb_sysexit(r), "Signature \"%s\": %s", name,
+		    stb_ctx_error(stb));
+	debug_msg("Signature \"%s\" is a %s signature", name,
+		  (len == 2 * EC_COORDBYTES) ? "RAW" : "DER");
 }
 
-
 void getSigRaw(ecc_signature_t *sigraw, char *inFile)
 {
 	int fdin;
 	struct stat s;
 	void *infile;
+	size_t len;
 	int r;
+	int t = timings_begin("read signatures");
 
 	fdin = open(inFile, O_RDONLY);
 	if (fdin <= 0)
@@ -264,111 +128,52 @@ void getSigRaw(ecc_signature_t *sigraw, char *inFile)
 
 	close(fdin);
 
-	if (s.st_size == 2 * EC_COORDBYTES) {
-		/* The file is a p521 signature in RAW format. */
-		debug_msg("File \"%s\" is a RAW signature", inFile);
-		memcpy(sigraw, infile, sizeof(ecc_signature_t));
-	}
-	else {
-		/* Assume the file is a p521 signature in DER format.
-		 * Convert the DER to a signature object, then extract the RAW. */
-		debug_msg("File \"%s\" is a DER signature", inFile);
-
-		int rlen, roff, slen, soff;
-		const BIGNUM *sr, *ss;
-		unsigned char outbuf[2 * EC_COORDBYTES];
-
-		ECDSA_SIG* signature = d2i_ECDSA_SIG(NULL,
-				(const unsigned char **) &infile, 7 + 2 * EC_COORDBYTES);
-
-		memset(&outbuf, 0, sizeof(outbuf));
-
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-		ECDSA_SIG_get0(signature, &sr, &ss);
-#else
-		sr = signature->r;
-		ss = signature->s;
-#endif
-		rlen = BN_num_bytes(sr);
-		roff = 66 - rlen;
-		BN_bn2bin(sr, &outbuf[roff]);
-
-		slen = BN_num_bytes(ss);
-		soff = 66 + (66 - slen);
-		BN_bn2bin(ss, &outbuf[soff]);
-
-		memcpy(sigraw, outbuf, sizeof(ecc_signature_t));
-
-		ECDSA_SIG_free(signature);
-	}
+	/* DER signatures are at most 7 bytes of framing over the RAW size */
+	len = s.st_size;
+	if (len > 7 + 2 * EC_COORDBYTES)
+		len = 7 + 2 * EC_COORDBYTES;
+	sigToRaw(sigraw, infile, len, inFile);
+	munmap(infile, s.st_size);
+	timings_end(t, 0);
 	return;
 }
 
-void writeHdr(void *hdr, const char *outFile, int hdr_type, int container_version, uint8_t hash_alg,
-              int writeRaw)
+/* Write a header of the container, and the hash of the prefix and SW ones. */
+void writeHdr(const struct stb_container *c, int hdr_type, const char *outFile,
+	      int writeRaw)
 {
 	FILE *fp;
-	int r, hdr_sz;
+	int r, hdr_sz, region;
 	unsigned char md_buf[SHA512_DIGEST_LENGTH];
 	unsigned char *md = NULL;
+	const void *hdr;
+	int t = timings_begin("write headers");
 
-	if (container_version == 3)
-	{
-		switch (hdr_type) {
-                  case CONTAINER_HDR:
-                    hdr_sz = SECURE_BOOT_HEADERS_V3_SIZE;
-                    break;
-                  case PREFIX_HDR:
-                    hdr_sz = sizeof(ROM_prefix_header_v3_raw);
-                    md = calc_hash(hash_alg, hdr, hdr_sz, md_buf);
-                    verbose_print((char *) "PR header hash  = ", md_buf, sizeof(md_buf));
-                    break;
-                  case SOFTWARE_HDR:
-                    hdr_sz = sizeof(ROM_sw_header_v3_raw);
-                    md = calc_hash(hash_alg, hdr, hdr_sz, md_buf);
-                    verbose_print((char *) "SW header hash  = ", md_buf, sizeof(md_buf));
-                    break;
-                  default:
-                    die(EX_SOFTWARE, "Unknown header type (%d)", hdr_type);
-                }
+	switch (hdr_type) {
+	case CONTAINER_HDR:
+		region = STB_REGION_HW_HDR;
+		hdr_sz = c->layout->header_size;
+		break;
+	case PREFIX_HDR:
+		region = STB_REGION_PREFIX_HDR;
+		hdr_sz = c->layout->region_size[region];
+		break;
+	case SOFTWARE_HDR:
+		region = STB_REGION_SW_HDR;
+		hdr_sz = c->layout->region_size[region];
+		break;
+	default:
+		die(EX_SOFTWARE, "Unknown header type (%d)", hdr_type);
 	}
-	else if (container_version == 2)
-	{
-		switch (hdr_type) {
-		  case CONTAINER_HDR:
-		    hdr_sz = SECURE_BOOT_HEADERS_V2_SIZE;
-		    break;
-		  case PREFIX_HDR:
-		    hdr_sz = sizeof(ROM_prefix_header_v2_raw);
-		    md = calc_hash(HASH_ALG_SHA3_512, hdr, hdr_sz, md_buf);
-		    verbose_print((char *) "PR header hash  = ", md_buf, sizeof(md_buf));
-		    break;
-		  case SOFTWARE_HDR:
-		    hdr_sz = sizeof(ROM_sw_header_v2_raw);
-		    md = calc_hash(HASH_ALG_SHA3_512, hdr, hdr_sz, md_buf);
-		    verbose_print((char *) "SW header hash  = ", md_buf, sizeof(md_buf));
-		    break;
-		  default:
-		    die(EX_SOFTWARE, "Unknown header type (%d)", hdr_type);
-		}
-	} else {
-		switch (hdr_type) {
-		  case CONTAINER_HDR:
-		    hdr_sz = SECURE_BOOT_HEADERS_SIZE;
-		    break;
-		  case PREFIX_HDR:
-		    hdr_sz = sizeof(ROM_prefix_header_raw);
-		    md = SHA512(hdr, hdr_sz, md_buf);
-		    verbose_print((char *) "PR header hash  = ", md_buf, sizeof(md_buf));
-		    break;
-		  case SOFTWARE_HDR:
-		    hdr_sz = sizeof(ROM_sw_header_raw);
-		    md = SHA512(hdr, hdr_sz, md_buf);
-		    verbose_print((char *) "SW header hash  = ", md_buf, sizeof(md_buf));
-		    break;
-		  default:
-		    die(EX_SOFTWARE, "Unknown header type (%d)", hdr_type);
-		}
+	hdr = c->region[region];
+
+	if (hdr_type != CONTAINER_HDR) {
+		r = stb_hash_region(stb, c, region, md_buf);
+		if (r)
+			die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+		md = md_buf;
+		verbose_print(hdr_type == PREFIX_HDR ? (char *) "PR header hash  = "
+			      : (char *) "SW header hash  = ", md_buf, sizeof(md_buf));
 	}
 
 	fp = fopen(outFile, "w");
@@ -376,7 +181,7 @@ void writeHdr(void *hdr, const char *outFile, int hdr_type, int container_versio
 		die(EX_CANTCREAT, "Cannot create output file: %s: %s", outFile,
 				strerror(errno));
 
-	r = fwrite((const void *) hdr, hdr_sz, 1, fp);
+	r = fwrite(hdr, hdr_sz, 1, fp);
 	fclose(fp);
 
 	if (r != 1)
@@ -429,6 +234,7 @@ void writeHdr(void *hdr, const char *outFile, int hdr_type, int container_versio
 		fclose(fp);
 		free(fn);
 	}
+	timings_end(t, hdr_sz);
 	return;
 }
 
@@ -462,8 +268,10 @@ __attribute__((__noreturn__)) void usage (int status)
 			" -Q, --sw_sig_q          file containing SW key Q signature in DER format\n"
 			" -R, --sw_sig_r          file containing SW key R signature in DER format\n"
 			"     --sw_sig_s          file containing SW key S signature in DER format\n"
-			" -l, --payload           file containing the payload to be signed\n"
-			" -I, --imagefile         file to write containerized image (output)\n"
+			" -l, --payload           file containing the payload to be signed, or - to\n"
+			"                          read it from stdin\n"
+			" -I, --imagefile         file to write containerized image (output), or -\n"
+			"                          to write it to stdout\n"
 			" -o, --hw-cs-offset      code start offset for prefix header in hex\n"
 			" -O, --sw-cs-offset      code start offset for software header in hex\n"
 			" -f, --hw-flags          prefix header flags in hex\n"
@@ -476,11 +284,50 @@ __attribute__((__noreturn__)) void usage (int status)
 			" -V, --container-version Container version to generate (1, 2, 3)\n"
 			" -H, --hash              hash to use for container V3: sha3-512 (default), sha512\n"
 			"     --pure              Write raw data into a file; for ML-DSA pure mode signing\n"
+			"     --sign-helper       command to request the missing ECDSA signatures from,\n"
+			"                          over a pipe, instead of a second pass (see below)\n"
+			"     --swHdrIn           Software header dumped by a previous pass over the\n"
+			"                          same payload, to take the payload hash from\n"
+			"     --timings           Print the time spent in each phase, the bytes\n"
+			"                          hashed, peak RSS and page faults to stderr\n"
+			"     --timings-json      Same as --timings, as one line of JSON\n"
+			"     --payload-digest    payload hash in hexascii, computed beforehand with\n"
+			"                          the hash of the container, used instead of\n"
+			"                          hashing the payload\n"
+			"     --payload-size      payload size in bytes, with --payload-digest and\n"
+			"                          no --payload, to build the headers before the\n"
+			"                          payload is final\n"
+			"     --payload-check     with --payload-digest and --payload, hash the\n"
+			"                          payload in the background while the container is\n"
+			"                          built, and fail if it does not match\n"
+			"     --update            write the signatures given into the existing\n"
+			"                          container --imagefile, once checked against its\n"
+			"                          headers and keys, instead of building it\n"
+			"     --hw-from           container signed before with the same SW keys, to\n"
+			"                          take the HW keys and signatures from, so that\n"
+			"                          only the software header needs signing\n"
+			"     --spool-mem         bytes of a payload read from a pipe to keep in\n"
+			"                          memory, the rest going to a temporary file\n"
+			"                          (default 64M)\n"
+			"     --unprotected       file appended after the payload (v2, v3), its\n"
+			"                          size signed but not its content; with --update,\n"
+			"                          replaces it, at the same size, without signing\n"
+			"     --digest-cache      file of the payload hashes of a batch of\n"
+			"                          containers: a payload found there, or the same\n"
+			"                          as a payload found there, is not hashed again\n"
+			"     --io-strategy       how the payload is read to hash it: auto\n"
+			"                          (default), mmap, madvise, populate, fadvise,\n"
+			"                          direct or uring, with fadvise, populate and\n"
+			"                          uring taking a window, e.g. fadvise,16M\n"
 			"Note:\n"
 			"- Keys A,B,C,P,Q,R must be valid p521 ECC keys. Keys may be provided as public\n"
 			"  or private key in PEM format, or public key in uncompressed raw format.\n"
 			"- Keys D,S must be valid Dilithium r2 8/7 keys. Keys may be provided as public\n"
 			"  or private key in PEM format, or public key in uncompressed raw format.\n"
+			"- The sign helper reads one \"<key> <digest>\" line per signature on stdin,\n"
+			"  <key> being a,b,c (prefix header) or p,q,r (software header) and <digest>\n"
+			"  the header hash in hexascii. It answers \"<key> <signature>\" lines on\n"
+			"  stdout, the signature being a RAW or DER signature in hexascii.\n"
 			"\n");
 	};
 	exit(status);
@@ -523,6 +370,19 @@ static struct option const opts[] = {
 	{ "fw-ecid",          required_argument, 0,  '3' },
 	{ "hash",             required_argument, 0,  'H' },
 	{ "pure",             no_argument      , 0,  '4' },
+	{ "sign-helper",      required_argument, 0,  '5' },
+	{ "swHdrIn",          required_argument, 0,  '6' },
+	{ "timings",          no_argument,       0,  '7' },
+	{ "timings-json",     no_argument,       0,  '8' },
+	{ "payload-digest",   required_argument, 0,  '9' },
+	{ "payload-size",     required_argument, 0,  '<' },
+	{ "payload-check",    no_argument,       0,  '>' },
+	{ "update",           no_argument,       0,  '^' },
+	{ "hw-from",          required_argument, 0,  '~' },
+	{ "spool-mem",        required_argument, 0,  '%' },
+	{ "unprotected",      required_argument, 0,  '&' },
+	{ "digest-cache",     required_argument, 0,  '*' },
+	{ "io-strategy",      required_argument, 0,  '@' },
 	{ NULL, 0, NULL, 0 }
 };
 #endif
@@ -558,40 +418,1205 @@ static struct {
 	uint8_t security_version;
 	uint8_t container_version;
 	int mldsa_pure_mode;
+	char *sign_helper;
+	char *swhdrinfn;
+	char *payload_digest;
+	char *payload_size;
+	bool payload_check;
+	bool update;
+	char *hw_from;
+	char *spool_mem;
+	char *unprotectedfn;
+	char *digest_cache;
+	char *io_strategy;
 } params;
 
+/*
+ * Signatures not given on the command line are requested from the sign
+ * helper once the headers are final. The helper is run with "sh -c", gets
+ * one "<key> <digest>" line per request on stdin, which is closed after the
+ * last one, and must answer with one "<key> <signature>" line per request
+ * on stdout (or "<key> error <message>"), then exit with status 0.
+ */
+struct sign_request {
+	char slot;
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	void *sig;
+	bool done;
+};
 
-int main(int argc, char* argv[])
+static struct sign_request sign_requests[6];
+static int sign_request_count;
+
+void queueSignRequest(char slot, const char *keyfn, const char *sigfn,
+		      const unsigned char *md, void *sig)
+{
+	struct sign_request *req;
+
+	// Only for keys in the container, whose signature was not given.
+	if (!params.sign_helper || !keyfn || sigfn)
+		return;
+
+	req = &sign_requests[sign_request_count++];
+	req->slot = slot;
+	memcpy(req->md, md, SHA512_DIGEST_LENGTH);
+	req->sig = sig;
+	req->done = false;
+	debug_msg("Queued signing request for key %c", slot);
+}
+
+void runSignHelper(void)
+{
+	int to_helper[2], from_helper[2], status, i;
+	unsigned char sigbuf[7 + 2 * EC_COORDBYTES];
+	struct sigaction ignore, old_pipe;
+	ecc_signature_t sigraw;
+	struct sign_request *req;
+	char *line = NULL, *hex, name[16];
+	size_t linelen = 0, len;
+	FILE *fp;
+	pid_t pid;
+
+	if (!sign_request_count)
+		return;
+
+	if (pipe(to_helper) || pipe(from_helper))
+		die(EX_OSERR, "Cannot create pipe (%s)", strerror(errno));
+
+	pid = fork();
+	if (pid < 0)
+		die(EX_OSERR, "Cannot fork sign helper (%s)", strerror(errno));
+
+	if (pid == 0) {
+		dup2(to_helper[0], STDIN_FILENO);
+		dup2(from_helper[1], STDOUT_FILENO);
+		close(to_helper[0]);
+		close(to_helper[1]);
+		close(from_helper[0]);
+		close(from_helper[1]);
+		execl("/bin/sh", "sh", "-c", params.sign_helper, (char *) NULL);
+		_exit(127);
+	}
+	close(to_helper[0]);
+	close(from_helper[1]);
+
+	// A helper exiting early is reported below, not by SIGPIPE, which is
+	// back to what it was once the exchange is done.
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, &old_pipe);
+
+	fp = fdopen(to_helper[1], "w");
+	if (!fp)
+		die(EX_OSERR, "Cannot fdopen pipe (%s)", strerror(errno));
+	for (i = 0; i < sign_request_count; i++) {
+		fprintf(fp, "%c ", sign_requests[i].slot);
+		for (int j = 0; j < SHA512_DIGEST_LENGTH; j++)
+			fprintf(fp, "%02x", sign_requests[i].md[j]);
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+	verbose_msg("Sent %d signing request(s) to sign helper", sign_request_count);
+
+	fp = fdopen(from_helper[0], "r");
+	if (!fp)
+		die(EX_OSERR, "Cannot fdopen pipe (%s)", strerror(errno));
+	while (getline(&line, &linelen, fp) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+			continue;
+
+		for (req = NULL, i = 0; i < sign_request_count; i++)
+			if (sign_requests[i].slot == line[0] && !sign_requests[i].done)
+				req = &sign_requests[i];
+		if (!req)
+			die(EX_DATAERR, "Unexpected response from sign helper: %.16s",
+			    line);
+
+		hex = line + 1 + strspn(line + 1, " \t");
+		if (!strncmp(hex, "error", 5))
+			die(EX_SOFTWARE, "Sign helper failed for key %c: %s",
+			    req->slot, hex);
+
+		len = strlen(hex) / 2;
+		if (!len || len > sizeof(sigbuf) || !isValidHex(hex, len))
+			die(EX_DATAERR, "Invalid signature from sign helper for key %c",
+			    req->slot);
+		for (size_t j = 0; j < len; j++)
+			sscanf(&hex[j * 2], "%2hhx", &sigbuf[j]);
+
+		snprintf(name, sizeof(name), "helper:%c", req->slot);
+		sigToRaw(&sigraw, sigbuf, len, name);
+		memcpy(req->sig, sigraw, sizeof(ecc_signature_t));
+		req->done = true;
+	}
+	free(line);
+	fclose(fp);
+	sigaction(SIGPIPE, &old_pipe, NULL);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		die(EX_SOFTWARE, "Sign helper \"%s\" failed (status %d)",
+		    params.sign_helper, status);
+
+	for (i = 0; i < sign_request_count; i++) {
+		if (!sign_requests[i].done)
+			die(EX_SOFTWARE, "No signature from sign helper for key %c",
+			    sign_requests[i].slot);
+		snprintf(name, sizeof(name), "signature %c = ",
+			 sign_requests[i].slot - ('a' - 'A'));
+		verbose_print(name, sign_requests[i].sig, sizeof(ecc_signature_t));
+	}
+	sign_request_count = 0;
+}
+
+/*
+ * The key and signature slots of each container version are described by
+ * its layout (see libstbcontainer.h); these fill them in from the files
+ * given on the command line, by the option letter of the slot.
+ */
+char *slotKeyFile(char id)
+{
+	switch (id) {
+	case 'a': return params.hw_keyfn_a;
+	case 'b': return params.hw_keyfn_b;
+	case 'c': return params.hw_keyfn_c;
+	case 'd': return params.hw_keyfn_d;
+	case 'p': return params.sw_keyfn_p;
+	case 'q': return params.sw_keyfn_q;
+	case 'r': return params.sw_keyfn_r;
+	case 's': return params.sw_keyfn_s;
+	default: return NULL;
+	}
+}
+
+char *slotSigFile(char id)
+{
+	switch (id) {
+	case 'a': return params.hw_sigfn_a;
+	case 'b': return params.hw_sigfn_b;
+	case 'c': return params.hw_sigfn_c;
+	case 'd': return params.hw_sigfn_d;
+	case 'p': return params.sw_sigfn_p;
+	case 'q': return params.sw_sigfn_q;
+	case 'r': return params.sw_sigfn_r;
+	case 's': return params.sw_sigfn_s;
+	default: return NULL;
+	}
+}
+
+bool isZero(const uint8_t *p, size_t len)
 {
-	int fdout;
+	while (len && !*p) {
+		p++;
+		len--;
+	}
+	return !len;
+}
+
+/* Set a field of the container being built. */
+void setField(struct stb_container *c, const struct stb_field *f,
+	      uint64_t value)
+{
+	int r = stb_build_set(stb, c, f, value);
+
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+}
+
+/* Set a field to the 4 byte hexadecimal value of option name. */
+void setHexField(struct stb_container *c, const struct stb_field *f,
+		 const char *value, const char *name)
+{
+	uint64_t data = 0;
+
+	if (!isValidHex((char *) value, 4))
+		die(EX_DATAERR, "Invalid input for %s, expecting a 4 byte "
+		    "hexadecimal value", name);
+	sscanf(value, "%lx", &data);
+	setField(c, f, data);
+	verbose_msg("%s = %#010lx", name, data);
+}
+
+/* Write the public keys of the slots, or NULL keys if not given. */
+void writeKeys(struct stb_container *c, const struct stb_slot *slots, int count)
+{
+	char lead[16];
+
+	for (const struct stb_slot *slot = slots; slot < slots + count; slot++) {
+		uint8_t *key = stb_build_field(c, &slot->key);
+		char *fn = slotKeyFile(slot->id);
+		size_t len = slot->key.size;
+
+		memset(key, 0, slot->key.size);
+		if (!fn)
+			continue;
+		if (slot->type == STB_SIG_ECDSA_P521)
+			getPublicKeyRaw((ecc_key_t *) key, fn);
+		else if (readBinaryFile(key, &len, fn) || len != slot->key.size)
+			die(EX_SOFTWARE, "Failure reading %.2s PUBKEY %c : %s",
+			    slot->name, toupper(slot->id), fn);
+		snprintf(lead, sizeof(lead), "pubkey %c = ", toupper(slot->id));
+		verbose_print(lead, key, slot->key.size);
+	}
+}
+
+/* Read the signature of a slot from fn into sig. */
+void readSlotSig(const struct stb_slot *slot, const char *fn, uint8_t *sig)
+{
+	ecc_signature_t sigraw;
+	size_t len = slot->sig.size;
+	char lead[16];
+
+	if (slot->type == STB_SIG_ECDSA_P521) {
+		getSigRaw(&sigraw, (char *) fn);
+		memcpy(sig, sigraw, sizeof(ecc_signature_t));
+	} else if (readBinaryFile(sig, &len, fn) || len != slot->sig.size) {
+		die(EX_SOFTWARE, "Failure reading %.2s SIG %c : %s",
+		    slot->name, toupper(slot->id), fn);
+	}
+	snprintf(lead, sizeof(lead), "signature %c = ", toupper(slot->id));
+	verbose_print(lead, sig, slot->sig.size);
+}
+
+/* Write the signatures of the slots given, the others are left NULL. */
+void writeSigs(struct stb_container *c, const struct stb_slot *slots, int count)
+{
+	for (const struct stb_slot *slot = slots; slot < slots + count; slot++) {
+		uint8_t *sig = stb_build_field(c, &slot->sig);
+		char *fn = slotSigFile(slot->id);
+
+		memset(sig, 0, slot->sig.size);
+		if (fn)
+			readSlotSig(slot, fn, sig);
+	}
+}
+
+/*
+ * Request the missing ECDSA signatures of the slots, over md; those already
+ * filled in (from --hw-from) are not missing.
+ */
+void queueSignRequests(struct stb_container *c, const struct stb_slot *slots,
+		       int count, const unsigned char *md)
+{
+	for (const struct stb_slot *slot = slots; slot < slots + count; slot++)
+		if (slot->type == STB_SIG_ECDSA_P521
+		    && isZero(stb_field_ptr(c, &slot->sig), slot->sig.size))
+			queueSignRequest(slot->id, slotKeyFile(slot->id),
+					 slotSigFile(slot->id), md,
+					 stb_build_field(c, &slot->sig));
+}
+
+/* Print where the regions of the finished container header are. */
+void printContainerStats(const struct stb_container *c)
+{
+	static const char *const names[STB_REGION_COUNT] = {
+		"HW header size       ",
+		"Prefix header size   ",
+		"Prefix data size     ",
+		"SW header size       ",
+		"SW signature size    ",
+	};
+	const struct stb_layout *l = c->layout;
 	unsigned int size, offset;
+	uint64_t payload_size, container_size;
+
+	if (!verbose)
+		return;
+
+	for (int i = 0; i < STB_REGION_COUNT; i++) {
+		if (i + 1 < STB_REGION_COUNT) {
+			size = c->region[i + 1] - c->region[i];
+		} else {
+			size = 0;
+			for (int n = 0; n < l->sw_slot_count; n++)
+				if (stb_sw_slot_used(c, n))
+					size += l->sw_slots[n].sig.size;
+		}
+		offset = c->region[i] - c->region[STB_REGION_HW_HDR];
+		verbose_msg("%s = %4u (%#06x) at offset %4u (%#06x)", names[i],
+			    size, size, offset, offset);
+	}
+
+	payload_size = stb_field_be64(c, &l->payload_size);
+	container_size = stb_field_be64(c, &l->container_size);
+	verbose_msg("TOTAL HEADER SIZE     = %4lu (%#0lx)", l->header_size,
+		    l->header_size);
+	verbose_msg("PAYLOAD SIZE          = %4lu (%#0lx)", payload_size,
+		    payload_size);
+	verbose_msg("TOTAL CONTAINER SIZE  = %4lu (%#0lx)", container_size,
+		    container_size);
+}
+
+/*
+ * The payload a software header was dumped for, "<size> <dev> <inode>
+ * <mtime>" in "<header>.payload", for getCachedPayloadHash() to tell
+ * whether it is still the same. There is none for a payload read from a
+ * pipe.
+ */
+#define PAYLOAD_STAMP_SUFFIX	".payload"
+
+void writePayloadStamp(const char *hdrfn, const struct stat *payload_st)
+{
+	char fn[PATH_MAX];
+	FILE *fp;
+
+	if (snprintf(fn, sizeof(fn), "%s%s", hdrfn, PAYLOAD_STAMP_SUFFIX)
+	    >= (int) sizeof(fn))
+		return;
+	unlink(fn);
+	if (!S_ISREG(payload_st->st_mode))
+		return;
+	fp = fopen(fn, "w");
+	if (!fp) {
+		verbose_msg("Cannot write payload stamp %s (%s)", fn, strerror(errno));
+		return;
+	}
+	fprintf(fp, "%llu %llu %llu %llu.%09llu\n",
+		(unsigned long long) payload_st->st_size,
+		(unsigned long long) payload_st->st_dev,
+		(unsigned long long) payload_st->st_ino,
+		(unsigned long long) payload_st->st_mtim.tv_sec,
+		(unsigned long long) payload_st->st_mtim.tv_nsec);
+	fclose(fp);
+}
+
+/*
+ * Whether the payload is the one the software header hdr_st was dumped for:
+ * the same file, not modified since, going by its stamp. A header without
+ * a stamp, one from an archive say, only holds for a payload last modified
+ * before it, to the nanosecond.
+ */
+static bool samePayloadAsDumped(const struct stat *hdr_st,
+				const struct stat *payload_st)
+{
+	unsigned long long size, dev, ino, sec, nsec;
+	char fn[PATH_MAX];
+	FILE *fp;
+	int n;
+
+	if (!S_ISREG(payload_st->st_mode))
+		return false;
+
+	if (snprintf(fn, sizeof(fn), "%s%s", params.swhdrinfn,
+		     PAYLOAD_STAMP_SUFFIX) >= (int) sizeof(fn))
+		return false;
+	fp = fopen(fn, "r");
+	if (!fp)
+		return payload_st->st_mtim.tv_sec < hdr_st->st_mtim.tv_sec
+			|| (payload_st->st_mtim.tv_sec == hdr_st->st_mtim.tv_sec
+			    && payload_st->st_mtim.tv_nsec < hdr_st->st_mtim.tv_nsec);
+	n = fscanf(fp, "%llu %llu %llu %llu.%llu", &size, &dev, &ino, &sec, &nsec);
+	fclose(fp);
+	return n == 5 && size == (unsigned long long) payload_st->st_size
+		&& dev == (unsigned long long) payload_st->st_dev
+		&& ino == (unsigned long long) payload_st->st_ino
+		&& sec == (unsigned long long) payload_st->st_mtim.tv_sec
+		&& nsec == (unsigned long long) payload_st->st_mtim.tv_nsec;
+}
+
+/*
+ * In independent signing mode the second pass is run over the same payload
+ * as the first one, which dumped the software header. If that header is
+ * identical to the one being built, apart from the payload hash, and the
+ * payload was not modified since it was dumped, take the payload hash from
+ * it rather than hashing the payload again.
+ */
+bool getCachedPayloadHash(const void *swhdr, size_t hdr_sz, size_t hash_off,
+			  const struct stat *payload_st, unsigned char *md)
+{
+	struct stat st;
+	unsigned char *cached;
+	size_t hash_end = hash_off + sizeof(sha2_hash_t);
+	bool match;
+	FILE *fp;
+
+	if (!params.swhdrinfn)
+		return false;
+
+	if (stat(params.swhdrinfn, &st) != 0)
+		die(EX_NOINPUT, "Cannot stat software header file: %s: %s",
+		    params.swhdrinfn, strerror(errno));
+
+	if ((size_t) st.st_size != hdr_sz) {
+		verbose_msg("Software header %s has the wrong size, ignored",
+			    params.swhdrinfn);
+		return false;
+	}
+
+	if (!samePayloadAsDumped(&st, payload_st)) {
+		verbose_msg("Payload changed since software header %s, ignored",
+			    params.swhdrinfn);
+		return false;
+	}
+
+	cached = (unsigned char *) malloc(hdr_sz);
+	if (!cached)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+
+	fp = fopen(params.swhdrinfn, "r");
+	if (!fp)
+		die(EX_NOINPUT, "Cannot open software header file: %s: %s",
+		    params.swhdrinfn, strerror(errno));
+	if (fread(cached, hdr_sz, 1, fp) != 1)
+		die(EX_DATAERR, "Cannot read software header file: %s",
+		    params.swhdrinfn);
+	fclose(fp);
+
+	match = !memcmp(cached, swhdr, hash_off) &&
+		!memcmp(cached + hash_end, (const unsigned char *) swhdr + hash_end,
+			hdr_sz - hash_end);
+	if (match) {
+		memset(md, 0, SHA512_DIGEST_LENGTH);
+		memcpy(md, cached + hash_off, sizeof(sha2_hash_t));
+		verbose_msg("Using payload hash from %s", params.swhdrinfn);
+	} else {
+		verbose_msg("Software header %s does not match, ignored",
+			    params.swhdrinfn);
+	}
+
+	free(cached);
+	return match;
+}
+
+/*
+ * --digest-cache: the containers of a build often share payloads, the golden
+ * and working sides of a PNOR or padding images. Each payload hashed is
+ * added to the cache file, one "<hash alg> <size> <dev> <inode> <mtime>
+ * <hash> <path>" line, and a payload of the same size as one there, with
+ * the same hash algorithm, takes its hash if it is the same file, not
+ * modified since, or has the same content (see stb_same_data()).
+ */
+#define DIGEST_CACHE_LINE	(PATH_MAX + 256)
+
+bool getDigestCacheHash(uint8_t hash_alg, int fd, unsigned char *md)
+{
+	char line[DIGEST_CACHE_LINE], hex[2 * SHA512_DIGEST_LENGTH + 1];
+	unsigned long long size, dev, ino, sec, nsec;
+	unsigned int alg;
+	struct stat st, cst;
+	bool found = false;
+	char *path = NULL;
+	int n, cfd, t;
+	FILE *fp;
+
+	if (!params.digest_cache || fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return false;
+	fp = fopen(params.digest_cache, "r");
+	if (!fp)
+		return false;
+
+	while (!found && fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%u %llu %llu %llu %llu.%llu %128s %n", &alg, &size,
+			   &dev, &ino, &sec, &nsec, hex, &n) != 7
+		    || alg != hash_alg || size != (uint64_t) st.st_size
+		    || strlen(hex) != 2 * SHA512_DIGEST_LENGTH)
+			continue;
+		path = line + n;
+		if (dev == (uint64_t) st.st_dev && ino == (uint64_t) st.st_ino
+		    && sec == (uint64_t) st.st_mtim.tv_sec
+		    && nsec == (uint64_t) st.st_mtim.tv_nsec) {
+			found = true;
+			break;
+		}
+		// Its hash only holds if it was not modified since.
+		cfd = open(path, O_RDONLY);
+		if (cfd < 0)
+			continue;
+		if (!fstat(cfd, &cst) && (uint64_t) cst.st_size == size
+		    && (uint64_t) cst.st_ino == ino
+		    && (uint64_t) cst.st_mtim.tv_sec == sec
+		    && (uint64_t) cst.st_mtim.tv_nsec == nsec) {
+			t = timings_begin("compare payload");
+			found = stb_same_data(cfd, 0, fd, 0, size);
+			timings_end(t, size);
+		}
+		close(cfd);
+	}
+	fclose(fp);
+	if (!found)
+		return false;
+
+	for (n = 0; n < SHA512_DIGEST_LENGTH; n++)
+		sscanf(&hex[n * 2], "%2hhx", &md[n]);
+	verbose_msg("Payload hash taken from %s, same payload as %s",
+		    params.digest_cache, path);
+	return true;
+}
+
+void addDigestCacheHash(uint8_t hash_alg, int fd, const unsigned char *md)
+{
+	char line[DIGEST_CACHE_LINE], path[PATH_MAX];
+	struct stat st;
+	int n, i, cfd;
+
+	if (!params.digest_cache || fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)
+	    || !realpath(params.payloadfn, path))
+		return;
+
+	n = snprintf(line, sizeof(line), "%u %llu %llu %llu %llu.%09llu ",
+		     (unsigned int) hash_alg, (unsigned long long) st.st_size,
+		     (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+		     (unsigned long long) st.st_mtim.tv_sec,
+		     (unsigned long long) st.st_mtim.tv_nsec);
+	for (i = 0; i < SHA512_DIGEST_LENGTH; i++)
+		n += snprintf(line + n, sizeof(line) - n, "%02x", md[i]);
+	n += snprintf(line + n, sizeof(line) - n, " %s\n", path);
+	if (n >= (int) sizeof(line))
+		return;
+
+	// One write, so that the containers of a parallel build may share it.
+	cfd = open(params.digest_cache, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (cfd < 0 || write(cfd, line, n) != n)
+		verbose_msg("Cannot add the payload hash to %s (%s)",
+			    params.digest_cache, strerror(errno));
+	if (cfd >= 0)
+		close(cfd);
+}
+
+/*
+ * The payload hash. The holes of a sparse payload, padding mostly, are
+ * hashed from zeros rather than faulted in from the file.
+ */
+unsigned char *hashPayload(uint8_t hash_alg, int fd, const void *payload,
+			   size_t len, unsigned char *md)
+{
+	uint64_t holes;
+
+	debug_msg("Payload read with %s",
+		  stb_io_name(stb_io_choose(stb, len, payload != NULL)));
+	if (!stb_calc_hash_file(stb, hash_alg, fd, 0, payload, len, md, &holes))
+		return NULL;
+	if (holes)
+		verbose_msg("Payload holes = %lu bytes, hashed without reading them",
+			    (unsigned long) holes);
+	addDigestCacheHash(hash_alg, fd, md);
+	return md;
+}
+
+/* Write all of buf to the container, which may be a pipe. */
+void writeAll(int fdout, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(fdout, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			die(EX_SOFTWARE, "Cannot write container payload (r = %d) (%s)",
+			    (int) r, strerror(errno));
+		p += r;
+		len -= r;
+	}
+}
+
+/*
+ * Write the payload after the container header, the holes of a sparse
+ * payload being left as holes in the container, unless it is written to a
+ * pipe, or appended to: a seek there does not move where the writes go.
+ */
+void writePayload(int fdout, int fdin, const uint8_t *payload, uint64_t len)
+{
+	static const uint8_t zeros[64 * 1024];
+	uint64_t pos, next, n;
+	int flags = fcntl(fdout, F_GETFL);
+	bool sparse = false, seekable = flags >= 0 && !(flags & O_APPEND);
+
+	for (pos = 0; pos < len; pos = next) {
+		if (!stb_file_extent(fdin, pos, len, &next)) {
+			if (seekable && lseek(fdout, next - pos, SEEK_CUR) >= 0) {
+				sparse = true;
+				continue;
+			}
+			if (seekable && errno != ESPIPE)
+				die(EX_IOERR, "Cannot seek in %s (%s)", params.imagefn,
+				    strerror(errno));
+			for (; pos < next; pos += n) {
+				n = min(next - pos, sizeof(zeros));
+				writeAll(fdout, zeros, n);
+			}
+			continue;
+		}
+		writeAll(fdout, payload + pos, next - pos);
+	}
+	// A hole at the end is only there once the file size covers it.
+	if (sparse && ftruncate(fdout, lseek(fdout, 0, SEEK_CUR)))
+		die(EX_IOERR, "Cannot write container payload (%s)", strerror(errno));
+}
+
+/*
+ * A payload read from a pipe (--payload -, or a FIFO) cannot be mapped, nor
+ * read twice: it is hashed as it is read, and kept until the header is
+ * written, in memory up to --spool-mem bytes and past that in an unlinked
+ * temporary file.
+ */
+#define SPOOL_MEM_DEFAULT	(64UL * 1024 * 1024)
+#define SPOOL_CHUNK		(1024 * 1024)
+
+static struct {
+	uint8_t *mem;
+	size_t mem_len;
+	int fd;			/* the rest, -1 if it all fit in memory */
+	uint64_t size;
+	bool hashed;
+	unsigned char md[SHA512_DIGEST_LENGTH];
+} spool;
+
+static void spoolToFile(const uint8_t *buf, size_t len)
+{
+	const char *dir = getenv("TMPDIR");
+	char *fn;
+
+	if (spool.fd < 0) {
+		if (!dir || !*dir)
+			dir = "/tmp";
+		fn = (char *) malloc(strlen(dir) + sizeof("/create-container.XXXXXX"));
+		if (!fn)
+			die(EX_OSERR, "%s", "Cannot allocate memory");
+		sprintf(fn, "%s/create-container.XXXXXX", dir);
+		spool.fd = mkstemp(fn);
+		if (spool.fd < 0)
+			die(EX_CANTCREAT, "Cannot create spool file in %s (%s)", dir,
+			    strerror(errno));
+		unlink(fn);
+		free(fn);
+		verbose_msg("Payload over %lu bytes, spooling the rest to %s",
+			    (unsigned long) spool.mem_len, dir);
+	}
+	while (len) {
+		ssize_t r = write(spool.fd, buf, len);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			die(EX_IOERR, "Cannot write spool file (%s)", strerror(errno));
+		buf += r;
+		len -= r;
+	}
+}
+
+void spoolPayload(int fdin, uint8_t hash_alg, uint64_t mem_max)
+{
+	struct stb_hash *h = stb_hash_new(hash_alg);
+	uint8_t *buf = (uint8_t *) malloc(SPOOL_CHUNK), *dst;
+	size_t cap = 0, want;
+	ssize_t n;
+	int t;
+
+	if (!h)
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	if (!buf)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+	spool.fd = -1;
+
+	t = timings_begin("spool payload");
+	for (;;) {
+		dst = buf;
+		want = SPOOL_CHUNK;
+		if (spool.mem_len < mem_max) {
+			want = min(want, mem_max - spool.mem_len);
+			if (spool.mem_len + want > cap) {
+				while (cap < spool.mem_len + want)
+					cap = cap ? 2 * cap : SPOOL_CHUNK;
+				cap = min(cap, mem_max);
+				spool.mem = (uint8_t *) realloc(spool.mem, cap);
+				if (!spool.mem)
+					die(EX_OSERR, "%s", "Cannot allocate memory");
+			}
+			dst = spool.mem + spool.mem_len;
+		}
+		n = read(fdin, dst, want);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			die(EX_IOERR, "Cannot read payload %s (%s)", params.payloadfn,
+			    strerror(errno));
+		if (n == 0)
+			break;
+		if (!stb_hash_update(h, dst, n))
+			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+		if (dst == buf)
+			spoolToFile(buf, n);
+		else
+			spool.mem_len += n;
+		spool.size += n;
+	}
+	if (!stb_hash_final(h, spool.md))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	timings_end(t, spool.size);
+	spool.hashed = true;
+	free(buf);
+	debug_msg("Spooled %lu bytes of payload, %lu in memory",
+		  (unsigned long) spool.size, (unsigned long) spool.mem_len);
+}
+
+/* Write the spooled payload after the container header. */
+void writeSpool(int fdout)
+{
+	uint8_t *buf;
+	ssize_t n;
+
+	writeAll(fdout, spool.mem, spool.mem_len);
+	free(spool.mem);
+	if (spool.fd < 0)
+		return;
+
+	buf = (uint8_t *) malloc(SPOOL_CHUNK);
+	if (!buf)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+	if (lseek(spool.fd, 0, SEEK_SET) < 0)
+		die(EX_IOERR, "Cannot read spool file (%s)", strerror(errno));
+	while ((n = read(spool.fd, buf, SPOOL_CHUNK)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			die(EX_IOERR, "Cannot read spool file (%s)", strerror(errno));
+		writeAll(fdout, buf, n);
+	}
+	free(buf);
+	close(spool.fd);
+}
+
+/*
+ * The unprotected payload (--unprotected, v2 and v3) follows the payload:
+ * its size is signed, its content is not hashed. It is copied file to file
+ * by the kernel where it can, without going through this process, else
+ * read and written.
+ */
+static struct {
+	int fd;
+	uint64_t size;
+} unprotected = { -1, 0 };
+
+void openUnprotected(void)
+{
+	struct stat st;
+
+	unprotected.fd = open(params.unprotectedfn, O_RDONLY);
+	if (unprotected.fd < 0)
+		die(EX_NOINPUT, "Cannot open unprotected payload file: %s (%s)",
+		    params.unprotectedfn, strerror(errno));
+	if (fstat(unprotected.fd, &st))
+		die(EX_NOINPUT, "Cannot stat unprotected payload file: %s",
+		    params.unprotectedfn);
+	// Its size goes in the header before it is written.
+	if (!S_ISREG(st.st_mode))
+		die(EX_USAGE, "Unprotected payload %s is not a regular file",
+		    params.unprotectedfn);
+	unprotected.size = st.st_size;
+}
+
+/* Copy the unprotected payload to the container, at its file offset. */
+void writeUnprotected(int fdout)
+{
+	uint64_t left = unprotected.size;
+	uint8_t *buf;
+	ssize_t n;
+	int t;
+
+	t = timings_begin("write unprotected");
+#ifdef __NR_copy_file_range
+	// Not across filesystems on older kernels, nor to a pipe: ENOSYS,
+	// EXDEV or EINVAL, and what is left is read and written.
+	while (left) {
+		n = syscall(__NR_copy_file_range, unprotected.fd, NULL, fdout,
+			    NULL, (size_t) min(left, (uint64_t) SSIZE_MAX), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		left -= n;
+	}
+	debug_msg("Unprotected payload: %lu bytes copied by the kernel",
+		  (unsigned long) (unprotected.size - left));
+#endif
+	if (left) {
+		buf = (uint8_t *) malloc(SPOOL_CHUNK);
+		if (!buf)
+			die(EX_OSERR, "%s", "Cannot allocate memory");
+		while (left) {
+			n = read(unprotected.fd, buf, min(left, (uint64_t) SPOOL_CHUNK));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				die(EX_IOERR, "Cannot read unprotected payload %s (%s)",
+				    params.unprotectedfn, strerror(errno));
+			if (n == 0)
+				die(EX_DATAERR, "Unprotected payload %s shrank while "
+				    "written", params.unprotectedfn);
+			writeAll(fdout, buf, n);
+			left -= n;
+		}
+		free(buf);
+	}
+	timings_end(t, unprotected.size);
+	close(unprotected.fd);
+}
+
+/*
+ * --update --unprotected: the unprotected payload is not signed, so it is
+ * replaced in place, by one of the size the SW header signed.
+ */
+void updateUnprotected(int fd, const struct stb_container *c)
+{
+	const struct stb_layout *l = c->layout;
+	uint64_t size, off;
+
+	if (!l->unprotected_size.size)
+		die(EX_DATAERR, "Container %s (v%d) has no unprotected payload",
+		    params.imagefn, c->version);
+	openUnprotected();
+	size = stb_field_be64(c, &l->unprotected_size);
+	if (unprotected.size != size)
+		die(EX_DATAERR, "Unprotected payload %s is %lu bytes, the container "
+		    "signed %lu", params.unprotectedfn,
+		    (unsigned long) unprotected.size, (unsigned long) size);
+
+	off = l->header_size + stb_field_be64(c, &l->payload_size);
+	if (lseek(fd, off, SEEK_SET) < 0)
+		die(EX_IOERR, "Cannot seek in %s (%s)", params.imagefn,
+		    strerror(errno));
+	writeUnprotected(fd);
+	// Whatever followed a previous unprotected payload is not the container.
+	if (ftruncate(fd, off + size))
+		die(EX_IOERR, "Cannot write container file: %s (%s)",
+		    params.imagefn, strerror(errno));
+	verbose_msg("Replaced the %lu bytes of unprotected payload of %s",
+		    (unsigned long) size, params.imagefn);
+}
+
+/*
+ * With --payload-digest the payload hash, computed by whatever produced the
+ * payload, is taken as given; that of a spooled payload was computed as it
+ * was read.
+ */
+bool getGivenPayloadHash(const unsigned char *given, unsigned char *md)
+{
+	if (!params.payload_digest && !spool.hashed)
+		return false;
+
+	memset(md, 0, SHA512_DIGEST_LENGTH);
+	if (params.payload_digest) {
+		memcpy(md, given, sizeof(sha2_hash_t));
+		verbose_msg("%s", "Using payload hash from --payload-digest");
+	} else {
+		memcpy(md, spool.md, sizeof(sha2_hash_t));
+		verbose_msg("%s", "Using payload hash computed as it was read");
+	}
+	return true;
+}
+
+/*
+ * With --payload-check the payload is hashed in a child process while the
+ * headers are built and signed, and the digest given checked against it by
+ * finishPayloadCheck() before the payload is written.
+ */
+pid_t startPayloadCheck(uint8_t hash_alg, int fd, const void *payload,
+			size_t len, const unsigned char *given)
+{
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	pid_t pid;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0)
+		die(EX_OSERR, "Cannot fork: %s", strerror(errno));
+	if (pid == 0) {
+		if (!stb_calc_hash_file(stb, hash_alg, fd, 0, payload, len, md,
+					NULL))
+			_exit(EX_SOFTWARE);
+		_exit(memcmp(md, given, sizeof(sha2_hash_t)) ? EX_DATAERR : EX_OK);
+	}
+	return pid;
+}
+
+void finishPayloadCheck(pid_t pid)
+{
+	int status, t;
+
+	t = timings_begin("payload check");
+	if (waitpid(pid, &status, 0) < 0)
+		die(EX_OSERR, "Cannot wait for the payload check: %s",
+		    strerror(errno));
+	timings_end(t, 0);
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EX_OK) {
+		verbose_msg("Payload %s matches --payload-digest", params.payloadfn);
+		return;
+	}
+	if (strcmp(params.imagefn, "-"))
+		unlink(params.imagefn);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EX_DATAERR)
+		die(EX_DATAERR, "Payload %s does not match --payload-digest",
+		    params.payloadfn);
+	die(EX_SOFTWARE, "Payload check failed (status %d)", status);
+}
+
+/*
+ * Check the signature in a slot of container imagefn against the header it
+ * signs; sigfn names where the signature comes from.
+ */
+void checkSlotSig(const struct stb_container *c, const struct stb_slot *slot,
+		  const char *imagefn, const char *sigfn, const char *hdr_name,
+		  const uint8_t *hdr, size_t hdr_sz, const unsigned char *md)
+{
+	const uint8_t *key = stb_field_ptr(c, &slot->key);
+	const uint8_t *sig = stb_field_ptr(c, &slot->sig);
+	bool good = false;
+	int r;
+
+	if (isZero(key, slot->key.size))
+		die(EX_DATAERR, "Container %s has no key %c for signature %s",
+		    imagefn, toupper(slot->id), sigfn);
+
+	switch (slot->type) {
+	case STB_SIG_ECDSA_P521:
+		r = stb_verify_ecdsa(stb, md, SHA512_DIGEST_LENGTH, sig, key, &good);
+		break;
+	case STB_SIG_DILITHIUM_R2_8x7:
+		r = stb_verify_dilithium(stb, md, SHA512_DIGEST_LENGTH, sig, key,
+					 &good);
+		break;
+	default:
+		if (c->mldsa_pure_mode)
+			r = stb_verify_mldsa_87(stb, hdr, hdr_sz, sig, key, &good);
+		else
+			r = stb_verify_mldsa_87(stb, md, SHA512_DIGEST_LENGTH, sig,
+						key, &good);
+	}
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	if (!good)
+		die(EX_DATAERR, "Signature %s is not key %c's signature of the "
+		    "%s header of %s", sigfn, toupper(slot->id), hdr_name, imagefn);
+}
+
+/*
+ * Check the signatures given against the headers of the slots, and write
+ * them in place in the headers. Returns the number of bytes written.
+ */
+size_t updateSigs(int fd, struct stb_container *c, const struct stb_slot *slots,
+		  int count, enum stb_region hdr)
+{
+	const uint8_t *h = c->region[hdr];
+	size_t h_sz = c->layout->region_size[hdr], written = 0;
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	const struct stb_slot *slot;
+	uint8_t *sig;
+	char *fn;
+	int t;
+
+	if (!stb_calc_hash(c->hash_alg, h, h_sz, md))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+
+	for (slot = slots; slot < slots + count; slot++) {
+		fn = slotSigFile(slot->id);
+		if (!fn)
+			continue;
+		sig = stb_build_field(c, &slot->sig);
+		readSlotSig(slot, fn, sig);
+
+		t = timings_begin("check signatures");
+		checkSlotSig(c, slot, params.imagefn, fn,
+			     hdr == STB_REGION_PREFIX_HDR ? "prefix" : "software",
+			     h, h_sz, md);
+		timings_end(t, 0);
+
+		t = timings_begin("write signatures");
+		if (pwrite(fd, sig, slot->sig.size, sig - c->region[STB_REGION_HW_HDR])
+		    != slot->sig.size)
+			die(EX_IOERR, "Cannot write signature %c to %s (%s)",
+			    toupper(slot->id), params.imagefn, strerror(errno));
+		timings_end(t, slot->sig.size);
+		written += slot->sig.size;
+	}
+	return written;
+}
+
+/*
+ * --update: the container was built by a first pass, only its signatures
+ * are missing. Rather than building it again and rewriting the payload,
+ * write the signatures into their slots.
+ */
+void updateContainer(void)
+{
+	struct stb_container c;
+	uint8_t *hdr;
+	size_t written;
+	ssize_t len;
+	int fd, r, i, t;
+
+	fd = open(params.imagefn, O_RDWR);
+	if (fd < 0)
+		die(EX_NOINPUT, "Cannot open container file: %s (%s)",
+		    params.imagefn, strerror(errno));
+
+	hdr = (uint8_t *) malloc(SECURE_BOOT_HEADERS_V2_SIZE);
+	if (!hdr)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+	t = timings_begin("read container");
+	len = pread(fd, hdr, SECURE_BOOT_HEADERS_V2_SIZE, 0);
+	if (len < 0)
+		die(EX_IOERR, "Cannot read container file: %s (%s)",
+		    params.imagefn, strerror(errno));
+	timings_end(t, len);
+
+	// hdr is ours, so its signatures are written through stb_build_field().
+	r = stb_parse(stb, hdr, len, &c);
+	if (r)
+		die(stb_sysexit(r), "%s: %s", params.imagefn, stb_ctx_error(stb));
+
+	// In v1 only the SW slots counted in the prefix header are in use.
+	for (i = 0; i < c.layout->sw_slot_count; i++)
+		if (c.layout->sw_keys_counted && !stb_sw_slot_used(&c, i)
+		    && slotSigFile(c.layout->sw_slots[i].id))
+			die(EX_DATAERR, "Container %s has no key %c for signature %s",
+			    params.imagefn, toupper(c.layout->sw_slots[i].id),
+			    slotSigFile(c.layout->sw_slots[i].id));
+
+	written = updateSigs(fd, &c, c.layout->hw_slots, c.layout->hw_slot_count,
+			     STB_REGION_PREFIX_HDR);
+	written += updateSigs(fd, &c, c.layout->sw_slots, c.layout->sw_slot_count,
+			      STB_REGION_SW_HDR);
+	if (params.unprotectedfn)
+		updateUnprotected(fd, &c);
+	if (close(fd))
+		die(EX_IOERR, "Cannot write container file: %s (%s)",
+		    params.imagefn, strerror(errno));
+	verbose_msg("Wrote %lu bytes of signatures into %s",
+		    (unsigned long) written, params.imagefn);
+
+	if (params.cthdrfn)
+		writeHdr(&c, CONTAINER_HDR, params.cthdrfn, false);
+	free(hdr);
+}
+
+/*
+ * --hw-from: the prefix header only covers the hash of the SW keys, so any
+ * container signed before with the same SW keys carries the HW signatures
+ * this one needs. Take them, and the HW keys, from it rather than having
+ * them signed again.
+ */
+static struct stb_container hw_ref;
+static uint8_t *hw_ref_hdr;
+
+void loadHwRef(void)
+{
+	ssize_t len;
+	int fd, r;
+
+	fd = open(params.hw_from, O_RDONLY);
+	if (fd < 0)
+		die(EX_NOINPUT, "Cannot open reference container: %s (%s)",
+		    params.hw_from, strerror(errno));
+
+	hw_ref_hdr = (uint8_t *) malloc(SECURE_BOOT_HEADERS_V2_SIZE);
+	if (!hw_ref_hdr)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+	len = pread(fd, hw_ref_hdr, SECURE_BOOT_HEADERS_V2_SIZE, 0);
+	if (len < 0)
+		die(EX_IOERR, "Cannot read reference container: %s (%s)",
+		    params.hw_from, strerror(errno));
+	close(fd);
+
+	r = stb_parse(stb, hw_ref_hdr, len, &hw_ref);
+	if (r)
+		die(stb_sysexit(r), "%s: %s", params.hw_from, stb_ctx_error(stb));
+	if (hw_ref.version != params.container_version)
+		die(EX_DATAERR, "Reference container %s is version %d, not %d",
+		    params.hw_from, hw_ref.version, params.container_version);
+}
+
+/* Take the HW keys of the reference container, or check they are ours. */
+void reuseHwKeys(struct stb_container *c)
+{
+	const struct stb_layout *l = c->layout;
+	uint8_t *keys = stb_build_field(c, &l->hw_keys);
+	const uint8_t *ref = stb_field_ptr(&hw_ref, &l->hw_keys);
+	const struct stb_slot *slot;
+
+	for (slot = l->hw_slots; slot < l->hw_slots + l->hw_slot_count; slot++)
+		if (slotKeyFile(slot->id))
+			break;
+	if (slot == l->hw_slots + l->hw_slot_count) {
+		memcpy(keys, ref, l->hw_keys.size);
+		verbose_msg("HW keys taken from %s", params.hw_from);
+	} else if (memcmp(keys, ref, l->hw_keys.size)) {
+		die(EX_DATAERR, "The HW keys are not those of the reference "
+		    "container %s", params.hw_from);
+	}
+}
+
+/*
+ * Check that the finished prefix header, and so the SW keys, is the one of
+ * the reference container, and take the HW signatures not given from it.
+ */
+void reuseHwSigs(struct stb_container *c)
+{
+	const struct stb_layout *l = c->layout;
+	const uint8_t *h = hw_ref.region[STB_REGION_PREFIX_HDR];
+	size_t h_sz = l->region_size[STB_REGION_PREFIX_HDR];
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	const struct stb_slot *slot;
+	const uint8_t *sig;
+	int i, n = 0, t;
+
+	// In v1 the unused SW slots are not in the prefix data.
+	for (i = 0; i < l->sw_slot_count; i++) {
+		slot = &l->sw_slots[i];
+		if (l->sw_keys_counted && !stb_sw_slot_used(&hw_ref, i))
+			continue;
+		if (memcmp(stb_field_ptr(c, &slot->key),
+			   stb_field_ptr(&hw_ref, &slot->key), slot->key.size))
+			die(EX_DATAERR, "SW key %c is not the one of the reference "
+			    "container %s", toupper(slot->id), params.hw_from);
+	}
+	if (memcmp(c->region[STB_REGION_PREFIX_HDR], h, h_sz))
+		die(EX_DATAERR, "The prefix header is not the one of the reference "
+		    "container %s (SW keys, hw-flags or hw-cs-offset differ)",
+		    params.hw_from);
+
+	if (!stb_calc_hash(hw_ref.hash_alg, h, h_sz, md))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+
+	t = timings_begin("check signatures");
+	for (slot = l->hw_slots; slot < l->hw_slots + l->hw_slot_count; slot++) {
+		sig = stb_field_ptr(&hw_ref, &slot->sig);
+		if (slotSigFile(slot->id) || isZero(sig, slot->sig.size))
+			continue;
+		checkSlotSig(&hw_ref, slot, params.hw_from, params.hw_from,
+			     "prefix", h, h_sz, md);
+		memcpy(stb_build_field(c, &slot->sig), sig, slot->sig.size);
+		n++;
+	}
+	timings_end(t, 0);
+	verbose_msg("%d HW signatures taken from %s", n, params.hw_from);
+}
+
+int main(int argc, char* argv[])
+{
+	int fdout = -1;
 	void *container = malloc(SECURE_BOOT_HEADERS_V2_SIZE);
 	char *buf = malloc(SECURE_BOOT_HEADERS_V2_SIZE);
 	struct stat payload_st;
 	void *infile = NULL;
 	int r;
-	ROM_container_raw *c = (ROM_container_raw*) container;
-	ROM_prefix_header_raw *ph;
-	ROM_prefix_data_raw *pd;
-	ROM_sw_header_raw *swh;
-	ROM_sw_sig_raw *ssig;
-	ROM_container_v2_raw *c_v2 = (ROM_container_v2_raw*) container;
-	ROM_prefix_header_v2_raw *ph_v2;
-	ROM_prefix_data_v2_raw *pd_v2;
-	ROM_sw_header_v2_raw *swh_v2;
-	ROM_sw_sig_v2_raw *ssig_v2;
-	ROM_container_v3_raw *c_v3 = (ROM_container_v3_raw*) container;
-        ROM_prefix_header_v3_raw *ph_v3;
-        ROM_prefix_data_v3_raw *pd_v3;
-        ROM_sw_header_v3_raw *swh_v3;
-        ROM_sw_sig_v3_raw *ssig_v3;
-        uint8_t hash_alg = HASH_ALG_NONE;
-        uint8_t sig_alg = SIG_ALG_NONE; /* for >= v3 */
+	struct stb_container c;
+	uint8_t hash_alg = HASH_ALG_NONE;
 
 	unsigned char md[SHA512_DIGEST_LENGTH];
-	void *p;
-	ecc_key_t pubkeyraw;
-	ecc_signature_t sigraw;
+	unsigned char payload_md[SHA512_DIGEST_LENGTH];
+	uint64_t payload_size = 0;
+	uint64_t spool_mem = SPOOL_MEM_DEFAULT;
+	bool spooled = false;
+	pid_t check_pid = 0;
+	int fdin = -1;
+	const struct stb_layout *l;
+	int t;
 
 	progname = strrchr(argv[0], '/');
 	if (progname != NULL)
@@ -599,6 +1624,12 @@ int main(int argc, char* argv[])
 	else
 		progname = argv[0];
 
+	timings_init(progname);
+
+	stb = stb_ctx_new();
+	if (!stb)
+		die(EX_OSERR, "%s", "Cannot allocate container context");
+
 	memset(container, 0, SECURE_BOOT_HEADERS_V2_SIZE);
 
 	// Set the default values for non-pointer optional args
@@ -675,6 +1706,32 @@ int main(int argc, char* argv[])
 			*(argv + i) = "-H";
 		} else if (!strcmp(*(argv + i), "--pure")) {
 			*(argv + i) = "-4";
+		} else if (!strcmp(*(argv + i), "--sign-helper")) {
+			*(argv + i) = "-5";
+		} else if (!strcmp(*(argv + i), "--swHdrIn")) {
+			*(argv + i) = "-6";
+		} else if (!strcmp(*(argv + i), "--timings")) {
+			*(argv + i) = "-7";
+		} else if (!strcmp(*(argv + i), "--timings-json")) {
+			*(argv + i) = "-8";
+		} else if (!strcmp(*(argv + i), "--payload-digest")) {
+			*(argv + i) = "-9";
+		} else if (!strcmp(*(argv + i), "--payload-size")) {
+			*(argv + i) = "-<";
+		} else if (!strcmp(*(argv + i), "--payload-check")) {
+			*(argv + i) = "->";
+		} else if (!strcmp(*(argv + i), "--update")) {
+			*(argv + i) = "-^";
+		} else if (!strcmp(*(argv + i), "--hw-from")) {
+			*(argv + i) = "-~";
+		} else if (!strcmp(*(argv + i), "--spool-mem")) {
+			*(argv + i) = "-%";
+		} else if (!strcmp(*(argv + i), "--unprotected")) {
+			*(argv + i) = "-&";
+		} else if (!strcmp(*(argv + i), "--digest-cache")) {
+			*(argv + i) = "-*";
+		} else if (!strcmp(*(argv + i), "--io-strategy")) {
+			*(argv + i) = "-@";
 		} else if (!strncmp(*(argv + i), "--", 2)) {
 			fprintf(stderr, "%s: unrecognized option \'%s\'\n", progname,
 					*(argv + i));
@@ -686,10 +1743,10 @@ int main(int argc, char* argv[])
 	while (1) {
 		int opt;
 #ifdef _AIX
-		opt = getopt(argc, argv, "?hvdw:a:b:c:[:p:q:r:]:A:B:C:{:P:Q:R:}:3:L:I:o:O:f:F:l:0:1:2:3:S:V:H:4");
+		opt = getopt(argc, argv, "?hvdw:a:b:c:[:p:q:r:]:A:B:C:{:P:Q:R:}:3:L:I:o:O:f:F:l:0:1:2:3:S:V:H:45:6:789:<:>^~:%:&:*:@:");
 #else
 		opt = getopt_long(argc, argv,
-				"hvdw:a:b:c:[:p:q:r:}:A:B:C:{:P:Q:R:}:3:L:I:o:O:f:F:l:0:1:2:3:S:V:H:4", opts,
+				"hvdw:a:b:c:[:p:q:r:}:A:B:C:{:P:Q:R:}:3:L:I:o:O:f:F:l:0:1:2:3:S:V:H:45:6:789:<:>^~:%:&:*:@:", opts,
 				NULL);
 #endif
 		if (opt == -1)
@@ -832,19 +1889,135 @@ int main(int argc, char* argv[])
 		case '4':
 			params.mldsa_pure_mode = true;
 			break;
+		case '5':
+			params.sign_helper = optarg;
+			break;
+		case '6':
+			params.swhdrinfn = optarg;
+			break;
+		case '7':
+			timings_enable(TIMINGS_TABLE);
+			break;
+		case '8':
+			timings_enable(TIMINGS_JSON);
+			break;
+		case '9':
+			params.payload_digest = optarg;
+			break;
+		case '<':
+			params.payload_size = optarg;
+			break;
+		case '>':
+			params.payload_check = true;
+			break;
+		case '^':
+			params.update = true;
+			break;
+		case '~':
+			params.hw_from = optarg;
+			break;
+		case '%':
+			params.spool_mem = optarg;
+			break;
+		case '&':
+			params.unprotectedfn = optarg;
+			break;
+		case '*':
+			params.digest_cache = optarg;
+			break;
+		case '@':
+			params.io_strategy = optarg;
+			break;
 		default:
 			usage(EX_USAGE);
 		}
 	}
 
+	// The container goes to stdout, and what would be printed to stderr.
+	if (params.imagefn && !strcmp(params.imagefn, "-")) {
+		if (params.update)
+			die(EX_USAGE, "%s", "--update needs a container file");
+		fdout = dup(STDOUT_FILENO);
+		if (fdout < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			die(EX_OSERR, "Cannot redirect stdout (%s)", strerror(errno));
+	}
+
+	if (params.update) {
+		if (!params.imagefn)
+			die(EX_USAGE, "%s", "--update needs the container (--imagefile)");
+		updateContainer();
+		free(container);
+		free(buf);
+		stb_ctx_free(stb);
+		return 0;
+	}
+
+	if (params.payload_digest) {
+		char *hex = params.payload_digest;
+
+		if (!isValidHex(hex, sizeof(sha2_hash_t)))
+			die(EX_DATAERR, "%s",
+			    "Invalid input for payload-digest, expecting a 64 byte hexadecimal value");
+		if (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
+			hex += 2;
+		for (size_t x = 0; x < sizeof(sha2_hash_t); x++)
+			sscanf(&hex[x * 2], "%2hhx", &payload_md[x]);
+	}
+	if (params.payload_size) {
+		char *end;
+
+		if (!params.payload_digest)
+			die(EX_USAGE, "%s", "--payload-size needs --payload-digest");
+		errno = 0;
+		payload_size = strtoull(params.payload_size, &end, 0);
+		if (errno || end == params.payload_size || *end)
+			die(EX_DATAERR, "Invalid input for payload-size: %s",
+			    params.payload_size);
+	}
+	if (params.io_strategy) {
+		size_t window;
+		int io = stb_io_parse(params.io_strategy, &window);
+
+		if (io < 0 || stb_ctx_set_io(stb, io, window))
+			die(EX_USAGE, "Invalid input for io-strategy: %s",
+			    params.io_strategy);
+	}
+	if (params.spool_mem) {
+		char *end;
+
+		errno = 0;
+		spool_mem = strtoull(params.spool_mem, &end, 0);
+		if (errno || end == params.spool_mem || *end)
+			die(EX_DATAERR, "Invalid input for spool-mem: %s",
+			    params.spool_mem);
+	}
+	if (params.payload_digest && !params.payload_size && !params.payloadfn)
+		die(EX_USAGE, "%s", "--payload-digest needs --payload-size or --payload");
+	if (params.payload_check && (!params.payload_digest || !params.payloadfn))
+		die(EX_USAGE, "%s", "--payload-check needs --payload-digest and --payload");
+
+	memset(&payload_st, 0, sizeof(payload_st));
 	if (params.payloadfn) {
-		int fdin = open(params.payloadfn, O_RDONLY);
-		if (fdin <= 0)
+		// Kept open to find the holes of a sparse payload.
+		if (!strcmp(params.payloadfn, "-"))
+			fdin = STDIN_FILENO;
+		else
+			fdin = open(params.payloadfn, O_RDONLY);
+		if (fdin < 0)
 			die(EX_NOINPUT, "Cannot open payload file: %s", params.payloadfn);
 
 		r = fstat(fdin, &payload_st);
 		if (r != 0)
 			die(EX_NOINPUT, "Cannot stat payload file: %s", params.payloadfn);
+		// A pipe is read once the hash algorithm is known.
+		spooled = !S_ISREG(payload_st.st_mode);
+		if (spooled)
+			payload_st.st_size = 0;
+		else if (params.payload_size
+			 && (uint64_t) payload_st.st_size != payload_size)
+			die(EX_DATAERR, "Payload %s is %lu bytes, not --payload-size %lu",
+			    params.payloadfn, (unsigned long) payload_st.st_size,
+			    (unsigned long) payload_size);
 
 		if (payload_st.st_size > 0) {
 			infile = mmap(NULL, payload_st.st_size, PROT_READ, MAP_PRIVATE,
@@ -853,7 +2026,6 @@ int main(int argc, char* argv[])
 				die(EX_OSERR, "Cannot mmap file at fd: %d, size: %lu (%s)",
 				    fdin, payload_st.st_size, strerror(errno));
 		}
-		close(fdin);
 	}
 
 	if (params.container_version < 1 || params.container_version > 3)
@@ -867,730 +2039,197 @@ int main(int argc, char* argv[])
 	}
 #endif
 
+	if (params.hw_from)
+		loadHwRef();
+	if (params.unprotectedfn) {
+		if (params.container_version == 1)
+			die(EX_USAGE, "%s", "--unprotected needs container version 2 or 3");
+		openUnprotected();
+	}
+
+	// Without the payload, the headers are built for its given size.
 	if (!infile)
-		payload_st.st_size = 0;
+		payload_st.st_size = params.payloadfn ? 0 : payload_size;
 
-	fdout = open(params.imagefn, O_WRONLY | O_CREAT | O_TRUNC,
-			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (fdout <= 0)
+	if (fdout < 0)
+		fdout = open(params.imagefn, O_WRONLY | O_CREAT | O_TRUNC,
+			     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fdout < 0)
 		die(EX_CANTCREAT, "Cannot create output file: %s", params.imagefn);
 
-	switch (params.container_version) {
-	case 1:
-		if (hash_alg == HASH_ALG_NONE)
-			hash_alg = HASH_ALG_SHA512;
-		else if (hash_alg != HASH_ALG_SHA512)
-			die(EX_DATAERR, "%s", "Only sha512 is supported for container version 1\n");
-		sig_alg = SIG_ALG_SHA512_ECDSA;
-		break;
-	case 2:
-		if (hash_alg == HASH_ALG_NONE)
-			hash_alg = HASH_ALG_SHA3_512;
-		else if (hash_alg != HASH_ALG_SHA3_512)
-			die(EX_DATAERR, "%s", "Only sha3-512 is supported for container version 2\n");
-		sig_alg = SIG_ALG_SHA3_512_ECDSA_DIL;
-		break;
-	case 3:
-		if (hash_alg == HASH_ALG_NONE)
-			hash_alg = HASH_ALG_SHA3_512;
-
-		switch (hash_alg) {
-		case HASH_ALG_SHA3_512:
-			if (params.mldsa_pure_mode)
-				die(EX_DATAERR, "%s", "ML-DSA signing in pure mode is only supported when SHA-512 is used\n");
-			sig_alg = SIG_ALG_SHA3_512_ECDSA_MLDSA;
-			break;
-		case HASH_ALG_SHA512:
-			sig_alg = SIG_ALG_SHA512_ECDSA_MLDSA;
-			if (params.mldsa_pure_mode)
-				sig_alg = SIG_ALG_SHA512_ECDSA_MLDSA_PURE_MODE;
-			break;
-		default:
-			die(EX_DATAERR, "Unsupported hash_alg id '%u'\n", hash_alg);
-		}
-		break;
-	default:
-		die(EX_DATAERR, "Unsupported container version '%u'\n", params.container_version);
+	// --pure is ignored by the versions without a pure mode, as it always was.
+	l = stb_layout(params.container_version);
+	r = stb_build_init(stb, &c, container, params.container_version, hash_alg,
+			   params.mldsa_pure_mode && l->pure_sig_alg);
+	if (r)
+		die(EX_DATAERR, "%s", stb_ctx_error(stb));
+
+	if (spooled) {
+		spoolPayload(fdin, c.hash_alg, spool_mem);
+		payload_st.st_size = spool.size;
+		if (params.payload_size && spool.size != payload_size)
+			die(EX_DATAERR, "Payload %s is %lu bytes, not --payload-size %lu",
+			    params.payloadfn, (unsigned long) spool.size,
+			    (unsigned long) payload_size);
+		if (params.payload_check
+		    && memcmp(spool.md, payload_md, sizeof(sha2_hash_t)))
+			die(EX_DATAERR, "Payload %s does not match --payload-digest",
+			    params.payloadfn);
+	} else if (params.payload_check) {
+		check_pid = startPayloadCheck(c.hash_alg, fdin, infile,
+					      payload_st.st_size, payload_md);
 	}
 
 	// Container creation starts here.
-	if (params.container_version == 1)
-	{
-		c->magic_number = cpu_to_be32(ROM_MAGIC_NUMBER);
-		c->version = cpu_to_be16(1);
-		c->container_size = cpu_to_be64(SECURE_BOOT_HEADERS_SIZE + payload_st.st_size);
-		c->target_hrmor = 0;
-		c->stack_pointer = 0;
-		memset(c->hw_pkey_a, 0, sizeof(ecc_key_t));
-		memset(c->hw_pkey_b, 0, sizeof(ecc_key_t));
-		memset(c->hw_pkey_c, 0, sizeof(ecc_key_t));
-		if (params.hw_keyfn_a) {
-			getPublicKeyRaw(&pubkeyraw, params.hw_keyfn_a);
-			verbose_print((char *) "pubkey A = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(c->hw_pkey_a, pubkeyraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_keyfn_b) {
-			getPublicKeyRaw(&pubkeyraw, params.hw_keyfn_b);
-			verbose_print((char *) "pubkey B = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(c->hw_pkey_b, pubkeyraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_keyfn_c) {
-			getPublicKeyRaw(&pubkeyraw, params.hw_keyfn_c);
-			verbose_print((char *) "pubkey C = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(c->hw_pkey_c, pubkeyraw, sizeof(ecc_key_t));
-		}
-		p = SHA512(c->hw_pkey_a, sizeof(ecc_key_t) * 3, md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-		verbose_print((char *) "HW keys hash = ", md, sizeof(md));
-
-		ph = container + sizeof(ROM_container_raw);
-		ph->ver_alg.version = cpu_to_be16(1);
-		ph->ver_alg.hash_alg = HASH_ALG_SHA512;
-		ph->ver_alg.sig_alg = SIG_ALG_SHA512_ECDSA;
-
-		// Set code-start-offset.
-		if (params.hw_cs_offset) {
-			if (!isValidHex(params.hw_cs_offset, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for hw-cs-offset, expecting a 4 byte hexadecimal value");
-			uint64_t data = 0;
-			sscanf(params.hw_cs_offset, "%lx", &data);
-			ph->code_start_offset = cpu_to_be64(data);
-			verbose_msg("hw-cs-offset = %#010lx", data);
-		} else {
-			ph->code_start_offset = 0;
-		}
-		ph->reserved = 0;
-
-		// Set flags.
-		if (params.hw_flags) {
-			if (!isValidHex(params.hw_flags, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for hw-flags, expecting a 4 byte hexadecimal value");
-			uint32_t data;
-			sscanf(params.hw_flags, "%x", &data);
-			ph->flags = cpu_to_be32(data);
-			verbose_msg("hw-flags = %#010x", data);
-		} else {
-			ph->flags = cpu_to_be32(0x80000000);
-		}
-		memset(ph->payload_hash, 0, sizeof(sha2_hash_t));
-		ph->ecid_count = 0;
-
-		pd = (ROM_prefix_data_raw*) ph->ecid;
-		memset(pd->hw_sig_a, 0, sizeof(ecc_signature_t));
-		memset(pd->hw_sig_b, 0, sizeof(ecc_signature_t));
-		memset(pd->hw_sig_c, 0, sizeof(ecc_signature_t));
-
-		// Write the HW signatures.
-		if (params.hw_sigfn_a) {
-			getSigRaw(&sigraw, params.hw_sigfn_a);
-			verbose_print((char *) "signature A = ", sigraw, sizeof(sigraw));
-			memcpy(pd->hw_sig_a, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_sigfn_b) {
-			getSigRaw(&sigraw, params.hw_sigfn_b);
-			verbose_print((char *) "signature B = ", sigraw, sizeof(sigraw));
-			memcpy(pd->hw_sig_b, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_sigfn_c) {
-			getSigRaw(&sigraw, params.hw_sigfn_c);
-			verbose_print((char *) "signature C = ", sigraw, sizeof(sigraw));
-			memcpy(pd->hw_sig_c, sigraw, sizeof(ecc_key_t));
-		}
-		memset(pd->sw_pkey_p, 0, sizeof(ecc_key_t));
-		memset(pd->sw_pkey_q, 0, sizeof(ecc_key_t));
-		memset(pd->sw_pkey_r, 0, sizeof(ecc_key_t));
-
-		// Write the FW keys.
-		if (params.sw_keyfn_p) {
-			getPublicKeyRaw(&pubkeyraw, params.sw_keyfn_p);
-			verbose_print((char *) "pubkey P = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(pd->sw_pkey_p, pubkeyraw, sizeof(ecc_key_t));
-			ph->sw_key_count++;
-		}
-		if (params.sw_keyfn_q) {
-			getPublicKeyRaw(&pubkeyraw, params.sw_keyfn_q);
-			verbose_print((char *) "pubkey Q = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(pd->sw_pkey_q, pubkeyraw, sizeof(ecc_key_t));
-			ph->sw_key_count++;
-		}
-		if (params.sw_keyfn_r) {
-			getPublicKeyRaw(&pubkeyraw, params.sw_keyfn_r);
-			verbose_print((char *) "pubkey R = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(pd->sw_pkey_r, pubkeyraw, sizeof(ecc_key_t));
-			ph->sw_key_count++;
-		}
-		debug_msg("sw_key_count = %u", ph->sw_key_count);
-		ph->payload_size = cpu_to_be64(ph->sw_key_count * sizeof(ecc_key_t));
-
-		// Calculate the SW keys hash.
-		p = SHA512(pd->sw_pkey_p, sizeof(ecc_key_t) * ph->sw_key_count, md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-		memcpy(ph->payload_hash, md, sizeof(sha2_hash_t));
-		verbose_print((char *) "SW keys hash = ", md, sizeof(md));
-
-		// Dump the Prefix header.
-		if (params.prhdrfn)
-			writeHdr((void *) ph, params.prhdrfn, PREFIX_HDR, params.container_version, HASH_ALG_SHA512,
-			         false);
-
-		swh = (ROM_sw_header_raw*) (((uint8_t*) pd) + sizeof(ecc_signature_t) * 3
-					    + be64_to_cpu(ph->payload_size));
-		swh->ver_alg.version = cpu_to_be16(1);
-		swh->ver_alg.hash_alg = HASH_ALG_SHA512;
-		swh->ver_alg.sig_alg = SIG_ALG_SHA512_ECDSA;
-
-		// Set code-start-offset.
-		if (params.sw_cs_offset) {
-			if (!isValidHex(params.sw_cs_offset, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for sw-cs-offset, expecting a 4 byte hexadecimal value");
-			uint64_t data = 0;
-			sscanf(params.sw_cs_offset, "%lx", &data);
-			swh->code_start_offset = cpu_to_be64(data);
-			verbose_msg("sw-cs-offset = %#010lx", data);
-		} else {
-			swh->code_start_offset = 0;
-		}
-		swh->reserved = 0;
-
-		// Add component ID (label).
-		if (params.label) {
-			if (!isValidAscii(params.label, 0))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for label, expecting a 8 char ASCII value");
-			strncpy((char *) &swh->reserved, params.label, 8);
-			verbose_msg("component ID (was reserved) = %.8s",
-				    (char * ) &swh->reserved);
-		}
-
-		// Set flags.
-		if (params.sw_flags) {
-			if (!isValidHex(params.sw_flags, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for sw-flags, expecting a 4 byte hexadecimal value");
-			uint32_t data;
-			sscanf(params.sw_flags, "%x", &data);
-			swh->flags = cpu_to_be32(data);
-			verbose_msg("sw-flags = %#010x", data);
-		} else {
-			swh->flags = cpu_to_be32(0x00000000);
-		}
-		swh->security_version = params.security_version;
-		swh->payload_size = cpu_to_be64(payload_st.st_size);
-
-		// Calculate the payload hash.
-		p = SHA512(infile, payload_st.st_size, md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-		memcpy(swh->payload_hash, md, sizeof(sha2_hash_t));
-		verbose_print((char *) "Payload hash = ", md, sizeof(md));
-
-		// Dump the Software header.
-		if (params.swhdrfn)
-			writeHdr((void *) swh, params.swhdrfn, SOFTWARE_HDR, params.container_version, HASH_ALG_SHA512,
-			         false);
-
-		ssig = (ROM_sw_sig_raw*) (((uint8_t*) swh) + sizeof(ROM_sw_header_raw));
-		memset(ssig->sw_sig_p, 0, sizeof(ecc_signature_t));
-		memset(ssig->sw_sig_q, 0, sizeof(ecc_signature_t));
-		memset(ssig->sw_sig_r, 0, sizeof(ecc_signature_t));
-
-		// Write the HW signatures.
-		if (params.sw_sigfn_p) {
-			getSigRaw(&sigraw, params.sw_sigfn_p);
-			verbose_print((char *) "signature P = ", sigraw, sizeof(sigraw));
-			memcpy(ssig->sw_sig_p, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.sw_sigfn_q) {
-			getSigRaw(&sigraw, params.sw_sigfn_q);
-			verbose_print((char *) "signature Q = ", sigraw, sizeof(sigraw));
-			memcpy(ssig->sw_sig_q, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.sw_sigfn_r) {
-			getSigRaw(&sigraw, params.sw_sigfn_r);
-			verbose_print((char *) "signature R = ", sigraw, sizeof(sigraw));
-			memcpy(ssig->sw_sig_r, sigraw, sizeof(ecc_key_t));
-		}
-
-		// Dump the full container header.
-		if (params.cthdrfn)
-			writeHdr((void *) c, params.cthdrfn, CONTAINER_HDR, params.container_version, HASH_ALG_SHA512,
-			         false);
-
-		// Print container stats.
-		size = (uint8_t*) ph - (uint8_t *) c;
-		offset = 0;
-		verbose_msg("HW header size        = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) pd - (uint8_t *) ph;
-		offset = (uint8_t*) ph - (uint8_t *) c;
-		verbose_msg("Prefix header size    = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) swh - (uint8_t *) pd;
-		offset = (uint8_t*) pd - (uint8_t *) c;
-		verbose_msg("Prefix data size      = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) ssig - (uint8_t *) swh;
-		offset = (uint8_t*) swh - (uint8_t *) c;
-		verbose_msg("SW header size        = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = sizeof(ecc_key_t) * ph->sw_key_count;
-		offset = (uint8_t*) ssig - (uint8_t *) c;
-		verbose_msg("SW signature size     = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-
-		verbose_msg("TOTAL HEADER SIZE     = %4d (%#0x)", SECURE_BOOT_HEADERS_SIZE,
-			    SECURE_BOOT_HEADERS_SIZE);
-		verbose_msg("PAYLOAD SIZE          = %4lu (%#0lx)",
-			    be64_to_cpu(swh->payload_size), be64_to_cpu(swh->payload_size));
-		verbose_msg("TOTAL CONTAINER SIZE  = %4lu (%#0lx)",
-			    be64_to_cpu(c->container_size), be64_to_cpu(c->container_size));
-
-		// Write container.
-		if ((r = write(fdout, container, SECURE_BOOT_HEADERS_SIZE)) != 4096)
-			die(EX_SOFTWARE, "Cannot write container header (r = %d) (%s)", r,
-			    strerror(errno));
-
-
-	} else if (params.container_version == 2) {
-		// VERSION 2 CONTAINER
-
-		c_v2->magic_number = cpu_to_be32(ROM_MAGIC_NUMBER);
-		c_v2->version = cpu_to_be16(2);
-		c_v2->container_size = cpu_to_be64(SECURE_BOOT_HEADERS_V2_SIZE + payload_st.st_size);
-		memset(c_v2->hw_pkey_a, 0, sizeof(ecc_key_t));
-		memset(c_v2->hw_pkey_d, 0, sizeof(dilithium_key_t));
-		if (params.hw_keyfn_a) {
-			getPublicKeyRaw(&pubkeyraw, params.hw_keyfn_a);
-			verbose_print((char *) "pubkey A = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(c_v2->hw_pkey_a, pubkeyraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_keyfn_d) {
-			size_t sLen = sizeof(c_v2->hw_pkey_d);
-			int r = readBinaryFile(c_v2->hw_pkey_d, &sLen,params.hw_keyfn_d);
-			if (0 != r || sLen != DILITHIUM_PUB_KEY_LENGTH)
-				die(EX_SOFTWARE, "Failure reading HW PUBKEY D : %s",params.hw_keyfn_d);
-			verbose_print((char *) "pubkey D = ", c_v2->hw_pkey_d, sizeof(c_v2->hw_pkey_d));
-		}
-		p = calc_hash(HASH_ALG_SHA3_512, c_v2->hw_pkey_a, sizeof(ecc_key_t) + sizeof(dilithium_key_t), md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-		verbose_print((char *) "HW keys hash = ", md, sizeof(md));
-
-		ph_v2 = (ROM_prefix_header_v2_raw*)&(c_v2->prefix);
-		ph_v2->ver_alg.version = cpu_to_be16(2);
-		ph_v2->ver_alg.hash_alg = HASH_ALG_SHA3_512;
-		ph_v2->ver_alg.sig_alg = SIG_ALG_SHA3_512_ECDSA_DIL;
-		ph_v2->reserved = 0;
-
-		// Set flags.
-		if (params.hw_flags) {
-			if (!isValidHex(params.hw_flags, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for hw-flags, expecting a 4 byte hexadecimal value");
-			uint32_t data;
-			sscanf(params.hw_flags, "%x", &data);
-			ph_v2->flags = cpu_to_be32(data);
-			verbose_msg("hw-flags = %#010x", data);
-		} else {
-			ph_v2->flags = cpu_to_be32(0x80000000);
-		}
-		memset(ph_v2->payload_hash, 0, sizeof(sha2_hash_t));
-		memset(ph_v2->ecid, 0, ECID_SIZE);
-		memset(ph_v2->reserved2, 0, sizeof(ph_v2->reserved2));
-
-		pd_v2 = (ROM_prefix_data_v2_raw*)&c_v2->prefix_data;
-		memset(pd_v2->hw_sig_a, 0, sizeof(ecc_signature_t));
-		memset(pd_v2->hw_sig_d, 0, sizeof(dilithium_signature_t));
-
-		// Write the HW signatures.
-		if (params.hw_sigfn_a) {
-			getSigRaw(&sigraw, params.hw_sigfn_a);
-			verbose_print((char *) "signature A = ", sigraw, sizeof(sigraw));
-			memcpy(pd_v2->hw_sig_a, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_sigfn_d) {
-			size_t sLen = sizeof(pd_v2->hw_sig_d);
-			int r = readBinaryFile(pd_v2->hw_sig_d, &sLen,params.hw_sigfn_d);
-			if (0 != r || sLen != DILITHIUM_SIG_LENGTH)
-				die(EX_SOFTWARE, "Failure reading HW SIG D : %s",params.hw_sigfn_d);
-			verbose_print((char *) "signature D = ", pd_v2->hw_sig_d, sizeof(pd_v2->hw_sig_d));
-		}
-		memset(pd_v2->sw_pkey_p, 0, sizeof(ecc_key_t));
-		memset(pd_v2->sw_pkey_s, 0, sizeof(dilithium_key_t));
-
-		// Write the FW keys.
-		if (params.sw_keyfn_p) {
-			getPublicKeyRaw(&pubkeyraw, params.sw_keyfn_p);
-			verbose_print((char *) "pubkey P = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(pd_v2->sw_pkey_p, pubkeyraw, sizeof(ecc_key_t));
-			ph_v2->sw_key_count++;
-			ph_v2->payload_size += sizeof(ecc_key_t);
-		}
-		if (params.sw_keyfn_s) {
-			size_t sLen = sizeof(pd_v2->sw_pkey_s);
-			int r = readBinaryFile(pd_v2->sw_pkey_s, &sLen,params.sw_keyfn_s);
-			if (0 != r || sLen != DILITHIUM_PUB_KEY_LENGTH)
-				die(EX_SOFTWARE, "Failure reading SW PUBKEY S : %s",params.sw_keyfn_s);
-			verbose_print((char *) "pubkey S = ", pd_v2->sw_pkey_s, sizeof(pd_v2->sw_pkey_s));
-			ph_v2->sw_key_count++;
-			ph_v2->payload_size += sizeof(dilithium_key_t);
-		}
-		ph_v2->payload_size = cpu_to_be64(ph_v2->payload_size);
-		debug_msg("sw_key_count = %u", ph_v2->sw_key_count);
-
-		// Calculate the SW keys hash.
-		p = calc_hash(HASH_ALG_SHA3_512, pd_v2->sw_pkey_p, be64_to_cpu(ph_v2->payload_size), md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-		memcpy(ph_v2->payload_hash, md, sizeof(sha2_hash_t));
-		verbose_print((char *) "SW keys hash = ", md, sizeof(md));
-
-		// Dump the Prefix header.
-		if (params.prhdrfn)
-			writeHdr((void *) ph_v2, params.prhdrfn, PREFIX_HDR, params.container_version, HASH_ALG_SHA3_512,
-			         false);
-
-		swh_v2 = (ROM_sw_header_v2_raw*) &c_v2->swheader;
-		swh_v2->ver_alg.version = cpu_to_be16(2);
-		swh_v2->ver_alg.hash_alg = HASH_ALG_SHA3_512;
-		swh_v2->ver_alg.sig_alg = SIG_ALG_SHA3_512_ECDSA_DIL;
-
-		swh_v2->reserved = 0;
-
-		// Add component ID (label).
-		if (params.label) {
-			if (!isValidAscii(params.label, 0))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for label, expecting a 8 char ASCII value");
-			strncpy((char *) &swh_v2->component_id, params.label, 8);
-			verbose_msg("component ID = %.8s",
-				    (char * ) &swh_v2->component_id);
-		} else {
-			swh_v2->component_id = 0;
-		}
-
-		// Set flags.
-		if (params.sw_flags) {
-			if (!isValidHex(params.sw_flags, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for sw-flags, expecting a 4 byte hexadecimal value");
-			uint32_t data;
-			sscanf(params.sw_flags, "%x", &data);
-			swh_v2->flags = cpu_to_be32(data);
-			verbose_msg("sw-flags = %#010x", data);
-		} else {
-			swh_v2->flags = cpu_to_be32(0x00000000);
-		}
-		swh_v2->security_version = params.security_version;
-		swh_v2->payload_size = cpu_to_be64(payload_st.st_size);
-		swh_v2->unprotected_payload_size = 0;
-
-		// Set the FW ECID if provided
-		memset(swh_v2->ecid, 0, ECID_SIZE);
-		if (params.fw_ecid) {
-			if (!isValidHex(params.fw_ecid, ECID_SIZE))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for sw-ecid, expecting a 16 byte hexadecimal value");
-			for (int x = 0; x < ECID_SIZE; x++) {
-				sscanf(&(params.fw_ecid[x*2]), "%2hhx", &(swh_v2->ecid[x]));
-			}
-			verbose_print((char *) "FW ECID = ", swh_v2->ecid, sizeof(swh_v2->ecid));
-		}
-
-		memset(swh_v2->reserved2,0, sizeof(swh_v2->reserved2));
-
-		// Calculate the payload hash.
-		p = calc_hash(HASH_ALG_SHA3_512, infile, payload_st.st_size, md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-		memcpy(swh_v2->payload_hash, md, sizeof(sha2_hash_t));
-		verbose_print((char *) "Payload hash = ", md, sizeof(md));
-
-		// Dump the Software header.
-		if (params.swhdrfn)
-			writeHdr((void *) swh_v2, params.swhdrfn, SOFTWARE_HDR, params.container_version, HASH_ALG_SHA3_512,
-			         false);
-
-		ssig_v2 = (ROM_sw_sig_v2_raw*)&c_v2->sw_data;
-		memset(ssig_v2->sw_sig_p, 0, sizeof(ecc_signature_t));
-		memset(ssig_v2->sw_sig_s, 0, sizeof(dilithium_signature_t));
-
-		// Write the HW signatures.
-		if (params.sw_sigfn_p) {
-			getSigRaw(&sigraw, params.sw_sigfn_p);
-			verbose_print((char *) "signature P = ", sigraw, sizeof(sigraw));
-			memcpy(ssig_v2->sw_sig_p, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.sw_sigfn_s) {
-			size_t sLen = sizeof(ssig_v2->sw_sig_s);
-			int r = readBinaryFile(ssig_v2->sw_sig_s, &sLen,params.sw_sigfn_s);
-			if (0 != r || sLen != DILITHIUM_SIG_LENGTH)
-				die(EX_SOFTWARE, "Failure reading SW SIG S : %s",params.sw_sigfn_s);
-			verbose_print((char *) "signature S = ", ssig_v2->sw_sig_s, sizeof(ssig_v2->sw_sig_s));
-		}
-
-		// Dump the full container header.
-		if (params.cthdrfn)
-			writeHdr((void *) c, params.cthdrfn, CONTAINER_HDR, params.container_version, HASH_ALG_SHA3_512,
-			         false);
-
-		// Print container stats.
-		size = (uint8_t*) ph_v2 - (uint8_t *) c_v2;
-		offset = 0;
-		verbose_msg("HW header size        = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) pd_v2 - (uint8_t *) ph_v2;
-		offset = (uint8_t*) ph_v2 - (uint8_t *) c_v2;
-		verbose_msg("Prefix header size    = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) swh_v2 - (uint8_t *) pd_v2;
-		offset = (uint8_t*) pd_v2 - (uint8_t *) c_v2;
-		verbose_msg("Prefix data size      = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) ssig_v2 - (uint8_t *) swh_v2;
-		offset = (uint8_t*) swh_v2 - (uint8_t *) c_v2;
-		verbose_msg("SW header size        = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-
-		verbose_msg("TOTAL HEADER SIZE     = %4d (%#0x)", SECURE_BOOT_HEADERS_V2_SIZE,
-			    SECURE_BOOT_HEADERS_V2_SIZE);
-		verbose_msg("PAYLOAD SIZE          = %4lu (%#0lx)",
-			    be64_to_cpu(swh_v2->payload_size), be64_to_cpu(swh_v2->payload_size));
-		verbose_msg("TOTAL CONTAINER SIZE  = %4lu (%#0lx)",
-			    be64_to_cpu(c_v2->container_size), be64_to_cpu(c_v2->container_size));
-
-		// Write container.
-		if ((r = write(fdout, container, SECURE_BOOT_HEADERS_V2_SIZE)) != SECURE_BOOT_HEADERS_V2_SIZE)
-			die(EX_SOFTWARE, "Cannot write container header (r = %d) (%s)", r,
-			    strerror(errno));
+	writeKeys(&c, l->hw_slots, l->hw_slot_count);
+	if (params.hw_from)
+		reuseHwKeys(&c);
+	if (!stb_calc_hash(c.hash_alg, stb_field_ptr(&c, &l->hw_keys),
+			   l->hw_keys.size, md))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	verbose_print((char *) "HW keys hash = ", md, sizeof(md));
+
+	// Set code-start-offset, in v1 only, and flags.
+	if (params.hw_cs_offset && l->hw_code_start.size)
+		setHexField(&c, &l->hw_code_start, params.hw_cs_offset,
+			    "hw-cs-offset");
+	if (params.hw_flags)
+		setHexField(&c, &l->hw_flags, params.hw_flags, "hw-flags");
+	else
+		setField(&c, &l->hw_flags, 0x80000000);
+
+	// Write the HW signatures.
+	writeSigs(&c, l->hw_slots, l->hw_slot_count);
+
+	// Write the FW keys, then their count and hash.
+	writeKeys(&c, l->sw_slots, l->sw_slot_count);
+	r = stb_build_sw_keys(stb, &c);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	debug_msg("sw_key_count = %u", *stb_field_ptr(&c, &l->sw_key_count));
+	verbose_print((char *) "SW keys hash = ",
+		      stb_build_field(&c, &l->sw_keys_hash), l->sw_keys_hash.size);
+	if (params.hw_from)
+		reuseHwSigs(&c);
+
+	// Dump the Prefix header.
+	if (params.prhdrfn)
+		writeHdr(&c, PREFIX_HDR, params.prhdrfn, c.mldsa_pure_mode);
+
+	// Set code-start-offset, in v1 only.
+	if (params.sw_cs_offset && l->sw_code_start.size)
+		setHexField(&c, &l->sw_code_start, params.sw_cs_offset,
+			    "sw-cs-offset");
+
+	// Add component ID (label), in the reserved field in v1.
+	if (params.label) {
+		if (!isValidAscii(params.label, 0))
+			die(EX_DATAERR, "%s",
+			    "Invalid input for label, expecting a 8 char ASCII value");
+		strncpy((char *) stb_build_field(&c, &l->component_id), params.label,
+			l->component_id.size);
+		verbose_msg("component ID = %.8s",
+			    (const char *) stb_field_ptr(&c, &l->component_id));
+	}
 
-	} else {
-		// VERSION 3 CONTAINER
-
-		c_v3->magic_number = cpu_to_be32(ROM_MAGIC_NUMBER);
-		c_v3->version = cpu_to_be16(3);
-		c_v3->container_size = cpu_to_be64(SECURE_BOOT_HEADERS_V3_SIZE + payload_st.st_size);
-		memset(c_v3->hw_pkey_a, 0, sizeof(ecc_key_t));
-		memset(c_v3->hw_pkey_d, 0, sizeof(mldsa_key_t));
-		if (params.hw_keyfn_a) {
-			getPublicKeyRaw(&pubkeyraw, params.hw_keyfn_a);
-			verbose_print((char *) "pubkey A = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(c_v3->hw_pkey_a, pubkeyraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_keyfn_d) {
-			size_t sLen = sizeof(c_v3->hw_pkey_d);
-			int r = readBinaryFile(c_v3->hw_pkey_d, &sLen,params.hw_keyfn_d);
-			if (0 != r || sLen != MLDSA_87_PUB_KEY_LENGTH)
-				die(EX_SOFTWARE, "Failure reading HW PUBKEY D : %s",params.hw_keyfn_d);
-			verbose_print((char *) "pubkey D = ", c_v3->hw_pkey_d, sizeof(c_v3->hw_pkey_d));
-		}
-		p = calc_hash(hash_alg, c_v3->hw_pkey_a, sizeof(ecc_key_t) + sizeof(mldsa_key_t), md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-		verbose_print((char *) "HW keys hash = ", md, sizeof(md));
-
-		ph_v3 = (ROM_prefix_header_v3_raw*)&(c_v3->prefix);
-		ph_v3->ver_alg.version = cpu_to_be16(3);
-		ph_v3->ver_alg.hash_alg = hash_alg;
-		ph_v3->ver_alg.sig_alg = sig_alg;
-		ph_v3->reserved = 0;
-
-		// Set flags.
-		if (params.hw_flags) {
-			if (!isValidHex(params.hw_flags, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for hw-flags, expecting a 4 byte hexadecimal value");
-			uint32_t data;
-			sscanf(params.hw_flags, "%x", &data);
-			ph_v3->flags = cpu_to_be32(data);
-			verbose_msg("hw-flags = %#010x", data);
-		} else {
-			ph_v3->flags = cpu_to_be32(0x80000000);
-		}
-		memset(ph_v3->payload_hash, 0, sizeof(sha2_hash_t));
-		memset(ph_v3->ecid, 0, ECID_SIZE);
-		memset(ph_v3->reserved2, 0, sizeof(ph_v3->reserved2));
-
-		pd_v3 = (ROM_prefix_data_v3_raw*)&c_v3->prefix_data;
-		memset(pd_v3->hw_sig_a, 0, sizeof(ecc_signature_t));
-		memset(pd_v3->hw_sig_d, 0, sizeof(mldsa_signature_t));
-
-		// Write the HW signatures.
-		if (params.hw_sigfn_a) {
-			getSigRaw(&sigraw, params.hw_sigfn_a);
-			verbose_print((char *) "signature A = ", sigraw, sizeof(sigraw));
-			memcpy(pd_v3->hw_sig_a, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.hw_sigfn_d) {
-			size_t sLen = sizeof(pd_v3->hw_sig_d);
-			int r = readBinaryFile(pd_v3->hw_sig_d, &sLen,params.hw_sigfn_d);
-			if (0 != r || sLen != MLDSA_87_SIG_LENGTH)
-				die(EX_SOFTWARE, "Failure reading HW SIG D : %s",params.hw_sigfn_d);
-			verbose_print((char *) "signature D = ", pd_v3->hw_sig_d, sizeof(pd_v3->hw_sig_d));
-		}
-		memset(pd_v3->sw_pkey_p, 0, sizeof(ecc_key_t));
-		memset(pd_v3->sw_pkey_s, 0, sizeof(mldsa_key_t));
-
-		// Write the FW keys.
-		if (params.sw_keyfn_p) {
-			getPublicKeyRaw(&pubkeyraw, params.sw_keyfn_p);
-			verbose_print((char *) "pubkey P = ", pubkeyraw, sizeof(pubkeyraw));
-			memcpy(pd_v3->sw_pkey_p, pubkeyraw, sizeof(ecc_key_t));
-			ph_v3->sw_key_count++;
-			ph_v3->payload_size += sizeof(ecc_key_t);
-		}
-		if (params.sw_keyfn_s) {
-			size_t sLen = sizeof(pd_v3->sw_pkey_s);
-			int r = readBinaryFile(pd_v3->sw_pkey_s, &sLen,params.sw_keyfn_s);
-			if (0 != r || sLen != MLDSA_87_PUB_KEY_LENGTH)
-				die(EX_SOFTWARE, "Failure reading SW PUBKEY S : %s",params.sw_keyfn_s);
-			verbose_print((char *) "pubkey S = ", pd_v3->sw_pkey_s, sizeof(pd_v3->sw_pkey_s));
-			ph_v3->sw_key_count++;
-			ph_v3->payload_size += sizeof(mldsa_key_t);
-		}
-		ph_v3->payload_size = cpu_to_be64(ph_v3->payload_size);
-		debug_msg("sw_key_count = %u", ph_v3->sw_key_count);
-
-		// Calculate the SW keys hash.
-		p = calc_hash(hash_alg, pd_v3->sw_pkey_p, be64_to_cpu(ph_v3->payload_size), md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-		memcpy(ph_v3->payload_hash, md, sizeof(sha2_hash_t));
-		verbose_print((char *) "SW keys hash = ", md, sizeof(md));
-
-		// Dump the Prefix header.
-		if (params.prhdrfn)
-			writeHdr((void *) ph_v3, params.prhdrfn, PREFIX_HDR, params.container_version, hash_alg,
-			         params.mldsa_pure_mode);
-
-		swh_v3 = (ROM_sw_header_v3_raw*) &c_v3->swheader;
-		swh_v3->ver_alg.version = cpu_to_be16(3);
-		swh_v3->ver_alg.hash_alg = hash_alg;
-		swh_v3->ver_alg.sig_alg = sig_alg;
-		swh_v3->reserved = 0;
-
-		// Add component ID (label).
-		if (params.label) {
-			if (!isValidAscii(params.label, 0))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for label, expecting a 8 char ASCII value");
-			strncpy((char *) &swh_v3->component_id, params.label, 8);
-			verbose_msg("component ID = %.8s",
-				    (char * ) &swh_v3->component_id);
-		} else {
-			swh_v3->component_id = 0;
-		}
+	// Set flags.
+	if (params.sw_flags)
+		setHexField(&c, &l->sw_flags, params.sw_flags, "sw-flags");
+	setField(&c, &l->security_version, params.security_version);
+	r = stb_build_sizes(stb, &c, payload_st.st_size, unprotected.size);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+
+	// Set the FW ECID if provided, not in v1.
+	if (params.fw_ecid && l->fw_ecid.size) {
+		uint8_t *ecid = stb_build_field(&c, &l->fw_ecid);
+
+		if (!isValidHex(params.fw_ecid, ECID_SIZE))
+			die(EX_DATAERR, "%s",
+			    "Invalid input for sw-ecid, expecting a 16 byte hexadecimal value");
+		for (int x = 0; x < l->fw_ecid.size; x++)
+			sscanf(&(params.fw_ecid[x*2]), "%2hhx", &ecid[x]);
+		verbose_print((char *) "FW ECID = ", ecid, l->fw_ecid.size);
+	}
 
-		// Set flags.
-		if (params.sw_flags) {
-			if (!isValidHex(params.sw_flags, 4))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for sw-flags, expecting a 4 byte hexadecimal value");
-			uint32_t data;
-			sscanf(params.sw_flags, "%x", &data);
-			swh_v3->flags = cpu_to_be32(data);
-			verbose_msg("sw-flags = %#010x", data);
-		} else {
-			swh_v3->flags = cpu_to_be32(0x00000000);
-		}
-		swh_v3->security_version = params.security_version;
-		swh_v3->payload_size = cpu_to_be64(payload_st.st_size);
-		swh_v3->unprotected_payload_size = 0;
-
-		// Set the FW ECID if provided
-		memset(swh_v3->ecid, 0, ECID_SIZE);
-		if (params.fw_ecid) {
-			if (!isValidHex(params.fw_ecid, ECID_SIZE))
-				die(EX_DATAERR, "%s",
-				    "Invalid input for sw-ecid, expecting a 16 byte hexadecimal value");
-			for (int x = 0; x < ECID_SIZE; x++) {
-				sscanf(&(params.fw_ecid[x*2]), "%2hhx", &(swh_v3->ecid[x]));
-			}
-			verbose_print((char *) "FW ECID = ", swh_v3->ecid, sizeof(swh_v3->ecid));
-		}
+	// Calculate the payload hash, unless given, or the previous pass
+	// or another container of the batch already did.
+	if (!getGivenPayloadHash(payload_md, md)
+	    && !getCachedPayloadHash(c.region[STB_REGION_SW_HDR],
+				     l->region_size[STB_REGION_SW_HDR],
+				     l->payload_hash.offset, &payload_st, md)
+	    && !getDigestCacheHash(c.hash_alg, fdin, md)) {
+		t = timings_begin("payload hash");
+		if (!hashPayload(c.hash_alg, fdin, infile, payload_st.st_size, md))
+			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+		timings_end(t, payload_st.st_size);
+	}
+	memcpy(stb_build_field(&c, &l->payload_hash), md, l->payload_hash.size);
+	verbose_print((char *) "Payload hash = ", md, sizeof(md));
 
-		memset(swh_v3->reserved2,0, sizeof(swh_v3->reserved2));
-
-		// Calculate the payload hash.
-		p = calc_hash(hash_alg, infile, payload_st.st_size, md);
-		if (!p)
-			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA-512");
-		memcpy(swh_v3->payload_hash, md, sizeof(sha2_hash_t));
-		verbose_print((char *) "Payload hash = ", md, sizeof(md));
-
-		// Dump the Software header.
-		if (params.swhdrfn)
-			writeHdr((void *) swh_v3, params.swhdrfn, SOFTWARE_HDR, params.container_version, hash_alg,
-			         params.mldsa_pure_mode);
-
-		ssig_v3 = (ROM_sw_sig_v3_raw*)&c_v3->sw_data;
-		memset(ssig_v3->sw_sig_p, 0, sizeof(ecc_signature_t));
-		memset(ssig_v3->sw_sig_s, 0, sizeof(mldsa_signature_t));
-
-		// Write the HW signatures.
-		if (params.sw_sigfn_p) {
-			getSigRaw(&sigraw, params.sw_sigfn_p);
-			verbose_print((char *) "signature P = ", sigraw, sizeof(sigraw));
-			memcpy(ssig_v3->sw_sig_p, sigraw, sizeof(ecc_key_t));
-		}
-		if (params.sw_sigfn_s) {
-			size_t sLen = sizeof(ssig_v3->sw_sig_s);
-			int r = readBinaryFile(ssig_v3->sw_sig_s, &sLen,params.sw_sigfn_s);
-			if (0 != r || sLen != MLDSA_87_SIG_LENGTH)
-				die(EX_SOFTWARE, "Failure reading SW SIG S : %s",params.sw_sigfn_s);
-			verbose_print((char *) "signature S = ", ssig_v3->sw_sig_s, sizeof(ssig_v3->sw_sig_s));
-		}
+	// Dump the Software header.
+	if (params.swhdrfn) {
+		writeHdr(&c, SOFTWARE_HDR, params.swhdrfn, c.mldsa_pure_mode);
+		writePayloadStamp(params.swhdrfn, &payload_st);
+	}
 
-		// Dump the full container header.
-		if (params.cthdrfn)
-			writeHdr((void *) c, params.cthdrfn, CONTAINER_HDR, params.container_version, hash_alg,
-			         false);
+	// Write the SW signatures.
+	writeSigs(&c, l->sw_slots, l->sw_slot_count);
+
+	// Request the missing ECDSA signatures from the sign helper.
+	if (params.sign_helper) {
+		r = stb_hash_region(stb, &c, STB_REGION_PREFIX_HDR, md);
+		if (r)
+			die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+		queueSignRequests(&c, l->hw_slots, l->hw_slot_count, md);
+		r = stb_hash_region(stb, &c, STB_REGION_SW_HDR, md);
+		if (r)
+			die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+		queueSignRequests(&c, l->sw_slots, l->sw_slot_count, md);
+		t = timings_begin("sign helper");
+		runSignHelper();
+		timings_end(t, 0);
+	}
 
-		// Print container stats.
-		size = (uint8_t*) ph_v3 - (uint8_t *) c_v3;
-		offset = 0;
-		verbose_msg("HW header size        = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) pd_v3 - (uint8_t *) ph_v3;
-		offset = (uint8_t*) ph_v3 - (uint8_t *) c_v3;
-		verbose_msg("Prefix header size    = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) swh_v3 - (uint8_t *) pd_v3;
-		offset = (uint8_t*) pd_v3 - (uint8_t *) c_v3;
-		verbose_msg("Prefix data size      = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
-		size = (uint8_t*) ssig_v3 - (uint8_t *) swh_v3;
-		offset = (uint8_t*) swh_v3 - (uint8_t *) c_v3;
-		verbose_msg("SW header size        = %4u (%#06x) at offset %4u (%#06x)",
-			    size, size, offset, offset);
+	// Dump the full container header.
+	if (params.cthdrfn)
+		writeHdr(&c, CONTAINER_HDR, params.cthdrfn, false);
 
-		verbose_msg("TOTAL HEADER SIZE     = %4d (%#0x)", SECURE_BOOT_HEADERS_V3_SIZE,
-			    SECURE_BOOT_HEADERS_V3_SIZE);
-		verbose_msg("PAYLOAD SIZE          = %4lu (%#0lx)",
-			    be64_to_cpu(swh_v3->payload_size), be64_to_cpu(swh_v3->payload_size));
-		verbose_msg("TOTAL CONTAINER SIZE  = %4lu (%#0lx)",
-			    be64_to_cpu(c_v3->container_size), be64_to_cpu(c_v3->container_size));
+	// Print container stats.
+	printContainerStats(&c);
 
-		// Write container.
-		if ((r = write(fdout, container, SECURE_BOOT_HEADERS_V3_SIZE)) != SECURE_BOOT_HEADERS_V3_SIZE)
-			die(EX_SOFTWARE, "Cannot write container header (r = %d) (%s)", r,
-			    strerror(errno));
+	// Write container.
+	t = timings_begin("write container");
+	if ((r = write(fdout, container, l->header_size)) != (int) l->header_size)
+		die(EX_SOFTWARE, "Cannot write container header (r = %d) (%s)", r,
+		    strerror(errno));
+	timings_end(t, r);
 
-	}
+	if (check_pid)
+		finishPayloadCheck(check_pid);
 
 	if (infile) {
-		if ((r = write(fdout, infile, payload_st.st_size))
-				!= payload_st.st_size)
-			die(EX_SOFTWARE, "Cannot write container payload (r = %d) (%s)", r,
-					strerror(errno));
+		t = timings_begin("write container");
+		writePayload(fdout, fdin, (const uint8_t *) infile,
+			     payload_st.st_size);
+		timings_end(t, payload_st.st_size);
+	} else if (spooled) {
+		t = timings_begin("write container");
+		writeSpool(fdout);
+		timings_end(t, spool.size);
 	}
+	// Without the payload, it is for whoever appends the payload to append.
+	if (unprotected.fd >= 0 && (infile || spooled || !payload_st.st_size))
+		writeUnprotected(fdout);
+	else if (unprotected.fd >= 0)
+		verbose_msg("Unprotected payload %s to be appended after the payload",
+			    params.unprotectedfn);
 	close(fdout);
+	if (fdin >= 0)
+		close(fdin);
 	free(container);
 	free(buf);
+	free(hw_ref_hdr);
+	stb_ctx_free(stb);
 	return 0;
 }
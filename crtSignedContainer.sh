@@ -54,6 +54,8 @@ usage () {
     echo "	    --contrHdrOut       file write container header only (w/o payload)"
     echo "	    --archiveOut        file or directory to write archive (tarball) of artifacts"
     echo "	                        if directory, must end in '/'.  for PWD, use '.'"
+    echo "	                        a name ending in .sba selects the indexed archive format"
+    echo "	                        (default for directories: SB_ARCHIVE_FORMAT=tgz or sba)"
     echo "	    --archiveIn         file containing archive of artifacts to import to cache"
     echo "	    --validate          validate the container after build"
     echo "	    --verify            verify the container after build, against the provided"
@@ -65,8 +67,15 @@ usage () {
     echo "	-S, --security-version  Integer, sets the security version container field"
     echo "	-V, --container-version Container version to generate (1, 2, 3)"
     echo "	-P, --password          ENV variable containing the sf_client password to pass to sf_client via 'sf_client --password"
+    echo "	-B, --sf-batch          batch signframework signing requests (production mode only):"
+    echo "	                        \"container\" submits all requests for this container at once,"
+    echo "	                        \"defer\" queues them in the cache for a later sfBatchSign.sh run"
+    echo "	-W, --sig-watch         independent mode: list the missing signatures in the cache, for"
+    echo "	                        sigwatch to complete the container as soon as they arrive"
     echo "	-H, --hash              Hash algorithm to use for container V3: sha3-512 (default), sha512"
     echo "	    --pure              Use proper ML-DSA pure mode signing of raw data"
+    echo "	    --hwFrom            container signed before with the same SW keys, to take"
+    echo "	                        the HW keys and signatures from (no HW signing)"
     echo ""
     exit 1
 }
@@ -190,7 +199,12 @@ exportArchive () {
 
 	# Create the archive.
     cd "$SB_SCRATCH_DIR" || die "Cannot cd to $SB_SCRATCH_DIR"
-    if tar -zcf "$SB_ARCHIVE_OUT" "$buildID/$LABEL/"; then
+    if [ "${SB_ARCHIVE_OUT##*.}" == sba ]; then
+        archcmd="sbarchive -c -f"
+    else
+        archcmd="tar -zcf"
+    fi
+    if $archcmd "$SB_ARCHIVE_OUT" "$buildID/$LABEL/"; then
         echo "--> $P: Archive saved to: $SB_ARCHIVE_OUT"
     else
         echo "--> $P: Error $? saving archive to: $SB_ARCHIVE_OUT"
@@ -211,7 +225,14 @@ importArchive () {
     local previous_wd="$PWD"
     cd "$TOPDIR" || die "Cannot cd to $TOPDIR"
 
-    archpath=$(tar -tf "$f" | head -1)
+    # Indexed archives (sbarchive) are recognized by their magic.
+    if [ "$(head -c 8 "$f")" == SBARCHV1 ]; then
+        is_cmd_available sbarchive || \
+            die "Required command \"sbarchive\" not available or not found in PATH"
+        archpath=$(sbarchive -t -f "$f" | head -1)
+    else
+        archpath=$(tar -tf "$f" | head -1)
+    fi
     archdir=$(echo "$archpath" | cut -d/ -f1)
     archsubdir=$(echo "$archpath" | cut -d/ -f2)
 
@@ -227,14 +248,22 @@ importArchive () {
         mkdir "$archsubdir"
     fi
 
-    if ! tar -xf "$f"; then
-        echo "--> $P: Error $? unpacking archive: $f"
-    fi
+    if [ "$(head -c 8 "$f")" == SBARCHV1 ]; then
+        # Only this component's members are read, straight into the subdir
+        if ! sbarchive -x -f "$f" -C "$archsubdir" --strip-components 2 \
+                       "$archdir/$archsubdir/"; then
+            echo "--> $P: Error $? unpacking archive: $f"
+        fi
+    else
+        if ! tar -xf "$f"; then
+            echo "--> $P: Error $? unpacking archive: $f"
+        fi
 
-    # Move the unpacked files and remove the temporary archive directory
-    mv "$archdir/$archsubdir/"* "$archsubdir/"
-    rmdir "$archdir/$archsubdir/"
-    rmdir "$archdir/"
+        # Move the unpacked files and remove the temporary archive directory
+        mv "$archdir/$archsubdir/"* "$archsubdir/"
+        rmdir "$archdir/$archsubdir/"
+        rmdir "$archdir/"
+    fi
     cd "$previous_wd" || die "Cannot cd back to ${previous_wd}, is it gone?"
 }
 
@@ -310,6 +339,20 @@ parseIni () {
     done
 }
 
+queueSigRequest () {
+    # Add a signing request to the batch list, only once.
+    grep -qsF " $3" "$SIG_BATCH_LIST" || echo "$1 $2 $3" >> "$SIG_BATCH_LIST"
+}
+
+isBatchedKey () {
+    # Whether the signing request for a key goes to the batch list. p11sign
+    # signs with ECDSA only, so the Dilithium/ML-DSA keys D and S of v2 and
+    # v3 containers are signed on their own, as without it.
+    test "$SIG_BATCH_LIST" || return 1
+    test "$SIG_BATCH_LIST" != "$T/p11_sign.lst" && return 0
+    test "$1" != d && test "$1" != s
+}
+
 findArtifact () {
     local f
     local found
@@ -345,6 +388,35 @@ findArtifact () {
     done
 }
 
+trace_now () {
+    # Wall clock in microseconds, the timebase of the tools' trace events
+    if [ "$EPOCHREALTIME" ]; then
+        echo "${EPOCHREALTIME/[.,]/}"
+    else
+        echo $(( $(date +%s%N) / 1000 ))
+    fi
+}
+
+trace_event () {
+    # Append a complete event (name, start, end) to $STB_TRACE_FILE.  The
+    # first writer starts the JSON array, trace viewers accept it open.
+    ( set -C; echo "[" > "$STB_TRACE_FILE" ) 2>/dev/null
+    printf '{"name":"%s","cat":"%s","ph":"X","ts":%s,"dur":%s,"pid":%s,"tid":%s},\n' \
+        "$1" "$P" "$2" $(( $3 - $2 )) $$ $$ >> "$STB_TRACE_FILE"
+}
+
+trace () {
+    # Run a command, in a span named $1 when tracing (STB_TRACE_FILE)
+    local name="$1" start rc
+    shift
+    test -z "$STB_TRACE_FILE" && { "$@"; return; }
+    start=$(trace_now)
+    "$@"
+    rc=$?
+    trace_event "$name" "$start" "$(trace_now)"
+    return $rc
+}
+
 #
 # Main
 #
@@ -391,14 +463,17 @@ for arg in "$@"; do
     "--container-version") set -- "$@" "-V" ;;
     "--fw-ecid")    set -- "$@" "-@" ;;
     "--password")   set -- "$@" "-P" ;;
+    "--sf-batch")   set -- "$@" "-B" ;;
+    "--sig-watch")  set -- "$@" "-W" ;;
     "--hash")       set -- "$@" "-H" ;;
     "--pure")       set -- "$@" "-2" ;;
+    "--hwFrom")     set -- "$@" "-j" ;;
     *)              set -- "$@" "$arg"
   esac
 done
 
 # Process command-line arguments
-while getopts -- ?hdvw:a:b:c:0:p:q:r:1:f:F:o:l:i:m:k:s:L:S:P:H:V:24:5:6:7:89:@: opt
+while getopts -- ?hdvw:a:b:c:0:p:q:r:1:f:F:o:l:i:m:k:s:L:S:P:H:V:B:W24:5:6:7:89:@:j: opt
 do
   case "${opt:?}" in
     v) SB_VERBOSE="TRUE";;
@@ -433,10 +508,24 @@ do
     V) CONTAINER_VERSION="$OPTARG";;
     P) SF_PWD_ENV="$OPTARG";;
     H) HASHALG="$OPTARG";;
+    B) SB_SF_BATCH="$(to_lower "$OPTARG")";;
+    W) SB_SIG_WATCH="TRUE";;
+    j) HW_FROM="$OPTARG";;
     h|\?) usage;;
   esac
 done
 
+# Trace the whole run, the steps below add their own spans.
+if [ "$STB_TRACE_FILE" ]; then
+    is_path_full "$STB_TRACE_FILE" || STB_TRACE_FILE="$PWD/$STB_TRACE_FILE"
+    export STB_TRACE_FILE
+    TRACE_START=$(trace_now)
+    ( set -C; echo "[" > "$STB_TRACE_FILE" ) 2>/dev/null
+    printf '{"name":"process_name","ph":"M","pid":%s,"args":{"name":"%s"}},\n' \
+        $$ "$P" >> "$STB_TRACE_FILE"
+    trap 'trace_event "$P ${LABEL:-}" "$TRACE_START" "$(trace_now)"' EXIT
+fi
+
 # Check required programs
 for p in date egrep tar openssl create-container print-container
 do
@@ -497,8 +586,12 @@ then
     signproject_hw_signing_project_basename=""
     signproject_fw_signing_project_basename=""
     signproject_getpubkey_project_basename=""
+    signproject_batch_project_basename=""
+    signtool_sf_batch=""
     pkcs11_module=""
     pkcs11_token=""
+    pkcs11_native=""
+    pkcs11_sessions=""
 
     echo "--> $P: Parsing INI file: $PROJECT_INI"
     parseIni "$PROJECT_INI"
@@ -520,9 +613,14 @@ then
         SF_FW_SIGNING_PROJECT_BASE="$signproject_fw_signing_project_basename"
     test "$signproject_getpubkey_project_basename" && \
         SF_GETPUBKEY_PROJECT_BASE="$signproject_getpubkey_project_basename"
+    test "$signproject_batch_project_basename" && \
+        SF_BATCH_PROJECT="$signproject_batch_project_basename"
+    test "$signtool_sf_batch" && SB_SF_BATCH="$(to_lower "$signtool_sf_batch")"
 
     test "$pkcs11_module" && SB_PKCS11_MODULE="$pkcs11_module"
     test "$pkcs11_token" && SB_PKCS11_TOKEN="$pkcs11_token"
+    test "$pkcs11_native" && SB_PKCS11_NATIVE="$(to_lower "$pkcs11_native")"
+    test "$pkcs11_sessions" && SB_PKCS11_SESSIONS="$pkcs11_sessions"
 
     # If SF_PWD_ENV was not specified on the CLI option, use the value defined in the .ini
     ! test "$SF_PWD_ENV" && test "$signer_sshkey_passwd_env_var" && SF_PWD_ENV="$signer_sshkey_passwd_env_var"
@@ -548,6 +646,23 @@ then
         die "Required command \"sf_client\" not available or not found in PATH"
 fi
 
+if [ "$SB_SF_BATCH" ]
+then
+    test "$SB_SF_BATCH" != container -a "$SB_SF_BATCH" != defer && \
+        die "Unsupported sf-batch mode: $SB_SF_BATCH"
+    test "$SIGN_MODE" != production -o "$KMS" != signframework && \
+        die "sf-batch is only valid for production mode with the signframework KMS"
+    is_cmd_available sfBatchSign.sh || \
+        die "Required command \"sfBatchSign.sh\" not available or not found in PATH"
+fi
+
+# The HW keys and signatures come from the reference container.
+if [ "$HW_FROM" ]; then
+    test -f "$HW_FROM" || die "Reference container \"$HW_FROM\" not found"
+    is_path_full "$HW_FROM" || HW_FROM="$PWD/$HW_FROM"
+    HW_KEY_A=__skip HW_KEY_B=__skip HW_KEY_C=__skip HW_KEY_D=__skip
+fi
+
 # Check input keys
 for KEY in HW_KEY_A HW_KEY_B HW_KEY_C HW_KEY_D; do
     checkKey $KEY
@@ -563,14 +678,35 @@ done
 : "${TMPDIR:=/tmp}"
 : "${SB_SCRATCH_DIR:=$TMPDIR}"
 : "${SB_KEEP_CACHE:=false}"
+: "${SB_ARCHIVE_FORMAT:=tgz}"
 : "${LABEL:=IMAGE}"
 
+test "$SB_ARCHIVE_FORMAT" != tgz -a "$SB_ARCHIVE_FORMAT" != sba && \
+    die "Unsupported archive format: $SB_ARCHIVE_FORMAT"
+
 moniker="SIGNTOOL"
 
 test ! -d "$SB_SCRATCH_DIR" && die "Scratch directory not found: $SB_SCRATCH_DIR"
 
 TOPDIR=$(ls -1dt "$SB_SCRATCH_DIR"/${moniker}_* 2>/dev/null | head -1)
 
+test "$SB_SF_BATCH" == defer && test "$SB_KEEP_CACHE" == false && \
+    die "sf-batch defer mode requires the cache to be kept (SB_KEEP_CACHE=true)"
+
+if [ "$(to_upper $SB_SIG_WATCH)" != Y ] && \
+   [ "$(to_upper $SB_SIG_WATCH)" != TRUE ]
+then
+    SB_SIG_WATCH=""
+fi
+
+if [ "$SB_SIG_WATCH" ]
+then
+    test "$SIGN_MODE" != independent && \
+        die "sig-watch is only valid for independent mode"
+    test "$SB_KEEP_CACHE" == false && \
+        die "sig-watch requires the cache to be kept (SB_KEEP_CACHE=true)"
+fi
+
 if [ "$TOPDIR" ]; then
     buildID="${TOPDIR##*/}"
     timestamp="${buildID##*_}"
@@ -594,6 +730,7 @@ fi
 # Set a scratch file for output, if none provided.
 if [ -z "$OUTPUT" ] || [ "$OUTPUT" == __none ]
 then
+    test "$SB_SIG_WATCH" && die "sig-watch requires an output file"
     OUTPUT="$SB_SCRATCH_DIR/$(to_lower "$buildID").scratch.out.img"
     OUTPUT_SCRATCH=true
 else
@@ -616,7 +753,12 @@ if [ "$SB_ARCHIVE_OUT" ]; then
 
     if is_path_dir "$path"; then
         # Path is a directory, append default filename
-        path=${path}$(to_lower "$buildID")_${LABEL}.tgz
+        path=${path}$(to_lower "$buildID")_${LABEL}.${SB_ARCHIVE_FORMAT}
+    fi
+
+    if [ "${path##*.}" == sba ]; then
+        is_cmd_available sbarchive || \
+            die "Required command \"sbarchive\" not available or not found in PATH"
     fi
 
     test ! -d "${path%/*}" && die "archiveOut directory not found: ${path%/*}/"
@@ -633,7 +775,7 @@ then
     for f in $SB_ARCHIVE_IN
     do
         f="${f# }"; f="${f% }" # strip leading or trailing space
-        importArchive "$f"
+        trace "import archive" importArchive "$f"
     done
     unset IFS
 fi
@@ -652,6 +794,9 @@ test "$SECURITY_VERSION" && ADDL_ARGS="$ADDL_ARGS --security-version $SECURITY_V
 test "$SB_CONTR_HDR_OUT" && CONTR_HDR_OUT_OPT="--dumpContrHdr"
 test "$CONTAINER_VERSION" && ADDL_ARGS="$ADDL_ARGS --container-version $CONTAINER_VERSION"
 test "$FW_ECID" && ADDL_ARGS="$ADDL_ARGS --fw-ecid $FW_ECID"
+test "$HW_FROM" && ADDL_ARGS="$ADDL_ARGS --hw-from $HW_FROM"
+# The containers sharing the cache dir hash a payload they share once.
+ADDL_ARGS="$ADDL_ARGS --digest-cache $TOPDIR/payload_digests"
 test "$MLDSA_PURE_MODE" && GENDILSIG_ARGS="$GENDILSIG_ARGS --pure"
 
 test "$SB_VERBOSE" && SF_DEBUG_ARGS=" -v"
@@ -677,6 +822,7 @@ then
 : "${SF_HW_SIGNING_PROJECT_BASE:=sign_ecc_pwr_hw_key}"
 : "${SF_FW_SIGNING_PROJECT_BASE:=sign_ecc_pwr_fw_key_op_bld}"
 : "${SF_GETPUBKEY_PROJECT_BASE:=getpubkeyecc}"
+: "${SF_BATCH_PROJECT:=sign_batch}"
 fi
 
 #
@@ -684,6 +830,33 @@ fi
 #
 : "${SB_PKCS11_MODULE:=/usr/lib64/pkcs11/libsofthsm2.so}"
 : "${SB_PKCS11_TOKEN:=P9Signing}"
+: "${SB_PKCS11_NATIVE:=false}"
+: "${SB_PKCS11_SESSIONS:=4}"
+
+#
+# Set the list of batched signing requests.  Deferred requests are
+# collected for all containers sharing this cache dir.  With the native
+# PKCS#11 signer all requests for the container are signed in one p11sign
+# call, sharing one login and a pool of sessions.
+#
+SW_SIG_INPUT="$T/software_hdr.md.bin"
+
+if [ "$SIGN_MODE" == production ] && [ "$KMS" == pkcs11 ] && \
+   [ "$SB_PKCS11_NATIVE" == true ]
+then
+    is_cmd_available p11sign || \
+        die "Required command \"p11sign\" not available or not found in PATH"
+    SIG_BATCH_LIST="$T/p11_sign.lst"
+    SW_SIG_INPUT="$T/software_hdr"
+    rm -f "$SIG_BATCH_LIST"
+elif [ "$SB_SF_BATCH" == container ]
+then
+    SIG_BATCH_LIST="$T/sf_batch.lst"
+    rm -f "$SIG_BATCH_LIST"
+elif [ "$SB_SF_BATCH" == defer ]
+then
+    SIG_BATCH_LIST="$TOPDIR/sf_batch.lst"
+fi
 
 #
 # Get the public keys
@@ -706,7 +879,7 @@ then
             SF_PROJECT=${SF_HW_SIGNING_PROJECT_BASE}_${KEY}
             KEYFILE_BASE=project.$SF_PROJECT.HW_key_$KEY
 
-            KEYFILE=$(findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
+            KEYFILE=$(trace "cache lookup" findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
 
             if [ "$KEYFILE" ]; then
                 test "$SB_VERBOSE" && msg=" ($KEYFILE)"
@@ -757,7 +930,7 @@ then
             SF_PROJECT=${SF_FW_SIGNING_PROJECT_BASE}_${KEY}
             KEYFILE_BASE=project.$SF_PROJECT.SW_key_$KEY
 
-            KEYFILE=$(findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
+            KEYFILE=$(trace "cache lookup" findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
 
             if [ "$KEYFILE" ]; then
                 test "$SB_VERBOSE" && msg=" ($KEYFILE)"
@@ -807,7 +980,7 @@ then
         SF_PROJECT=${SF_HW_SIGNING_PROJECT_BASE}_${KEY}
         KEYFILE_BASE=project.$SF_PROJECT.HW_key_$KEY
 
-        KEYFILE=$(findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
+        KEYFILE=$(trace "cache lookup" findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
 
         if [ "$KEYFILE" ]; then
             test "$SB_VERBOSE" && msg=" ($KEYFILE)"
@@ -820,6 +993,7 @@ then
             then
                 # Output is pubkey in raw format
                 KEYFILE="$KEYFILE_BASE.raw"
+                trace "sf_client $SF_PROJECT" \
                 sf_client $SF_DEBUG_ARGS $SF_COMMON_ARGS \
                           -p "$SF_GETPUBKEY_PROJECT_BASE" \
                           -r "-signproject $SF_PROJECT" \
@@ -865,7 +1039,7 @@ then
         SF_PROJECT=${SF_FW_SIGNING_PROJECT_BASE}_${KEY}
         KEYFILE_BASE=project.$SF_PROJECT.SW_key_$KEY
 
-        KEYFILE=$(findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
+        KEYFILE=$(trace "cache lookup" findArtifact "$KEYFILE_BASE.pub" "$KEYFILE_BASE.raw")
 
         if [ "$KEYFILE" ]; then
             test "$SB_VERBOSE" && msg=" ($KEYFILE)"
@@ -877,6 +1051,7 @@ then
             if [ "$KMS" == "signframework" ]
             then
                 KEYFILE="$KEYFILE_BASE.raw"
+                trace "sf_client $SF_PROJECT" \
                 sf_client $SF_DEBUG_ARGS $SF_COMMON_ARGS \
                           -p "$SF_GETPUBKEY_PROJECT_BASE" \
                           -r "-signproject $SF_PROJECT" \
@@ -929,6 +1104,7 @@ else
                      --dumpSwHdr "$T/software_hdr" \
                      $DEBUG_ARGS \
                      $ADDL_ARGS
+    trace "create-container signing requests" \
     create-container $HW_KEY_ARGS $SW_KEY_ARGS \
                      --payload "$PAYLOAD" --imagefile "$OUTPUT" \
                      --dumpPrefixHdr "$T/prefix_hdr" \
@@ -938,12 +1114,18 @@ else
     rc=$?
 
     test $rc -ne 0 && die "Call to create-container failed with error: $rc"
+
+    # The container is complete but for its signatures, which can be
+    # written into it in place.
+    BUILT_UNSIGNED=true
 fi
 
 #
 # Prepare the HW and SW key signatures
 #
 FOUND=""
+WAITING=""
+rm -f "$T/pending.sigs.new"
 
 if [ "$SIGN_MODE" == "local" ] || [ "$SIGN_MODE" == "independent" ]
 then
@@ -963,11 +1145,16 @@ then
             SF_PROJECT=${SF_HW_SIGNING_PROJECT_BASE}_${KEY}
             SIGFILE_BASE=project.$SF_PROJECT.HW_sig_$KEY
 
-            SIGFILE=$(findArtifact "$SIGFILE_BASE.sig" "$SIGFILE_BASE.raw")
+            SIGFILE=$(trace "cache lookup" findArtifact "$SIGFILE_BASE.sig" "$SIGFILE_BASE.raw")
 
             if [ "$SIGFILE" ]; then
                 test "$SB_VERBOSE" && msg=" ($SIGFILE)"
                 echo "--> $P: Found sig for HW key $(to_upper $KEY).${msg}"
+            elif [ "$SB_SIG_WATCH" ]; then
+                echo "--> $P: Waiting for imported sig for HW key $(to_upper $KEY)."
+                echo "--hw_sig_$KEY $SIGFILE_BASE.sig $SIGFILE_BASE.raw" >> "$T/pending.sigs.new"
+                WAITING="${WAITING}$(to_upper $KEY),"
+                continue
             else
                 die "__get or __getsig requested but no imported sig found for HW key $(to_upper $KEY)."
             fi
@@ -1007,6 +1194,7 @@ then
                 if [ -f "$KEYFILE" ] && is_private_key "$KEYFILE"
                 then
                     echo "--> $P: Generating signature for HW key $(to_upper $KEY)..."
+                    trace "openssl sign HW key $(to_upper $KEY)" \
                     openssl dgst $DIGEST_ARG -sign "$KEYFILE" "$T/prefix_hdr" > "$T/$SIGFILE"
                     rc=$?
                     test $rc -ne 0 && die "Call to openssl failed with error: $rc"
@@ -1022,6 +1210,12 @@ then
                     gendilsig -k "$KEYFILE" -i "$infile" -o "$T/$SIGFILE" $GENDILSIG_ARGS
                     rc=$?
                     test $rc -ne 0 && die "Call to gendilsig failed with error: $rc"
+                elif [ "$SB_SIG_WATCH" ]
+                then
+                    echo "--> $P: Waiting for signature for HW key $(to_upper $KEY)."
+                    echo "--hw_sig_$KEY ./$SIGFILE" >> "$T/pending.sigs.new"
+                    WAITING="${WAITING}$(to_upper $KEY),"
+                    continue
                 else
                     echo "--> $P: No signature found and no private key available for HW key $(to_upper $KEY), skipping."
                     continue
@@ -1058,6 +1252,7 @@ then
         then
             # No signature found, try to generate one.
             echo "--> $P: Generating signature for SW key $(to_upper $KEY)..."
+            trace "openssl sign SW key $(to_upper $KEY)" \
             openssl dgst $DIGEST_ARG -sign "$KEYFILE" "$T/software_hdr" > "$T/$SIGFILE"
             rc=$?
             test $rc -ne 0 && die "Call to openssl failed with error: $rc"
@@ -1073,6 +1268,12 @@ then
             gendilsig -k "$KEYFILE" -i "$infile" -o "$T/$SIGFILE" $GENDILSIG_ARGS
             rc=$?
             test $rc -ne 0 && die "Call to gendilsig failed with error: $rc"
+        elif [ "$SB_SIG_WATCH" ]
+        then
+            echo "--> $P: Waiting for signature for SW key $(to_upper $KEY)."
+            echo "--sw_sig_$KEY ./$SIGFILE" >> "$T/pending.sigs.new"
+            WAITING="${WAITING}$(to_upper $KEY),"
+            continue
         else
             echo "--> $P: No signature found and no private key available for SW key $(to_upper $KEY), skipping."
             continue
@@ -1096,7 +1297,7 @@ then
         SF_PROJECT=${SF_HW_SIGNING_PROJECT_BASE}_${KEY}
         SIGFILE_BASE=project.$SF_PROJECT.HW_sig_$KEY
 
-        SIGFILE=$(findArtifact "$SIGFILE_BASE.sig" "$SIGFILE_BASE.raw")
+        SIGFILE=$(trace "cache lookup" findArtifact "$SIGFILE_BASE.sig" "$SIGFILE_BASE.raw")
 
         if [ "$SIGFILE" ]; then
             test "$SB_VERBOSE" && msg=" ($SIGFILE)"
@@ -1104,12 +1305,25 @@ then
         else
             # No signature found, request one.
             test "$KEYFILE" == __getkey && break  # (unless instructed not to)
+
+            if isBatchedKey $KEY
+            then
+                # Queue the request, it is submitted with the batch below.
+                SIGFILE="$SIGFILE_BASE.raw"
+                queueSigRequest $SF_PROJECT "$T/prefix_hdr" "$T/$SIGFILE"
+                echo "--> $P: Queued signing request for HW key $(to_upper $KEY)."
+                QUEUED="${QUEUED}$(to_upper $KEY),"
+                QUEUED_HW_SIG_ARGS="$QUEUED_HW_SIG_ARGS --hw_sig_$KEY $T/$SIGFILE"
+                continue
+            fi
+
             echo "--> $P: Requesting signature for HW key $(to_upper $KEY)..."
 
             if [ "$KMS" == "signframework" ]
             then
                 # Output is signature in raw format
                 SIGFILE="$SIGFILE_BASE.raw"
+                trace "sf_client $SF_PROJECT" \
                 sf_client $SF_DEBUG_ARGS $SF_COMMON_ARGS \
                           -p $SF_PROJECT \
                           -e "$SF_EPWD" \
@@ -1123,6 +1337,7 @@ then
             then
                 # Output is signature in DER format
                 SIGFILE="$SIGFILE_BASE.sig"
+                trace "openssl sign $SF_PROJECT" \
                 /bin/openssl dgst -engine pkcs11 -keyform engine \
                              -sign "pkcs11:token=$SB_PKCS11_TOKEN;object=$SF_PROJECT" \
                              $DIGEST_ARG -out "$T/$SIGFILE" "$T/prefix_hdr"
@@ -1158,7 +1373,7 @@ then
         then
             SIGFILE=""
         else
-            SIGFILE=$(findArtifact "./$SIGFILE_BASE.sig" "./$SIGFILE_BASE.raw")
+            SIGFILE=$(trace "cache lookup" findArtifact "./$SIGFILE_BASE.sig" "./$SIGFILE_BASE.raw")
         fi
 
         if [ "$SIGFILE" ]; then
@@ -1167,12 +1382,25 @@ then
         else
             # No signature found, request one.
             test "$KEYFILE" == __getkey && break  # (unless instructed not to)
+
+            if isBatchedKey $KEY
+            then
+                # Queue the request, it is submitted with the batch below.
+                SIGFILE="$SIGFILE_BASE.raw"
+                queueSigRequest $SF_PROJECT "$SW_SIG_INPUT" "$T/$SIGFILE"
+                echo "--> $P: Queued signing request for SW key $(to_upper $KEY)."
+                QUEUED="${QUEUED}$(to_upper $KEY),"
+                QUEUED_SW_SIG_ARGS="$QUEUED_SW_SIG_ARGS --sw_sig_$KEY $T/$SIGFILE"
+                continue
+            fi
+
             echo "--> $P: Requesting signature for SW key $(to_upper $KEY)..."
 
             if [ "$KMS" == "signframework" ]
             then
                 # Output is signature in raw format
                 SIGFILE="$SIGFILE_BASE.raw"
+                trace "sf_client $SF_PROJECT" \
                 sf_client $SF_DEBUG_ARGS $SF_COMMON_ARGS \
                           -p $SF_PROJECT \
                           -e "$SF_EPWD" \
@@ -1186,6 +1414,7 @@ then
             then
                 # Output is signature in DER format
                 SIGFILE="$SIGFILE_BASE.sig"
+                trace "openssl sign $SF_PROJECT" \
                 /bin/openssl dgst -engine pkcs11 -keyform engine \
                              -sign "pkcs11:token=$SB_PKCS11_TOKEN;object=$SF_PROJECT" \
                              $DIGEST_ARG -out "$T/$SIGFILE" "$T/software_hdr"
@@ -1203,19 +1432,75 @@ then
         FOUND="${FOUND}$(to_upper $KEY),"
         SW_SIG_ARGS="$SW_SIG_ARGS --sw_sig_$KEY $T/$SIGFILE"
     done
+
+    #
+    # Submit the batched signing requests, or leave them for later.
+    #
+    if [ "$QUEUED" ] && [ "$KMS" == pkcs11 ]
+    then
+        P11_ARGS="-m $SB_PKCS11_MODULE -t $SB_PKCS11_TOKEN"
+        P11_ARGS="$P11_ARGS -s $SB_PKCS11_SESSIONS --hash ${DIGEST_ARG#-} --raw"
+        test "$SB_VERBOSE" && P11_ARGS="$P11_ARGS -v"
+        test "$SB_DEBUG" && P11_ARGS="$P11_ARGS --debug"
+
+        trace "p11sign batch" p11sign $P11_ARGS --list "$SIG_BATCH_LIST"
+        rc=$?
+        test $rc -ne 0 && die "Call to p11sign failed with error: $rc"
+
+        echo "--> $P: Retrieved signatures for keys $QUEUED from PKCS#11 token."
+        FOUND="${FOUND}${QUEUED}"
+        HW_SIG_ARGS="$HW_SIG_ARGS$QUEUED_HW_SIG_ARGS"
+        SW_SIG_ARGS="$SW_SIG_ARGS$QUEUED_SW_SIG_ARGS"
+    elif [ "$QUEUED" ] && [ "$SB_SF_BATCH" == container ]
+    then
+        SF_BATCH_ARGS="-u $SF_USER -k $SF_SSHKEY -e $SF_EPWD -S $SF_SERVER"
+        SF_BATCH_ARGS="$SF_BATCH_ARGS -j $SF_BATCH_PROJECT"
+        test "$SF_PWD_ENV" && SF_BATCH_ARGS="$SF_BATCH_ARGS -P $SF_PWD_ENV"
+        test "$SB_VERBOSE" && SF_BATCH_ARGS="$SF_BATCH_ARGS -v"
+        test "$SB_DEBUG" && SF_BATCH_ARGS="$SF_BATCH_ARGS -d"
+
+        trace "sfBatchSign.sh" sfBatchSign.sh $SF_BATCH_ARGS --list "$SIG_BATCH_LIST"
+        rc=$?
+        test $rc -ne 0 && die "Call to sfBatchSign.sh failed with error: $rc"
+
+        FOUND="${FOUND}${QUEUED}"
+        HW_SIG_ARGS="$HW_SIG_ARGS$QUEUED_HW_SIG_ARGS"
+        SW_SIG_ARGS="$SW_SIG_ARGS$QUEUED_SW_SIG_ARGS"
+    elif [ "$QUEUED" ]
+    then
+        echo "--> $P: Deferred signing requests for keys $QUEUED to: $SIG_BATCH_LIST"
+        echo "--> $P: Submit them with sfBatchSign.sh, then rerun to complete the container."
+        DEFERRED=true
+    fi
 fi
 
 #
 # Build the full container
 #
-if [ "$HW_SIG_ARGS" ] || [ "$SW_SIG_ARGS" ]; then
+if [ "$WAITING" ]; then
+    echo "--> $P: Waiting for signatures for keys $WAITING container build left to sigwatch."
+    DEFERRED=true
+elif [ "$HW_SIG_ARGS" ] || [ "$SW_SIG_ARGS" ]; then
     echo "--> $P: Have signatures for keys $FOUND adding to container..."
-    create-container $HW_KEY_ARGS $SW_KEY_ARGS \
-                     $HW_SIG_ARGS $SW_SIG_ARGS \
-                     --payload "$PAYLOAD" --imagefile "$OUTPUT" \
-                     $DEBUG_ARGS $ADDL_ARGS \
-                     $CONTR_HDR_OUT_OPT "$SB_CONTR_HDR_OUT"
-    rc=$?
+    rc=1
+    if [ "$BUILT_UNSIGNED" ]; then
+        trace "create-container update" \
+        create-container --update $HW_SIG_ARGS $SW_SIG_ARGS \
+                         --imagefile "$OUTPUT" $DEBUG_ARGS \
+                         $CONTR_HDR_OUT_OPT "$SB_CONTR_HDR_OUT"
+        rc=$?
+        test $rc -ne 0 && \
+            echo "--> $P: Cannot add the signatures in place, rebuilding the container..."
+    fi
+    if [ $rc -ne 0 ]; then
+        trace "create-container build" \
+        create-container $HW_KEY_ARGS $SW_KEY_ARGS \
+                         $HW_SIG_ARGS $SW_SIG_ARGS \
+                         --payload "$PAYLOAD" --imagefile "$OUTPUT" \
+                         $DEBUG_ARGS $ADDL_ARGS \
+                         $CONTR_HDR_OUT_OPT "$SB_CONTR_HDR_OUT"
+        rc=$?
+    fi
 
     test $rc -ne 0 && die "Call to create-container failed with error: $rc"
 
@@ -1226,12 +1511,12 @@ else
     echo "--> $P: No signatures available."
 fi
 
-echo "--> $P: Container $LABEL build completed."
+test "$WAITING" || echo "--> $P: Container $LABEL build completed."
 
 #
 # Export archive
 #
-test "$SB_ARCHIVE_OUT" && exportArchive "$SB_ARCHIVE_OUT"
+test "$SB_ARCHIVE_OUT" && trace "export archive" exportArchive "$SB_ARCHIVE_OUT"
 
 #
 # Validate, verify the container
@@ -1257,11 +1542,49 @@ fi
 test "$SB_VALIDATE" && VALIDATE_OPT="--validate"
 test "$SB_VERIFY" && VERIFY_OPT="--verify" && VERIFY_ARGS="$SB_VERIFY"
 
-if [ "$VALIDATE_OPT" ] || [ "$VERIFY_OPT" ]; then
+#
+# Leave the completion of the container to sigwatch: finalize.sh is run
+# with the "<option> <file>" pairs of the signatures from pending.sigs.
+#
+if [ "$WAITING" ]; then
+    {
+        echo "#!/bin/sh"
+        echo "# Generated by $P, run by sigwatch to complete container $LABEL."
+        if [ "$BUILT_UNSIGNED" ]; then
+            echo "create-container --update $HW_SIG_ARGS $SW_SIG_ARGS \\"
+            echo "    --imagefile $(printf %q "$OUTPUT") $DEBUG_ARGS \\"
+            test "$SB_CONTR_HDR_OUT" && \
+                echo "    $CONTR_HDR_OUT_OPT $(printf %q "$SB_CONTR_HDR_OUT") \\"
+            echo "    \"\$@\" ||"
+        fi
+        echo "create-container $HW_KEY_ARGS $SW_KEY_ARGS $HW_SIG_ARGS $SW_SIG_ARGS \\"
+        echo "    --payload $(printf %q "$PAYLOAD") --imagefile $(printf %q "$OUTPUT") \\"
+        echo "    --swHdrIn $(printf %q "$T/software_hdr") $DEBUG_ARGS $ADDL_ARGS \\"
+        test "$SB_CONTR_HDR_OUT" && \
+            echo "    $CONTR_HDR_OUT_OPT $(printf %q "$SB_CONTR_HDR_OUT") \\"
+        echo "    \"\$@\" || exit"
+        echo "echo \"--> $P: Container $LABEL build completed.\""
+        if [ "$VALIDATE_OPT" ] || [ "$VERIFY_OPT" ]; then
+            echo "print-container --imagefile $(printf %q "$OUTPUT") --no-print \\"
+            echo "    $DEBUG_ARGS $VALIDATE_OPT $VERIFY_OPT $(printf %q "$VERIFY_ARGS")"
+        fi
+    } > "$T/finalize.sh"
+
+    # Last, sigwatch acts on pending.sigs as soon as it appears.
+    rm -f "$T/pending.sigs.done"
+    mv "$T/pending.sigs.new" "$T/pending.sigs"
+    echo "--> $P: Signatures for keys $WAITING listed in: $T/pending.sigs"
+    echo "--> $P: Run \"sigwatch $TOPDIR\" to complete the container as they arrive."
+fi
+
+if [ "$DEFERRED" ]; then
+    echo "--> $P: Signing requests deferred, skipping validation."
+elif [ "$VALIDATE_OPT" ] || [ "$VERIFY_OPT" ]; then
     echo
     test "$SB_VERBOSE" && \
         echo print-container --imagefile "$OUTPUT" --no-print \
              $DEBUG_ARGS $VALIDATE_OPT $VERIFY_OPT "$VERIFY_ARGS"
+    trace "print-container validate" \
     print-container --imagefile "$OUTPUT" --no-print \
                     $DEBUG_ARGS $VALIDATE_OPT $VERIFY_OPT "$VERIFY_ARGS"
 
@@ -16,6 +16,7 @@
 
 #include "crystals-oids.h"
 #include "dilutils.h"
+#include "timings.h"
 #include "mlca2.h"
 #include "pqalgs.h"
 
@@ -41,6 +42,9 @@ int main(int argc, char** argv)
     const char* sOutFile   = NULL;
     bool        sPrintHelp = false;
     bool        sVerbose   = false;
+    int         sTiming    = -1;
+
+    timings_init("extractdilkey");
 
     for(sIdx = 1; sIdx < argc; sIdx++)
     {
@@ -78,6 +82,14 @@ int main(int argc, char** argv)
         {
             sVerbose = true;
         }
+        else if(strcmp(argv[sIdx], "--timings") == 0)
+        {
+            timings_enable(TIMINGS_TABLE);
+        }
+        else if(strcmp(argv[sIdx], "--timings-json") == 0)
+        {
+            timings_enable(TIMINGS_JSON);
+        }
         else
         {
             printf("**** ERROR : Unknown parameter : %s\n", argv[sIdx]);
@@ -95,6 +107,8 @@ int main(int argc, char** argv)
     {
         printf(
             "\nextractdilkey -k <input key> [-pubin] [-inraw] [-o <output filename> [-outraw]]\n");
+        printf("  --timings        print the time spent in each phase, peak RSS and page faults\n");
+        printf("  --timings-json   same as --timings, as one line of JSON\n");
         exit(0);
     }
 
@@ -107,7 +121,9 @@ int main(int argc, char** argv)
         exit(1);
     }
 
+    sTiming = timings_begin("read key");
     sRc = readFile(sKey, &sKeyBytes, sInFile);
+    timings_end(sTiming, sRc ? 0 : sKeyBytes);
     if(0 != sRc)
     {
         printf("**** ERROR : Unable to read from : %s\n", sInFile);
@@ -117,6 +133,7 @@ int main(int argc, char** argv)
     {
         printf("extractdilkey: Key Size: %d\n", (int)sKeyBytes);
     }
+    sTiming = timings_begin("extract");
     do
     {
         // Now validate our input
@@ -350,6 +367,7 @@ int main(int argc, char** argv)
             }
         }
     } while(0);
+    timings_end(sTiming, 0);
 
     free(sKey);
     free(sRawKey);
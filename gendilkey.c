@@ -15,6 +15,7 @@
  */
 
 #include "dilutils.h"
+#include "timings.h"
 #include "mlca2.h"
 #include "pqalgs.h"
 
@@ -39,6 +40,9 @@ int main(int argc, char** argv)
     bool        sRaw              = false;
     const char* sPubKeyFile       = NULL;
     const char* sPrivKeyFile      = NULL;
+    int         sTiming           = -1;
+
+    timings_init("gendilkey");
 
     for(sIdx = 1; sIdx < argc; sIdx++)
     {
@@ -75,6 +79,14 @@ int main(int argc, char** argv)
                 sPrintHelp = true;
             }
         }
+        else if(strcmp(argv[sIdx], "--timings") == 0)
+        {
+            timings_enable(TIMINGS_TABLE);
+        }
+        else if(strcmp(argv[sIdx], "--timings-json") == 0)
+        {
+            timings_enable(TIMINGS_JSON);
+        }
         else
         {
             printf("**** ERROR : Unknown parameter : %s\n", argv[sIdx]);
@@ -93,6 +105,8 @@ int main(int argc, char** argv)
         printf("\ngendilkey -priv <private key file> -pub <public key file> [-alg <algorithm>]\n");
         printf("\n");
         printf("\t-alg <dilr2-87|mldsa-87>\tDefault: dilr2-87\n");
+        printf("\t--timings\t\t\tPrint the time spent in each phase, peak RSS\n");
+        printf("\t\t\t\t\tand page faults; --timings-json as JSON\n");
         exit(0);
     }
 
@@ -109,6 +123,7 @@ int main(int argc, char** argv)
         exit(1);
     }
 
+    sTiming = timings_begin("mlca init");
     if(0 == sRc)
     {
         sMlRc = mlca_init(&sCtx, 1, 0);
@@ -137,6 +152,9 @@ int main(int argc, char** argv)
         }
     }
 
+    timings_end(sTiming, 0);
+
+    sTiming = timings_begin("keygen");
     if(0 == sRc)
     {
         printf("Generating %s key pair ...\n", gAlgname);
@@ -150,6 +168,9 @@ int main(int argc, char** argv)
         }
     }
 
+    timings_end(sTiming, 0);
+
+    sTiming = timings_begin("key encode");
     if (sRaw)
     {
         // Just copy over the key
@@ -202,10 +223,14 @@ int main(int argc, char** argv)
         }
     }
 
+    timings_end(sTiming, 0);
+
     if(0 == sRc)
     {
+        sTiming = timings_begin("write keys");
         writeFile(sWirePrivKey, sWirePrivKeyBytes, sPrivKeyFile);
         writeFile(sWirePubKey, sWirePubKeyBytes, sPubKeyFile);
+        timings_end(sTiming, sWirePrivKeyBytes + sWirePubKeyBytes);
 
         printf("Private Key Size : %lu\n", sPrivKeyBytes);
         printf("Public Key Size  : %lu\n", sPubKeyBytes);
@@ -16,6 +16,7 @@
 
 #include "crystals-oids.h"
 #include "dilutils.h"
+#include "timings.h"
 #include "mlca2.h"
 #include "pqalgs.h"
 
@@ -43,6 +44,9 @@ int main(int argc, char** argv)
     bool        sPrintHelp        = false;
     bool        sVerbose          = false;
     bool        sMLDSAPureMode    = false;
+    int         sTiming           = -1;
+
+    timings_init("gendilsig");
 
     for(sIdx = 1; sIdx < argc; sIdx++)
     {
@@ -73,6 +77,14 @@ int main(int argc, char** argv)
         {
             sMLDSAPureMode = true;
         }
+        else if(strcmp(argv[sIdx], "--timings") == 0)
+        {
+            timings_enable(TIMINGS_TABLE);
+        }
+        else if(strcmp(argv[sIdx], "--timings-json") == 0)
+        {
+            timings_enable(TIMINGS_JSON);
+        }
         else
         {
             printf("**** ERROR : Unknown parameter : %s\n", argv[sIdx]);
@@ -90,6 +102,8 @@ int main(int argc, char** argv)
     {
         printf("\ngendilsig -i <input digest or raw data> -k <private key> -o <output filename> [--pure]\n");
         printf("  --pure   pure mode: -i accepts raw data instead of a digest\n");
+        printf("  --timings        print the time spent in each phase, peak RSS and page faults\n");
+        printf("  --timings-json   same as --timings, as one line of JSON\n");
         exit(0);
     }
 
@@ -106,6 +120,7 @@ int main(int argc, char** argv)
         exit(1);
     }
 
+    sTiming = timings_begin("read files");
     sRc = readFileAlloc(sTBSDataFile, &sTBS, &sTBSBytes);
     /* if pure mode was NOT chosen, then input data must be SHA3-512 or SHA512 */
     if(0 == sRc && sMLDSAPureMode == false && SHA3_512_DigestSize != sTBSBytes)
@@ -118,8 +133,10 @@ int main(int argc, char** argv)
     {
         sRc = readFile(sWirePrivKey, &sWirePrivKeyBytes, sPrivKeyFile);
     }
+    timings_end(sTiming, sRc ? 0 : sTBSBytes + sWirePrivKeyBytes);
 
     // Convert the key
+    sTiming = timings_begin("key decode");
     if(0 == sRc)
     {
         // Raw private key size for dilithium r2 8/7
@@ -176,6 +193,9 @@ int main(int argc, char** argv)
         }
     }
 
+    timings_end(sTiming, 0);
+
+    sTiming = timings_begin("mlca init");
     if(0 == sRc)
     {
         sMlRc = mlca_init(&sCtx, 1, 0);
@@ -204,9 +224,12 @@ int main(int argc, char** argv)
         }
     }
 
+    timings_end(sTiming, 0);
+
     if(0 == sRc)
     {
         printf("Generating %s signature ... (signing %zu bytes)\n",gAlgname, sTBSBytes);
+        sTiming = timings_begin("sign");
         int gRc = mlca_sign(sSignature,
                             sSignatureBytes, /// validate RC
                             sTBS,
@@ -225,13 +248,16 @@ int main(int argc, char** argv)
         {
             sSignatureBytes = gRc;
         }
+        timings_end(sTiming, sTBSBytes);
     }
 
     if(0 == sRc)
     {
         printf("Signature Size : %lu\n", sSignatureBytes);
 
+        sTiming = timings_begin("write signature");
         writeFile(sSignature, sSignatureBytes, sSigFile);
+        timings_end(sTiming, sSignatureBytes);
     }
 
     free(sTBS);
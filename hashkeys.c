@@ -40,6 +40,8 @@
 
 #include "container.c"
 #include "container.h"
+#include "libstbcontainer.h"
+#include "timings.h"
 
 #define BINARY_OUT 0
 #define ASCII_OUT 1
@@ -49,185 +51,30 @@ char *progname;
 bool verbose, debug;
 int wrap = 100;
 
-void usage(int status);
+struct stb_ctx *stb;
 
-unsigned char *calc_hash(unsigned hashalg,
-			 const unsigned char *data, size_t len,
-			 unsigned char *md)
-{
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	uint32_t md_len = SHA512_DIGEST_LENGTH;
-	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-	const EVP_MD* alg;
-
-	switch (hashalg) {
-	case HASH_ALG_SHA512:
-		alg = EVP_sha512();
-		break;
-	case HASH_ALG_SHA3_512:
-		alg = EVP_sha3_512();
-		break;
-	default:
-		return NULL;
-	}
-	EVP_DigestInit_ex(ctx, alg, NULL);
-	EVP_DigestUpdate(ctx, data, len);
-	EVP_DigestFinal_ex(ctx, md, &md_len);
-	EVP_MD_CTX_destroy(ctx);
-	return md;
-#else
-	return NULL;
-#endif
-}
+void usage(int status);
 
 void getPublicKeyRaw(ecc_key_t *pubkeyraw, char *inFile)
 {
-	EVP_PKEY* pkey;
-	unsigned char pubkeyData[1 + 2 * EC_COORDBYTES];
-
-	FILE *fp = fopen(inFile, "r");
-	if (!fp)
-		die(EX_NOINPUT, "Cannot open key file: %s: %s", inFile, strerror(errno));
-
-	if ((pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL))) {
-		debug_msg("File \"%s\" is a PEM private key", inFile);
-		fclose(fp);
-	} else {
-		fclose(fp);
-		fp = fopen(inFile, "r");
-		if ((pkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL))) {
-			debug_msg("File \"%s\" is a PEM public key", inFile);
-		}
-		fclose(fp);
-	}
-
-	if (pkey) {
-		EC_KEY *key;
-		const EC_GROUP *ecgrp;
-		const EC_POINT *ecpoint;
-		BIGNUM *pubkeyBN;
-
-		key = EVP_PKEY_get1_EC_KEY(pkey);
-		if (!key)
-			die(EX_SOFTWARE, "%s", "Cannot EVP_PKEY_get1_EC_KEY");
-
-		ecgrp = EC_KEY_get0_group(key);
-		if (!ecgrp)
-			die(EX_SOFTWARE, "%s", "Cannot EC_KEY_get0_group");
-
-		ecpoint = EC_KEY_get0_public_key(key);
-		if (!ecpoint)
-			die(EX_SOFTWARE, "%s", "Cannot EC_KEY_get0_public_key");
-
-		pubkeyBN = EC_POINT_point2bn(ecgrp, ecpoint, POINT_CONVERSION_UNCOMPRESSED,
-				NULL, NULL);
-		BN_bn2bin(pubkeyBN, pubkeyData);
-
-		BN_free(pubkeyBN);
-		EC_KEY_free(key);
-		EVP_PKEY_free(pkey);
-	}
-	else {
-		/* The file is not a public or private key in PEM format. So we check if
-		 * it is a p521 pubkey in RAW format, in which case it will be 133 bytes
-		 * with a leading byte of 0x04, indicating an uncompressed key. */
-		int fdin, r;
-		struct stat s;
-		void *infile = NULL;
-
-		fdin = open(inFile, O_RDONLY);
-		if (fdin <= 0)
-			die(EX_NOINPUT, "Cannot open key file: %s: %s", inFile, strerror(errno));
-
-		r = fstat(fdin, &s);
-		if (r != 0)
-			die(EX_NOINPUT, "Cannot stat key file: %s", inFile);
-
-		if (s.st_size == 1 + 2 * EC_COORDBYTES) {
-			infile = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fdin, 0);
-			if (infile == MAP_FAILED)
-				die(EX_OSERR, "Cannot mmap file at fd: %d, size: %lu (%s)",
-						fdin, s.st_size, strerror(errno));
-		}
-		close(fdin);
-
-		if (!infile || (*(unsigned char*) infile != 0x04)) {
-			die(EX_DATAERR,
-					"File \"%s\" is not in expected format (private or public key in PEM, or public key RAW)",
-					inFile);
-		} else
-			debug_msg("File \"%s\" is a RAW public key", inFile);
-
-		memcpy(pubkeyData, infile, sizeof(ecc_key_t) + 1);
-	}
-
-	// Remove the leading byte
-	memcpy(*pubkeyraw, &pubkeyData[1], sizeof(ecc_key_t));
-
-	return;
+	int t = timings_begin("read keys");
+	int r = stb_get_public_key_raw(stb, inFile, pubkeyraw);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	timings_end(t, 0);
+	debug_msg("File \"%s\" is a public or private key", inFile);
 }
+
 int readBinaryFile(unsigned char *data,
 		   size_t *length,
 		   const char *filename)
 {
-	int sRc = 0;
-	size_t sBytes = 0;
-
-	FILE *sFile = fopen(filename, "rb");
-	if (NULL == sFile)
-	{
-		printf("**** ERROR: Unable to open file : %s\n", filename);
-		sRc = 1;
-	}
-
-	/* Verify we have enough space */
-	if (0 == sRc)
-	{
-		sRc = fseek(sFile, 0, SEEK_END);
-		if (-1 == sRc) {
-			printf("**** ERROR : Unable to find end of : %s\n", filename);
-			sRc = 1;
-		}
-	}
-
-	if (0 == sRc)
-	{
-		long sLen = ftell(sFile);
-		if (-1 == sLen)
-		{
-			printf("**** ERROR : Unable to determine length of %s\n", filename);
-			sRc = 1;
-		}
-		else if (*length < (size_t)sLen)
-		{
-			printf("**** ERROR : Not enough space for contents of file E:%lu A:%lu : %s\n",
-			       (size_t)sLen, *length, filename);
-			sRc = 1;
-		}
-		else
-		{
-			*length = (size_t)sLen;
-		}
-	}
-
-	if (0 == sRc)
-	{
-		fseek(sFile, 0, SEEK_SET);
-
-		sBytes = fread(data, 1, *length, sFile);
-		if (sBytes != *length)
-		{
-			printf("**** ERROR: Failure reading from file : %s\n", filename);
-			sRc = 1;
-		}
-	}
-	if (NULL != sFile) {
-		if (fclose(sFile)) {
-			printf("**** ERROR: Failure closing file : %s\n", filename);
-			if (0 == sRc) sRc = 1;
-		}
-	}
-	return sRc;
+	int t = timings_begin("read keys");
+	int r = stb_read_file(stb, filename, data, length);
+	if (r)
+		printf("**** ERROR: %s\n", stb_ctx_error(stb));
+	timings_end(t, r ? 0 : *length);
+	return r != STB_OK;
 }
 
 
@@ -255,6 +102,9 @@ __attribute__((__noreturn__)) void usage (int status)
 			"     --binary            output in binary\n"
 			"     --pretty            add 0x the start of the string, for --ascii\n"
 			"     --hash              hash to use for V3 container: sha3-512 (default), sha512\n"
+			"     --timings           print the time spent in each phase, the bytes hashed,\n"
+			"                          peak RSS and page faults to stderr\n"
+			"     --timings-json      same as --timings, as one line of JSON\n"
 			"\n");
 	};
 	exit(status);
@@ -276,6 +126,8 @@ static struct option const opts[] = {
 	{ "binary",           no_argument,       0,  '1' },
 	{ "pretty",           no_argument,       0,  '2' },
 	{ "hash",             required_argument, 0,  'H' },
+	{ "timings",          no_argument,       0,  '4' },
+	{ "timings-json",     no_argument,       0,  '5' },
 	{ NULL, 0, NULL, 0 }
 };
 #endif
@@ -305,6 +157,8 @@ int main(int argc, char* argv[])
 	unsigned char md[SHA512_DIGEST_LENGTH];
 	void *p;
 	ecc_key_t pubkeyraw;
+	size_t hashed = 0;
+	int t;
 
 	progname = strrchr(argv[0], '/');
 	if (progname != NULL)
@@ -312,6 +166,12 @@ int main(int argc, char* argv[])
 	else
 		progname = argv[0];
 
+	timings_init(progname);
+
+	stb = stb_ctx_new();
+	if (!stb)
+		die(EX_OSERR, "%s", "Cannot allocate container context");
+
 	memset(container, 0, SECURE_BOOT_HEADERS_V2_SIZE);
 
 #ifdef _AIX
@@ -344,6 +204,10 @@ int main(int argc, char* argv[])
 			*(argv + i) = "-V";
 		} else if (!strcmp(*(argv + i), "--hash")) {
 			*(argv + i) = "-H";
+		} else if (!strcmp(*(argv + i), "--timings")) {
+			*(argv + i) = "-4";
+		} else if (!strcmp(*(argv + i), "--timings-json")) {
+			*(argv + i) = "-5";
 		} else if (!strncmp(*(argv + i), "--", 2)) {
 			fprintf(stderr, "%s: unrecognized option \'%s\'\n", progname,
 					*(argv + i));
@@ -355,9 +219,9 @@ int main(int argc, char* argv[])
 	while (1) {
 		int opt;
 #ifdef _AIX
-		opt = getopt(argc, argv, "?hv3w:a:b:c:d:V:o:H:012");
+		opt = getopt(argc, argv, "?hv3w:a:b:c:d:V:o:H:01245");
 #else
-		opt = getopt_long(argc, argv, "?hv3w:a:b:c:d:V:o:H:012", opts, NULL);
+		opt = getopt_long(argc, argv, "?hv3w:a:b:c:d:V:o:H:01245", opts, NULL);
 #endif
 
 		if (opt == -1)
@@ -407,6 +271,12 @@ int main(int argc, char* argv[])
 		case '2':
 			params.pretty = true;
 			break;
+		case '4':
+			timings_enable(TIMINGS_TABLE);
+			break;
+		case '5':
+			timings_enable(TIMINGS_JSON);
+			break;
 		case 'H':
 			if (strcmp(optarg, "sha512") == 0)
 				hash_alg = HASH_ALG_SHA512;
@@ -504,17 +374,22 @@ int main(int argc, char* argv[])
 		verbose_print((char *) "pubkey D = ", c_v3->hw_pkey_d, sLen);
 	}
 
+	t = timings_begin("keys hash");
 	if (params.container_version == 1) {
-		p = SHA512(c->hw_pkey_a, sizeof(ecc_key_t) * 3, md);
+		hashed = sizeof(ecc_key_t) * 3;
+		p = SHA512(c->hw_pkey_a, hashed, md);
 	} else if (params.container_version == 2) {
-		p = calc_hash(HASH_ALG_SHA3_512, c_v2->hw_pkey_a, sizeof(ecc_key_t) + sizeof(dilithium_key_t), md);
+		hashed = sizeof(ecc_key_t) + sizeof(dilithium_key_t);
+		p = stb_calc_hash(HASH_ALG_SHA3_512, c_v2->hw_pkey_a, hashed, md);
 	} else if (params.container_version == 3) {
-		p = calc_hash(hash_alg, c_v3->hw_pkey_a, sizeof(ecc_key_t) + sizeof(mldsa_key_t), md);
+		hashed = sizeof(ecc_key_t) + sizeof(mldsa_key_t);
+		p = stb_calc_hash(hash_alg, c_v3->hw_pkey_a, hashed, md);
 	} else {
 		die(EX_SOFTWARE, "Invalid container version : %d", params.container_version);
 	}
 	if (!p)
 		die(EX_SOFTWARE, "%s", "Cannot get SHA512");
+	timings_end(t, hashed);
 	verbose_print((char *) "HW keys hash = ", md, sizeof(md));
 
 	if (outform == BINARY_OUT) {
@@ -534,5 +409,6 @@ int main(int argc, char* argv[])
 
 	fclose(fp);
 	free(container);
+	stb_ctx_free(stb);
 	return 0;
 }
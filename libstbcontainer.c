@@ -0,0 +1,2283 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* For SEEK_DATA and SEEK_HOLE. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <config.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/opensslv.h>
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#include "ccan/endian/endian.h"
+#include "libstbcontainer.h"
+
+#ifdef ADD_DILITHIUM
+#include "mlca2.h"
+#endif
+
+struct stb_ctx {
+	char errmsg[256];
+	EC_GROUP *p521;		/* created on first ECDSA verify */
+	struct stb_arena *arena;
+	int io;			/* how stb_calc_hash_file() reads */
+	size_t io_window;
+#ifdef HAVE_IO_URING
+	struct uring *ring;	/* set up on first uring read */
+#endif
+#ifdef ADD_DILITHIUM
+	mlca_ctx_t dilithium;	/* set up on first verify of each */
+	mlca_ctx_t mldsa_87;
+	bool dilithium_ready;
+	bool mldsa_87_ready;
+#endif
+};
+
+static const ecc_key_t ECDSA_KEY_NULL;
+
+#ifdef HAVE_IO_URING
+static void uring_free(struct uring *ring);
+#endif
+
+static int set_error(struct stb_ctx *ctx, int err, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static int set_error(struct stb_ctx *ctx, int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(ctx->errmsg, sizeof(ctx->errmsg), fmt, ap);
+	va_end(ap);
+	return err;
+}
+
+struct stb_ctx *stb_ctx_new(void)
+{
+	struct stb_ctx *ctx = (struct stb_ctx *) calloc(1, sizeof(struct stb_ctx));
+
+	if (ctx)
+		stb_ctx_set_io(ctx, STB_IO_AUTO, 0);
+	return ctx;
+}
+
+void stb_ctx_free(struct stb_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	EC_GROUP_free(ctx->p521);
+#ifdef HAVE_IO_URING
+	uring_free(ctx->ring);
+#endif
+#ifdef ADD_DILITHIUM
+	if (ctx->dilithium_ready)
+		mlca_ctx_free(&ctx->dilithium);
+	if (ctx->mldsa_87_ready)
+		mlca_ctx_free(&ctx->mldsa_87);
+#endif
+	// Last, for the blocks of the arena freed above.
+	stb_ctx_set_arena(ctx, NULL);
+	free(ctx);
+}
+
+const char *stb_ctx_error(const struct stb_ctx *ctx)
+{
+	return ctx->errmsg[0] ? ctx->errmsg : "no error";
+}
+
+const char *stb_strerror(int err)
+{
+	switch (err) {
+	case STB_OK:			return "no error";
+	case STB_ERR_INVALID:		return "invalid argument";
+	case STB_ERR_NOMEM:		return "out of memory";
+	case STB_ERR_IO:		return "I/O error";
+	case STB_ERR_FORMAT:		return "malformed container";
+	case STB_ERR_UNSUPPORTED:	return "not supported";
+	case STB_ERR_CRYPTO:		return "crypto library failure";
+	case STB_ERR_KEY:		return "unsupported key format";
+	case STB_ERR_SIGNATURE:		return "unsupported signature format";
+	default:			return "unknown error";
+	}
+}
+
+int stb_sysexit(int err)
+{
+	switch (err) {
+	case STB_OK:			return EX_OK;
+	case STB_ERR_NOMEM:		return EX_OSERR;
+	case STB_ERR_IO:		return EX_NOINPUT;
+	case STB_ERR_FORMAT:
+	case STB_ERR_KEY:
+	case STB_ERR_SIGNATURE:		return EX_DATAERR;
+	default:			return EX_SOFTWARE;
+	}
+}
+
+/*
+ * Allocation hooks. OpenSSL allocates through them once installed: they
+ * count every allocation, and while stb_validate() runs with an arena, serve
+ * it from the arena. A block in the arena is preceded by its size, for
+ * realloc; freeing it only drops the count of live blocks.
+ *
+ * A block may be freed on any thread, and long after the validation that
+ * allocated it, so whether it is in an arena is looked up in the arenas set
+ * on contexts, not taken from the arena this thread used last. An arena is
+ * registered while a context uses it. Once none does, its struct stb_arena,
+ * which may be gone by then, is let go of, and the range of its buffer
+ * stays registered with the count of its live blocks until they are freed.
+ */
+#define ARENA_ALIGN	16
+#define MAX_ARENAS	64
+
+struct arena_block {
+	size_t size;
+	size_t pad;		/* keeps the block ARENA_ALIGN aligned */
+};
+
+struct arena_slot {
+	struct stb_arena *arena;	/* NULL once no context uses it */
+	const uint8_t *base;	/* of its buffer, NULL if the slot is free */
+	size_t size;
+	unsigned long refs;	/* contexts using it */
+	unsigned long live;	/* blocks left, once no context uses it */
+};
+
+static bool hooks_installed;
+static struct stb_alloc_stats alloc_stats;
+static struct arena_slot arenas[MAX_ARENAS];
+static int arenas_lock;
+static __thread struct stb_arena *thread_arena;	/* in use by stb_validate() */
+static __thread bool arena_active;
+
+#define COUNT(field, n)	__sync_fetch_and_add(&alloc_stats.field, (n))
+
+/*
+ * The slot of the registered arena p is in, -1 if none. The slot of a live
+ * block is kept until it is freed.
+ */
+static int find_arena(const void *p)
+{
+	const uint8_t *base;
+	int i;
+
+	for (i = 0; i < MAX_ARENAS; i++) {
+		base = __atomic_load_n(&arenas[i].base, __ATOMIC_ACQUIRE);
+		if (base && (const uint8_t *) p >= base
+		    && (const uint8_t *) p < base + arenas[i].size)
+			return i;
+	}
+	return -1;
+}
+
+static void lock_arenas(void)
+{
+	while (__sync_lock_test_and_set(&arenas_lock, 1))
+		;
+}
+
+static void unlock_arenas(void)
+{
+	__sync_lock_release(&arenas_lock);
+}
+
+/*
+ * Let go of the arena of a slot no context uses any more, keeping the count
+ * of its live blocks, and free the slot once there is none. Called with the
+ * lock held.
+ */
+static void prune_arena(struct arena_slot *slot)
+{
+	if (slot->refs || !slot->base)
+		return;
+	if (slot->arena) {
+		slot->live = __atomic_load_n(&slot->arena->live, __ATOMIC_ACQUIRE);
+		slot->arena = NULL;
+	}
+	if (!slot->live)
+		__atomic_store_n(&slot->base, NULL, __ATOMIC_RELEASE);
+}
+
+static int ref_arena(struct stb_ctx *ctx, struct stb_arena *a)
+{
+	int i, free_slot = -1;
+
+	if (!a->base)
+		return set_error(ctx, STB_ERR_INVALID, "%s", "Arena without a buffer");
+	lock_arenas();
+	for (i = 0; i < MAX_ARENAS; i++) {
+		if (arenas[i].arena == a)
+			break;
+		// Set again after it was let go of, its blocks still live. Where
+		// they are is not known to an arena set up anew over its buffer,
+		// which serves nothing until they are freed and it is rewound.
+		if (!arenas[i].arena && arenas[i].base == a->base
+		    && arenas[i].size == a->size) {
+			arenas[i].arena = a;
+			a->live = arenas[i].live;
+			if (a->live && !a->used)
+				a->used = a->size;
+			break;
+		}
+		if (!arenas[i].base) {
+			if (free_slot < 0)
+				free_slot = i;
+		} else if (arenas[i].base < a->base + a->size
+			   && a->base < arenas[i].base + arenas[i].size) {
+			unlock_arenas();
+			return set_error(ctx, STB_ERR_INVALID, "%s",
+					 "Arena over blocks still live");
+		}
+	}
+	if (i == MAX_ARENAS && free_slot >= 0) {
+		i = free_slot;
+		arenas[i].arena = a;
+		arenas[i].size = a->size;
+		arenas[i].refs = 0;
+		arenas[i].live = 0;
+		__atomic_store_n(&arenas[i].base, a->base, __ATOMIC_RELEASE);
+	}
+	if (i < MAX_ARENAS)
+		arenas[i].refs++;
+	unlock_arenas();
+	if (i == MAX_ARENAS)
+		return set_error(ctx, STB_ERR_UNSUPPORTED,
+				 "More than %d arenas in use", MAX_ARENAS);
+	return STB_OK;
+}
+
+static void unref_arena(struct stb_arena *a)
+{
+	int i;
+
+	lock_arenas();
+	for (i = 0; i < MAX_ARENAS; i++) {
+		if (arenas[i].arena == a && arenas[i].refs) {
+			arenas[i].refs--;
+			prune_arena(&arenas[i]);
+		}
+	}
+	unlock_arenas();
+}
+
+/* A block of the arena of a slot is freed. */
+static void free_in_arena(struct arena_slot *slot)
+{
+	lock_arenas();
+	if (slot->arena) {
+		__sync_fetch_and_sub(&slot->arena->live, 1);
+	} else if (slot->live) {
+		slot->live--;
+		prune_arena(slot);
+	}
+	unlock_arenas();
+}
+
+static void *arena_alloc(struct stb_arena *a, size_t size)
+{
+	size_t need = sizeof(struct arena_block)
+		+ ((size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+	struct arena_block *b;
+
+	if (need < size || need > a->size - a->used) {
+		a->misses++;
+		return NULL;
+	}
+	b = (struct arena_block *) (a->base + a->used);
+	b->size = size;
+	a->used += need;
+	a->peak = max(a->peak, a->used);
+	__sync_fetch_and_add(&a->live, 1);
+	a->allocs++;
+	return b + 1;
+}
+
+static void *hook_malloc(size_t size, const char *file, int line)
+{
+	void *p;
+
+	(void) file; (void) line;
+	COUNT(allocs, 1);
+	COUNT(bytes, size);
+	if (arena_active && (p = arena_alloc(thread_arena, size))) {
+		COUNT(arena_allocs, 1);
+		return p;
+	}
+	return malloc(size);
+}
+
+static void hook_free(void *p, const char *file, int line)
+{
+	int i;
+
+	(void) file; (void) line;
+	if (!p)
+		return;
+	COUNT(frees, 1);
+	i = find_arena(p);
+	if (i >= 0)
+		free_in_arena(&arenas[i]);
+	else
+		free(p);
+}
+
+static void *hook_realloc(void *p, size_t size, const char *file, int line)
+{
+	const struct arena_block *b;
+	void *n;
+
+	if (!p)
+		return hook_malloc(size, file, line);
+	if (find_arena(p) < 0) {
+		COUNT(allocs, 1);
+		COUNT(bytes, size);
+		return realloc(p, size);
+	}
+	b = (const struct arena_block *) p - 1;
+	n = hook_malloc(size, file, line);
+	if (n) {
+		memcpy(n, p, min(b->size, size));
+		hook_free(p, file, line);
+	}
+	return n;
+}
+
+bool stb_alloc_hooks_install(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (!CRYPTO_set_mem_functions(hook_malloc, hook_realloc, hook_free))
+		return false;
+	hooks_installed = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void stb_alloc_stats(struct stb_alloc_stats *s)
+{
+	s->allocs = __sync_fetch_and_add(&alloc_stats.allocs, 0);
+	s->frees = __sync_fetch_and_add(&alloc_stats.frees, 0);
+	s->bytes = __sync_fetch_and_add(&alloc_stats.bytes, 0);
+	s->arena_allocs = __sync_fetch_and_add(&alloc_stats.arena_allocs, 0);
+}
+
+void stb_arena_init(struct stb_arena *a, void *buf, size_t size)
+{
+	uintptr_t start = ((uintptr_t) buf + ARENA_ALIGN - 1)
+		& ~(uintptr_t) (ARENA_ALIGN - 1);
+
+	memset(a, 0, sizeof(*a));
+	if (size < start - (uintptr_t) buf)
+		return;
+	a->base = (uint8_t *) start;
+	a->size = size - (start - (uintptr_t) buf);
+}
+
+bool stb_arena_reset(struct stb_arena *a)
+{
+	if (a->live) {
+		a->pinned++;
+		return false;
+	}
+	a->used = 0;
+	return true;
+}
+
+/* An incremental hash, of one of the container hash algorithms. */
+struct stb_hash {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	EVP_MD_CTX *ctx;
+#else
+	SHA512_CTX sha;
+#endif
+};
+
+static bool hash_init(struct stb_hash *h, uint8_t hash_alg)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	const EVP_MD *alg;
+
+	switch (hash_alg) {
+	case HASH_ALG_SHA512:
+		alg = EVP_sha512();
+		break;
+	case HASH_ALG_SHA3_512:
+		alg = EVP_sha3_512();
+		break;
+	default:
+		return false;
+	}
+	h->ctx = EVP_MD_CTX_new();
+	if (!h->ctx)
+		return false;
+	if (!EVP_DigestInit_ex(h->ctx, alg, NULL)) {
+		EVP_MD_CTX_free(h->ctx);
+		return false;
+	}
+	return true;
+#else
+	return hash_alg == HASH_ALG_SHA512 && SHA512_Init(&h->sha);
+#endif
+}
+
+static bool hash_update(struct stb_hash *h, const void *data, size_t len)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return EVP_DigestUpdate(h->ctx, data, len);
+#else
+	return SHA512_Update(&h->sha, data, len);
+#endif
+}
+
+/* Finish the hash into md if ok, and free the context in any case. */
+static unsigned char *hash_final(struct stb_hash *h, bool ok, unsigned char *md)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	unsigned int md_len = SHA512_DIGEST_LENGTH;
+
+	ok = ok && EVP_DigestFinal_ex(h->ctx, md, &md_len);
+	EVP_MD_CTX_free(h->ctx);
+#else
+	ok = SHA512_Final(md, &h->sha) && ok;
+#endif
+	return ok ? md : NULL;
+}
+
+struct stb_hash *stb_hash_new(uint8_t hash_alg)
+{
+	struct stb_hash *h = (struct stb_hash *) malloc(sizeof(*h));
+
+	if (h && !hash_init(h, hash_alg)) {
+		free(h);
+		h = NULL;
+	}
+	return h;
+}
+
+bool stb_hash_update(struct stb_hash *h, const void *data, size_t len)
+{
+	return hash_update(h, data, len);
+}
+
+unsigned char *stb_hash_final(struct stb_hash *h, unsigned char *md)
+{
+	md = hash_final(h, true, md);
+	free(h);
+	return md;
+}
+
+unsigned char *stb_calc_hash(uint8_t hash_alg, const void *data, size_t len,
+			     unsigned char *md)
+{
+	struct stb_hash h;
+
+	if (!hash_init(&h, hash_alg))
+		return NULL;
+	return hash_final(&h, hash_update(&h, data, len), md);
+}
+
+bool stb_file_extent(int fd, uint64_t pos, uint64_t end, uint64_t *next)
+{
+#ifdef SEEK_DATA
+	off_t data, hole;
+
+	data = lseek(fd, pos, SEEK_DATA);
+	if (data < 0 && errno == ENXIO) {
+		// In a hole that runs to the end of the file.
+		*next = end;
+		return false;
+	}
+	if (data > (off_t) pos) {
+		*next = min((uint64_t) data, end);
+		return false;
+	}
+	if (data == (off_t) pos) {
+		hole = lseek(fd, pos, SEEK_HOLE);
+		*next = hole < 0 ? end : min((uint64_t) hole, end);
+		return true;
+	}
+#endif
+	*next = end;
+	return true;
+}
+
+/* What stb_calc_hash_file() reads the data at a time, without a mapping. */
+#define HASH_FILE_CHUNK	(1024 * 1024)
+
+/*
+ * How stb_calc_hash_file() reads the data: set for a context with
+ * stb_ctx_set_io(). Below IO_SMALL bytes the mapping, or plain reads, do best,
+ * anything more is set up for sequential reading: a mapping with madvise()
+ * up to IO_LARGE, reads with posix_fadvise() windows beyond, the page table
+ * and TLB of a mapping of gigabytes costing more than the copy out of the
+ * page cache.
+ */
+#define IO_SMALL	(1024 * 1024)
+#define IO_LARGE	(256 * 1024 * 1024)
+#define IO_WINDOW	(8 * 1024 * 1024)
+#define DIRECT_ALIGN	4096
+
+static const char *io_names[STB_IO_COUNT] = {
+	"auto", "mmap", "madvise", "populate", "fadvise", "direct", "uring"
+};
+
+const char *stb_io_name(int io)
+{
+	return (io >= 0 && io < STB_IO_COUNT) ? io_names[io] : "unknown";
+}
+
+int stb_io_parse(const char *spec, size_t *window)
+{
+	const char *comma = strchr(spec, ',');
+	size_t len = comma ? (size_t) (comma - spec) : strlen(spec);
+	unsigned long long w = 0;
+	char *end;
+	int io;
+
+	for (io = 0; io < STB_IO_COUNT; io++)
+		if (strlen(io_names[io]) == len && !strncmp(spec, io_names[io], len))
+			break;
+	if (io == STB_IO_COUNT)
+		return -1;
+
+	if (comma) {
+		w = strtoull(comma + 1, &end, 0);
+		switch (*end) {
+		case 'G': case 'g':
+			w <<= 10;
+			/* fall through */
+		case 'M': case 'm':
+			w <<= 10;
+			/* fall through */
+		case 'K': case 'k':
+			w <<= 10;
+			end++;
+			break;
+		}
+		if (end == comma + 1 || *end || !w)
+			return -1;
+	}
+	if (window)
+		*window = w;
+	return io;
+}
+
+int stb_ctx_set_io(struct stb_ctx *ctx, int io, size_t window)
+{
+	if (io < 0 || io >= STB_IO_COUNT)
+		return set_error(ctx, STB_ERR_INVALID, "No I/O strategy %d", io);
+	ctx->io = io;
+	ctx->io_window = window ? window : IO_WINDOW;
+	return STB_OK;
+}
+
+int stb_io_choose(const struct stb_ctx *ctx, uint64_t len, bool mapped)
+{
+	if (ctx->io != STB_IO_AUTO)
+		return ctx->io;
+	if (len < IO_SMALL)
+		return STB_IO_MMAP;
+	if (mapped && len < IO_LARGE)
+		return STB_IO_MADVISE;
+	return STB_IO_FADVISE;
+}
+
+static size_t page_size(void)
+{
+	long sz = sysconf(_SC_PAGESIZE);
+
+	return sz > 0 ? (size_t) sz : 4096;
+}
+
+/* Hash [pos, end) of fd, read into *buf, allocated on first use. */
+static bool read_hash(struct stb_hash *h, int fd, uint8_t **buf, uint64_t pos,
+		      uint64_t end)
+{
+	ssize_t n;
+	bool ok;
+
+	if (!*buf)
+		*buf = (uint8_t *) malloc(HASH_FILE_CHUNK);
+	for (ok = *buf != NULL; ok && pos < end; pos += n) {
+		n = pread(fd, *buf, min(end - pos, HASH_FILE_CHUNK), pos);
+		ok = n > 0 && hash_update(h, *buf, n);
+	}
+	return ok;
+}
+
+/* The mapping, read sequentially, in huge pages where the kernel can. */
+static bool madvise_hash(struct stb_hash *h, const uint8_t *data, size_t len)
+{
+#ifdef MADV_SEQUENTIAL
+	uintptr_t start = (uintptr_t) data & ~(page_size() - 1);
+	size_t maplen = len + ((uintptr_t) data - start);
+
+	madvise((void *) start, maplen, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise((void *) start, maplen, MADV_HUGEPAGE);
+#endif
+#endif
+	return hash_update(h, data, len);
+}
+
+/* Mapped a window at a time, its pages read in by mmap(). */
+static bool populate_hash(struct stb_hash *h, int fd, uint8_t **buf,
+			  uint64_t pos, uint64_t end, size_t window)
+{
+#ifdef MAP_POPULATE
+	uint64_t start, n;
+	void *p;
+	bool ok = true;
+
+	for (; ok && pos < end; pos += n) {
+		start = pos & ~((uint64_t) page_size() - 1);
+		n = min(end - pos, (uint64_t) window);
+		p = mmap(NULL, n + (pos - start), PROT_READ,
+			 MAP_PRIVATE | MAP_POPULATE, fd, start);
+		if (p == MAP_FAILED)
+			return read_hash(h, fd, buf, pos, end);
+		ok = hash_update(h, (const uint8_t *) p + (pos - start), n);
+		munmap(p, n + (pos - start));
+	}
+	return ok;
+#else
+	return read_hash(h, fd, buf, pos, end);
+#endif
+}
+
+/* Read, with the kernel told to read ahead a window or two. */
+static bool fadvise_hash(struct stb_hash *h, int fd, uint8_t **buf,
+			 uint64_t pos, uint64_t end, size_t window)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+	uint64_t ahead = pos, n;
+	bool ok;
+
+	posix_fadvise(fd, pos, end - pos, POSIX_FADV_SEQUENTIAL);
+	if (!*buf)
+		*buf = (uint8_t *) malloc(HASH_FILE_CHUNK);
+	for (ok = *buf != NULL; ok && pos < end; pos += n) {
+		while (ahead < end && ahead < pos + 2 * window) {
+			posix_fadvise(fd, ahead, min(end - ahead, (uint64_t) window),
+				      POSIX_FADV_WILLNEED);
+			ahead += window;
+		}
+		n = pread(fd, *buf, min(end - pos, HASH_FILE_CHUNK), pos);
+		ok = (ssize_t) n > 0 && hash_update(h, *buf, n);
+	}
+	return ok;
+#else
+	return read_hash(h, fd, buf, pos, end);
+#endif
+}
+
+/*
+ * Read around the page cache, into an aligned buffer, from a descriptor of
+ * its own: O_DIRECT is a flag of the open file, which others may share.
+ * Where the file system does not take O_DIRECT, read as usual.
+ */
+static bool direct_hash(struct stb_hash *h, int fd, uint8_t **buf, uint64_t pos,
+			uint64_t end)
+{
+#if defined(O_DIRECT) && defined(__linux__)
+	char path[64];
+	uint64_t rpos = pos & ~((uint64_t) DIRECT_ALIGN - 1), skip = pos - rpos;
+	void *abuf;
+	ssize_t n;
+	bool ok = true;
+	int dfd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	dfd = open(path, O_RDONLY | O_DIRECT);
+	if (dfd < 0)
+		return read_hash(h, fd, buf, pos, end);
+	if (posix_memalign(&abuf, DIRECT_ALIGN, HASH_FILE_CHUNK)) {
+		close(dfd);
+		return false;
+	}
+	for (; ok && rpos < end; rpos += n, skip = 0) {
+		n = pread(dfd, abuf, HASH_FILE_CHUNK, rpos);
+		if (n < 0 && errno == EINVAL && rpos + skip == pos) {
+			free(abuf);
+			close(dfd);
+			return read_hash(h, fd, buf, pos, end);
+		}
+		ok = n > (ssize_t) skip
+			&& hash_update(h, (uint8_t *) abuf + skip,
+				       min((uint64_t) n, end - rpos) - skip);
+	}
+	free(abuf);
+	close(dfd);
+	return ok;
+#else
+	return read_hash(h, fd, buf, pos, end);
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring, through the raw system calls: a window of reads is kept in
+ * flight, into buffers registered once, and each chunk is hashed as it
+ * completes while those after it are still being read. The ring and its
+ * buffers are set up on first use by a context, and kept for the files it
+ * hashes after, so that a batch of containers pays for them once; they are
+ * set up again when the window changes, and freed with the context. Where
+ * io_uring is not there, or not allowed, the reads are synchronous.
+ */
+struct uring {
+	int fd;			/* -1 if it could not be set up */
+	unsigned int depth;
+	bool fixed;		/* the buffers are registered */
+	uint8_t *sq, *cq;	/* the mappings of the rings, NULL if none */
+	size_t sq_sz, cq_sz;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	struct io_uring_cqe *cqes;
+	uint8_t *bufs;
+	int *res;		/* of the read into each buffer */
+};
+
+static void *uring_map(int fd, size_t len, off_t off)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, off);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Unmap and close the ring. Reads still in flight when busy may yet land
+ * in the buffers, which are then left to them rather than freed.
+ */
+static void uring_close(struct uring *ring, bool busy)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq && ring->cq != ring->sq)
+		munmap(ring->cq, ring->cq_sz);
+	if (ring->sq)
+		munmap(ring->sq, ring->sq_sz);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring->res);
+	if (!busy)
+		free(ring->bufs);
+	ring->sq = ring->cq = ring->bufs = NULL;
+	ring->sqes = NULL;
+	ring->res = NULL;
+	ring->fd = -1;
+}
+
+static void uring_free(struct uring *ring)
+{
+	if (!ring)
+		return;
+	uring_close(ring, false);
+	free(ring);
+}
+
+/* The ring of ctx for its window, NULL if it cannot be set up. */
+static struct uring *uring_setup(struct stb_ctx *ctx)
+{
+	unsigned int depth = max((size_t) 2, min(ctx->io_window / HASH_FILE_CHUNK,
+						 (size_t) 64));
+	struct uring *ring = ctx->ring;
+	struct io_uring_params p;
+	struct iovec *iov;
+	unsigned int i;
+
+	if (ring && ring->depth == depth)
+		return ring->fd >= 0 ? ring : NULL;
+	if (ring) {
+		uring_close(ring, false);
+	} else {
+		ring = (struct uring *) calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+		ctx->ring = ring;
+	}
+
+	ring->depth = depth;
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (ring->fd < 0)
+		return NULL;
+
+	ring->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_sz = ring->cq_sz = max(ring->sq_sz, ring->cq_sz);
+	ring->sq = (uint8_t *) uring_map(ring->fd, ring->sq_sz,
+					 IORING_OFF_SQ_RING);
+	ring->cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq
+		: (uint8_t *) uring_map(ring->fd, ring->cq_sz, IORING_OFF_CQ_RING);
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) uring_map(ring->fd, ring->sqes_sz,
+						       IORING_OFF_SQES);
+	ring->res = (int *) calloc(depth, sizeof(int));
+	iov = (struct iovec *) calloc(depth, sizeof(*iov));
+	if (!ring->sq || !ring->cq || !ring->sqes || !ring->res || !iov
+	    || posix_memalign((void **) &ring->bufs, page_size(),
+			      depth * HASH_FILE_CHUNK)) {
+		// The context goes on without it, until its window changes.
+		free(iov);
+		uring_close(ring, false);
+		return NULL;
+	}
+
+	ring->sq_head = (unsigned int *) (ring->sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (ring->sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (ring->sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (ring->sq + p.sq_off.array);
+	ring->cq_head = (unsigned int *) (ring->cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (ring->cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (ring->cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (ring->cq + p.cq_off.cqes);
+
+	// Registered buffers are pinned once rather than on each read; past
+	// RLIMIT_MEMLOCK they are not, and plain reads do.
+	for (i = 0; i < depth; i++) {
+		iov[i].iov_base = ring->bufs + i * HASH_FILE_CHUNK;
+		iov[i].iov_len = HASH_FILE_CHUNK;
+	}
+	ring->fixed = !syscall(__NR_io_uring_register, ring->fd,
+			       IORING_REGISTER_BUFFERS, iov, depth);
+	free(iov);
+	return ring;
+}
+
+#define URING_RUNNING	INT_MIN
+
+/* Queue the read of len bytes at pos into buffer i. */
+static void uring_read(struct uring *ring, int fd, unsigned int i,
+		       uint64_t pos, size_t len)
+{
+	unsigned int tail = *ring->sq_tail, idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = pos;
+	sqe->addr = (uintptr_t) (ring->bufs + i * HASH_FILE_CHUNK);
+	sqe->len = len;
+	sqe->buf_index = ring->fixed ? i : 0;
+	sqe->user_data = i;
+	ring->sq_array[idx] = idx;
+	ring->res[i] = URING_RUNNING;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit the reads queued since the last call, and wait until the one into
+ * buffer i is done, its result then in ring->res[i].
+ */
+static bool uring_wait(struct uring *ring, unsigned int i)
+{
+	unsigned int head, tail, submit, wait;
+	struct io_uring_cqe *cqe;
+	int r;
+
+	for (;;) {
+		submit = *ring->sq_tail - __atomic_load_n(ring->sq_head,
+							  __ATOMIC_ACQUIRE);
+		wait = ring->res[i] == URING_RUNNING;
+		if (!submit && !wait)
+			return true;
+		r = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+			    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r < 0 && errno != EINTR)
+			return false;
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			ring->res[cqe->user_data] = cqe->res;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Hash [pos, end) of fd, chunk k being read into buffer k % depth, and the
+ * read of chunk k + depth queued once it is hashed. A short read is
+ * completed with pread(). Once something fails, the reads in flight are
+ * still waited for, so that the buffers are free for the next file.
+ */
+static bool uring_hash(struct stb_ctx *ctx, struct stb_hash *h, int fd,
+		       uint8_t **buf, uint64_t pos, uint64_t end)
+{
+	struct uring *ring = uring_setup(ctx);
+	uint64_t next = pos, chunk, n;
+	unsigned int i, running = 0;
+	uint8_t *b;
+	ssize_t r, m;
+	bool ok = true;
+
+	if (!ring)
+		return fadvise_hash(h, fd, buf, pos, end, ctx->io_window);
+
+	for (i = 0; i < ring->depth && next < end; i++, next += n, running++) {
+		n = min(end - next, (uint64_t) HASH_FILE_CHUNK);
+		uring_read(ring, fd, i, next, n);
+	}
+	for (chunk = 0; running; chunk++, pos += n, running--) {
+		i = chunk % ring->depth;
+		if (!uring_wait(ring, i)) {
+			uring_close(ring, true);
+			return false;
+		}
+		n = min(end - pos, (uint64_t) HASH_FILE_CHUNK);
+		b = ring->bufs + i * HASH_FILE_CHUNK;
+		r = ring->res[i];
+		// A kernel without the read opcodes, from the start.
+		if (chunk == 0 && r == -EINVAL) {
+			while (--running)
+				if (!uring_wait(ring, ++chunk % ring->depth))
+					break;
+			uring_close(ring, running != 0);
+			return fadvise_hash(h, fd, buf, pos, end, ctx->io_window);
+		}
+		while (ok && r >= 0 && (uint64_t) r < n) {
+			m = pread(fd, b + r, n - r, pos + r);
+			r = m > 0 ? r + m : -1;
+		}
+		ok = ok && r >= 0 && hash_update(h, b, n);
+		if (ok && next < end) {
+			m = min(end - next, (uint64_t) HASH_FILE_CHUNK);
+			uring_read(ring, fd, i, next, m);
+			next += m;
+			running++;
+		}
+	}
+	return ok;
+}
+#endif
+
+unsigned char *stb_calc_hash_file(struct stb_ctx *ctx, uint8_t hash_alg,
+				  int fd, uint64_t off, const void *data,
+				  size_t len, unsigned char *md, uint64_t *holes)
+{
+	static const uint8_t zeros[64 * 1024];
+	uint64_t pos = off, end = off + len, next;
+	const uint8_t *p;
+	uint8_t *buf = NULL;
+	struct stb_hash h;
+	ssize_t n;
+	bool ok;
+	size_t window = ctx->io_window;
+	int io = stb_io_choose(ctx, len, data != NULL);
+
+	if (holes)
+		*holes = 0;
+	if (!hash_init(&h, hash_alg))
+		return NULL;
+
+	for (ok = true; ok && pos < end; pos = next) {
+		if (!stb_file_extent(fd, pos, end, &next)) {
+			if (holes)
+				*holes += next - pos;
+			for (; ok && pos < next; pos += n) {
+				n = min(next - pos, sizeof(zeros));
+				ok = hash_update(&h, zeros, n);
+			}
+			continue;
+		}
+		p = data ? (const uint8_t *) data + (pos - off) : NULL;
+		switch (io) {
+		case STB_IO_MADVISE:
+			ok = p ? madvise_hash(&h, p, next - pos)
+			       : fadvise_hash(&h, fd, &buf, pos, next, window);
+			break;
+		case STB_IO_POPULATE:
+			ok = populate_hash(&h, fd, &buf, pos, next, window);
+			break;
+		case STB_IO_FADVISE:
+			ok = fadvise_hash(&h, fd, &buf, pos, next, window);
+			break;
+		case STB_IO_DIRECT:
+			ok = direct_hash(&h, fd, &buf, pos, next);
+			break;
+		case STB_IO_URING:
+#ifdef HAVE_IO_URING
+			ok = uring_hash(ctx, &h, fd, &buf, pos, next);
+#else
+			ok = fadvise_hash(&h, fd, &buf, pos, next, window);
+#endif
+			break;
+		default:
+			ok = p ? hash_update(&h, p, next - pos)
+			       : read_hash(&h, fd, &buf, pos, next);
+		}
+	}
+	free(buf);
+	return hash_final(&h, ok, md);
+}
+
+#ifdef FS_IOC_FIEMAP
+#define FIEMAP_EXTENTS	256
+#define FIEMAP_UNSHARABLE (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC \
+			   | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED \
+			   | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_UNWRITTEN)
+
+/* The extents of len bytes of fd at off, NULL if there are too many. */
+static struct fiemap *get_extents(int fd, uint64_t off, uint64_t len)
+{
+	struct fiemap *fm;
+
+	fm = (struct fiemap *) calloc(1, sizeof(*fm) + FIEMAP_EXTENTS
+				      * sizeof(struct fiemap_extent));
+	if (!fm)
+		return NULL;
+	fm->fm_start = off;
+	fm->fm_length = len;
+	fm->fm_flags = FIEMAP_FLAG_SYNC;
+	fm->fm_extent_count = FIEMAP_EXTENTS;
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) || (fm->fm_mapped_extents == FIEMAP_EXTENTS
+	    && !(fm->fm_extents[FIEMAP_EXTENTS - 1].fe_flags & FIEMAP_EXTENT_LAST))) {
+		free(fm);
+		return NULL;
+	}
+	return fm;
+}
+
+/* The disk address of pos, 0 in a hole; at most *len bytes are there. */
+static uint64_t extent_at(const struct fiemap *fm, uint64_t pos, uint64_t *len,
+			  bool *ok)
+{
+	const struct fiemap_extent *e;
+	unsigned int i;
+
+	for (i = 0; i < fm->fm_mapped_extents; i++) {
+		e = &fm->fm_extents[i];
+		if (pos < e->fe_logical) {
+			*len = min(*len, e->fe_logical - pos);
+			return 0;
+		}
+		if (pos < e->fe_logical + e->fe_length) {
+			*len = min(*len, e->fe_logical + e->fe_length - pos);
+			*ok = !(e->fe_flags & FIEMAP_UNSHARABLE);
+			return e->fe_physical + (pos - e->fe_logical);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Whether the two ranges are on the same blocks of the disk, as those of a
+ * reflinked copy are, or holes in both.
+ */
+static bool same_extents(int fd_a, uint64_t off_a, int fd_b, uint64_t off_b,
+			 uint64_t len)
+{
+	struct fiemap *fa = get_extents(fd_a, off_a, len);
+	struct fiemap *fb = get_extents(fd_b, off_b, len);
+	uint64_t pos, n, pa, pb;
+	bool same = fa && fb, ok_a, ok_b;
+
+	for (pos = 0; same && pos < len; pos += n) {
+		n = len - pos;
+		ok_a = ok_b = true;
+		pa = extent_at(fa, off_a + pos, &n, &ok_a);
+		pb = extent_at(fb, off_b + pos, &n, &ok_b);
+		same = ok_a && ok_b && pa == pb;
+	}
+	free(fa);
+	free(fb);
+	return same;
+}
+#endif
+
+bool stb_same_data(int fd_a, uint64_t off_a, int fd_b, uint64_t off_b,
+		   uint64_t len)
+{
+	struct stat sa, sb;
+	uint8_t *buf;
+	ssize_t n, m;
+	uint64_t pos;
+	bool same;
+
+	if (fstat(fd_a, &sa) || fstat(fd_b, &sb))
+		return false;
+	if (off_a + len > (uint64_t) sa.st_size || off_b + len > (uint64_t) sb.st_size)
+		return false;
+	if (sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino && off_a == off_b)
+		return true;
+#ifdef FS_IOC_FIEMAP
+	if (sa.st_dev == sb.st_dev && same_extents(fd_a, off_a, fd_b, off_b, len))
+		return true;
+#endif
+
+	buf = (uint8_t *) malloc(2 * HASH_FILE_CHUNK);
+	if (!buf)
+		return false;
+	for (same = true, pos = 0; same && pos < len; pos += n) {
+		n = pread(fd_a, buf, min(len - pos, HASH_FILE_CHUNK), off_a + pos);
+		m = n > 0 ? pread(fd_b, buf + HASH_FILE_CHUNK, n, off_b + pos) : -1;
+		same = n > 0 && m == n && !memcmp(buf, buf + HASH_FILE_CHUNK, n);
+	}
+	free(buf);
+	return same;
+}
+
+int stb_read_file(struct stb_ctx *ctx, const char *fn, void *data, size_t *len)
+{
+	FILE *fp;
+	long sz;
+	int r = STB_OK;
+
+	fp = fopen(fn, "rb");
+	if (!fp)
+		return set_error(ctx, STB_ERR_IO, "Unable to open file: %s (%s)",
+				 fn, strerror(errno));
+
+	if (fseek(fp, 0, SEEK_END) || (sz = ftell(fp)) < 0)
+		r = set_error(ctx, STB_ERR_IO, "Unable to determine length of %s",
+			      fn);
+	else if (*len < (size_t) sz)
+		r = set_error(ctx, STB_ERR_INVALID,
+			      "Not enough space for contents of file E:%lu A:%lu : %s",
+			      (unsigned long) sz, (unsigned long) *len, fn);
+	else if (fseek(fp, 0, SEEK_SET)
+		 || fread(data, 1, sz, fp) != (size_t) sz)
+		r = set_error(ctx, STB_ERR_IO, "Failure reading from file: %s", fn);
+	else
+		*len = sz;
+
+	if (fclose(fp) && r == STB_OK)
+		r = set_error(ctx, STB_ERR_IO, "Failure closing file: %s", fn);
+	return r;
+}
+
+int stb_get_public_key_raw(struct stb_ctx *ctx, const char *fn, ecc_key_t *key)
+{
+	EVP_PKEY *pkey;
+	unsigned char pubkeyData[1 + 2 * EC_COORDBYTES];
+	FILE *fp;
+
+	fp = fopen(fn, "r");
+	if (!fp)
+		return set_error(ctx, STB_ERR_IO, "Cannot open key file: %s: %s",
+				 fn, strerror(errno));
+
+	pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	if (!pkey) {
+		rewind(fp);
+		pkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+	}
+	fclose(fp);
+
+	if (pkey) {
+		EC_KEY *eckey;
+		const EC_GROUP *ecgrp;
+		const EC_POINT *ecpoint;
+		BIGNUM *pubkeyBN = NULL;
+		int r = STB_OK;
+
+		eckey = EVP_PKEY_get1_EC_KEY(pkey);
+		EVP_PKEY_free(pkey);
+		if (!eckey)
+			return set_error(ctx, STB_ERR_KEY,
+					 "Key \"%s\" is not an EC key", fn);
+
+		ecgrp = EC_KEY_get0_group(eckey);
+		ecpoint = EC_KEY_get0_public_key(eckey);
+		if (!ecgrp || !ecpoint
+		    || EC_GROUP_get_curve_name(ecgrp) != NID_secp521r1)
+			r = set_error(ctx, STB_ERR_KEY,
+				      "Key \"%s\" is not a P-521 key", fn);
+		else if (!(pubkeyBN = EC_POINT_point2bn(ecgrp, ecpoint,
+				POINT_CONVERSION_UNCOMPRESSED, NULL, NULL))
+			 || BN_num_bytes(pubkeyBN) != sizeof(pubkeyData))
+			r = set_error(ctx, STB_ERR_CRYPTO, "%s",
+				      "Cannot EC_POINT_point2bn");
+		else
+			BN_bn2bin(pubkeyBN, pubkeyData);
+
+		BN_free(pubkeyBN);
+		EC_KEY_free(eckey);
+		if (r)
+			return r;
+	} else {
+		/* The file is not a public or private key in PEM format. So we
+		 * check if it is a p521 pubkey in RAW format, in which case it
+		 * will be 133 bytes with a leading byte of 0x04, indicating an
+		 * uncompressed key. */
+		struct stat s;
+		ssize_t n = -1;
+		int fd;
+
+		fd = open(fn, O_RDONLY);
+		if (fd < 0)
+			return set_error(ctx, STB_ERR_IO, "Cannot open key file: %s: %s",
+					 fn, strerror(errno));
+		if (fstat(fd, &s) == 0 && s.st_size == sizeof(pubkeyData))
+			n = read(fd, pubkeyData, sizeof(pubkeyData));
+		close(fd);
+
+		if (n != sizeof(pubkeyData) || pubkeyData[0] != 0x04)
+			return set_error(ctx, STB_ERR_KEY,
+					 "File \"%s\" is not in expected format (private or public key in PEM, or public key RAW)",
+					 fn);
+	}
+
+	// Remove the leading byte
+	memcpy(*key, &pubkeyData[1], sizeof(ecc_key_t));
+	return STB_OK;
+}
+
+int stb_sig_to_raw(struct stb_ctx *ctx, const unsigned char *sig, size_t len,
+		   ecc_signature_t *raw)
+{
+	const BIGNUM *sr, *ss;
+	ECDSA_SIG *signature;
+	unsigned char outbuf[2 * EC_COORDBYTES];
+	int rlen, slen;
+
+	if (len == 2 * EC_COORDBYTES) {
+		/* The signature is a p521 signature in RAW format. */
+		memcpy(*raw, sig, sizeof(ecc_signature_t));
+		return STB_OK;
+	}
+
+	/* Assume the signature is a p521 signature in DER format. Convert
+	 * the DER to a signature object, then extract the RAW. */
+	signature = d2i_ECDSA_SIG(NULL, &sig, len);
+	if (!signature)
+		return set_error(ctx, STB_ERR_SIGNATURE, "%s",
+				 "Signature is not in RAW or DER format");
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ECDSA_SIG_get0(signature, &sr, &ss);
+#else
+	sr = signature->r;
+	ss = signature->s;
+#endif
+	rlen = BN_num_bytes(sr);
+	slen = BN_num_bytes(ss);
+	if (rlen > EC_COORDBYTES || slen > EC_COORDBYTES) {
+		ECDSA_SIG_free(signature);
+		return set_error(ctx, STB_ERR_SIGNATURE, "%s",
+				 "Signature is not a P-521 signature");
+	}
+
+	memset(outbuf, 0, sizeof(outbuf));
+	BN_bn2bin(sr, &outbuf[EC_COORDBYTES - rlen]);
+	BN_bn2bin(ss, &outbuf[2 * EC_COORDBYTES - slen]);
+	memcpy(*raw, outbuf, sizeof(ecc_signature_t));
+
+	ECDSA_SIG_free(signature);
+	return STB_OK;
+}
+
+static int get_p521(struct stb_ctx *ctx)
+{
+	if (!ctx->p521) {
+		ctx->p521 = EC_GROUP_new_by_curve_name(NID_secp521r1);
+		if (!ctx->p521)
+			return set_error(ctx, STB_ERR_CRYPTO, "%s",
+					 "Cannot EC_GROUP_new_by_curve_name");
+	}
+	return STB_OK;
+}
+
+int stb_verify_ecdsa(struct stb_ctx *ctx, const unsigned char *dgst,
+		     size_t dgst_len, const ecc_signature_t sig,
+		     const ecc_key_t key, bool *good)
+{
+	unsigned char buffer[1 + sizeof(ecc_key_t)];
+	EC_KEY *ec_key = NULL;
+	EC_POINT *ec_point = NULL;
+	ECDSA_SIG *ecdsa_sig = NULL;
+	BIGNUM *r_bn, *s_bn;
+	int r = STB_OK;
+
+	*good = false;
+
+	r = get_p521(ctx);
+	if (r)
+		return r;
+
+	// Convert the raw sig to a structure that can be handled by openssl.
+	r_bn = BN_bin2bn(&sig[0], EC_COORDBYTES, NULL);
+	s_bn = BN_bin2bn(&sig[EC_COORDBYTES], EC_COORDBYTES, NULL);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ecdsa_sig = ECDSA_SIG_new();
+	if (!r_bn || !s_bn || !ecdsa_sig
+	    || !ECDSA_SIG_set0(ecdsa_sig, r_bn, s_bn)) {
+		BN_free(r_bn);
+		BN_free(s_bn);
+		r = set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot ECDSA_SIG_set0");
+		goto out;
+	}
+#else
+	ecdsa_sig = ECDSA_SIG_new();
+	if (!r_bn || !s_bn || !ecdsa_sig) {
+		BN_free(r_bn);
+		BN_free(s_bn);
+		r = set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot ECDSA_SIG_new");
+		goto out;
+	}
+	BN_free(ecdsa_sig->r);
+	BN_free(ecdsa_sig->s);
+	ecdsa_sig->r = r_bn;
+	ecdsa_sig->s = s_bn;
+#endif
+
+	// Convert the raw key, prefixed by 0x04 for uncompressed.
+	buffer[0] = 0x04;
+	memcpy(buffer + 1, key, sizeof(ecc_key_t));
+
+	ec_key = EC_KEY_new();
+	ec_point = EC_POINT_new(ctx->p521);
+	if (!ec_key || !ec_point || !EC_KEY_set_group(ec_key, ctx->p521)) {
+		r = set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot EC_KEY_new");
+		goto out;
+	}
+	if (!EC_POINT_oct2point(ctx->p521, ec_point, buffer, sizeof(buffer), NULL)
+	    || !EC_KEY_set_public_key(ec_key, ec_point)) {
+		/* Not a point on the curve, no signature verifies with it. */
+		goto out;
+	}
+
+	// Verify the signature.
+	switch (ECDSA_do_verify(dgst, dgst_len, ecdsa_sig, ec_key)) {
+	case 1:
+		*good = true;
+		break;
+	case 0:
+		break;
+	default:
+		r = set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot ECDSA_do_verify");
+	}
+
+out:
+	EC_POINT_free(ec_point);
+	EC_KEY_free(ec_key);
+	ECDSA_SIG_free(ecdsa_sig);
+	return r;
+}
+
+#ifdef ADD_DILITHIUM
+/*
+ * The mlca context of an algorithm is set up on its first verify, and kept
+ * in the stb_ctx for the next ones.
+ */
+static int mlca_verify(struct stb_ctx *ctx, mlca_ctx_t *sCtx, bool *ready,
+		       const char *alg, const unsigned char *dgst,
+		       size_t dgst_len, const uint8_t *sig, size_t sig_len,
+		       const uint8_t *key, bool *good)
+{
+	MLCA_RC sMlRc;
+
+	*good = false;
+
+	if (!*ready) {
+		sMlRc = mlca_init(sCtx, 1, 0);
+		if (sMlRc)
+			return set_error(ctx, STB_ERR_CRYPTO,
+					 "Failed mlca_init : %d", sMlRc);
+		sMlRc = mlca_set_alg(sCtx, alg, OPT_LEVEL_AUTO);
+		if (!sMlRc)
+			sMlRc = mlca_set_encoding_by_idx(sCtx, 0);
+		if (sMlRc) {
+			mlca_ctx_free(sCtx);
+			return set_error(ctx, STB_ERR_CRYPTO,
+					 "Failed to set up %s : %d", alg, sMlRc);
+		}
+		*ready = true;
+	}
+
+	*good = (mlca_sig_verify(sCtx, dgst, dgst_len, sig, sig_len, key) == 1);
+	return STB_OK;
+}
+#endif
+
+int stb_verify_dilithium(struct stb_ctx *ctx, const unsigned char *dgst,
+			 size_t dgst_len, const dilithium_signature_t sig,
+			 const dilithium_key_t key, bool *good)
+{
+#ifdef ADD_DILITHIUM
+	return mlca_verify(ctx, &ctx->dilithium, &ctx->dilithium_ready,
+			   MLCA_ALGORITHM_SIG_DILITHIUM_R2_8x7_OID, dgst, dgst_len,
+			   sig, sizeof(dilithium_signature_t), key, good);
+#else
+	(void) dgst; (void) dgst_len; (void) sig; (void) key;
+	*good = false;
+	return set_error(ctx, STB_ERR_UNSUPPORTED, "%s",
+			 "Dilithium support not built in (ADD_DILITHIUM)");
+#endif
+}
+
+int stb_verify_mldsa_87(struct stb_ctx *ctx, const unsigned char *dgst,
+			size_t dgst_len, const mldsa_signature_t sig,
+			const mldsa_key_t key, bool *good)
+{
+#ifdef ADD_DILITHIUM
+	return mlca_verify(ctx, &ctx->mldsa_87, &ctx->mldsa_87_ready,
+			   MLCA_ALGORITHM_SIG_MLDSA_87, dgst, dgst_len,
+			   sig, sizeof(mldsa_signature_t), key, good);
+#else
+	(void) dgst; (void) dgst_len; (void) sig; (void) key;
+	*good = false;
+	return set_error(ctx, STB_ERR_UNSUPPORTED, "%s",
+			 "ML-DSA-87 support not built in (ADD_DILITHIUM)");
+#endif
+}
+
+/*
+ * Go once through an ECDSA verify, failed and not, and the hashes without
+ * the arena, so that what OpenSSL sets up on first use and keeps is not
+ * allocated in it.
+ */
+static int arena_warm_up(struct stb_ctx *ctx)
+{
+	unsigned char buffer[1 + sizeof(ecc_key_t)];
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	ecc_signature_t sig;
+	bool good;
+	int r;
+
+	r = get_p521(ctx);
+	if (r)
+		return r;
+	if (EC_POINT_point2oct(ctx->p521, EC_GROUP_get0_generator(ctx->p521),
+			       POINT_CONVERSION_UNCOMPRESSED, buffer,
+			       sizeof(buffer), NULL) != sizeof(buffer))
+		return set_error(ctx, STB_ERR_CRYPTO, "%s",
+				 "Cannot EC_POINT_point2oct");
+
+	memset(md, 0, sizeof(md));
+	memset(sig, 0, sizeof(sig));
+	sig[EC_COORDBYTES - 1] = sig[sizeof(sig) - 1] = 1;
+	r = stb_verify_ecdsa(ctx, md, sizeof(md), sig, buffer + 1, &good);
+	if (!r)
+		r = stb_verify_ecdsa(ctx, md, sizeof(md), sig, ECDSA_KEY_NULL,
+				     &good);
+	if (!r && (!stb_calc_hash(HASH_ALG_SHA512, md, sizeof(md), md)
+		   || !stb_calc_hash(HASH_ALG_SHA3_512, md, sizeof(md), md)))
+		r = set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot get SHA3-512/SHA512");
+	ERR_clear_error();
+	return r;
+}
+
+int stb_ctx_set_arena(struct stb_ctx *ctx, struct stb_arena *arena)
+{
+	int r;
+
+	if (arena == ctx->arena)
+		return STB_OK;
+	if (arena) {
+		if (!hooks_installed)
+			return set_error(ctx, STB_ERR_UNSUPPORTED, "%s",
+					 "Allocation hooks not installed");
+		r = arena_warm_up(ctx);
+		if (!r)
+			r = ref_arena(ctx, arena);
+		if (r)
+			return r;
+	}
+	if (ctx->arena)
+		unref_arena(ctx->arena);
+	ctx->arena = arena;
+	return STB_OK;
+}
+
+bool stb_is_container(const void *buf, size_t size)
+{
+	const ROM_container_raw *c = (const ROM_container_raw *) buf;
+
+	if (!buf || size < SECURE_BOOT_HEADERS_SIZE)
+		return false;
+	return be32_to_cpu(c->magic_number) == ROM_MAGIC_NUMBER;
+}
+
+bool stb_is_v2_container(const void *buf, size_t size)
+{
+	const ROM_container_v2_raw *c = (const ROM_container_v2_raw *) buf;
+
+	if (!buf || size < SECURE_BOOT_HEADERS_V2_SIZE)
+		return false;
+	return be32_to_cpu(c->magic_number) == ROM_MAGIC_NUMBER
+		&& be16_to_cpu(c->version) == 2;
+}
+
+bool stb_is_v3_container(const void *buf, size_t size)
+{
+	const ROM_container_v3_raw *c = (const ROM_container_v3_raw *) buf;
+
+	if (!buf || size < SECURE_BOOT_HEADERS_V3_SIZE)
+		return false;
+	return be32_to_cpu(c->magic_number) == ROM_MAGIC_NUMBER
+		&& be16_to_cpu(c->version) == 3;
+}
+
+int parse_stb_container(const void *data, size_t len,
+			struct parsed_stb_container *c)
+{
+	const size_t prefix_data_min_size = 3 * (EC_COORDBYTES * 2);
+	const uint8_t *p = (const uint8_t *) data;
+	size_t off;
+
+	off = sizeof(ROM_container_raw) + sizeof(ROM_prefix_header_raw);
+	if (len < off)
+		return -1;
+
+	c->buf = data;
+	c->bufsz = len;
+	c->c = (const ROM_container_raw *) p;
+	c->ph = (const ROM_prefix_header_raw *) (p + sizeof(ROM_container_raw));
+
+	/* The ECID and SW key counts size the rest, keep it all in len. */
+	off += c->ph->ecid_count * ECID_SIZE;
+	c->pd = (const ROM_prefix_data_raw *) (p + off);
+	off += prefix_data_min_size + c->ph->sw_key_count * (EC_COORDBYTES * 2);
+	if (len < off + sizeof(ROM_sw_header_raw))
+		return -1;
+	c->sh = (const ROM_sw_header_raw *) (p + off);
+	off += sizeof(ROM_sw_header_raw) + c->sh->ecid_count * ECID_SIZE;
+	c->ssig = (const ROM_sw_sig_raw *) (p + off);
+	if (len < off + sizeof(ROM_sw_sig_raw))
+		return -1;
+
+	return 0;
+}
+
+int parse_stb_container_v2(const void *data, size_t len,
+			   struct parsed_stb_container_v2 *c)
+{
+	if (len < sizeof(ROM_container_v2_raw))
+		return -1;
+
+	c->buf = data;
+	c->bufsz = len;
+	c->c = (const ROM_container_v2_raw *) data;
+	c->ph = &(c->c->prefix);
+	c->pd = &(c->c->prefix_data);
+	c->sh = &(c->c->swheader);
+	c->ssig = &(c->c->sw_data);
+
+	return 0;
+}
+
+int parse_stb_container_v3(const void *data, size_t len,
+			   struct parsed_stb_container_v3 *c)
+{
+	if (len < sizeof(ROM_container_v3_raw))
+		return -1;
+
+	c->buf = data;
+	c->bufsz = len;
+	c->c = (const ROM_container_v3_raw *) data;
+	c->ph = &(c->c->prefix);
+	c->pd = &(c->c->prefix_data);
+	c->sh = &(c->c->swheader);
+	c->ssig = &(c->c->sw_data);
+
+	return 0;
+}
+
+#define FIELD(region, type, member) \
+	{ STB_REGION_##region, offsetof(type, member), sizeof(((type *) 0)->member) }
+#define NO_FIELD { 0, 0, 0 }
+#define SLOT(name, id, sig_type, key_region, key_type, key, sig_region, sig_type_, sig) \
+	{ name, id, sig_type, FIELD(key_region, key_type, key), \
+	  FIELD(sig_region, sig_type_, sig) }
+
+static const struct stb_layout layout_v1 = {
+	1, SECURE_BOOT_HEADERS_SIZE, HASH_ALG_SHA512, SIG_ALG_SHA512_ECDSA,
+	HASH_ALG_NONE, SIG_ALG_NONE, SIG_ALG_NONE,
+	{ sizeof(ROM_container_raw), sizeof(ROM_prefix_header_raw),
+	  sizeof(ROM_prefix_data_raw), sizeof(ROM_sw_header_raw),
+	  sizeof(ROM_sw_sig_raw) },
+	FIELD(HW_HDR, ROM_container_raw, magic_number),
+	FIELD(HW_HDR, ROM_container_raw, version),
+	FIELD(HW_HDR, ROM_container_raw, container_size),
+	{ STB_REGION_HW_HDR, offsetof(ROM_container_raw, hw_pkey_a),
+	  3 * sizeof(ecc_key_t) },
+	FIELD(PREFIX_HDR, ROM_prefix_header_raw, ver_alg),
+	FIELD(PREFIX_HDR, ROM_prefix_header_raw, code_start_offset),
+	FIELD(PREFIX_HDR, ROM_prefix_header_raw, flags),
+	FIELD(PREFIX_HDR, ROM_prefix_header_raw, sw_key_count),
+	FIELD(PREFIX_HDR, ROM_prefix_header_raw, payload_size),
+	FIELD(PREFIX_HDR, ROM_prefix_header_raw, payload_hash),
+	FIELD(SW_HDR, ROM_sw_header_raw, ver_alg),
+	FIELD(SW_HDR, ROM_sw_header_raw, code_start_offset),
+	FIELD(SW_HDR, ROM_sw_header_raw, reserved),
+	FIELD(SW_HDR, ROM_sw_header_raw, flags),
+	FIELD(SW_HDR, ROM_sw_header_raw, security_version),
+	FIELD(SW_HDR, ROM_sw_header_raw, payload_size),
+	FIELD(SW_HDR, ROM_sw_header_raw, payload_hash),
+	NO_FIELD,
+	NO_FIELD,
+	true,
+	3, {
+		SLOT("HW_key_A", 'a', STB_SIG_ECDSA_P521, HW_HDR, ROM_container_raw,
+		     hw_pkey_a, PREFIX_DATA, ROM_prefix_data_raw, hw_sig_a),
+		SLOT("HW_key_B", 'b', STB_SIG_ECDSA_P521, HW_HDR, ROM_container_raw,
+		     hw_pkey_b, PREFIX_DATA, ROM_prefix_data_raw, hw_sig_b),
+		SLOT("HW_key_C", 'c', STB_SIG_ECDSA_P521, HW_HDR, ROM_container_raw,
+		     hw_pkey_c, PREFIX_DATA, ROM_prefix_data_raw, hw_sig_c),
+	},
+	3, {
+		SLOT("SW_key_P", 'p', STB_SIG_ECDSA_P521, PREFIX_DATA,
+		     ROM_prefix_data_raw, sw_pkey_p, SW_SIG, ROM_sw_sig_raw, sw_sig_p),
+		SLOT("SW_key_Q", 'q', STB_SIG_ECDSA_P521, PREFIX_DATA,
+		     ROM_prefix_data_raw, sw_pkey_q, SW_SIG, ROM_sw_sig_raw, sw_sig_q),
+		SLOT("SW_key_R", 'r', STB_SIG_ECDSA_P521, PREFIX_DATA,
+		     ROM_prefix_data_raw, sw_pkey_r, SW_SIG, ROM_sw_sig_raw, sw_sig_r),
+	},
+};
+
+/*
+ * v2 and v3 only differ in their PQ algorithm, and v3 headers may also be
+ * hashed with SHA-512.
+ */
+#define LAYOUT_V2_V3(ver, size, sig_alg, alt_hash, alt_sig, pure_sig, pq_type, pq_key_t, c_t, ph_t, pd_t, sh_t, ss_t) { \
+	ver, size, HASH_ALG_SHA3_512, sig_alg, alt_hash, alt_sig, pure_sig, \
+	{ offsetof(c_t, prefix), sizeof(ph_t), sizeof(pd_t), sizeof(sh_t), \
+	  sizeof(ss_t) }, \
+	FIELD(HW_HDR, c_t, magic_number), \
+	FIELD(HW_HDR, c_t, version), \
+	FIELD(HW_HDR, c_t, container_size), \
+	{ STB_REGION_HW_HDR, offsetof(c_t, hw_pkey_a), \
+	  sizeof(ecc_key_t) + sizeof(pq_key_t) }, \
+	FIELD(PREFIX_HDR, ph_t, ver_alg), \
+	NO_FIELD, \
+	FIELD(PREFIX_HDR, ph_t, flags), \
+	FIELD(PREFIX_HDR, ph_t, sw_key_count), \
+	FIELD(PREFIX_HDR, ph_t, payload_size), \
+	FIELD(PREFIX_HDR, ph_t, payload_hash), \
+	FIELD(SW_HDR, sh_t, ver_alg), \
+	NO_FIELD, \
+	FIELD(SW_HDR, sh_t, component_id), \
+	FIELD(SW_HDR, sh_t, flags), \
+	FIELD(SW_HDR, sh_t, security_version), \
+	FIELD(SW_HDR, sh_t, payload_size), \
+	FIELD(SW_HDR, sh_t, payload_hash), \
+	FIELD(SW_HDR, sh_t, unprotected_payload_size), \
+	FIELD(SW_HDR, sh_t, ecid), \
+	false, \
+	2, { \
+		SLOT("HW_key_A", 'a', STB_SIG_ECDSA_P521, HW_HDR, c_t, hw_pkey_a, \
+		     PREFIX_DATA, pd_t, hw_sig_a), \
+		SLOT("HW_key_D", 'd', pq_type, HW_HDR, c_t, hw_pkey_d, \
+		     PREFIX_DATA, pd_t, hw_sig_d), \
+	}, \
+	2, { \
+		SLOT("SW_key_P", 'p', STB_SIG_ECDSA_P521, PREFIX_DATA, pd_t, \
+		     sw_pkey_p, SW_SIG, ss_t, sw_sig_p), \
+		SLOT("SW_key_S", 's', pq_type, PREFIX_DATA, pd_t, sw_pkey_s, \
+		     SW_SIG, ss_t, sw_sig_s), \
+	}, \
+}
+
+static const struct stb_layout layout_v2 =
+	LAYOUT_V2_V3(2, SECURE_BOOT_HEADERS_V2_SIZE, SIG_ALG_SHA3_512_ECDSA_DIL,
+		     HASH_ALG_NONE, SIG_ALG_NONE, SIG_ALG_NONE,
+		     STB_SIG_DILITHIUM_R2_8x7, dilithium_key_t, ROM_container_v2_raw,
+		     ROM_prefix_header_v2_raw, ROM_prefix_data_v2_raw,
+		     ROM_sw_header_v2_raw, ROM_sw_sig_v2_raw);
+
+static const struct stb_layout layout_v3 =
+	LAYOUT_V2_V3(3, SECURE_BOOT_HEADERS_V3_SIZE, SIG_ALG_SHA3_512_ECDSA_MLDSA,
+		     HASH_ALG_SHA512, SIG_ALG_SHA512_ECDSA_MLDSA,
+		     SIG_ALG_SHA512_ECDSA_MLDSA_PURE_MODE,
+		     STB_SIG_MLDSA_87, mldsa_key_t, ROM_container_v3_raw,
+		     ROM_prefix_header_v3_raw, ROM_prefix_data_v3_raw,
+		     ROM_sw_header_v3_raw, ROM_sw_sig_v3_raw);
+
+const struct stb_layout *stb_layout(int version)
+{
+	switch (version) {
+	case 1:
+		return &layout_v1;
+	case 2:
+		return &layout_v2;
+	case 3:
+		return &layout_v3;
+	default:
+		return NULL;
+	}
+}
+
+size_t stb_header_size(int version)
+{
+	const struct stb_layout *l = stb_layout(version);
+
+	return l ? l->header_size : 0;
+}
+
+const uint8_t *stb_field_ptr(const struct stb_container *c,
+			     const struct stb_field *f)
+{
+	return c->region[f->region] + f->offset;
+}
+
+uint64_t stb_field_be64(const struct stb_container *c,
+			const struct stb_field *f)
+{
+	be64 value;
+
+	memcpy(&value, stb_field_ptr(c, f), sizeof(value));
+	return be64_to_cpu(value);
+}
+
+bool stb_sw_slot_used(const struct stb_container *c, int i)
+{
+	const struct stb_layout *l = c->layout;
+
+	if (i >= l->sw_slot_count)
+		return false;
+	if (l->sw_keys_counted)
+		return i < *stb_field_ptr(c, &l->sw_key_count);
+	return memcmp(stb_field_ptr(c, &l->sw_slots[i].key), ECDSA_KEY_NULL,
+		      sizeof(ecc_key_t));
+}
+
+#define SET_REGIONS(c, p) do { \
+	(c)->region[STB_REGION_HW_HDR] = (const uint8_t *) (p)->c; \
+	(c)->region[STB_REGION_PREFIX_HDR] = (const uint8_t *) (p)->ph; \
+	(c)->region[STB_REGION_PREFIX_DATA] = (const uint8_t *) (p)->pd; \
+	(c)->region[STB_REGION_SW_HDR] = (const uint8_t *) (p)->sh; \
+	(c)->region[STB_REGION_SW_SIG] = (const uint8_t *) (p)->ssig; \
+} while (0)
+
+int stb_parse(struct stb_ctx *ctx, const void *buf, size_t size,
+	      struct stb_container *c)
+{
+	memset(c, 0, sizeof(*c));
+
+	if (!stb_is_container(buf, size))
+		return set_error(ctx, STB_ERR_FORMAT, "%s",
+				 "Not a container, missing magic number");
+
+	if (stb_is_v3_container(buf, size)) {
+		const ROM_version_raw *va;
+
+		c->version = 3;
+		if (parse_stb_container_v3(buf, SECURE_BOOT_HEADERS_V3_SIZE, &c->v3))
+			return set_error(ctx, STB_ERR_FORMAT, "%s",
+					 "Failed to parse container");
+
+		va = &c->v3.ph->ver_alg;
+		if ((va->hash_alg == HASH_ALG_SHA512 &&
+		     va->sig_alg != SIG_ALG_SHA512_ECDSA_MLDSA &&
+		     va->sig_alg != SIG_ALG_SHA512_ECDSA_MLDSA_PURE_MODE) ||
+		    (va->hash_alg == HASH_ALG_SHA3_512 &&
+		     va->sig_alg != SIG_ALG_SHA3_512_ECDSA_MLDSA))
+			return set_error(ctx, STB_ERR_FORMAT,
+					 "There's an inconsistency between the hash used by "
+					 "hash_alg '%u' and sig_alg '%u'",
+					 va->hash_alg, va->sig_alg);
+		if (va->hash_alg != HASH_ALG_SHA512
+		    && va->hash_alg != HASH_ALG_SHA3_512)
+			return set_error(ctx, STB_ERR_UNSUPPORTED,
+					 "Unsupported hash_alg '%u'", va->hash_alg);
+
+		c->hash_alg = va->hash_alg;
+		c->mldsa_pure_mode =
+			(va->sig_alg == SIG_ALG_SHA512_ECDSA_MLDSA_PURE_MODE);
+	} else if (stb_is_v2_container(buf, size)) {
+		c->version = 2;
+		c->hash_alg = HASH_ALG_SHA3_512;
+		if (parse_stb_container_v2(buf, SECURE_BOOT_HEADERS_V2_SIZE, &c->v2))
+			return set_error(ctx, STB_ERR_FORMAT, "%s",
+					 "Failed to parse container");
+	} else {
+		c->version = 1;
+		c->hash_alg = HASH_ALG_SHA512;
+		if (parse_stb_container(buf, SECURE_BOOT_HEADERS_SIZE, &c->v1))
+			return set_error(ctx, STB_ERR_FORMAT, "%s",
+					 "Failed to parse container");
+	}
+
+	c->layout = stb_layout(c->version);
+	switch (c->version) {
+	case 1:
+		SET_REGIONS(c, &c->v1);
+		break;
+	case 2:
+		SET_REGIONS(c, &c->v2);
+		break;
+	default:
+		SET_REGIONS(c, &c->v3);
+		break;
+	}
+	return STB_OK;
+}
+
+static const char *hash_name(uint8_t hash_alg)
+{
+	switch (hash_alg) {
+	case HASH_ALG_SHA512:
+		return "SHA-512";
+	case HASH_ALG_SHA3_512:
+		return "SHA3-512";
+	default:
+		return "none";
+	}
+}
+
+int stb_build_init(struct stb_ctx *ctx, struct stb_container *c, void *hdr,
+		   int version, uint8_t hash_alg, bool mldsa_pure_mode)
+{
+	const struct stb_layout *l = stb_layout(version);
+	ROM_version_raw va;
+	int r;
+
+	memset(c, 0, sizeof(*c));
+	if (!l)
+		return set_error(ctx, STB_ERR_UNSUPPORTED,
+				 "Unsupported container version %d", version);
+
+	if (hash_alg == HASH_ALG_NONE)
+		hash_alg = l->hash_alg;
+	if (hash_alg == l->hash_alg) {
+		va.sig_alg = l->sig_alg;
+	} else if (hash_alg == l->alt_hash_alg) {
+		va.sig_alg = l->alt_sig_alg;
+	} else if (l->alt_hash_alg == HASH_ALG_NONE) {
+		return set_error(ctx, STB_ERR_UNSUPPORTED,
+				 "Only %s is supported for container version %d",
+				 hash_name(l->hash_alg), version);
+	} else {
+		return set_error(ctx, STB_ERR_UNSUPPORTED,
+				 "Unsupported hash_alg '%u'", hash_alg);
+	}
+	if (mldsa_pure_mode) {
+		if (l->pure_sig_alg == SIG_ALG_NONE)
+			return set_error(ctx, STB_ERR_UNSUPPORTED,
+					 "No ML-DSA pure mode in container version %d",
+					 version);
+		if (hash_alg != l->alt_hash_alg)
+			return set_error(ctx, STB_ERR_UNSUPPORTED,
+					 "ML-DSA signing in pure mode is only supported "
+					 "when %s is used", hash_name(l->alt_hash_alg));
+		va.sig_alg = l->pure_sig_alg;
+	}
+	va.version = cpu_to_be16(version);
+	va.hash_alg = hash_alg;
+
+	memset(hdr, 0, l->header_size);
+	c->version = version;
+	c->hash_alg = hash_alg;
+	c->mldsa_pure_mode = mldsa_pure_mode;
+	c->layout = l;
+	c->region[STB_REGION_HW_HDR] = (const uint8_t *) hdr;
+	c->region[STB_REGION_PREFIX_HDR] = c->region[STB_REGION_HW_HDR]
+		+ l->region_size[STB_REGION_HW_HDR];
+	c->region[STB_REGION_PREFIX_DATA] = c->region[STB_REGION_PREFIX_HDR]
+		+ l->region_size[STB_REGION_PREFIX_HDR];
+
+	r = stb_build_set(ctx, c, &l->magic, ROM_MAGIC_NUMBER);
+	if (!r)
+		r = stb_build_set(ctx, c, &l->hdr_version, version);
+	if (r)
+		return r;
+	memcpy(stb_build_field(c, &l->prefix_ver_alg), &va, sizeof(va));
+	return STB_OK;
+}
+
+uint8_t *stb_build_field(struct stb_container *c, const struct stb_field *f)
+{
+	if (!f->size || !c->region[f->region])
+		return NULL;
+	return (uint8_t *) stb_field_ptr(c, f);
+}
+
+int stb_build_set(struct stb_ctx *ctx, struct stb_container *c,
+		  const struct stb_field *f, uint64_t value)
+{
+	uint8_t *p = stb_build_field(c, f);
+	int i;
+
+	if (!p || f->size > sizeof(value))
+		return set_error(ctx, STB_ERR_INVALID, "%s",
+				 "No such field in the container");
+	if (f->size < sizeof(value) && value >> (8 * f->size))
+		return set_error(ctx, STB_ERR_INVALID,
+				 "Value %#llx too large for its %u byte field",
+				 (unsigned long long) value, f->size);
+	for (i = f->size - 1; i >= 0; i--, value >>= 8)
+		p[i] = value & 0xff;
+	return STB_OK;
+}
+
+static bool is_zero(const uint8_t *p, size_t len)
+{
+	while (len && !*p) {
+		p++;
+		len--;
+	}
+	return !len;
+}
+
+int stb_build_sw_keys(struct stb_ctx *ctx, struct stb_container *c)
+{
+	const struct stb_layout *l = c->layout;
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	const uint8_t *keys, *sw;
+	uint64_t size = 0;
+	int i, n = 0, r;
+
+	for (i = 0; i < l->sw_slot_count; i++) {
+		if (is_zero(stb_field_ptr(c, &l->sw_slots[i].key),
+			    l->sw_slots[i].key.size))
+			continue;
+		// Only the first sw_key_count slots are in v1 containers.
+		if (l->sw_keys_counted && n < i)
+			return set_error(ctx, STB_ERR_INVALID,
+					 "SW key %c without SW key %c",
+					 toupper(l->sw_slots[i].id),
+					 toupper(l->sw_slots[n].id));
+		size += l->sw_slots[i].key.size;
+		n++;
+	}
+
+	r = stb_build_set(ctx, c, &l->sw_key_count, n);
+	if (!r)
+		r = stb_build_set(ctx, c, &l->sw_keys_size, size);
+	if (r)
+		return r;
+	keys = stb_field_ptr(c, &l->sw_slots[0].key);
+	if (!stb_calc_hash(c->hash_alg, keys, size, md))
+		return set_error(ctx, STB_ERR_CRYPTO, "%s",
+				 "Cannot hash the SW keys");
+	memcpy(stb_build_field(c, &l->sw_keys_hash), md, l->sw_keys_hash.size);
+
+	// In v1 the SW header follows the keys in use, not the slots.
+	if (l->sw_keys_counted)
+		sw = keys + size;
+	else
+		sw = c->region[STB_REGION_PREFIX_DATA]
+			+ l->region_size[STB_REGION_PREFIX_DATA];
+	c->region[STB_REGION_SW_HDR] = sw;
+	c->region[STB_REGION_SW_SIG] = sw + l->region_size[STB_REGION_SW_HDR];
+	memcpy(stb_build_field(c, &l->sw_ver_alg),
+	       stb_field_ptr(c, &l->prefix_ver_alg), l->sw_ver_alg.size);
+	return STB_OK;
+}
+
+int stb_build_sizes(struct stb_ctx *ctx, struct stb_container *c,
+		    uint64_t payload_size, uint64_t unprotected_size)
+{
+	const struct stb_layout *l = c->layout;
+	int r;
+
+	if (unprotected_size && !l->unprotected_size.size)
+		return set_error(ctx, STB_ERR_UNSUPPORTED,
+				 "No unprotected payload in container version %d",
+				 c->version);
+
+	r = stb_build_set(ctx, c, &l->container_size,
+			  l->header_size + payload_size + unprotected_size);
+	if (!r)
+		r = stb_build_set(ctx, c, &l->payload_size, payload_size);
+	if (!r && unprotected_size)
+		r = stb_build_set(ctx, c, &l->unprotected_size, unprotected_size);
+	return r;
+}
+
+int stb_hash_region(struct stb_ctx *ctx, const struct stb_container *c,
+		    int region, unsigned char *md)
+{
+	if ((region != STB_REGION_PREFIX_HDR && region != STB_REGION_SW_HDR)
+	    || !c->region[region])
+		return set_error(ctx, STB_ERR_INVALID, "%s",
+				 "Only the prefix and SW headers are hashed");
+	if (!stb_calc_hash(c->hash_alg, c->region[region],
+			   c->layout->region_size[region], md))
+		return set_error(ctx, STB_ERR_CRYPTO, "Cannot get %s",
+				 hash_name(c->hash_alg));
+	return STB_OK;
+}
+
+static struct stb_sig_check *add_check(struct stb_sig_check *checks, int *count,
+				       const char *name, int type,
+				       const uint8_t *key, const uint8_t *sig)
+{
+	struct stb_sig_check *k = &checks[(*count)++];
+
+	k->name = name;
+	k->type = type;
+	k->result = STB_CHECK_SKIPPED;
+	k->key = key;
+	k->sig = sig;
+	return k;
+}
+
+/* Verify the signature of a check over dgst, unless its key is NULL. */
+static int run_check(struct stb_ctx *ctx, struct stb_sig_check *k,
+		     const unsigned char *dgst, size_t dgst_len)
+{
+	bool good = false;
+	int r;
+
+	if (!memcmp(k->key, ECDSA_KEY_NULL, sizeof(ecc_key_t)))
+		return STB_OK;
+
+	switch (k->type) {
+	case STB_SIG_ECDSA_P521:
+		r = stb_verify_ecdsa(ctx, dgst, dgst_len, k->sig, k->key, &good);
+		break;
+	case STB_SIG_DILITHIUM_R2_8x7:
+		r = stb_verify_dilithium(ctx, dgst, dgst_len, k->sig, k->key, &good);
+		break;
+	case STB_SIG_MLDSA_87:
+		r = stb_verify_mldsa_87(ctx, dgst, dgst_len, k->sig, k->key, &good);
+		break;
+	default:
+		return set_error(ctx, STB_ERR_INVALID, "Unknown signature type %d",
+				 k->type);
+	}
+	if (r)
+		return r;
+	k->result = good ? STB_CHECK_PASSED : STB_CHECK_FAILED;
+	return STB_OK;
+}
+
+static bool checks_passed(const struct stb_sig_check *checks, int count)
+{
+	for (int i = 0; i < count; i++)
+		if (checks[i].result == STB_CHECK_FAILED)
+			return false;
+	return true;
+}
+
+/* Where validate() gets the payload, or its hash, from. */
+struct payload_src {
+	int fd;				/* the container file, or -1 */
+	uint64_t off;			/* of the payload in the file */
+	const void *data;		/* the payload, mapped or in memory */
+	size_t size;
+	const unsigned char *md;	/* or its hash, computed by the caller */
+};
+
+uint64_t stb_payload_hashed(const struct stb_container *c,
+			    uint64_t payload_size, bool ignore_remainder)
+{
+	const struct stb_layout *l = c->layout;
+	uint64_t unprotected = 0;
+
+	if (l->unprotected_size.size)
+		unprotected = stb_field_be64(c, &l->unprotected_size);
+	if (unprotected <= payload_size)
+		payload_size -= unprotected;
+	if (ignore_remainder)
+		payload_size = min(payload_size, stb_field_be64(c, &l->payload_size));
+	return payload_size;
+}
+
+static int validate(struct stb_ctx *ctx, const struct stb_container *c,
+		    const struct payload_src *p, bool ignore_remainder,
+		    struct stb_validation *v)
+{
+	const struct stb_layout *l = c->layout;
+	const struct stb_slot *slot;
+	const uint8_t *ph, *sh, *sw_keys;
+	size_t ph_sz, sh_sz, sw_keys_sz = 0, payload_size;
+	const uint8_t *sw_hdr_payload_hash, *ph_payload_hash;
+	struct stb_sig_check *k;
+	int r, i;
+
+	memset(v, 0, sizeof(*v));
+
+	if (!l)
+		return set_error(ctx, STB_ERR_INVALID, "Invalid container version : %d",
+				 c->version);
+
+	ph = c->region[STB_REGION_PREFIX_HDR];
+	ph_sz = l->region_size[STB_REGION_PREFIX_HDR];
+	sh = c->region[STB_REGION_SW_HDR];
+	sh_sz = l->region_size[STB_REGION_SW_HDR];
+	sw_keys = stb_field_ptr(c, &l->sw_slots[0].key);
+	sw_hdr_payload_hash = stb_field_ptr(c, &l->payload_hash);
+	ph_payload_hash = stb_field_ptr(c, &l->sw_keys_hash);
+	v->payload_size_expected = stb_field_be64(c, &l->payload_size);
+
+	for (slot = l->hw_slots; slot < l->hw_slots + l->hw_slot_count; slot++)
+		add_check(v->hw_sigs, &v->hw_sig_count, slot->name, slot->type,
+			  stb_field_ptr(c, &slot->key), stb_field_ptr(c, &slot->sig));
+
+	// v1 checks the SW keys it counts, v2 and v3 all of them.
+	for (i = 0; i < l->sw_slot_count; i++) {
+		slot = &l->sw_slots[i];
+		if (l->sw_keys_counted && !stb_sw_slot_used(c, i))
+			break;
+		add_check(v->sw_sigs, &v->sw_sig_count, slot->name, slot->type,
+			  stb_field_ptr(c, &slot->key), stb_field_ptr(c, &slot->sig));
+		if (!l->sw_keys_counted && stb_sw_slot_used(c, i))
+			sw_keys_sz += slot->key.size;
+	}
+	if (l->sw_keys_counted)
+		sw_keys_sz = l->sw_slots[0].key.size
+			* *stb_field_ptr(c, &l->sw_key_count);
+
+	// Prefix header hash, signed by the HW keys.
+	if (!stb_calc_hash(c->hash_alg, ph, ph_sz, v->prefix_hdr_hash))
+		return set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot get SHA3-512/SHA512");
+	for (k = v->hw_sigs; k < v->hw_sigs + v->hw_sig_count; k++) {
+		if (c->mldsa_pure_mode && k->type == STB_SIG_MLDSA_87)
+			r = run_check(ctx, k, ph, ph_sz);
+		else
+			r = run_check(ctx, k, v->prefix_hdr_hash, SHA512_DIGEST_LENGTH);
+		if (r)
+			return r;
+	}
+
+	// SW header hash, signed by the SW keys.
+	if (!stb_calc_hash(c->hash_alg, sh, sh_sz, v->sw_hdr_hash))
+		return set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot get SHA3-512/SHA512");
+	for (k = v->sw_sigs; k < v->sw_sigs + v->sw_sig_count; k++) {
+		if (c->mldsa_pure_mode && k->type == STB_SIG_MLDSA_87)
+			r = run_check(ctx, k, sh, sh_sz);
+		else
+			r = run_check(ctx, k, v->sw_hdr_hash, SHA512_DIGEST_LENGTH);
+		if (r)
+			return r;
+	}
+
+	// Payload hash, in the SW header. The unprotected payload, at the end
+	// in v2 and v3, is not hashed.
+	if (l->unprotected_size.size)
+		v->unprotected_size = stb_field_be64(c, &l->unprotected_size);
+	v->payload_size_actual = stb_payload_hashed(c, p->size, false);
+	payload_size = stb_payload_hashed(c, p->size, ignore_remainder);
+	if (p->md)
+		memcpy(v->payload_hash, p->md, SHA512_DIGEST_LENGTH);
+	else if (p->fd < 0 ? !stb_calc_hash(c->hash_alg, p->data, payload_size,
+					    v->payload_hash)
+		 : !stb_calc_hash_file(ctx, c->hash_alg, p->fd, p->off,
+				       p->data, payload_size, v->payload_hash,
+				       &v->payload_holes))
+		return set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot get SHA3-512/SHA512");
+	v->payload_hash_ok = !memcmp(sw_hdr_payload_hash, v->payload_hash,
+				     SHA512_DIGEST_LENGTH)
+		&& (ignore_remainder || payload_size == v->payload_size_expected);
+
+	// SW keys hash, in the prefix header.
+	if (!stb_calc_hash(c->hash_alg, sw_keys, sw_keys_sz, v->sw_keys_hash))
+		return set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot get SHA3-512/SHA512");
+	v->sw_keys_hash_ok = !memcmp(ph_payload_hash, v->sw_keys_hash,
+				     SHA512_DIGEST_LENGTH);
+
+	v->valid = checks_passed(v->hw_sigs, v->hw_sig_count)
+		&& checks_passed(v->sw_sigs, v->sw_sig_count)
+		&& v->payload_hash_ok && v->sw_keys_hash_ok;
+	return STB_OK;
+}
+
+static int validate_in_arena(struct stb_ctx *ctx,
+			     const struct stb_container *c,
+			     const struct payload_src *p, bool ignore_remainder,
+			     struct stb_validation *v)
+{
+	int r;
+
+	if (!ctx->arena)
+		return validate(ctx, c, p, ignore_remainder, v);
+
+	/* What OpenSSL queues on errors, it allocates: drop it before leaving. */
+	stb_arena_reset(ctx->arena);
+	thread_arena = ctx->arena;
+	arena_active = true;
+	ERR_set_mark();
+	r = validate(ctx, c, p, ignore_remainder, v);
+	ERR_pop_to_mark();
+	arena_active = false;
+	thread_arena = NULL;
+	return r;
+}
+
+int stb_validate(struct stb_ctx *ctx, const struct stb_container *c,
+		 const void *payload, size_t payload_size,
+		 bool ignore_remainder, struct stb_validation *v)
+{
+	struct payload_src p = { -1, 0, payload, payload_size, NULL };
+
+	return validate_in_arena(ctx, c, &p, ignore_remainder, v);
+}
+
+int stb_validate_file(struct stb_ctx *ctx, const struct stb_container *c,
+		      int fd, uint64_t off, const void *payload,
+		      size_t payload_size, bool ignore_remainder,
+		      struct stb_validation *v)
+{
+	struct payload_src p = { fd, off, payload, payload_size, NULL };
+
+	return validate_in_arena(ctx, c, &p, ignore_remainder, v);
+}
+
+int stb_validate_digest(struct stb_ctx *ctx, const struct stb_container *c,
+			const unsigned char *payload_md, uint64_t payload_size,
+			bool ignore_remainder, struct stb_validation *v)
+{
+	struct payload_src p = { -1, 0, NULL, (size_t) payload_size,
+				 payload_md };
+
+	return validate_in_arena(ctx, c, &p, ignore_remainder, v);
+}
+
+int stb_hw_keys_hash(struct stb_ctx *ctx, const struct stb_container *c,
+		     unsigned char *md)
+{
+	if (!c->layout)
+		return set_error(ctx, STB_ERR_INVALID, "Invalid container version : %d",
+				 c->version);
+	if (!stb_calc_hash(c->hash_alg, stb_field_ptr(c, &c->layout->hw_keys),
+			   c->layout->hw_keys.size, md))
+		return set_error(ctx, STB_ERR_CRYPTO, "%s", "Cannot get SHA3-512/SHA512");
+	return STB_OK;
+}
@@ -0,0 +1,453 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libstbcontainer: build, parse, validate and verify secure boot containers.
+ *
+ * The library keeps no global state, but for the optional allocation hooks
+ * below: everything a call needs is passed in, or held in a struct stb_ctx,
+ * which also records the message of the last error. A context must not be
+ * used by two threads at the same time, but any number of contexts may be
+ * used concurrently.
+ *
+ * Functions return STB_OK or one of the STB_ERR_* codes below, and never
+ * exit the process or print. A container that fails validation is not an
+ * error: the result of each check is returned in struct stb_validation.
+ *
+ * Dilithium and ML-DSA-87 signatures (v2 and v3 containers) are only
+ * checked when the library is built with ADD_DILITHIUM.
+ */
+
+#ifndef __LIBSTBCONTAINER_H
+#define __LIBSTBCONTAINER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "container.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum stb_error {
+	STB_OK = 0,
+	STB_ERR_INVALID,	/* invalid argument */
+	STB_ERR_NOMEM,		/* out of memory */
+	STB_ERR_IO,		/* cannot open, read or write a file */
+	STB_ERR_FORMAT,		/* not a container, or malformed */
+	STB_ERR_UNSUPPORTED,	/* version or algorithm not supported */
+	STB_ERR_CRYPTO,		/* failure in the crypto library */
+	STB_ERR_KEY,		/* key not in a supported format */
+	STB_ERR_SIGNATURE,	/* signature not in a supported format */
+};
+
+struct stb_ctx;
+
+struct stb_ctx *stb_ctx_new(void);
+void stb_ctx_free(struct stb_ctx *ctx);
+
+/* Message of the last error returned with this context. */
+const char *stb_ctx_error(const struct stb_ctx *ctx);
+const char *stb_strerror(int err);
+
+/* The sysexits.h status matching an error, for command line tools. */
+int stb_sysexit(int err);
+
+/*
+ * Hash with HASH_ALG_SHA512 or HASH_ALG_SHA3_512 into md, which must hold
+ * SHA512_DIGEST_LENGTH bytes. Returns md, or NULL if the algorithm is not
+ * supported.
+ */
+unsigned char *stb_calc_hash(uint8_t hash_alg, const void *data, size_t len,
+			     unsigned char *md);
+
+/*
+ * The same hash, of data given a piece at a time: stb_hash_final() writes
+ * it to md and frees h. stb_hash_new() returns NULL if the algorithm is not
+ * supported, or on failure.
+ */
+struct stb_hash;
+struct stb_hash *stb_hash_new(uint8_t hash_alg);
+bool stb_hash_update(struct stb_hash *h, const void *data, size_t len);
+unsigned char *stb_hash_final(struct stb_hash *h, unsigned char *md);
+
+/*
+ * Whether the file fd holds data at pos, rather than a hole, and where that
+ * extent ends in *next, at most end. Without SEEK_DATA and SEEK_HOLE, all of
+ * a file is data.
+ */
+bool stb_file_extent(int fd, uint64_t pos, uint64_t end, uint64_t *next);
+
+/*
+ * stb_calc_hash() of the len bytes of the file fd at off, which a sparse
+ * file may have holes in: these are hashed from zeros, without reading or
+ * faulting them in. The data is hashed from data, the file mapped from off,
+ * or read if NULL, as the I/O strategy of ctx has it (see stb_io_parse()
+ * below). The bytes of holes are returned in *holes, if not NULL.
+ */
+unsigned char *stb_calc_hash_file(struct stb_ctx *ctx, uint8_t hash_alg,
+				  int fd, uint64_t off, const void *data,
+				  size_t len, unsigned char *md, uint64_t *holes);
+
+/*
+ * Whether the len bytes of the file fd_a at off_a are those of fd_b at off_b.
+ * They are not read when they are the same bytes of the same file, or the
+ * same blocks on disk, as those of a reflinked copy are; else they are
+ * compared.
+ */
+bool stb_same_data(int fd_a, uint64_t off_a, int fd_b, uint64_t off_b,
+		   uint64_t len);
+
+/*
+ * How stb_calc_hash_file() reads the data of a file, for a context:
+ *   mmap      the mapping given, as it is, else plain reads
+ *   madvise   the mapping given, with MADV_SEQUENTIAL and MADV_HUGEPAGE
+ *   populate  mapped a window at a time with MAP_POPULATE
+ *   fadvise   read, with POSIX_FADV_SEQUENTIAL and a POSIX_FADV_WILLNEED
+ *             window or two ahead
+ *   direct    read with O_DIRECT, into an aligned buffer, around the page
+ *             cache
+ *   uring     read through io_uring, a window of reads in flight while
+ *             the chunks read are hashed (Linux), else as fadvise
+ *   auto      by size: mmap for small files, madvise then fadvise
+ * A strategy the system lacks falls back to plain reads. stb_io_parse()
+ * takes a "<strategy>[,<window>]" spec, the window of populate, fadvise and
+ * uring in bytes with a K, M or G suffix (0 if not given, for the default
+ * 8M), and returns -1 if it is not one. stb_ctx_set_io() sets the strategy
+ * and window of a context, auto and 8M when it is created, and
+ * stb_io_choose() is the strategy it uses for len bytes, mapped or not.
+ */
+enum stb_io {
+	STB_IO_AUTO,
+	STB_IO_MMAP,
+	STB_IO_MADVISE,
+	STB_IO_POPULATE,
+	STB_IO_FADVISE,
+	STB_IO_DIRECT,
+	STB_IO_URING,
+	STB_IO_COUNT,
+};
+
+int stb_io_parse(const char *spec, size_t *window);
+const char *stb_io_name(int io);
+int stb_ctx_set_io(struct stb_ctx *ctx, int io, size_t window);
+int stb_io_choose(const struct stb_ctx *ctx, uint64_t len, bool mapped);
+
+/* Read a file into data, *len is the size of data in, of the file out. */
+int stb_read_file(struct stb_ctx *ctx, const char *fn, void *data, size_t *len);
+
+/* The raw P-521 public key of a PEM private or public key, or RAW key. */
+int stb_get_public_key_raw(struct stb_ctx *ctx, const char *fn, ecc_key_t *key);
+
+/* Convert a P-521 signature, in RAW or DER format, to RAW. */
+int stb_sig_to_raw(struct stb_ctx *ctx, const unsigned char *sig, size_t len,
+		   ecc_signature_t *raw);
+
+/* Verify a signature, *good tells whether it verified. */
+int stb_verify_ecdsa(struct stb_ctx *ctx, const unsigned char *dgst,
+		     size_t dgst_len, const ecc_signature_t sig,
+		     const ecc_key_t key, bool *good);
+int stb_verify_dilithium(struct stb_ctx *ctx, const unsigned char *dgst,
+			 size_t dgst_len, const dilithium_signature_t sig,
+			 const dilithium_key_t key, bool *good);
+int stb_verify_mldsa_87(struct stb_ctx *ctx, const unsigned char *dgst,
+			size_t dgst_len, const mldsa_signature_t sig,
+			const mldsa_key_t key, bool *good);
+
+bool stb_is_container(const void *buf, size_t size);
+bool stb_is_v2_container(const void *buf, size_t size);
+bool stb_is_v3_container(const void *buf, size_t size);
+
+int parse_stb_container(const void *data, size_t len,
+			struct parsed_stb_container *c);
+int parse_stb_container_v2(const void *data, size_t len,
+			   struct parsed_stb_container_v2 *c);
+int parse_stb_container_v3(const void *data, size_t len,
+			   struct parsed_stb_container_v3 *c);
+
+/* Size of the container header of a version, the payload follows it. */
+size_t stb_header_size(int version);
+
+enum stb_sig_type {
+	STB_SIG_ECDSA_P521 = 0,
+	STB_SIG_DILITHIUM_R2_8x7,
+	STB_SIG_MLDSA_87,
+};
+
+#define STB_MAX_SIGS	3
+
+/*
+ * Container layouts. Each version is described by a table of its regions,
+ * of the fields the tools use and of its key and signature slots, and the
+ * code that builds, prints, validates and verifies containers walks these
+ * tables rather than the raw structs of each version.
+ *
+ * Fields are at an offset in their region. In v1 containers the regions
+ * after the prefix header move with the ECID and SW key counts, so a parsed
+ * container records where each region starts.
+ */
+enum stb_region {
+	STB_REGION_HW_HDR = 0,
+	STB_REGION_PREFIX_HDR,
+	STB_REGION_PREFIX_DATA,
+	STB_REGION_SW_HDR,
+	STB_REGION_SW_SIG,
+	STB_REGION_COUNT,
+};
+
+struct stb_field {
+	uint8_t region;		/* enum stb_region */
+	uint16_t offset;
+	uint16_t size;		/* 0 if the version has no such field */
+};
+
+struct stb_slot {
+	const char *name;	/* "HW_key_A", ... */
+	char id;		/* 'a', ..., as in the tool options */
+	int type;		/* enum stb_sig_type */
+	struct stb_field key;
+	struct stb_field sig;
+};
+
+struct stb_layout {
+	int version;
+	size_t header_size;
+	uint8_t hash_alg;	/* unless the prefix header has its own */
+	uint8_t sig_alg;
+	uint8_t alt_hash_alg;	/* the other hash it may use, or NONE */
+	uint8_t alt_sig_alg;	/* with alt_hash_alg */
+	uint8_t pure_sig_alg;	/* with alt_hash_alg, in ML-DSA pure mode */
+	uint16_t region_size[STB_REGION_COUNT];	/* without the ECIDs */
+	struct stb_field magic;		/* HW header */
+	struct stb_field hdr_version;	/* HW header */
+	struct stb_field container_size;	/* HW header */
+	struct stb_field hw_keys;	/* all of them, hashed to verify */
+	struct stb_field prefix_ver_alg;	/* prefix header */
+	struct stb_field hw_code_start;	/* prefix header, v1 only */
+	struct stb_field hw_flags;	/* prefix header */
+	struct stb_field sw_key_count;	/* prefix header */
+	struct stb_field sw_keys_size;	/* prefix header payload_size */
+	struct stb_field sw_keys_hash;	/* prefix header payload_hash */
+	struct stb_field sw_ver_alg;	/* SW header */
+	struct stb_field sw_code_start;	/* SW header, v1 only */
+	struct stb_field component_id;	/* SW header, reserved in v1 */
+	struct stb_field sw_flags;	/* SW header */
+	struct stb_field security_version;	/* SW header */
+	struct stb_field payload_size;	/* SW header */
+	struct stb_field payload_hash;	/* SW header */
+	struct stb_field unprotected_size;	/* SW header */
+	struct stb_field fw_ecid;	/* SW header, not in v1 */
+	bool sw_keys_counted;	/* the first sw_key_count SW slots are used,
+				   else those with a key */
+	int hw_slot_count;
+	struct stb_slot hw_slots[STB_MAX_SIGS];
+	int sw_slot_count;
+	struct stb_slot sw_slots[STB_MAX_SIGS];
+};
+
+/* The layout of a container version, NULL if not supported. */
+const struct stb_layout *stb_layout(int version);
+
+struct stb_container {
+	int version;		/* 1, 2 or 3 */
+	uint8_t hash_alg;	/* of the headers, payload and keys */
+	bool mldsa_pure_mode;	/* v3: headers signed, not their hash */
+	const struct stb_layout *layout;
+	const uint8_t *region[STB_REGION_COUNT];
+	struct parsed_stb_container v1;
+	struct parsed_stb_container_v2 v2;
+	struct parsed_stb_container_v3 v3;
+};
+
+/* A field of a parsed container. */
+const uint8_t *stb_field_ptr(const struct stb_container *c,
+			     const struct stb_field *f);
+/* A big endian 64 bit field, which may not be aligned in v1 containers. */
+uint64_t stb_field_be64(const struct stb_container *c,
+			const struct stb_field *f);
+
+/*
+ * Whether SW slot i of a parsed container is in use: one of the first
+ * sw_key_count slots in v1, a slot with a key in v2 and v3.
+ */
+bool stb_sw_slot_used(const struct stb_container *c, int i);
+
+/*
+ * Parse the container at buf, of size bytes (at least the header). The
+ * parsed container points into buf.
+ */
+int stb_parse(struct stb_ctx *ctx, const void *buf, size_t size,
+	      struct stb_container *c);
+
+/*
+ * Build a container header. stb_build_init() lays out an empty header of a
+ * version at hdr, of at least its header_size bytes, with its magic number,
+ * version and algorithms, hash_alg HASH_ALG_NONE being the default of the
+ * version. c then describes the header as if it had been parsed, and its
+ * fields are filled in with stb_build_set(), or through stb_build_field().
+ *
+ * In v1 the SW header follows the SW keys in use: once the keys are in their
+ * slots, stb_build_sw_keys() counts and hashes them and places the SW header
+ * and signatures, whose fields cannot be filled in before.
+ */
+int stb_build_init(struct stb_ctx *ctx, struct stb_container *c, void *hdr,
+		   int version, uint8_t hash_alg, bool mldsa_pure_mode);
+/* A field of a container being built, NULL if not there (yet). */
+uint8_t *stb_build_field(struct stb_container *c, const struct stb_field *f);
+/* Set a big endian field of up to 64 bits. */
+int stb_build_set(struct stb_ctx *ctx, struct stb_container *c,
+		  const struct stb_field *f, uint64_t value);
+int stb_build_sw_keys(struct stb_ctx *ctx, struct stb_container *c);
+/* Set the payload sizes, and the container size from them. */
+int stb_build_sizes(struct stb_ctx *ctx, struct stb_container *c,
+		    uint64_t payload_size, uint64_t unprotected_size);
+/* The hash of the prefix or SW header of a container, which is signed. */
+int stb_hash_region(struct stb_ctx *ctx, const struct stb_container *c,
+		    int region, unsigned char *md);
+
+enum stb_check {
+	STB_CHECK_SKIPPED = 0,	/* no key in that slot */
+	STB_CHECK_PASSED,
+	STB_CHECK_FAILED,
+};
+
+struct stb_sig_check {
+	const char *name;	/* "HW_key_A", ... */
+	int type;		/* enum stb_sig_type */
+	int result;		/* enum stb_check */
+	const uint8_t *key;	/* in the container */
+	const uint8_t *sig;
+};
+
+struct stb_validation {
+	unsigned char prefix_hdr_hash[SHA512_DIGEST_LENGTH];
+	unsigned char sw_hdr_hash[SHA512_DIGEST_LENGTH];
+	unsigned char payload_hash[SHA512_DIGEST_LENGTH];
+	unsigned char sw_keys_hash[SHA512_DIGEST_LENGTH];
+	struct stb_sig_check hw_sigs[STB_MAX_SIGS];
+	int hw_sig_count;
+	struct stb_sig_check sw_sigs[STB_MAX_SIGS];
+	int sw_sig_count;
+	uint64_t payload_size_expected;
+	uint64_t payload_size_actual;	/* before the unprotected payload */
+	uint64_t unprotected_size;	/* at the end, not hashed (v2, v3) */
+	bool payload_hash_ok;	/* payload hash agrees with SW header */
+	bool sw_keys_hash_ok;	/* SW keys hash agrees with prefix header */
+	bool valid;		/* all of the checks passed */
+	uint64_t payload_holes;	/* payload bytes in holes, not read */
+};
+
+/*
+ * Check all signatures and hashes of a container. payload and payload_size
+ * are what follows the container header, of which the unprotected payload
+ * size in the SW header, at the end, is not hashed; with ignore_remainder
+ * only the payload size in the SW header is hashed.
+ */
+int stb_validate(struct stb_ctx *ctx, const struct stb_container *c,
+		 const void *payload, size_t payload_size,
+		 bool ignore_remainder, struct stb_validation *v);
+
+/*
+ * stb_validate() of a container in the file fd, the payload being at off in
+ * the file, and mapped at payload (or NULL, to read it): the holes of a
+ * sparse payload are not read (see stb_calc_hash_file()).
+ */
+int stb_validate_file(struct stb_ctx *ctx, const struct stb_container *c,
+		      int fd, uint64_t off, const void *payload,
+		      size_t payload_size, bool ignore_remainder,
+		      struct stb_validation *v);
+
+/*
+ * The bytes of the payload_size following the header of c that stb_validate()
+ * hashes.
+ */
+uint64_t stb_payload_hashed(const struct stb_container *c,
+			    uint64_t payload_size, bool ignore_remainder);
+
+/*
+ * stb_validate() of a container whose payload the caller hashed, as it
+ * streamed in or before, with stb_hash_new(c->hash_alg): payload_md is the
+ * hash of the stb_payload_hashed() bytes, and payload_size the bytes that
+ * followed the header, unprotected payload included.
+ */
+int stb_validate_digest(struct stb_ctx *ctx, const struct stb_container *c,
+			const unsigned char *payload_md, uint64_t payload_size,
+			bool ignore_remainder, struct stb_validation *v);
+
+/*
+ * Allocation-free validation.
+ *
+ * Each ECDSA verify has OpenSSL allocate, and free before it returns, the
+ * big numbers, signature, key and point it works with. With an arena set on
+ * a context, stb_validate() rewinds it and has these allocations served
+ * from it, so that a batch of containers is validated without going through
+ * malloc. ML-DSA and Dilithium contexts are set up once per stb_ctx.
+ *
+ * OpenSSL allocates through the library once stb_alloc_hooks_install() is
+ * called, which must be before anything else uses OpenSSL. The hooks also
+ * count allocations, arena or not, for stb_alloc_stats().
+ *
+ * An allocation that does not fit goes to malloc, and an arena in which a
+ * block is still live is not rewound, so that nothing OpenSSL keeps is ever
+ * overwritten. stb_ctx_set_arena() goes once through a verify without the
+ * arena to have OpenSSL set up what it keeps. An arena is for the contexts of
+ * one thread, and must outlive them. Its buffer must outlive every block
+ * allocated from it: a block may be freed on any thread, after the contexts
+ * are freed, and the live count of the arena is no longer kept once none
+ * uses it. While a block is live, the buffer is not freed; an arena set up
+ * again over all of it takes its live blocks over, one over part of it is
+ * refused by stb_ctx_set_arena(). Up to 64 arenas may be in use at a time,
+ * those with live blocks included.
+ */
+struct stb_arena {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	size_t peak;		/* most used, over the rewinds */
+	unsigned long live;	/* blocks not freed yet */
+	uint64_t allocs;	/* served from the arena */
+	uint64_t misses;	/* did not fit, went to malloc */
+	uint64_t pinned;	/* rewinds skipped for a live block */
+};
+
+void stb_arena_init(struct stb_arena *a, void *buf, size_t size);
+/* Rewind the arena; false if a block in it is still live. */
+bool stb_arena_reset(struct stb_arena *a);
+/* Use the arena in stb_validate(), or not with NULL. */
+int stb_ctx_set_arena(struct stb_ctx *ctx, struct stb_arena *arena);
+
+struct stb_alloc_stats {
+	uint64_t allocs;	/* by OpenSSL, malloc and realloc */
+	uint64_t frees;
+	uint64_t bytes;		/* requested by the allocs */
+	uint64_t arena_allocs;	/* of the allocs, served from an arena */
+};
+
+/* False if OpenSSL has already allocated, or is too old (< 1.1.0). */
+bool stb_alloc_hooks_install(void);
+void stb_alloc_stats(struct stb_alloc_stats *s);
+
+/* The HW keys hash, to verify the container against. */
+int stb_hw_keys_hash(struct stb_ctx *ctx, const struct stb_container *c,
+		     unsigned char *md);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBSTBCONTAINER_H */
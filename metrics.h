@@ -0,0 +1,499 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Metrics of the long running and batch modes of the tools (--metrics,
+ * --metrics-socket), in the Prometheus text format.
+ *
+ * A tool counts its work in counters and gauges, labelled by key or result,
+ * and times its sign, verify and hash operations into latency histograms.
+ * These are HDR-style: each power of two of nanoseconds is split into 32
+ * linear sub-buckets, so that any percentile is known to within 3%, from
+ * nanoseconds to an hour, in constant memory and time. They are exposed as
+ * summaries of the 50th, 90th, 99th and 99.9th percentiles, with the
+ * maximum as a gauge.
+ *
+ * The metrics are written to a file, replaced atomically as the
+ * node_exporter textfile collector wants, every STB_METRICS_INTERVAL
+ * seconds (default 10) and at exit, and/or served on a Unix socket, where
+ * each connection is answered with an HTTP response carrying them, for
+ * Prometheus or "curl --unix-socket". STB_METRICS_FILE and
+ * STB_METRICS_SOCKET set the same from the environment.
+ *
+ * The metrics live in shared memory, so that processes forked after
+ * metrics_init() add to the same ones.
+ */
+
+#ifndef __STB_METRICS_H
+#define __STB_METRICS_H
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define METRICS_MAX_SERIES	64
+#define METRICS_MAX_HISTS	16
+#define METRICS_LABELS_LEN	96
+#define METRICS_SUB_BITS	5
+#define METRICS_SUB		(1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS	42	/* 2^42 ns, over an hour */
+#define METRICS_BUCKETS	((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) \
+				 * METRICS_SUB)
+
+enum metrics_type {
+	METRICS_COUNTER,
+	METRICS_GAUGE,
+	METRICS_LATENCY,
+};
+
+struct metrics_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics_series {
+	const char *name;
+	const char *help;
+	int type;
+	char labels[METRICS_LABELS_LEN];	/* key="a", or "" */
+	int64_t value;
+	struct metrics_hist *hist;
+};
+
+/* In shared memory, updated with atomics. */
+struct metrics_shared {
+	int lock;		/* when adding a series */
+	int nseries;
+	int nhists;
+	struct metrics_series series[METRICS_MAX_SERIES];
+	struct metrics_hist hists[METRICS_MAX_HISTS];
+};
+
+struct metrics {
+	const char *tool;
+	const char *file;
+	const char *socket;
+	int interval;
+	int listen_fd;
+	bool started;
+	pid_t pid;		/* that started, forks do not write */
+	pthread_mutex_t write_lock;
+	struct metrics_shared *m;
+};
+
+struct metrics metrics;
+
+uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Set up the metrics, and pick up STB_METRICS_* from the environment. */
+void metrics_init(const char *tool)
+{
+	const char *env;
+	void *p;
+
+	metrics.tool = tool;
+	metrics.listen_fd = -1;
+	pthread_mutex_init(&metrics.write_lock, NULL);
+	metrics.file = getenv("STB_METRICS_FILE");
+	metrics.socket = getenv("STB_METRICS_SOCKET");
+	env = getenv("STB_METRICS_INTERVAL");
+	metrics.interval = env ? atoi(env) : 10;
+	if (metrics.interval < 1)
+		metrics.interval = 1;
+
+	p = mmap(NULL, sizeof(struct metrics_shared), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+		metrics.m = (struct metrics_shared *) p;
+}
+
+/*
+ * The series of a metric with these labels, added on first use. NULL, which
+ * the functions below ignore, if there is no room for it.
+ */
+struct metrics_series *metrics_get(int type, const char *name,
+				   const char *help, const char *labels)
+{
+	struct metrics_shared *m = metrics.m;
+	struct metrics_series *s = NULL;
+	int i;
+
+	if (!m)
+		return NULL;
+	if (!labels)
+		labels = "";
+
+	while (__sync_lock_test_and_set(&m->lock, 1))
+		;
+	for (i = 0; i < m->nseries; i++)
+		if (m->series[i].name == name
+		    && !strcmp(m->series[i].labels, labels))
+			break;
+	if (i < m->nseries) {
+		s = &m->series[i];
+	} else if (i < METRICS_MAX_SERIES
+		   && strlen(labels) < METRICS_LABELS_LEN
+		   && (type != METRICS_LATENCY || m->nhists < METRICS_MAX_HISTS)) {
+		s = &m->series[i];
+		s->name = name;
+		s->help = help;
+		s->type = type;
+		strcpy(s->labels, labels);
+		if (type == METRICS_LATENCY)
+			s->hist = &m->hists[m->nhists++];
+		__sync_synchronize();
+		m->nseries++;
+	}
+	__sync_lock_release(&m->lock);
+	return s;
+}
+
+/* Format name="value" into buf, escaped as the text format wants. */
+const char *metrics_label(char *buf, size_t len, const char *name,
+			  const char *value)
+{
+	size_t n = snprintf(buf, len, "%s=\"", name);
+
+	for (; *value && n + 4 < len; value++) {
+		if (*value == '\\' || *value == '"')
+			buf[n++] = '\\';
+		if (*value == '\n') {
+			buf[n++] = '\\';
+			buf[n++] = 'n';
+			continue;
+		}
+		buf[n++] = *value;
+	}
+	if (n + 2 <= len) {
+		buf[n++] = '"';
+		buf[n] = '\0';
+	}
+	return buf;
+}
+
+void metrics_add(struct metrics_series *s, int64_t n)
+{
+	if (s)
+		__sync_fetch_and_add(&s->value, n);
+}
+
+void metrics_set(struct metrics_series *s, int64_t v)
+{
+	if (s)
+		s->value = v;
+}
+
+static int metrics_bucket(uint64_t ns)
+{
+	int e;
+
+	if (ns < METRICS_SUB)
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	if (e >= METRICS_MAX_BITS)
+		return METRICS_BUCKETS - 1;
+	return (e - METRICS_SUB_BITS + 1) * METRICS_SUB
+		+ ((ns >> (e - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+}
+
+/* The highest value counted in a bucket. */
+static uint64_t metrics_bucket_max(int i)
+{
+	int k = i / METRICS_SUB;
+
+	if (!k)
+		return i;
+	return ((uint64_t) (METRICS_SUB + i % METRICS_SUB) << (k - 1))
+		+ ((uint64_t) 1 << (k - 1)) - 1;
+}
+
+void metrics_observe(struct metrics_series *s, uint64_t ns)
+{
+	struct metrics_hist *h;
+	uint64_t max;
+
+	if (!s || !s->hist)
+		return;
+	h = s->hist;
+	__sync_fetch_and_add(&h->buckets[metrics_bucket(ns)], 1);
+	__sync_fetch_and_add(&h->sum_ns, ns);
+	__sync_fetch_and_add(&h->count, 1);
+	while ((max = h->max_ns) < ns
+	       && !__sync_bool_compare_and_swap(&h->max_ns, max, ns))
+		;
+}
+
+/* Shorthands, looking the series up each time. */
+void metrics_count(const char *name, const char *help, const char *labels,
+		   int64_t n)
+{
+	metrics_add(metrics_get(METRICS_COUNTER, name, help, labels), n);
+}
+
+void metrics_gauge(const char *name, const char *help, const char *labels,
+		   int64_t v)
+{
+	metrics_set(metrics_get(METRICS_GAUGE, name, help, labels), v);
+}
+
+/* The percentile p (0 to 1) of a histogram, in nanoseconds. */
+static uint64_t metrics_percentile(const struct metrics_hist *h, uint64_t count,
+				   double p)
+{
+	uint64_t rank = p * count + 0.5, seen = 0;
+	int i;
+
+	if (!rank)
+		rank = 1;
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return metrics_bucket_max(i) < h->max_ns ?
+				metrics_bucket_max(i) : h->max_ns;
+	}
+	return h->max_ns;
+}
+
+/* "{tool="x",key="a"}", with extra ("quantile=...") if given. */
+static void metrics_labels(FILE *fp, const struct metrics_series *s,
+			   const char *extra)
+{
+	fprintf(fp, "{tool=\"%s\"%s%s%s%s}", metrics.tool,
+		s->labels[0] ? "," : "", s->labels, extra ? "," : "",
+		extra ? extra : "");
+}
+
+static void metrics_family(FILE *fp, const struct metrics_series *s,
+			   const char *suffix, const char *type)
+{
+	fprintf(fp, "# HELP %s%s %s\n# TYPE %s%s %s\n", s->name, suffix,
+		s->help, s->name, suffix, type);
+}
+
+void metrics_write(FILE *fp)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	struct metrics_shared *m = metrics.m;
+	const struct metrics_series *s;
+	const struct metrics_hist *h;
+	char q[32];
+	uint64_t count;
+	int i, j, k;
+
+	if (!m)
+		return;
+
+	for (i = 0; i < m->nseries; i++) {
+		s = &m->series[i];
+		/* The series of a metric are together, after its first. */
+		for (j = 0; j < i; j++)
+			if (m->series[j].name == s->name)
+				break;
+		if (j < i)
+			continue;
+
+		if (s->type == METRICS_LATENCY) {
+			metrics_family(fp, s, "_seconds", "summary");
+			for (j = i; j < m->nseries; j++) {
+				if (m->series[j].name != s->name)
+					continue;
+				h = m->series[j].hist;
+				count = h->count;
+				for (k = 0; count && k < 4; k++) {
+					snprintf(q, sizeof(q), "quantile=\"%g\"",
+						 quantiles[k]);
+					fprintf(fp, "%s_seconds", s->name);
+					metrics_labels(fp, &m->series[j], q);
+					fprintf(fp, " %.9f\n", metrics_percentile(h,
+						count, quantiles[k]) / 1e9);
+				}
+				fprintf(fp, "%s_seconds_sum", s->name);
+				metrics_labels(fp, &m->series[j], NULL);
+				fprintf(fp, " %.9f\n", h->sum_ns / 1e9);
+				fprintf(fp, "%s_seconds_count", s->name);
+				metrics_labels(fp, &m->series[j], NULL);
+				fprintf(fp, " %llu\n", (unsigned long long) count);
+			}
+			metrics_family(fp, s, "_max_seconds", "gauge");
+			for (j = i; j < m->nseries; j++) {
+				if (m->series[j].name != s->name)
+					continue;
+				fprintf(fp, "%s_max_seconds", s->name);
+				metrics_labels(fp, &m->series[j], NULL);
+				fprintf(fp, " %.9f\n", m->series[j].hist->max_ns / 1e9);
+			}
+			continue;
+		}
+
+		metrics_family(fp, s, "", s->type == METRICS_COUNTER ?
+			       "counter" : "gauge");
+		for (j = i; j < m->nseries; j++) {
+			if (m->series[j].name != s->name)
+				continue;
+			fprintf(fp, "%s", s->name);
+			metrics_labels(fp, &m->series[j], NULL);
+			fprintf(fp, " %lld\n", (long long) m->series[j].value);
+		}
+	}
+}
+
+/* Write the metrics to a temporary file renamed over the file. */
+void metrics_write_file(void)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (!metrics.file || !metrics.m)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", metrics.file, (int) getpid());
+	pthread_mutex_lock(&metrics.write_lock);
+	fp = fopen(tmp, "w");
+	if (fp) {
+		metrics_write(fp);
+		if (fclose(fp) || rename(tmp, metrics.file))
+			unlink(tmp);
+	}
+	pthread_mutex_unlock(&metrics.write_lock);
+}
+
+/* Answer a scrape with the metrics, whatever the request. */
+static void metrics_answer(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char buf[1024], *body = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int n;
+
+	if (poll(&pfd, 1, 1000) > 0 && read(fd, buf, sizeof(buf)) < 0)
+		return;
+
+	fp = open_memstream(&body, &len);
+	if (!fp)
+		return;
+	metrics_write(fp);
+	fclose(fp);
+
+	n = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n"
+		     "Content-Type: text/plain; version=0.0.4\r\n"
+		     "Content-Length: %lu\r\n\r\n", (unsigned long) len);
+	if (write(fd, buf, n) == n && len)
+		(void) !write(fd, body, len);
+	free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+	struct pollfd pfd = { metrics.listen_fd, POLLIN, 0 };
+	uint64_t next = metrics_now();
+	int64_t wait_ms;
+	int fd;
+
+	(void) arg;
+	while (1) {
+		if (metrics_now() >= next) {
+			metrics_write_file();
+			next = metrics_now() + metrics.interval * 1000000000ULL;
+		}
+		wait_ms = (int64_t) (next - metrics_now()) / 1000000;
+		if (pfd.fd < 0) {
+			poll(NULL, 0, wait_ms > 0 ? wait_ms : 0);
+			continue;
+		}
+		if (poll(&pfd, 1, wait_ms > 0 ? wait_ms : 0) <= 0)
+			continue;
+		fd = accept(pfd.fd, NULL, NULL);
+		if (fd >= 0) {
+			metrics_answer(fd);
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+static void metrics_exit(void)
+{
+	if (getpid() != metrics.pid)
+		return;
+	metrics_write_file();
+	if (metrics.listen_fd >= 0) {
+		close(metrics.listen_fd);
+		unlink(metrics.socket);
+	}
+}
+
+/*
+ * Start writing the metrics file and serving the socket, if set, from a
+ * thread of their own. False, with errno, if the socket cannot be bound.
+ */
+bool metrics_start(void)
+{
+	struct sockaddr_un sa;
+	pthread_t thread;
+	int fd;
+
+	if (metrics.started || !metrics.m || (!metrics.file && !metrics.socket))
+		return true;
+
+	if (metrics.socket) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		if (strlen(metrics.socket) >= sizeof(sa.sun_path)) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		strcpy(sa.sun_path, metrics.socket);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return false;
+		unlink(metrics.socket);
+		if (bind(fd, (struct sockaddr *) &sa, sizeof(sa))
+		    || listen(fd, 8)) {
+			close(fd);
+			return false;
+		}
+		metrics.listen_fd = fd;
+	}
+
+	if (pthread_create(&thread, NULL, metrics_thread, NULL))
+		return false;
+	pthread_detach(thread);
+	metrics.started = true;
+	metrics.pid = getpid();
+	atexit(metrics_exit);
+	return true;
+}
+
+#endif /* __STB_METRICS_H */
@@ -0,0 +1,199 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * NUMA placement of the worker threads of the tools, without libnuma.
+ *
+ * numa_init() reads the nodes and their CPUs from sysfs, keeping only the
+ * CPUs the process may run on, and dropping the nodes left without any. A
+ * worker pinned to a node with numa_pin() runs on the CPUs of that node,
+ * and the memory it touches first is allocated there by the kernel.
+ * numa_place() binds a range of memory to a node, or interleaves it over
+ * all of them, before it is first touched.
+ *
+ * Elsewhere than on Linux, or without sysfs, there is a single node, and
+ * nothing is pinned or placed. The file defining _GNU_SOURCE before any
+ * include is needed for the CPU sets.
+ */
+
+#ifndef __STB_NUMA_NODES_H
+#define __STB_NUMA_NODES_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__NR_mbind) && defined(__has_include)
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#define HAVE_MBIND 1
+#endif
+#endif
+#endif
+
+#define NUMA_MAX_NODES	64
+#define NUMA_MAX_ID	1024
+
+struct numa_node {
+	int id;			/* -1 when the system has no NUMA nodes */
+	int ncpus;
+#ifdef __linux__
+	cpu_set_t cpus;
+#endif
+};
+
+struct numa_nodes {
+	int count;
+	struct numa_node nodes[NUMA_MAX_NODES];
+};
+
+struct numa_nodes numa_nodes;
+
+#ifdef __linux__
+/* Add the numbers of a sysfs list, such as "0-3,8-11", to set. */
+static void numa_parse_list(const char *list, cpu_set_t *set)
+{
+	unsigned long a, b;
+	char *end;
+
+	while (1) {
+		a = b = strtoul(list, &end, 10);
+		if (end == list)
+			break;
+		if (*end == '-')
+			b = strtoul(end + 1, &end, 10);
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+		if (*end != ',')
+			break;
+		list = end + 1;
+	}
+}
+
+static bool numa_read_list(const char *fn, cpu_set_t *set)
+{
+	char buf[4096];
+	FILE *fp = fopen(fn, "r");
+	bool ok;
+
+	CPU_ZERO(set);
+	if (!fp)
+		return false;
+	ok = fgets(buf, sizeof(buf), fp) != NULL;
+	fclose(fp);
+	if (ok)
+		numa_parse_list(buf, set);
+	return ok;
+}
+#endif
+
+/* Returns the number of nodes, at least 1. */
+int numa_init(void)
+{
+#ifdef __linux__
+	struct numa_node *node;
+	cpu_set_t allowed, online;
+	char fn[64];
+	int id;
+
+	numa_nodes.count = 0;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		CPU_ZERO(&allowed);
+	if (numa_read_list("/sys/devices/system/node/online", &online)) {
+		for (id = 0; id < NUMA_MAX_ID && numa_nodes.count < NUMA_MAX_NODES;
+		     id++) {
+			if (!CPU_ISSET(id, &online))
+				continue;
+			node = &numa_nodes.nodes[numa_nodes.count];
+			snprintf(fn, sizeof(fn),
+				 "/sys/devices/system/node/node%d/cpulist", id);
+			if (!numa_read_list(fn, &node->cpus))
+				continue;
+			CPU_AND(&node->cpus, &node->cpus, &allowed);
+			node->ncpus = CPU_COUNT(&node->cpus);
+			node->id = id;
+			if (node->ncpus)
+				numa_nodes.count++;
+		}
+	}
+	if (!numa_nodes.count) {
+		node = &numa_nodes.nodes[0];
+		node->id = -1;
+		node->cpus = allowed;
+		node->ncpus = CPU_COUNT(&allowed);
+		numa_nodes.count = 1;
+	}
+#else
+	numa_nodes.nodes[0].id = -1;
+	numa_nodes.nodes[0].ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	numa_nodes.count = 1;
+#endif
+	if (numa_nodes.nodes[0].ncpus < 1)
+		numa_nodes.nodes[0].ncpus = 1;
+	return numa_nodes.count;
+}
+
+/* Run the calling thread on the CPUs of a node only. */
+bool numa_pin(int node)
+{
+#ifdef __linux__
+	if (numa_nodes.nodes[node].id < 0)
+		return false;
+	return !sched_setaffinity(0, sizeof(cpu_set_t),
+				  &numa_nodes.nodes[node].cpus);
+#else
+	(void) node;
+	return false;
+#endif
+}
+
+/*
+ * Have the pages of [p, p + len), not touched yet and page aligned, come
+ * from a node, or from each node in turn if node is -1.
+ */
+bool numa_place(void *p, size_t len, int node)
+{
+#ifdef HAVE_MBIND
+	unsigned long mask[NUMA_MAX_ID / (8 * sizeof(unsigned long))];
+	const int bits = 8 * sizeof(unsigned long);
+	int i, id;
+
+	memset(mask, 0, sizeof(mask));
+	for (i = 0; i < numa_nodes.count; i++) {
+		id = numa_nodes.nodes[i].id;
+		if (id < 0)
+			return false;
+		if (node < 0 || node == i)
+			mask[id / bits] |= 1UL << (id % bits);
+	}
+	// The kernel takes one bit less than maxnode.
+	return !syscall(__NR_mbind, p, len,
+			node < 0 ? MPOL_INTERLEAVE : MPOL_BIND, mask,
+			sizeof(mask) * 8 + 1, 0);
+#else
+	(void) p;
+	(void) len;
+	(void) node;
+	return false;
+#endif
+}
+
+#endif /* __STB_NUMA_NODES_H */
@@ -0,0 +1,904 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sign container headers with keys held in a PKCS#11 token.
+ *
+ * The module is loaded once, the user logs in once per slot, and a pool
+ * of sessions (spread over every slot holding a token with the requested
+ * label) services all signing requests concurrently. This replaces one
+ * "openssl dgst -engine pkcs11" invocation, with its own session and
+ * login, per signature.
+ *
+ * With --serve it acts as the sign helper of create-container: requests
+ * "<key> <digest>" are read from stdin until EOF, and "<key> <signature>"
+ * answered on stdout, in hexascii. --slot maps each key letter to the label
+ * of the private key in the token.
+ */
+
+#include <config.h>
+
+#ifndef _AIX
+#include <getopt.h>
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <p11-kit/pkcs11.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "container.c"
+#include "container.h"
+#include "timings.h"
+#include "metrics.h"
+
+#define P11_MAX_SESSIONS	64
+#define P11_MAX_KEYS		16
+#define P11_MAX_SIG		512
+#define P11_LABEL_LEN		64
+
+char *progname;
+
+bool verbose, debug;
+int wrap = 100;
+
+void usage(int status);
+
+struct p11_job {
+	char *label;
+	char *infile;
+	char *outfile;
+	char slot;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+};
+
+struct p11_session {
+	CK_SLOT_ID slot;
+	CK_SESSION_HANDLE handle;
+	struct {
+		char label[P11_LABEL_LEN];
+		CK_OBJECT_HANDLE obj;
+	} keys[P11_MAX_KEYS];
+	int nkeys;
+	unsigned long count;
+	pthread_t thread;
+};
+
+static CK_FUNCTION_LIST_PTR p11;
+static void *p11_module;
+
+static struct {
+	char *module;
+	char *token;
+	char *pinfile;
+	char *label;
+	char *infile;
+	char *outfile;
+	char *listfile;
+	const EVP_MD *md;
+	int sessions;
+	unsigned long bench;
+	bool raw;
+	bool serve;
+	char *slot_labels[26];
+} params;
+
+static struct {
+	struct p11_job *jobs;
+	size_t njobs;
+	size_t next;
+	pthread_mutex_t lock;
+} queue = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void p11_load(const char *module)
+{
+	CK_C_GetFunctionList get_function_list;
+	CK_C_INITIALIZE_ARGS init_args;
+	CK_RV rv;
+
+	p11_module = dlopen(module, RTLD_NOW | RTLD_LOCAL);
+	if (!p11_module)
+		die(EX_UNAVAILABLE, "Cannot load PKCS#11 module: %s", dlerror());
+
+	get_function_list = (CK_C_GetFunctionList) dlsym(p11_module,
+			"C_GetFunctionList");
+	if (!get_function_list)
+		die(EX_UNAVAILABLE, "Not a PKCS#11 module: %s", module);
+
+	rv = get_function_list(&p11);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_GetFunctionList failed: 0x%lx", rv);
+
+	/* The sessions are driven from several threads */
+	memset(&init_args, 0, sizeof(init_args));
+	init_args.flags = CKF_OS_LOCKING_OK;
+
+	rv = p11->C_Initialize(&init_args);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_Initialize failed: 0x%lx", rv);
+
+	debug_msg("Loaded PKCS#11 module %s (Cryptoki %d.%d)", module,
+			p11->version.major, p11->version.minor);
+}
+
+static void p11_unload(void)
+{
+	if (p11)
+		p11->C_Finalize(NULL);
+	if (p11_module)
+		dlclose(p11_module);
+	p11 = NULL;
+	p11_module = NULL;
+}
+
+/* Token labels are blank padded to 32 characters */
+static bool p11_label_match(const CK_UTF8CHAR *padded, size_t len,
+		const char *label)
+{
+	size_t n = strlen(label);
+
+	if (n > len || memcmp(padded, label, n))
+		return false;
+	for (; n < len; n++)
+		if (padded[n] != ' ')
+			return false;
+	return true;
+}
+
+static int p11_find_slots(const char *token, CK_SLOT_ID *slots, int max)
+{
+	CK_SLOT_ID *all;
+	CK_ULONG count = 0, i;
+	CK_TOKEN_INFO info;
+	CK_RV rv;
+	int n = 0;
+
+	rv = p11->C_GetSlotList(CK_TRUE, NULL, &count);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_GetSlotList failed: 0x%lx", rv);
+
+	all = malloc(sizeof(CK_SLOT_ID) * (count ? count : 1));
+	if (!all)
+		die(EX_OSERR, "%s", "Cannot get memory");
+
+	rv = p11->C_GetSlotList(CK_TRUE, all, &count);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_GetSlotList failed: 0x%lx", rv);
+
+	for (i = 0; i < count && n < max; i++) {
+		rv = p11->C_GetTokenInfo(all[i], &info);
+		if (rv != CKR_OK)
+			continue;
+		if (!p11_label_match(info.label, sizeof(info.label), token))
+			continue;
+		debug_msg("Token \"%s\" found in slot %lu", token, all[i]);
+		slots[n++] = all[i];
+	}
+	free(all);
+
+	if (!n)
+		die(EX_UNAVAILABLE, "No token with label \"%s\" found", token);
+
+	return n;
+}
+
+/*
+ * The PIN, in a buffer the caller scrubs once logged in: the one from the
+ * environment is copied, so that the environment itself is left alone.
+ */
+static char *p11_get_pin(void)
+{
+	static char pin[256];
+	char *p;
+
+	if ((p = getenv("SB_PKCS11_PIN"))) {
+		if (strlen(p) >= sizeof(pin))
+			die(EX_USAGE, "%s", "SB_PKCS11_PIN is too long");
+		strcpy(pin, p);
+		return pin;
+	}
+
+	if (params.pinfile) {
+		FILE *fp = fopen(params.pinfile, "r");
+		if (!fp)
+			die(EX_NOINPUT, "Cannot open PIN file: %s: %s",
+					params.pinfile, strerror(errno));
+		if (!fgets(pin, sizeof(pin), fp))
+			pin[0] = '\0';
+		fclose(fp);
+		pin[strcspn(pin, "\r\n")] = '\0';
+		return pin;
+	}
+
+	p = getpass("PKCS#11 token PIN: ");
+	if (!p)
+		die(EX_NOINPUT, "%s", "Cannot read PIN");
+	return p;
+}
+
+static int p11_open_pool(struct p11_session *pool, int n)
+{
+	CK_SLOT_ID slots[P11_MAX_SESSIONS];
+	char *pin;
+	CK_RV rv;
+	int nslots, i;
+
+	nslots = p11_find_slots(params.token, slots, P11_MAX_SESSIONS);
+	pin = p11_get_pin();
+
+	for (i = 0; i < n; i++) {
+		memset(&pool[i], 0, sizeof(pool[i]));
+		pool[i].slot = slots[i % nslots];
+
+		rv = p11->C_OpenSession(pool[i].slot, CKF_SERIAL_SESSION, NULL,
+				NULL, &pool[i].handle);
+		if (rv != CKR_OK)
+			die(EX_SOFTWARE, "C_OpenSession failed (slot %lu): 0x%lx",
+					pool[i].slot, rv);
+
+		/* A login applies to every session of the application on that
+		 * slot, so it is done once per slot. */
+		if (i < nslots) {
+			rv = p11->C_Login(pool[i].handle, CKU_USER,
+					(CK_UTF8CHAR_PTR) pin, strlen(pin));
+			if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN)
+				die(EX_NOPERM, "C_Login failed (slot %lu): 0x%lx",
+						pool[i].slot, rv);
+		}
+	}
+	memset(pin, 0, strlen(pin));
+
+	if (nslots > n)
+		nslots = n;
+	verbose_msg("Opened %d session(s) on %d slot(s)", n, nslots);
+	return nslots;
+}
+
+static void p11_close_pool(struct p11_session *pool, int n)
+{
+	for (int i = 0; i < n; i++)
+		p11->C_CloseSession(pool[i].handle);
+}
+
+static CK_OBJECT_HANDLE p11_find_key(struct p11_session *s, const char *label)
+{
+	CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE tmpl[] = {
+		{ CKA_CLASS, &key_class, sizeof(key_class) },
+		{ CKA_LABEL, (void *) label, strlen(label) },
+	};
+	CK_OBJECT_HANDLE obj;
+	CK_ULONG found = 0;
+	CK_RV rv;
+	int i;
+
+	for (i = 0; i < s->nkeys; i++)
+		if (!strcmp(s->keys[i].label, label)) {
+			metrics_count("stb_key_cache_lookups_total",
+					"Key handle lookups, by cache result",
+					"result=\"hit\"", 1);
+			return s->keys[i].obj;
+		}
+	metrics_count("stb_key_cache_lookups_total",
+			"Key handle lookups, by cache result", "result=\"miss\"", 1);
+
+	rv = p11->C_FindObjectsInit(s->handle, tmpl, 2);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_FindObjectsInit failed: 0x%lx", rv);
+	rv = p11->C_FindObjects(s->handle, &obj, 1, &found);
+	p11->C_FindObjectsFinal(s->handle);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_FindObjects failed: 0x%lx", rv);
+	if (!found)
+		die(EX_NOINPUT, "No private key with label \"%s\" in slot %lu",
+				label, s->slot);
+
+	if (s->nkeys < P11_MAX_KEYS && strlen(label) < P11_LABEL_LEN) {
+		strcpy(s->keys[s->nkeys].label, label);
+		s->keys[s->nkeys++].obj = obj;
+	}
+	return obj;
+}
+
+/* label is the key="..." label of the metrics of the signature */
+static size_t p11_sign(struct p11_session *s, CK_OBJECT_HANDLE key,
+		unsigned char *md, unsigned int mdlen, unsigned char *sig,
+		const char *label)
+{
+	CK_MECHANISM mech = { CKM_ECDSA, NULL, 0 };
+	CK_ULONG siglen = P11_MAX_SIG;
+	uint64_t started = metrics_now();
+	CK_RV rv;
+
+	rv = p11->C_SignInit(s->handle, &mech, key);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_SignInit failed: 0x%lx", rv);
+
+	rv = p11->C_Sign(s->handle, md, mdlen, sig, &siglen);
+	if (rv != CKR_OK)
+		die(EX_SOFTWARE, "C_Sign failed: 0x%lx", rv);
+
+	metrics_observe(metrics_get(METRICS_LATENCY, "stb_sign",
+			"Time to sign a digest", label), metrics_now() - started);
+	metrics_count("stb_signatures_total", "Signatures made, by key", label, 1);
+	s->count++;
+	return siglen;
+}
+
+/* CKM_ECDSA returns r | s, convert to the DER form "openssl dgst" writes */
+static int sig_to_der(unsigned char *sig, size_t siglen, unsigned char **der)
+{
+	ECDSA_SIG *ecsig = ECDSA_SIG_new();
+	BIGNUM *r, *s;
+	int len;
+
+	if (!ecsig)
+		die(EX_SOFTWARE, "%s", "Cannot ECDSA_SIG_new");
+
+	r = BN_bin2bn(sig, siglen / 2, NULL);
+	s = BN_bin2bn(sig + siglen / 2, siglen / 2, NULL);
+	if (!r || !s || !ECDSA_SIG_set0(ecsig, r, s))
+		die(EX_SOFTWARE, "%s", "Cannot convert signature");
+
+	*der = NULL;
+	len = i2d_ECDSA_SIG(ecsig, der);
+	ECDSA_SIG_free(ecsig);
+	if (len <= 0)
+		die(EX_SOFTWARE, "%s", "Cannot i2d_ECDSA_SIG");
+	return len;
+}
+
+static void digest_file(const char *fn, unsigned char *md, unsigned int *mdlen)
+{
+	unsigned char buf[65536];
+	EVP_MD_CTX *ctx;
+	uint64_t started, bytes = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		die(EX_NOINPUT, "Cannot open file: %s: %s", fn, strerror(errno));
+
+	/* Without a hash the input already is the digest */
+	if (!params.md) {
+		n = read(fd, md, EVP_MAX_MD_SIZE + 1);
+		close(fd);
+		if (n <= 0 || n > EVP_MAX_MD_SIZE)
+			die(EX_DATAERR, "File is not a digest: %s", fn);
+		*mdlen = n;
+		return;
+	}
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || !EVP_DigestInit_ex(ctx, params.md, NULL))
+		die(EX_SOFTWARE, "%s", "Cannot EVP_DigestInit_ex");
+
+	started = metrics_now();
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		EVP_DigestUpdate(ctx, buf, n);
+		bytes += n;
+	}
+	if (n < 0)
+		die(EX_NOINPUT, "Cannot read file: %s: %s", fn, strerror(errno));
+	close(fd);
+
+	EVP_DigestFinal_ex(ctx, md, mdlen);
+	EVP_MD_CTX_free(ctx);
+	metrics_observe(metrics_get(METRICS_LATENCY, "stb_hash",
+			"Time to read and hash a file", NULL),
+			metrics_now() - started);
+	metrics_count("stb_hashed_bytes_total", "Bytes hashed", NULL, bytes);
+}
+
+static void write_sig(const char *fn, unsigned char *sig, size_t siglen)
+{
+	unsigned char *der = NULL;
+	FILE *fp;
+	size_t len = siglen;
+
+	if (!params.raw)
+		len = sig_to_der(sig, siglen, &der);
+
+	fp = fopen(fn, "w");
+	if (!fp)
+		die(EX_CANTCREAT, "Cannot create file: %s: %s", fn, strerror(errno));
+	if (fwrite(der ? der : sig, 1, len, fp) != len || fclose(fp))
+		die(EX_IOERR, "Cannot write file: %s: %s", fn, strerror(errno));
+
+	OPENSSL_free(der);
+}
+
+static struct p11_job *next_job(void)
+{
+	struct p11_job *job = NULL;
+
+	pthread_mutex_lock(&queue.lock);
+	if (queue.next < queue.njobs)
+		job = &queue.jobs[queue.next++];
+	metrics_gauge("stb_queue_depth", "Requests waiting for a session", NULL,
+			queue.njobs - queue.next);
+	pthread_mutex_unlock(&queue.lock);
+
+	return job;
+}
+
+static void *sign_worker(void *arg)
+{
+	struct p11_session *s = (struct p11_session *) arg;
+	unsigned char md[EVP_MAX_MD_SIZE], sig[P11_MAX_SIG];
+	unsigned int mdlen = SHA512_DIGEST_LENGTH;
+	struct p11_job *job;
+	char label[METRICS_LABELS_LEN];
+	size_t siglen;
+
+	/* The benchmark signs random digests, nothing is read or written */
+	if (params.bench)
+		RAND_bytes(md, mdlen);
+
+	while ((job = next_job())) {
+		metrics_label(label, sizeof(label), "key", job->label);
+		if (params.serve) {
+			siglen = p11_sign(s, p11_find_key(s, job->label), job->md,
+					job->mdlen, sig, label);
+
+			/* RAW is accepted by create-container, and fixed size */
+			pthread_mutex_lock(&stdout_lock);
+			printf("%c ", job->slot);
+			for (size_t i = 0; i < siglen; i++)
+				printf("%02x", sig[i]);
+			printf("\n");
+			fflush(stdout);
+			pthread_mutex_unlock(&stdout_lock);
+			continue;
+		}
+
+		if (!params.bench)
+			digest_file(job->infile, md, &mdlen);
+
+		siglen = p11_sign(s, p11_find_key(s, job->label), md, mdlen, sig,
+				label);
+
+		if (!params.bench) {
+			write_sig(job->outfile, sig, siglen);
+			verbose_msg("Signed %s with %s (slot %lu), signature in %s",
+					job->infile, job->label, s->slot,
+					job->outfile);
+		}
+	}
+	return NULL;
+}
+
+static struct p11_job *add_job(size_t *max)
+{
+	if (queue.njobs == *max) {
+		*max = *max ? *max * 2 : 16;
+		queue.jobs = realloc(queue.jobs, *max * sizeof(*queue.jobs));
+		if (!queue.jobs)
+			die(EX_OSERR, "%s", "Cannot get memory");
+	}
+	memset(&queue.jobs[queue.njobs], 0, sizeof(*queue.jobs));
+	return &queue.jobs[queue.njobs++];
+}
+
+static void read_list(const char *fn)
+{
+	char *line = NULL, *label, *infile, *outfile, *save;
+	size_t len = 0, max = 0;
+	struct p11_job *job;
+	FILE *fp;
+
+	fp = fopen(fn, "r");
+	if (!fp)
+		die(EX_NOINPUT, "Cannot open list: %s: %s", fn, strerror(errno));
+
+	while (getline(&line, &len, fp) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		label = strtok_r(line, " \t", &save);
+		if (!label || *label == '#')
+			continue;
+		infile = strtok_r(NULL, " \t", &save);
+		outfile = strtok_r(NULL, "", &save);
+		if (outfile)
+			outfile += strspn(outfile, " \t");
+		if (!infile || !outfile || !*outfile)
+			die(EX_DATAERR, "Malformed line in list %s: %s", fn, label);
+
+		job = add_job(&max);
+		job->label = strdup(label);
+		job->infile = strdup(infile);
+		job->outfile = strdup(outfile);
+	}
+	free(line);
+	fclose(fp);
+
+	debug_msg("Read %lu signing request(s) from %s", queue.njobs, fn);
+}
+
+static void read_requests(FILE *fp)
+{
+	char *line = NULL, *hex;
+	size_t len = 0, max = 0, n;
+	struct p11_job *job;
+	int slot;
+
+	while (getline(&line, &len, fp) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+			continue;
+
+		slot = line[0];
+		if (slot < 'a' || slot > 'z' || !params.slot_labels[slot - 'a'])
+			die(EX_DATAERR, "No key label for requested key: %c", slot);
+
+		hex = line + 1 + strspn(line + 1, " \t");
+		n = strlen(hex) / 2;
+		if (!n || n > EVP_MAX_MD_SIZE ||
+				strspn(hex, "0123456789abcdefABCDEF") != n * 2)
+			die(EX_DATAERR, "Invalid digest for key %c", slot);
+
+		job = add_job(&max);
+		job->slot = slot;
+		job->label = params.slot_labels[slot - 'a'];
+		for (size_t i = 0; i < n; i++)
+			sscanf(&hex[i * 2], "%2hhx", &job->md[i]);
+		job->mdlen = n;
+	}
+	free(line);
+
+	debug_msg("Read %lu signing request(s) from stdin", queue.njobs);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+__attribute__((__noreturn__)) void usage (int status)
+{
+	if (status != 0) {
+		fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+	}
+	else {
+		printf("Usage: %s [options]\n", progname);
+		printf(
+			"\n"
+			"Options:\n"
+			" -h, --help              display this message and exit\n"
+			" -v, --verbose           show verbose output\n"
+			"     --debug             show additional debug output\n"
+			" -m, --module            PKCS#11 module to load\n"
+			" -t, --token             label of the token(s) holding the keys, every\n"
+			"                          slot with a matching token joins the pool\n"
+			"     --pin-file          file containing the user PIN (default is\n"
+			"                          $SB_PKCS11_PIN, else prompt)\n"
+			" -k, --label             label of the private key to sign with\n"
+			" -i, --infile            file to sign\n"
+			" -o, --outfile           file to write the signature to\n"
+			" -l, --list              file of signing requests, one\n"
+			"                          \"<label> <infile> <outfile>\" per line\n"
+			" -s, --sessions          number of sessions to sign with concurrently\n"
+			"                          (default 4)\n"
+			"     --hash              hash to sign: sha512 (default), sha3-512, or none\n"
+			"                          if the input already is the digest\n"
+			"     --raw               write signatures in RAW format (default DER)\n"
+			"     --bench             sign this many random digests with --label and\n"
+			"                          report signatures per second\n"
+			"     --serve             serve create-container --sign-helper requests on\n"
+			"                          stdin/stdout\n"
+			"     --slot              <key>=<label>, label of the private key for key\n"
+			"                          letter a, b, c, p, q or r in --serve mode\n"
+			"     --timings           print the time spent in each phase, peak RSS and\n"
+			"                          page faults to stderr\n"
+			"     --timings-json      same as --timings, as one line of JSON\n"
+			"     --metrics           write Prometheus metrics of the signing to this\n"
+			"                          file, every $STB_METRICS_INTERVAL seconds and\n"
+			"                          at exit\n"
+			"     --metrics-socket    serve the metrics to scrapes on this Unix socket\n"
+			"\n");
+	};
+	exit(status);
+}
+
+#ifndef _AIX
+static struct option const opts[] = {
+	{ "help",             no_argument,       0,  'h' },
+	{ "verbose",          no_argument,       0,  'v' },
+	{ "debug",            no_argument,       0,  '4' },
+	{ "module",           required_argument, 0,  'm' },
+	{ "token",            required_argument, 0,  't' },
+	{ "pin-file",         required_argument, 0,  '5' },
+	{ "label",            required_argument, 0,  'k' },
+	{ "infile",           required_argument, 0,  'i' },
+	{ "outfile",          required_argument, 0,  'o' },
+	{ "list",             required_argument, 0,  'l' },
+	{ "sessions",         required_argument, 0,  's' },
+	{ "hash",             required_argument, 0,  'H' },
+	{ "raw",              no_argument,       0,  '6' },
+	{ "bench",            required_argument, 0,  '7' },
+	{ "serve",            no_argument,       0,  '8' },
+	{ "slot",             required_argument, 0,  '9' },
+	{ "timings",          no_argument,       0,  '0' },
+	{ "timings-json",     no_argument,       0,  '1' },
+	{ "metrics",          required_argument, 0,  '2' },
+	{ "metrics-socket",   required_argument, 0,  '3' },
+	{ NULL, 0, NULL, 0 }
+};
+#endif
+
+int main(int argc, char* argv[])
+{
+	struct p11_session pool[P11_MAX_SESSIONS];
+	struct p11_job single;
+	unsigned long total = 0;
+	double start, elapsed;
+	int nsessions, nslots, i, t;
+
+	progname = strrchr(argv[0], '/');
+	if (progname != NULL)
+		++progname;
+	else
+		progname = argv[0];
+
+	timings_init(progname);
+	metrics_init(progname);
+
+	params.module = getenv("SB_PKCS11_MODULE");
+	params.token = getenv("SB_PKCS11_TOKEN");
+	params.md = EVP_sha512();
+	params.sessions = 4;
+
+#ifdef _AIX
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(*(argv + i), "--help")) {
+			*(argv + i) = "-h";
+		} else if (!strcmp(*(argv + i), "--verbose")) {
+			*(argv + i) = "-v";
+		} else if (!strcmp(*(argv + i), "--debug")) {
+			*(argv + i) = "-4";
+		} else if (!strcmp(*(argv + i), "--module")) {
+			*(argv + i) = "-m";
+		} else if (!strcmp(*(argv + i), "--token")) {
+			*(argv + i) = "-t";
+		} else if (!strcmp(*(argv + i), "--pin-file")) {
+			*(argv + i) = "-5";
+		} else if (!strcmp(*(argv + i), "--label")) {
+			*(argv + i) = "-k";
+		} else if (!strcmp(*(argv + i), "--infile")) {
+			*(argv + i) = "-i";
+		} else if (!strcmp(*(argv + i), "--outfile")) {
+			*(argv + i) = "-o";
+		} else if (!strcmp(*(argv + i), "--list")) {
+			*(argv + i) = "-l";
+		} else if (!strcmp(*(argv + i), "--sessions")) {
+			*(argv + i) = "-s";
+		} else if (!strcmp(*(argv + i), "--hash")) {
+			*(argv + i) = "-H";
+		} else if (!strcmp(*(argv + i), "--raw")) {
+			*(argv + i) = "-6";
+		} else if (!strcmp(*(argv + i), "--bench")) {
+			*(argv + i) = "-7";
+		} else if (!strcmp(*(argv + i), "--serve")) {
+			*(argv + i) = "-8";
+		} else if (!strcmp(*(argv + i), "--slot")) {
+			*(argv + i) = "-9";
+		} else if (!strcmp(*(argv + i), "--timings")) {
+			*(argv + i) = "-0";
+		} else if (!strcmp(*(argv + i), "--timings-json")) {
+			*(argv + i) = "-1";
+		} else if (!strcmp(*(argv + i), "--metrics")) {
+			*(argv + i) = "-2";
+		} else if (!strcmp(*(argv + i), "--metrics-socket")) {
+			*(argv + i) = "-3";
+		} else if (!strncmp(*(argv + i), "--", 2)) {
+			fprintf(stderr, "%s: unrecognized option \'%s\'\n", progname,
+					*(argv + i));
+			usage(EX_OK);
+		}
+	}
+#endif
+
+	while (1) {
+		int opt;
+#ifdef _AIX
+		opt = getopt(argc, argv, "?hv4m:t:5:k:i:o:l:s:H:67:89:012:3:");
+#else
+		opt = getopt_long(argc, argv, "?hv4m:t:5:k:i:o:l:s:H:67:89:012:3:", opts,
+				NULL);
+#endif
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'h':
+			usage(EX_OK);
+			break;
+		case '?':
+			usage(EX_USAGE);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case '4':
+			debug = true;
+			break;
+		case 'm':
+			params.module = optarg;
+			break;
+		case 't':
+			params.token = optarg;
+			break;
+		case '5':
+			params.pinfile = optarg;
+			break;
+		case 'k':
+			params.label = optarg;
+			break;
+		case 'i':
+			params.infile = optarg;
+			break;
+		case 'o':
+			params.outfile = optarg;
+			break;
+		case 'l':
+			params.listfile = optarg;
+			break;
+		case 's':
+			params.sessions = atoi(optarg);
+			if (params.sessions < 1 || params.sessions > P11_MAX_SESSIONS)
+				die(EX_USAGE, "Sessions must be 1 to %d", P11_MAX_SESSIONS);
+			break;
+		case 'H':
+			if (strcmp(optarg, "sha512") == 0)
+				params.md = EVP_sha512();
+			else if (strcmp(optarg, "sha3-512") == 0)
+				params.md = EVP_sha3_512();
+			else if (strcmp(optarg, "none") == 0)
+				params.md = NULL;
+			else
+				die(EX_DATAERR, "Unsupported hash: %s", optarg);
+			break;
+		case '6':
+			params.raw = true;
+			break;
+		case '7':
+			params.bench = strtoul(optarg, NULL, 0);
+			break;
+		case '8':
+			params.serve = true;
+			break;
+		case '9':
+			if (optarg[0] < 'a' || optarg[0] > 'z' || optarg[1] != '=')
+				die(EX_USAGE, "Invalid --slot, expecting <key>=<label>: %s",
+						optarg);
+			params.slot_labels[optarg[0] - 'a'] = optarg + 2;
+			break;
+		case '0':
+			timings_enable(TIMINGS_TABLE);
+			break;
+		case '1':
+			timings_enable(TIMINGS_JSON);
+			break;
+		case '2':
+			metrics.file = optarg;
+			break;
+		case '3':
+			metrics.socket = optarg;
+			break;
+		default:
+			usage(EX_USAGE);
+		}
+	}
+
+	if (!params.module)
+		die(EX_USAGE, "%s", "No PKCS#11 module given (--module)");
+	if (!params.token)
+		die(EX_USAGE, "%s", "No token label given (--token)");
+	if (!metrics_start())
+		die(EX_OSERR, "Cannot serve metrics: %s", strerror(errno));
+
+	t = timings_begin("read requests");
+	if (params.serve) {
+		/* stdout carries the responses */
+		verbose = false;
+		read_requests(stdin);
+	} else if (params.listfile) {
+		read_list(params.listfile);
+	} else if (params.bench) {
+		if (!params.label)
+			die(EX_USAGE, "%s", "The benchmark needs a key (--label)");
+		queue.jobs = calloc(params.bench, sizeof(*queue.jobs));
+		if (!queue.jobs)
+			die(EX_OSERR, "%s", "Cannot get memory");
+		for (unsigned long j = 0; j < params.bench; j++)
+			queue.jobs[j].label = params.label;
+		queue.njobs = params.bench;
+	} else {
+		if (!params.label || !params.infile || !params.outfile)
+			die(EX_USAGE, "%s",
+				"Need --label, --infile and --outfile, or --list");
+		single.label = params.label;
+		single.infile = params.infile;
+		single.outfile = params.outfile;
+		queue.jobs = &single;
+		queue.njobs = 1;
+	}
+
+	timings_end(t, 0);
+
+	if (!queue.njobs)
+		return 0;
+
+	nsessions = params.sessions;
+	if ((size_t) nsessions > queue.njobs)
+		nsessions = queue.njobs;
+
+	t = timings_begin("load module");
+	p11_load(params.module);
+	timings_end(t, 0);
+	t = timings_begin("open sessions");
+	nslots = p11_open_pool(pool, nsessions);
+	timings_end(t, 0);
+	metrics_gauge("stb_sessions", "Sessions signing", NULL, nsessions);
+
+	t = timings_begin("sign");
+	start = now();
+	for (i = 0; i < nsessions; i++)
+		if (pthread_create(&pool[i].thread, NULL, sign_worker, &pool[i]))
+			die(EX_OSERR, "Cannot create thread: %s", strerror(errno));
+	for (i = 0; i < nsessions; i++) {
+		pthread_join(pool[i].thread, NULL);
+		debug_msg("Session %d (slot %lu) made %lu signature(s)", i,
+				pool[i].slot, pool[i].count);
+		total += pool[i].count;
+	}
+	elapsed = now() - start;
+	timings_end(t, 0);
+
+	p11_close_pool(pool, nsessions);
+	p11_unload();
+
+	if (params.bench)
+		printf("%lu signatures, %d session(s) on %d slot(s): %.3f s, "
+				"%.1f signatures/s\n", total, nsessions, nslots,
+				elapsed, elapsed > 0 ? total / elapsed : 0.0);
+	else
+		verbose_msg("Made %lu signature(s) in %.3f s", total, elapsed);
+
+	return 0;
+}
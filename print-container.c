@@ -20,15 +20,10 @@
 #include <getopt.h>
 #endif
 
-#include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <openssl/bn.h>
-#include <openssl/ec.h>
-#include <openssl/ecdsa.h>
 #include <openssl/evp.h>
-#include <openssl/obj_mac.h>
 #include <openssl/opensslv.h>
 #include <openssl/ossl_typ.h>
 #include <openssl/sha.h>
@@ -46,10 +41,8 @@
 #include "ccan/endian/endian.h"
 #include "container.c"
 #include "container.h"
-
-#ifdef ADD_DILITHIUM
-#include "mlca2.h"
-#endif
+#include "libstbcontainer.h"
+#include "timings.h"
 
 char *progname;
 
@@ -57,63 +50,36 @@ bool print_stats;
 bool verbose, debug;
 int wrap = 100;
 
-ecc_key_t ECDSA_KEY_NULL;
-
-typedef struct keyprops {
-	char index;
-	char *name;
-	const ecc_key_t *key;
-	const ecc_signature_t *sig;
-} Keyprops;
-
 static struct {
-	char *imagefn;
+	char *imagefn;		/* the one being looked at */
+	char **imagefns;
+	int nimages;
 	bool validate;
 	bool ignore_remainder;
 	char *verify;
 	bool print_container;
+	bool arena;
+	char *io_strategy;
 } params;
 
+/* Enough for the OpenSSL working memory of validating any container. */
+#define ARENA_SIZE	(256 * 1024)
+
 static void usage(int status);
 
-static bool getPayloadHash(int fdin, uint64_t pl_sz_expected, unsigned char *md, int container_version,
-			   uint8_t hash_alg);
 static bool getVerificationHash(char *input, unsigned char *md, int len);
-static bool verify_signature(const char *moniker, const unsigned char *dgst,
-		int dgst_len, const ecc_signature_t sig_raw, const ecc_key_t key_raw);
-static bool verify_dilithium_signature(const char *moniker, const unsigned char *dgst,
-				       int dgst_len, const dilithium_signature_t sig_raw, const dilithium_key_t key_raw);
-static bool verify_mldsa_87_signature(const char *moniker, const unsigned char *dgst,
-				       int dgst_len, const mldsa_signature_t sig_raw, const mldsa_key_t key_raw);
 
+struct stb_ctx *stb;
 
-unsigned char *calc_hash(uint8_t hash_alg,
-			 const unsigned char *data, size_t len,
-			 unsigned char *md)
+static void alloc_counts(uint64_t *allocs, uint64_t *bytes,
+			 uint64_t *arena_allocs)
 {
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	uint32_t md_len = SHA512_DIGEST_LENGTH;
-	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-	const EVP_MD* alg;
-
-	switch (hash_alg) {
-	case HASH_ALG_SHA512:
-		alg = EVP_sha512();
-		break;
-	case HASH_ALG_SHA3_512:
-		alg = EVP_sha3_512();
-		break;
-	default:
-		return NULL;
-	}
-	EVP_DigestInit_ex(ctx, alg, NULL);
-	EVP_DigestUpdate(ctx, data, len);
-	EVP_DigestFinal_ex(ctx, md, &md_len);
-	EVP_MD_CTX_destroy(ctx);
-	return md;
-#else
-	return NULL;
-#endif
+	struct stb_alloc_stats as;
+
+	stb_alloc_stats(&as);
+	*allocs = as.allocs;
+	*bytes = as.bytes;
+	*arena_allocs = as.arena_allocs;
 }
 
 static void print_bytes(char *lead, uint8_t *buffer, size_t buflen)
@@ -134,93 +100,6 @@ static void print_bytes(char *lead, uint8_t *buffer, size_t buflen)
 	fprintf(stdout, "\n");
 }
 
-bool stb_is_container(const void *buf, size_t size)
-{
-	ROM_container_raw *c;
-
-	c = (ROM_container_raw*) buf;
-	if (!buf || size < SECURE_BOOT_HEADERS_SIZE)
-		return false;
-	if (be32_to_cpu(c->magic_number) != ROM_MAGIC_NUMBER)
-		return false;
-	return true;
-}
-
-bool stb_is_v2_container(const void *buf, size_t size)
-{
-	ROM_container_v2_raw *c;
-
-	c = (ROM_container_v2_raw*) buf;
-	if (!buf || size < SECURE_BOOT_HEADERS_V2_SIZE)
-		return false;
-	if (be32_to_cpu(c->magic_number) != ROM_MAGIC_NUMBER)
-		return false;
-	if (be16_to_cpu(c->version) != 2) {
-		return false;
-	}
-	return true;
-}
-
-bool stb_is_v3_container(const void *buf, size_t size)
-{
-	ROM_container_v3_raw *c;
-
-	c = (ROM_container_v3_raw*) buf;
-	if (!buf || size < SECURE_BOOT_HEADERS_V3_SIZE)
-		return false;
-	if (be32_to_cpu(c->magic_number) != ROM_MAGIC_NUMBER)
-		return false;
-	if (be16_to_cpu(c->version) != 3) {
-		return false;
-	}
-	return true;
-}
-
-int parse_stb_container(const void* data, size_t len,
-		struct parsed_stb_container *c)
-{
-	const size_t prefix_data_min_size = 3 * (EC_COORDBYTES * 2);
-	c->buf = data;
-	c->bufsz = len;
-	c->c = data;
-	c->ph = data += sizeof(ROM_container_raw);
-	c->pd = data += sizeof(ROM_prefix_header_raw)
-			+ (c->ph->ecid_count * ECID_SIZE);
-	c->sh = data += prefix_data_min_size
-			+ c->ph->sw_key_count * (EC_COORDBYTES * 2);
-	c->ssig = data += sizeof(ROM_sw_header_raw) + c->sh->ecid_count * ECID_SIZE;
-
-	return 0;
-}
-
-int parse_stb_container_v2(const void* data, size_t len,
-                           struct parsed_stb_container_v2 *c)
-{
-	c->buf = data;
-	c->bufsz = len;
-	c->c = data;
-	c->ph = &(c->c->prefix);
-	c->pd = &(c->c->prefix_data);
-	c->sh = &(c->c->swheader);
-	c->ssig = &(c->c->sw_data);
-
-	return 0;
-}
-
-int parse_stb_container_v3(const void* data, size_t len,
-                           struct parsed_stb_container_v3 *c)
-{
-	c->buf = data;
-	c->bufsz = len;
-	c->c = data;
-	c->ph = &(c->c->prefix);
-	c->pd = &(c->c->prefix_data);
-	c->sh = &(c->c->swheader);
-	c->ssig = &(c->c->sw_data);
-
-	return 0;
-}
-
 static void display_version_raw(const ROM_version_raw v)
 {
 	printf("ver_alg:\n");
@@ -236,107 +115,110 @@ static void display_version_raw(const ROM_version_raw v)
 	else printf("  sig_alg:  %02x (%s)\n", v.sig_alg, "UNKNOWN");
 }
 
-static void display_container_stats(const struct parsed_stb_container *c)
+static void display_container_stats(const struct stb_container *c)
 {
+	static const char *const names[STB_REGION_COUNT] = {
+		"HW header size       ",
+		"Prefix header size   ",
+		"Prefix data size     ",
+		"SW header size       ",
+		"SW signature size    ",
+	};
+	const struct stb_layout *l = c->layout;
+	const uint8_t *buf = c->region[STB_REGION_HW_HDR];
 	unsigned int size, offset;
+	uint64_t payload_size, unprotected_size, container_size;
 
 	printf("Container stats:\n");
-	size = (uint8_t*) c->ph - (uint8_t *) c->c;
-	offset = (uint8_t*) c->c - (uint8_t *) c->buf;
-	printf("  HW header size        = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->pd - (uint8_t *) c->ph;
-	offset = (uint8_t*) c->ph - (uint8_t *) c->buf;
-	printf("  Prefix header size    = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->sh - (uint8_t *) c->pd;
-	offset = (uint8_t*) c->pd - (uint8_t *) c->buf;
-	printf("  Prefix data size      = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->ssig - (uint8_t *) c->sh;
-	offset = (uint8_t*) c->sh - (uint8_t *) c->buf;
-	printf("  SW header size        = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = sizeof(ecc_key_t) * c->ph->sw_key_count;
-	offset = (uint8_t*) c->ssig - (uint8_t *) c->buf;
-	printf("  SW signature size     = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-
-	printf("  TOTAL HEADER SIZE     = %4lu (%#0lx)\n", c->bufsz, c->bufsz);
-	printf("  PAYLOAD SIZE          = %4lu (%#0lx)\n",
-			be64_to_cpu(c->sh->payload_size), be64_to_cpu(c->sh->payload_size));
-	printf("  TOTAL CONTAINER SIZE  = %4lu (%#0lx)\n",
-			be64_to_cpu(c->c->container_size),
-			be64_to_cpu(c->c->container_size));
+	for (int i = 0; i < STB_REGION_COUNT; i++) {
+		if (i + 1 < STB_REGION_COUNT) {
+			size = c->region[i + 1] - c->region[i];
+		} else {
+			// The signatures of the SW keys in use.
+			size = 0;
+			for (int n = 0; n < l->sw_slot_count; n++)
+				if (stb_sw_slot_used(c, n))
+					size += l->sw_slots[n].sig.size;
+		}
+		offset = c->region[i] - buf;
+		printf("  %s = %4u (%#06x) at offset %4u (%#06x)\n", names[i],
+				size, size, offset, offset);
+	}
+
+	payload_size = stb_field_be64(c, &l->payload_size);
+	container_size = stb_field_be64(c, &l->container_size);
+	printf("  TOTAL HEADER SIZE     = %4lu (%#0lx)\n", l->header_size,
+			l->header_size);
+	printf("  PAYLOAD SIZE          = %4lu (%#0lx)\n", payload_size,
+			payload_size);
+	if (l->unprotected_size.size) {
+		unprotected_size = stb_field_be64(c, &l->unprotected_size);
+		printf("  UNPROTECTED SIZE      = %4lu (%#0lx)\n", unprotected_size,
+				unprotected_size);
+	}
+	printf("  TOTAL CONTAINER SIZE  = %4lu (%#0lx)\n", container_size,
+			container_size);
 	printf("\n");
 }
 
-static void display_container_stats_v2(const struct parsed_stb_container_v2 *c)
+/* The keys, or signatures, of count slots of a container. */
+static void display_slots(const struct stb_container *c, const char *kind,
+			  const struct stb_slot *slots, int count, bool keys)
 {
-	unsigned int size, offset;
+	char name[16], lead[16];
 
-	printf("Container stats:\n");
-	size = (uint8_t*) c->ph - (uint8_t *) c->c;
-	offset = (uint8_t*) c->c - (uint8_t *) c->buf;
-	printf("  HW header size        = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->pd - (uint8_t *) c->ph;
-	offset = (uint8_t*) c->ph - (uint8_t *) c->buf;
-	printf("  Prefix header size    = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->sh - (uint8_t *) c->pd;
-	offset = (uint8_t*) c->pd - (uint8_t *) c->buf;
-	printf("  Prefix data size      = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->ssig - (uint8_t *) c->sh;
-	offset = (uint8_t*) c->sh - (uint8_t *) c->buf;
-	printf("  SW header size        = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-
-	printf("  TOTAL HEADER SIZE     = %4lu (%#0lx)\n", c->bufsz, c->bufsz);
-	printf("  PAYLOAD SIZE          = %4lu (%#0lx)\n",
-			be64_to_cpu(c->sh->payload_size), be64_to_cpu(c->sh->payload_size));
-	printf("  TOTAL CONTAINER SIZE  = %4lu (%#0lx)\n",
-			be64_to_cpu(c->c->container_size),
-			be64_to_cpu(c->c->container_size));
+	for (int i = 0; i < count; i++) {
+		const struct stb_field *f = keys ? &slots[i].key : &slots[i].sig;
+
+		snprintf(name, sizeof(name), "%s_%c:", kind, slots[i].id);
+		snprintf(lead, sizeof(lead), "%-11s", name);
+		print_bytes(lead, (uint8_t *) stb_field_ptr(c, f), f->size);
+	}
+}
+
+static void display_hw_keys(const struct stb_container *c)
+{
+	const struct stb_layout *l = c->layout;
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	int r;
+
+	display_slots(c, "hw_pkey", l->hw_slots, l->hw_slot_count, true);
+
+	r = stb_hw_keys_hash(stb, c, md);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	printf("HW keys hash (calculated):\n");
+	print_bytes((char *) "           ", (uint8_t *) md, sizeof(md));
 	printf("\n");
 }
 
-static void display_container_stats_v3(const struct parsed_stb_container_v3 *c)
+/* The HW signatures, and the SW keys counted in the prefix header. */
+static void display_prefix_data(const struct stb_container *c)
 {
-	unsigned int size, offset;
+	const struct stb_layout *l = c->layout;
+	int sw_keys = min((int) *stb_field_ptr(c, &l->sw_key_count),
+			  l->sw_slot_count);
 
-	printf("Container stats:\n");
-	size = (uint8_t*) c->ph - (uint8_t *) c->c;
-	offset = (uint8_t*) c->c - (uint8_t *) c->buf;
-	printf("  HW header size        = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->pd - (uint8_t *) c->ph;
-	offset = (uint8_t*) c->ph - (uint8_t *) c->buf;
-	printf("  Prefix header size    = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->sh - (uint8_t *) c->pd;
-	offset = (uint8_t*) c->pd - (uint8_t *) c->buf;
-	printf("  Prefix data size      = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-	size = (uint8_t*) c->ssig - (uint8_t *) c->sh;
-	offset = (uint8_t*) c->sh - (uint8_t *) c->buf;
-	printf("  SW header size        = %4u (%#06x) at offset %4u (%#06x)\n",
-			size, size, offset, offset);
-
-	printf("  TOTAL HEADER SIZE     = %4lu (%#0lx)\n", c->bufsz, c->bufsz);
-	printf("  PAYLOAD SIZE          = %4lu (%#0lx)\n",
-			be64_to_cpu(c->sh->payload_size), be64_to_cpu(c->sh->payload_size));
-	printf("  TOTAL CONTAINER SIZE  = %4lu (%#0lx)\n",
-			be64_to_cpu(c->c->container_size),
-			be64_to_cpu(c->c->container_size));
+	printf("Prefix Data:\n");
+	display_slots(c, "hw_sig", l->hw_slots, l->hw_slot_count, false);
+	display_slots(c, "sw_pkey", l->sw_slots, sw_keys, true);
+}
+
+static void display_sw_sigs(const struct stb_container *c)
+{
+	const struct stb_layout *l = c->layout;
+
+	printf("Software Signatures:\n");
+	display_slots(c, "sw_sig", l->sw_slots, l->sw_slot_count, false);
 	printf("\n");
+
+	if (print_stats)
+		display_container_stats(c);
 }
 
-static void display_container(struct parsed_stb_container c)
+static void display_container(const struct stb_container *sc)
 {
-	unsigned char md[SHA512_DIGEST_LENGTH];
-	void *p;
+	struct parsed_stb_container c = sc->v1;
 
 	printf("Container:\n");
 	printf("magic:          0x%04x\n", be32_to_cpu(c.c->magic_number));
@@ -345,19 +227,7 @@ static void display_container(struct parsed_stb_container c)
 			be64_to_cpu(c.c->container_size));
 	printf("target_hrmor:   0x%08lx\n", be64_to_cpu(c.c->target_hrmor));
 	printf("stack_pointer:  0x%08lx\n", be64_to_cpu(c.c->stack_pointer));
-	print_bytes((char *) "hw_pkey_a: ", (uint8_t *) c.c->hw_pkey_a,
-			sizeof(c.c->hw_pkey_a));
-	print_bytes((char *) "hw_pkey_b: ", (uint8_t *) c.c->hw_pkey_b,
-			sizeof(c.c->hw_pkey_b));
-	print_bytes((char *) "hw_pkey_c: ", (uint8_t *) c.c->hw_pkey_c,
-			sizeof(c.c->hw_pkey_c));
-
-	p = SHA512(c.c->hw_pkey_a, sizeof(ecc_key_t) * 3, md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-	printf("HW keys hash (calculated):\n");
-	print_bytes((char *) "           ", (uint8_t *) md, sizeof(md));
-	printf("\n");
+	display_hw_keys(sc);
 
 	printf("Prefix Header:\n");
 	display_version_raw(c.ph->ver_alg);
@@ -378,18 +248,7 @@ static void display_container(struct parsed_stb_container c)
 	}
 	printf("\n");
 
-	printf("Prefix Data:\n");
-	print_bytes((char *) "hw_sig_a:  ", (uint8_t *) c.pd->hw_sig_a, sizeof(c.pd->hw_sig_a));
-	print_bytes((char *) "hw_sig_b:  ", (uint8_t *) c.pd->hw_sig_b, sizeof(c.pd->hw_sig_b));
-	print_bytes((char *) "hw_sig_c:  ", (uint8_t *) c.pd->hw_sig_c, sizeof(c.pd->hw_sig_c));
-
-	if (c.ph->sw_key_count >=1)
-		print_bytes((char *) "sw_pkey_p: ", (uint8_t *) c.pd->sw_pkey_p, sizeof(c.pd->sw_pkey_p));
-	if (c.ph->sw_key_count >=2)
-		print_bytes((char *) "sw_pkey_q: ", (uint8_t *) c.pd->sw_pkey_q, sizeof(c.pd->sw_pkey_q));
-	if (c.ph->sw_key_count >=3)
-		print_bytes((char *) "sw_pkey_r: ", (uint8_t *) c.pd->sw_pkey_r, sizeof(c.pd->sw_pkey_r));
-
+	display_prefix_data(sc);
 	printf("\n");
 
 	printf("Software Header:\n");
@@ -413,779 +272,324 @@ static void display_container(struct parsed_stb_container c)
 	}
 	printf("\n");
 
-	printf("Software Signatures:\n");
-	print_bytes((char *) "sw_sig_p:  ", (uint8_t *) c.ssig->sw_sig_p,
-			sizeof(c.ssig->sw_sig_p));
-	print_bytes((char *) "sw_sig_q:  ", (uint8_t *) c.ssig->sw_sig_q,
-			sizeof(c.ssig->sw_sig_q));
-	print_bytes((char *) "sw_sig_r:  ", (uint8_t *) c.ssig->sw_sig_r,
-			sizeof(c.ssig->sw_sig_r));
-	printf("\n");
-
-	if (print_stats)
-	display_container_stats(&c);
+	display_sw_sigs(sc);
 }
 
-static void display_container_v2(struct parsed_stb_container_v2 c)
+/* v2 and v3 containers, whose headers only differ in their PQ keys. */
+static void display_container_v2(const struct stb_container *sc)
 {
-	unsigned char md[SHA512_DIGEST_LENGTH];
-	void *p;
+	const ROM_container_v2_raw *c =
+		(const ROM_container_v2_raw *) sc->region[STB_REGION_HW_HDR];
+	const ROM_prefix_header_v2_raw *ph =
+		(const ROM_prefix_header_v2_raw *) sc->region[STB_REGION_PREFIX_HDR];
+	const ROM_sw_header_v2_raw *sh =
+		(const ROM_sw_header_v2_raw *) sc->region[STB_REGION_SW_HDR];
 
 	printf("Container:\n");
-	printf("magic:          0x%04x\n", be32_to_cpu(c.c->magic_number));
-	printf("version:        0x%02x\n", be16_to_cpu(c.c->version));
-	printf("container_size: 0x%08lx (%lu)\n", be64_to_cpu(c.c->container_size),
-			be64_to_cpu(c.c->container_size));
-	print_bytes((char *) "hw_pkey_a: ", (uint8_t *) c.c->hw_pkey_a,
-			sizeof(c.c->hw_pkey_a));
-	print_bytes((char *) "hw_pkey_d: ", (uint8_t *) c.c->hw_pkey_d,
-			sizeof(c.c->hw_pkey_d));
-
-	p = calc_hash(HASH_ALG_SHA3_512, c.c->hw_pkey_a, sizeof(ecc_key_t) + sizeof(dilithium_key_t), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
-	printf("HW keys hash (calculated):\n");
-	print_bytes((char *) "           ", (uint8_t *) md, sizeof(md));
-	printf("\n");
+	printf("magic:          0x%04x\n", be32_to_cpu(c->magic_number));
+	printf("version:        0x%02x\n", be16_to_cpu(c->version));
+	printf("container_size: 0x%08lx (%lu)\n", be64_to_cpu(c->container_size),
+			be64_to_cpu(c->container_size));
+	display_hw_keys(sc);
 
 	printf("Prefix Header:\n");
-	display_version_raw(c.ph->ver_alg);
-	printf("reserved:          %08lx\n", be64_to_cpu(c.ph->reserved));
-	printf("flags:             %08x\n", be32_to_cpu(c.ph->flags));
-	printf("sw_key_count:      %02x\n", c.ph->sw_key_count);
-	printf("payload_size:      %08lx\n", be64_to_cpu(c.ph->payload_size));
-	print_bytes((char *) "payload_hash:      ", (uint8_t *) c.ph->payload_hash,
-			sizeof(c.ph->payload_hash));
+	display_version_raw(ph->ver_alg);
+	printf("reserved:          %08lx\n", be64_to_cpu(ph->reserved));
+	printf("flags:             %08x\n", be32_to_cpu(ph->flags));
+	printf("sw_key_count:      %02x\n", ph->sw_key_count);
+	printf("payload_size:      %08lx\n", be64_to_cpu(ph->payload_size));
+	print_bytes((char *) "payload_hash:      ", (uint8_t *) ph->payload_hash,
+			sizeof(ph->payload_hash));
 	print_bytes((char *) "ecid:              ",
-		    (uint8_t *) c.ph->ecid, sizeof(c.ph->ecid));
+		    (uint8_t *) ph->ecid, sizeof(ph->ecid));
 	printf("\n");
 	printf("\n");
 
-	printf("Prefix Data:\n");
-	print_bytes((char *) "hw_sig_a:  ", (uint8_t *) c.pd->hw_sig_a, sizeof(c.pd->hw_sig_a));
-	print_bytes((char *) "hw_sig_d:  ", (uint8_t *) c.pd->hw_sig_d, sizeof(c.pd->hw_sig_d));
-
-	if (c.ph->sw_key_count >=1)
-		print_bytes((char *) "sw_pkey_p: ", (uint8_t *) c.pd->sw_pkey_p, sizeof(c.pd->sw_pkey_p));
-	if (c.ph->sw_key_count >=2)
-		print_bytes((char *) "sw_pkey_s: ", (uint8_t *) c.pd->sw_pkey_s, sizeof(c.pd->sw_pkey_s));
+	display_prefix_data(sc);
 	printf("\n");
 
 	printf("Software Header:\n");
-	display_version_raw(c.sh->ver_alg);
-	printf("reserved:          %08lx\n", be64_to_cpu(c.sh->reserved));
-	printf("component id:      %08lx\n", be64_to_cpu(c.sh->component_id));
-	printf("component id (ASCII): %.8s\n", (char *) &(c.sh->component_id));
-	printf("flags:             %08x\n", be32_to_cpu(c.sh->flags));
-	printf("security_version:  %02x\n", c.sh->security_version);
-	printf("payload_size:      %08lx (%lu)\n", be64_to_cpu(c.sh->payload_size),
-			be64_to_cpu(c.sh->payload_size));
-	printf("unprotected payload_size: %08lx (%lu)\n", be64_to_cpu(c.sh->unprotected_payload_size),
-			be64_to_cpu(c.sh->unprotected_payload_size));
-	print_bytes((char *) "payload_hash:      ", (uint8_t *) c.sh->payload_hash,
-			sizeof(c.sh->payload_hash));
+	display_version_raw(sh->ver_alg);
+	printf("reserved:          %08lx\n", be64_to_cpu(sh->reserved));
+	printf("component id:      %08lx\n", be64_to_cpu(sh->component_id));
+	printf("component id (ASCII): %.8s\n", (char *) &(sh->component_id));
+	printf("flags:             %08x\n", be32_to_cpu(sh->flags));
+	printf("security_version:  %02x\n", sh->security_version);
+	printf("payload_size:      %08lx (%lu)\n", be64_to_cpu(sh->payload_size),
+			be64_to_cpu(sh->payload_size));
+	printf("unprotected payload_size: %08lx (%lu)\n", be64_to_cpu(sh->unprotected_payload_size),
+			be64_to_cpu(sh->unprotected_payload_size));
+	print_bytes((char *) "payload_hash:      ", (uint8_t *) sh->payload_hash,
+			sizeof(sh->payload_hash));
 	print_bytes((char *) "ecid:              ",
-		    (uint8_t *) c.sh->ecid, sizeof(c.sh->ecid));
-	printf("\n");
+		    (uint8_t *) sh->ecid, sizeof(sh->ecid));
 	printf("\n");
-
-	printf("Software Signatures:\n");
-	print_bytes((char *) "sw_sig_p:  ", (uint8_t *) c.ssig->sw_sig_p,
-			sizeof(c.ssig->sw_sig_p));
-	print_bytes((char *) "sw_sig_s:  ", (uint8_t *) c.ssig->sw_sig_s,
-			sizeof(c.ssig->sw_sig_s));
 	printf("\n");
 
-	if (print_stats)
-        display_container_stats_v2(&c);
+	display_sw_sigs(sc);
 }
 
-static void display_container_v3(struct parsed_stb_container_v3 c, uint8_t hash_alg)
+static void print_sig_checks(const struct stb_sig_check *k, int count,
+			     const char *skipped)
 {
-	unsigned char md[SHA512_DIGEST_LENGTH];
-	void *p;
-
-	printf("Container:\n");
-	printf("magic:          0x%04x\n", be32_to_cpu(c.c->magic_number));
-	printf("version:        0x%02x\n", be16_to_cpu(c.c->version));
-	printf("container_size: 0x%08lx (%lu)\n", be64_to_cpu(c.c->container_size),
-			be64_to_cpu(c.c->container_size));
-	print_bytes((char *) "hw_pkey_a: ", (uint8_t *) c.c->hw_pkey_a,
-			sizeof(c.c->hw_pkey_a));
-	print_bytes((char *) "hw_pkey_d: ", (uint8_t *) c.c->hw_pkey_d,
-			sizeof(c.c->hw_pkey_d));
-
-	p = calc_hash(hash_alg, c.c->hw_pkey_a, sizeof(ecc_key_t) + sizeof(mldsa_key_t), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
-	printf("HW keys hash (calculated):\n");
-	print_bytes((char *) "           ", (uint8_t *) md, sizeof(md));
-	printf("\n");
-
-	printf("Prefix Header:\n");
-	display_version_raw(c.ph->ver_alg);
-	printf("reserved:          %08lx\n", be64_to_cpu(c.ph->reserved));
-	printf("flags:             %08x\n", be32_to_cpu(c.ph->flags));
-	printf("sw_key_count:      %02x\n", c.ph->sw_key_count);
-	printf("payload_size:      %08lx\n", be64_to_cpu(c.ph->payload_size));
-	print_bytes((char *) "payload_hash:      ", (uint8_t *) c.ph->payload_hash,
-			sizeof(c.ph->payload_hash));
-	print_bytes((char *) "ecid:              ",
-		    (uint8_t *) c.ph->ecid, sizeof(c.ph->ecid));
-	printf("\n");
-	printf("\n");
-
-	printf("Prefix Data:\n");
-	print_bytes((char *) "hw_sig_a:  ", (uint8_t *) c.pd->hw_sig_a, sizeof(c.pd->hw_sig_a));
-	print_bytes((char *) "hw_sig_d:  ", (uint8_t *) c.pd->hw_sig_d, sizeof(c.pd->hw_sig_d));
-
-	if (c.ph->sw_key_count >=1)
-		print_bytes((char *) "sw_pkey_p: ", (uint8_t *) c.pd->sw_pkey_p, sizeof(c.pd->sw_pkey_p));
-	if (c.ph->sw_key_count >=2)
-		print_bytes((char *) "sw_pkey_s: ", (uint8_t *) c.pd->sw_pkey_s, sizeof(c.pd->sw_pkey_s));
-	printf("\n");
-
-	printf("Software Header:\n");
-	display_version_raw(c.sh->ver_alg);
-	printf("reserved:          %08lx\n", be64_to_cpu(c.sh->reserved));
-	printf("component id:      %08lx\n", be64_to_cpu(c.sh->component_id));
-	printf("component id (ASCII): %.8s\n", (char *) &(c.sh->component_id));
-	printf("flags:             %08x\n", be32_to_cpu(c.sh->flags));
-	printf("security_version:  %02x\n", c.sh->security_version);
-	printf("payload_size:      %08lx (%lu)\n", be64_to_cpu(c.sh->payload_size),
-			be64_to_cpu(c.sh->payload_size));
-	printf("unprotected payload_size: %08lx (%lu)\n", be64_to_cpu(c.sh->unprotected_payload_size),
-			be64_to_cpu(c.sh->unprotected_payload_size));
-	print_bytes((char *) "payload_hash:      ", (uint8_t *) c.sh->payload_hash,
-			sizeof(c.sh->payload_hash));
-	print_bytes((char *) "ecid:              ",
-		    (uint8_t *) c.sh->ecid, sizeof(c.sh->ecid));
-	printf("\n");
-	printf("\n");
-
-	printf("Software Signatures:\n");
-	print_bytes((char *) "sw_sig_p:  ", (uint8_t *) c.ssig->sw_sig_p,
-			sizeof(c.ssig->sw_sig_p));
-	print_bytes((char *) "sw_sig_s:  ", (uint8_t *) c.ssig->sw_sig_s,
-			sizeof(c.ssig->sw_sig_s));
-	printf("\n");
-
-	if (print_stats)
-        display_container_stats_v3(&c);
-}
-
-static bool validate_container(struct parsed_stb_container c, int fdin)
-{
-	static int n;
-	static int status = true;
-
-	Keyprops *k;
-
-	Keyprops hwKeylist[] = {
-		{ 'a', "HW_key_A", &(c.c->hw_pkey_a), &(c.pd->hw_sig_a) },
-		{ 'b', "HW_key_B", &(c.c->hw_pkey_b), &(c.pd->hw_sig_b) },
-		{ 'c', "HW_key_C", &(c.c->hw_pkey_c), &(c.pd->hw_sig_c) },
-		{ 0, NULL, NULL, NULL },
-	};
-	Keyprops swKeylist[] = {
-		{ 'p', "SW_key_P", &(c.pd->sw_pkey_p), &(c.ssig->sw_sig_p) },
-		{ 'q', "SW_key_Q", &(c.pd->sw_pkey_q), &(c.ssig->sw_sig_q) },
-		{ 'r', "SW_key_R", &(c.pd->sw_pkey_r), &(c.ssig->sw_sig_r) },
-		{ 0, NULL, NULL, NULL },
-	};
-
-	void *md = alloca(SHA512_DIGEST_LENGTH);
-	void *p;
-
-	// Get Prefix header hash.
-	p = SHA512((uint8_t *) c.ph, sizeof(ROM_prefix_header_raw), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-	if (verbose) print_bytes((char *) "PR header hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	// Verify HW key sigs.
-	for (k = hwKeylist; k->index; k++) {
-
-		if (memcmp(k->key, &ECDSA_KEY_NULL, sizeof(ecc_key_t)))
-			status = verify_signature(k->name, md, SHA512_DIGEST_LENGTH,
-					*(k->sig), *(k->key)) && status;
-		else
-			if (verbose) printf("%s is NULL, skipping signature check.\n", k->name);
-	}
-	if (verbose) printf("\n");
-
-	// Get SW header hash.
-	p = SHA512((uint8_t *) c.sh, sizeof(ROM_sw_header_raw), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-	if (verbose) print_bytes((char *) "SW header hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	// Verify SW key sigs.
-	for (k = swKeylist, n = 1; k->index && n <= c.ph->sw_key_count; k++, n++) {
-
-		if (memcmp(k->key, &ECDSA_KEY_NULL, sizeof(ecc_key_t)))
-			status = verify_signature(k->name, md, SHA512_DIGEST_LENGTH,
-					*(k->sig), *(k->key)) && status;
+	for (; count > 0; k++, count--) {
+		if (!verbose)
+			continue;
+		if (k->result == STB_CHECK_PASSED)
+			printf("%s signature is good: VERIFIED ./\n", k->name);
+		else if (k->result == STB_CHECK_FAILED)
+			printf("%s signature FAILED to verify.\n", k->name);
 		else
-			if (verbose) printf("%s is NULL, skipping\n", k->name);
-	}
-	if (verbose) printf("\n");
-
-	// Verify Payload hash.
-	status = getPayloadHash(fdin, be64_to_cpu(c.sh->payload_size), md, 1, HASH_ALG_SHA512)
-			&& status;
-	if (verbose) print_bytes((char *) "Payload hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	if (memcmp((uint8_t *) c.sh->payload_hash, md, SHA512_DIGEST_LENGTH)) {
-		if (verbose)
-			printf("Payload hash does not agree with value in SW header: MISMATCH\n");
-		status = false;
-	} else {
-		if (verbose)
-			printf("Payload hash agrees with value in SW header: VERIFIED ./\n");
-		status = status && true;
-	}
-	if (verbose) printf("\n");
-
-	// Verify SW keys hash.
-	p = SHA512(c.pd->sw_pkey_p, sizeof(ecc_key_t) * c.ph->sw_key_count, md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-	if (verbose) print_bytes((char *) "SW keys hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	if (memcmp((uint8_t *) c.ph->payload_hash, md, SHA512_DIGEST_LENGTH)) {
-		if (verbose)
-			printf("SW keys hash does not agree with value in Prefix header: MISMATCH\n");
-		status = false;
-	} else {
-		if (verbose)
-			printf("SW keys hash agrees with value in Prefix header: VERIFIED ./\n");
-		status = status && true;
+			printf("%s is NULL, %s\n", k->name, skipped);
 	}
 	if (verbose) printf("\n");
-	return status;
 }
 
+/* What a container read from a pipe is read and hashed at a time. */
+#define STREAM_CHUNK	(256 * 1024)
 
-static bool validate_container_v2(struct parsed_stb_container_v2 c, int fdin)
+static size_t read_full(int fd, void *buf, size_t len)
 {
-	static int status = true;
-
-	void *md = alloca(SHA512_DIGEST_LENGTH);
-	void *p;
-	size_t sSwKeySize = 0;
-
-	// Get Prefix header hash.
-	p = calc_hash(HASH_ALG_SHA3_512, (uint8_t *) c.ph, sizeof(ROM_prefix_header_v2_raw), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-	if (verbose) print_bytes((char *) "PR header hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	// Verify HW key sigs.
-	if (memcmp(&(c.c->hw_pkey_a), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		status = verify_signature("HW_key_A", md, SHA512_DIGEST_LENGTH,
-					  c.pd->hw_sig_a, c.c->hw_pkey_a) && status;
-	} else if (verbose) {
-		printf("HW_key_A is NULL, skipping signature check.\n");
-	}
-	if (memcmp(&(c.c->hw_pkey_d), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		status = verify_dilithium_signature("HW_key_D", md, SHA512_DIGEST_LENGTH,
-						    c.pd->hw_sig_d, c.c->hw_pkey_d) && status;
-	} else if (verbose) {
-		printf("HW_key_D is NULL, skipping signature check.\n");
-	}
-	if (verbose) printf("\n");
-
-	// Get SW header hash.
-	p = calc_hash(HASH_ALG_SHA3_512, (uint8_t *) c.sh, sizeof(ROM_sw_header_v2_raw), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-	if (verbose) print_bytes((char *) "SW header hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	// Verify SW key sigs.
-	if (memcmp(&(c.pd->sw_pkey_p), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		status = verify_signature("SW_key_P", md, SHA512_DIGEST_LENGTH,
-					  c.ssig->sw_sig_p, c.pd->sw_pkey_p) && status;
-		sSwKeySize += sizeof(ecc_key_t);
-	} else if (verbose) {
-		printf("%s is NULL, skipping\n", "SW_key_P");
-	}
-	if (memcmp(&(c.pd->sw_pkey_s), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		status = verify_dilithium_signature("SW_key_S", md, SHA512_DIGEST_LENGTH,
-						    c.ssig->sw_sig_s, c.pd->sw_pkey_s) && status;
-		sSwKeySize += sizeof(dilithium_key_t);
-	} else if (verbose) {
-		printf("%s is NULL, skipping\n", "SW_key_S");
-	}
-	if (verbose) printf("\n");
-
-	// Verify Payload hash.
-	status = getPayloadHash(fdin, be64_to_cpu(c.sh->payload_size), md, 2, HASH_ALG_SHA3_512)
-			&& status;
-	if (verbose) print_bytes((char *) "Payload hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	if (memcmp((uint8_t *) c.sh->payload_hash, md, SHA512_DIGEST_LENGTH)) {
-		if (verbose)
-			printf("Payload hash does not agree with value in SW header: MISMATCH\n");
-		status = false;
-	} else {
-		if (verbose)
-			printf("Payload hash agrees with value in SW header: VERIFIED ./\n");
-		status = status && true;
-	}
-	if (verbose) printf("\n");
-
-	// Verify SW keys hash.
-	p = calc_hash(HASH_ALG_SHA3_512, c.pd->sw_pkey_p, sSwKeySize,md );
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-	if (verbose) print_bytes((char *) "SW keys hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	if (memcmp((uint8_t *) c.ph->payload_hash, md, SHA512_DIGEST_LENGTH)) {
-		if (verbose)
-			printf("SW keys hash does not agree with value in Prefix header: MISMATCH\n");
-		status = false;
-	} else {
-		if (verbose)
-			printf("SW keys hash agrees with value in Prefix header: VERIFIED ./\n");
-		status = status && true;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, (uint8_t *) buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			die(EX_IOERR, "Cannot read container: %s (%s)", params.imagefn,
+			    strerror(errno));
+		if (n == 0)
+			break;
+		done += n;
 	}
-	if (verbose) printf("\n");
-	return status;
+	return done;
 }
 
-static bool validate_container_v3(struct parsed_stb_container_v3 c, int fdin, uint8_t hash_alg,
-                                  int mldsa_pure_mode)
+/*
+ * The header of a container read from a pipe: the v1 header size first, and
+ * the rest of the header of a later version, found in the first one.
+ */
+static void *read_header(int fd, size_t *len)
 {
-	static int status = true;
-
-	void *md = alloca(SHA512_DIGEST_LENGTH);
-	void *p;
-	size_t sSwKeySize = 0;
-
-	// Get Prefix header hash.
-	p = calc_hash(hash_alg, (uint8_t *) c.ph, sizeof(ROM_prefix_header_v3_raw), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-	if (verbose) print_bytes((char *) "PR header hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
+	uint8_t *buf = (uint8_t *) malloc(SECURE_BOOT_HEADERS_V2_SIZE);
+	size_t hdr_sz;
+
+	if (!buf)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+	*len = read_full(fd, buf, SECURE_BOOT_HEADERS_SIZE);
+	if (*len == SECURE_BOOT_HEADERS_SIZE) {
+		hdr_sz = stb_header_size(be16_to_cpu(*(uint16_t *) (buf + 4)));
+		if (hdr_sz > *len && hdr_sz <= SECURE_BOOT_HEADERS_V2_SIZE)
+			*len += read_full(fd, buf + *len, hdr_sz - *len);
+	}
+	return buf;
+}
 
-	// Verify HW key sigs.
-	if (memcmp(&(c.c->hw_pkey_a), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		status = verify_signature("HW_key_A", md, SHA512_DIGEST_LENGTH,
-					  c.pd->hw_sig_a, c.c->hw_pkey_a) && status;
-	} else if (verbose) {
-		printf("HW_key_A is NULL, skipping signature check.\n");
-	}
-	if (memcmp(&(c.c->hw_pkey_d), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		if (mldsa_pure_mode)
-			status = verify_mldsa_87_signature("HW_key_D",
-							   (const unsigned char *)c.ph, sizeof(ROM_prefix_header_v3_raw),
-							   c.pd->hw_sig_d, c.c->hw_pkey_d) && status;
-		else
-			status = verify_mldsa_87_signature("HW_key_D", md, SHA512_DIGEST_LENGTH,
-							   c.pd->hw_sig_d, c.c->hw_pkey_d) && status;
-	} else if (verbose) {
-		printf("HW_key_D is NULL, skipping signature check.\n");
-	}
-	if (verbose) printf("\n");
+/*
+ * Validate a container read from a pipe, its header already parsed: the
+ * payload is hashed as it is read, up to its size in the SW header, and
+ * only then are the signatures checked.
+ */
+static int validate_stream(const struct stb_container *c, int fd,
+			   struct stb_validation *v)
+{
+	uint64_t expected = stb_field_be64(c, &c->layout->payload_size);
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	struct stb_hash *h = stb_hash_new(c->hash_alg);
+	uint8_t *buf = (uint8_t *) malloc(STREAM_CHUNK);
+	uint64_t size = 0;
+	size_t n, hashed;
 
-	// Get SW header hash.
-	p = calc_hash(hash_alg, (uint8_t *) c.sh, sizeof(ROM_sw_header_v3_raw), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-	if (verbose) print_bytes((char *) "SW header hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
+	if (!h)
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	if (!buf)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
 
-	// Verify SW key sigs.
-	if (memcmp(&(c.pd->sw_pkey_p), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		status = verify_signature("SW_key_P", md, SHA512_DIGEST_LENGTH,
-					  c.ssig->sw_sig_p, c.pd->sw_pkey_p) && status;
-		sSwKeySize += sizeof(ecc_key_t);
-	} else if (verbose) {
-		printf("%s is NULL, skipping\n", "SW_key_P");
-	}
-	if (memcmp(&(c.pd->sw_pkey_s), &ECDSA_KEY_NULL, sizeof(ecc_key_t))) {
-		if (mldsa_pure_mode)
-			status = verify_mldsa_87_signature("SW_key_S",
-							   (const unsigned char *)c.sh, sizeof(ROM_sw_header_v3_raw),
-							   c.ssig->sw_sig_s, c.pd->sw_pkey_s) && status;
-		else
-			status = verify_mldsa_87_signature("SW_key_S", md, SHA512_DIGEST_LENGTH,
-							   c.ssig->sw_sig_s, c.pd->sw_pkey_s) && status;
-		sSwKeySize += sizeof(mldsa_key_t);
-	} else if (verbose) {
-		printf("%s is NULL, skipping\n", "SW_key_S");
+	while ((n = read_full(fd, buf, STREAM_CHUNK))) {
+		hashed = size < expected ? min(n, expected - size) : 0;
+		if (!stb_hash_update(h, buf, hashed))
+			die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+		size += n;
 	}
-	if (verbose) printf("\n");
+	free(buf);
+	if (!stb_hash_final(h, md))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
 
-	// Verify Payload hash.
-	status = getPayloadHash(fdin, be64_to_cpu(c.sh->payload_size), md, 3, hash_alg)
-			&& status;
-	if (verbose) print_bytes((char *) "Payload hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
+	return stb_validate_digest(stb, c, md, size, params.ignore_remainder, v);
+}
 
-	if (memcmp((uint8_t *) c.sh->payload_hash, md, SHA512_DIGEST_LENGTH)) {
-		if (verbose)
-			printf("Payload hash does not agree with value in SW header: MISMATCH\n");
-		status = false;
-	} else {
-		if (verbose)
-			printf("Payload hash agrees with value in SW header: VERIFIED ./\n");
-		status = status && true;
-	}
-	if (verbose) printf("\n");
+/*
+ * The payloads hashed so far in a batch (several --imagefile), their files
+ * kept open: a container whose payload is that of one of them, as the
+ * golden and working sides of a PNOR often are, is validated with its hash
+ * rather than hashing it again. Payloads of the same size and hash in their
+ * SW header are compared, which stb_same_data() does without reading them
+ * when they are the same blocks on disk.
+ */
+struct hashed_payload {
+	const char *fn;
+	int fd;
+	uint64_t off;
+	uint64_t len;
+	uint8_t hash_alg;
+	unsigned char expected[SHA512_DIGEST_LENGTH];
+	unsigned char md[SHA512_DIGEST_LENGTH];
+};
 
-	// Verify SW keys hash.
-	p = calc_hash(hash_alg, c.pd->sw_pkey_p, sSwKeySize,md );
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-	if (verbose) print_bytes((char *) "SW keys hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
+static struct hashed_payload *hashed_payloads;
+static int nhashed_payloads;
 
-	if (memcmp((uint8_t *) c.ph->payload_hash, md, SHA512_DIGEST_LENGTH)) {
-		if (verbose)
-			printf("SW keys hash does not agree with value in Prefix header: MISMATCH\n");
-		status = false;
-	} else {
-		if (verbose)
-			printf("SW keys hash agrees with value in Prefix header: VERIFIED ./\n");
-		status = status && true;
+static const struct hashed_payload *find_payload(const struct stb_container *c,
+						 int fd, uint64_t off,
+						 uint64_t len)
+{
+	const uint8_t *expected = stb_field_ptr(c, &c->layout->payload_hash);
+	const struct hashed_payload *hp;
+	int t;
+
+	for (hp = hashed_payloads; hp < hashed_payloads + nhashed_payloads; hp++) {
+		if (hp->hash_alg != c->hash_alg || hp->len != len
+		    || memcmp(hp->expected, expected, SHA512_DIGEST_LENGTH))
+			continue;
+		t = timings_begin("compare payload");
+		if (stb_same_data(hp->fd, hp->off, fd, off, len)) {
+			timings_end(t, len);
+			return hp;
+		}
+		timings_end(t, len);
 	}
-	if (verbose) printf("\n");
-	return status;
+	return NULL;
 }
 
-static bool verify_container(struct parsed_stb_container c, char * verify)
+/* Returns whether fd is now kept, for the containers after it. */
+static bool add_payload(const struct stb_container *c, const char *fn, int fd,
+			uint64_t off, uint64_t len, const unsigned char *md)
 {
-	static int status = false;
-
-	void *md = alloca(SHA512_DIGEST_LENGTH);
-	void *p;
+	struct hashed_payload *hp;
 
-	p = SHA512(c.c->hw_pkey_a, sizeof(ecc_key_t) * 3, md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA512");
-	if (verbose) print_bytes((char *) "HW keys hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	void *md_verify = alloca(SHA512_DIGEST_LENGTH);
-	getVerificationHash(verify, md_verify, SHA512_DIGEST_LENGTH);
-
-	if (memcmp((uint8_t *) md_verify, md, SHA512_DIGEST_LENGTH )) {
-		if (verbose)
-			printf("HW keys hash does not agree with provided value: MISMATCH\n");
-	} else {
-		if (verbose)
-			printf("HW keys hash agrees with provided value: VERIFIED ./\n");
-		status = true;
-	}
-	if (verbose) printf("\n");
-	return status;
+	if (params.nimages < 2)
+		return false;
+	if (!hashed_payloads) {
+		hashed_payloads = (struct hashed_payload *)
+			calloc(params.nimages, sizeof(*hashed_payloads));
+		if (!hashed_payloads)
+			die(EX_OSERR, "%s", "Cannot allocate memory");
+	}
+	hp = &hashed_payloads[nhashed_payloads++];
+	hp->fn = fn;
+	hp->fd = fd;
+	hp->off = off;
+	hp->len = len;
+	hp->hash_alg = c->hash_alg;
+	memcpy(hp->expected, stb_field_ptr(c, &c->layout->payload_hash),
+	       SHA512_DIGEST_LENGTH);
+	memcpy(hp->md, md, SHA512_DIGEST_LENGTH);
+	return true;
 }
 
-static bool verify_container_v2(struct parsed_stb_container_v2 c, char * verify)
+/* Returns whether the container is valid, and in *kept whether fd is kept. */
+static bool validate_container(const struct stb_container *c, const char *fn,
+			       int fd, const void *container, size_t size,
+			       bool streaming, bool *kept)
 {
-	static int status = false;
-
-	void *md = alloca(SHA512_DIGEST_LENGTH);
-	void *p;
-
-	p = calc_hash(HASH_ALG_SHA3_512, c.c->hw_pkey_a, sizeof(ecc_key_t) + sizeof(dilithium_key_t), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512");
-	if (verbose) print_bytes((char *) "HW keys hash = ", (uint8_t *) md,
-			SHA512_DIGEST_LENGTH);
-
-	void *md_verify = alloca(SHA512_DIGEST_LENGTH);
-	getVerificationHash(verify, md_verify, SHA512_DIGEST_LENGTH);
+	const struct hashed_payload *same = NULL;
+	struct stb_validation v;
+	size_t hdr_sz = stb_header_size(c->version);
+	uint64_t hashed;
+	int r, t;
+
+	if (!streaming) {
+		hashed = stb_payload_hashed(c, size - hdr_sz, params.ignore_remainder);
+		same = find_payload(c, fd, hdr_sz, hashed);
+	}
+
+	t = timings_begin("validate");
+	if (streaming)
+		r = validate_stream(c, fd, &v);
+	else if (same)
+		r = stb_validate_digest(stb, c, same->md, size - hdr_sz,
+					params.ignore_remainder, &v);
+	else
+		r = stb_validate_file(stb, c, fd, hdr_sz,
+				      (const uint8_t *) container + hdr_sz,
+				      size - hdr_sz, params.ignore_remainder, &v);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	if (streaming) {
+		hashed = v.payload_size_actual;
+		if (params.ignore_remainder && hashed > v.payload_size_expected)
+			hashed = v.payload_size_expected;
+	}
+	timings_end(t, same ? 0 : hashed);
+	if (!streaming && !same)
+		*kept = add_payload(c, fn, fd, hdr_sz, hashed, v.payload_hash);
+
+	if (verbose) print_bytes((char *) "PR header hash = ",
+			(uint8_t *) v.prefix_hdr_hash, SHA512_DIGEST_LENGTH);
+	print_sig_checks(v.hw_sigs, v.hw_sig_count, "skipping signature check.");
+
+	if (verbose) print_bytes((char *) "SW header hash = ",
+			(uint8_t *) v.sw_hdr_hash, SHA512_DIGEST_LENGTH);
+	print_sig_checks(v.sw_sigs, v.sw_sig_count, "skipping");
+
+	if (verbose && v.unprotected_size)
+		printf("Unprotected payload = %lu bytes, not hashed\n",
+		       (unsigned long) v.unprotected_size);
+	if (verbose && (v.payload_size_expected != v.payload_size_actual))
+		printf("Payload expected size = %lu, actual size = %lu\n\n",
+				v.payload_size_expected, v.payload_size_actual);
+	if (verbose && v.payload_holes)
+		printf("Payload holes = %lu bytes, hashed without reading them\n",
+		       (unsigned long) v.payload_holes);
+	if (verbose && same)
+		printf("Payload same as in %s, not hashed again\n", same->fn);
+	if (verbose) print_bytes((char *) "Payload hash = ",
+			(uint8_t *) v.payload_hash, SHA512_DIGEST_LENGTH);
+	if (verbose)
+		printf(v.payload_hash_ok ?
+		       "Payload hash agrees with value in SW header: VERIFIED ./\n" :
+		       "Payload hash does not agree with value in SW header: MISMATCH\n");
+	if (verbose) printf("\n");
 
-	if (memcmp((uint8_t *) md_verify, md, SHA512_DIGEST_LENGTH )) {
-		if (verbose)
-			printf("HW keys hash does not agree with provided value: MISMATCH\n");
-	} else {
-		if (verbose)
-			printf("HW keys hash agrees with provided value: VERIFIED ./\n");
-		status = true;
-	}
+	if (verbose) print_bytes((char *) "SW keys hash = ",
+			(uint8_t *) v.sw_keys_hash, SHA512_DIGEST_LENGTH);
+	if (verbose)
+		printf(v.sw_keys_hash_ok ?
+		       "SW keys hash agrees with value in Prefix header: VERIFIED ./\n" :
+		       "SW keys hash does not agree with value in Prefix header: MISMATCH\n");
 	if (verbose) printf("\n");
-	return status;
+
+	return v.valid;
 }
 
-static bool verify_container_v3(struct parsed_stb_container_v3 c, char * verify, uint8_t hash_alg)
+static bool verify_container(const struct stb_container *c, char *verify)
 {
-	static int status = false;
-
-	void *md = alloca(SHA512_DIGEST_LENGTH);
-	void *p;
-
-	p = calc_hash(hash_alg, c.c->hw_pkey_a, sizeof(ecc_key_t) + sizeof(mldsa_key_t), md);
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	unsigned char md_verify[SHA512_DIGEST_LENGTH];
+	bool status;
+	int r, t;
+
+	t = timings_begin("verify");
+	r = stb_hw_keys_hash(stb, c, md);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	timings_end(t, 0);
 	if (verbose) print_bytes((char *) "HW keys hash = ", (uint8_t *) md,
 			SHA512_DIGEST_LENGTH);
 
-	void *md_verify = alloca(SHA512_DIGEST_LENGTH);
 	getVerificationHash(verify, md_verify, SHA512_DIGEST_LENGTH);
 
-	if (memcmp((uint8_t *) md_verify, md, SHA512_DIGEST_LENGTH )) {
-		if (verbose)
-			printf("HW keys hash does not agree with provided value: MISMATCH\n");
-	} else {
-		if (verbose)
-			printf("HW keys hash agrees with provided value: VERIFIED ./\n");
-		status = true;
-	}
+	status = !memcmp(md_verify, md, SHA512_DIGEST_LENGTH);
+	if (verbose)
+		printf(status ?
+		       "HW keys hash agrees with provided value: VERIFIED ./\n" :
+		       "HW keys hash does not agree with provided value: MISMATCH\n");
 	if (verbose) printf("\n");
 	return status;
 }
 
-static bool verify_signature(const char *moniker, const unsigned char *dgst,
-		int dgst_len, const ecc_signature_t sig_raw, const ecc_key_t key_raw)
-{
-	int r;
-	bool status = false;
-
-	// Convert the raw sig to a structure that can be handled by openssl.
-	debug_print((char *) "Raw sig = ", (uint8_t *) sig_raw,
-			sizeof(ecc_signature_t));
-
-	BIGNUM *r_bn = BN_new();
-	BIGNUM *s_bn = BN_new();
-
-	BN_bin2bn((const unsigned char*) &sig_raw[0], 66, r_bn);
-	BN_bin2bn((const unsigned char*) &sig_raw[66], 66, s_bn);
-
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	ECDSA_SIG* ecdsa_sig = ECDSA_SIG_new();
-	ECDSA_SIG_set0(ecdsa_sig, r_bn, s_bn);
-#else
-	ECDSA_SIG* ecdsa_sig = malloc(sizeof(ECDSA_SIG));
-	ecdsa_sig->r = r_bn;
-	ecdsa_sig->s = s_bn;
-#endif
-
-	// Convert the raw key to a structure that can be handled by openssl.
-	debug_print((char *) "Raw key = ", (uint8_t *) key_raw,
-			sizeof(ecc_key_t));
-
-	EC_KEY *ec_key = EC_KEY_new();
-	if (!ec_key)
-		die(EX_SOFTWARE, "%s", "Cannot EC_KEY_new");
-
-	const EC_GROUP *ec_group = EC_GROUP_new_by_curve_name(NID_secp521r1);
-	if (!ec_group)
-		die(EX_SOFTWARE, "%s", "Cannot EC_GROUP_new_by_curve_name");
-
-	r = EC_KEY_set_group(ec_key, ec_group);
-	if (r == 0)
-		die(EX_SOFTWARE, "%s", "Cannot EC_KEY_set_group");
-
-	// Add prefix 0x04, for uncompressed key.
-	unsigned char *buffer = alloca(sizeof(ecc_key_t) + 1);
-	*buffer = 0x04;
-	memcpy(buffer + 1, key_raw, sizeof(ecc_key_t));
-
-	BIGNUM *key_bn = BN_new();
-	BN_bin2bn((const unsigned char*) buffer, EC_COORDBYTES * 2 + 1, key_bn);
-
-	EC_POINT *ec_point = EC_POINT_bn2point(ec_group, key_bn, NULL, NULL);
-	if (!ec_point)
-		die(EX_SOFTWARE, "%s", "Cannot EC_POINT_bn2point");
-
-	r = EC_KEY_set_public_key(ec_key, (const EC_POINT*) ec_point);
-	if (r == 0)
-		die(EX_SOFTWARE, "%s", "Cannot EC_KEY_set_public_key");
-
-	// Verify the signature.
-	r = ECDSA_do_verify(dgst, dgst_len, ecdsa_sig, ec_key);
-	if (r == 1) {
-		if (verbose) printf("%s signature is good: VERIFIED ./\n", moniker);
-		status = true;
-	} else if (r == 0) {
-		if (verbose) printf("%s signature FAILED to verify.\n", moniker);
-		status = false;
-	} else {
-		die(EX_SOFTWARE, "%s", "Cannot ECDSA_do_verify");
-	}
-
-	BN_free(key_bn);
-
-	EC_KEY_free(ec_key);
-
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	ECDSA_SIG_free(ecdsa_sig);
-#else
-	BN_free(r_bn);
-	BN_free(s_bn);
-	free(ecdsa_sig);
-#endif
-	return status;
-}
-
-static bool verify_dilithium_signature(const char *moniker, const unsigned char *dgst,
-				       int dgst_len, const dilithium_signature_t sig_raw, const dilithium_key_t key_raw)
-{
-	bool sRet = false;
-#ifdef ADD_DILITHIUM
-	mlca_ctx_t sCtx;
-	MLCA_RC    sMlRc = 0;
-
-	sMlRc = mlca_init(&sCtx,1,0);
-	if (sMlRc)
-	{
-		printf("**** ERROR : Failed mlca_init : %d\n", sMlRc);
-	}
-	if (0 == sMlRc)
-	{
-		sMlRc = mlca_set_alg(&sCtx, MLCA_ALGORITHM_SIG_DILITHIUM_R2_8x7_OID, OPT_LEVEL_AUTO);
-		if (sMlRc)
-		{
-			printf("**** ERROR : Failed mlca_set_alg : %d\n", sMlRc);
-		}
-	}
-	if (0 == sMlRc)
-	{
-		sMlRc = mlca_set_encoding_by_idx(&sCtx, 0);
-		if (sMlRc)
-		{
-			printf("**** ERROR : Failed mlca_set_encoding_by_name_oid : %d\n", sMlRc);
-		}
-	}
-	if (0 == sMlRc)
-	{
-		printf("Verifying Dilthium R2 8x7 signature ...\n");
-		sMlRc = mlca_sig_verify(&sCtx, dgst, dgst_len, sig_raw, sizeof(dilithium_signature_t), key_raw);
-		if (1 != sMlRc)
-		{
-			if (verbose) printf("%s signature FAILED to verify.\n", moniker);
-			sRet = false;
-		}
-		else
-		{
-			if (verbose) printf("%s signature is good: VERIFIED ./\n", moniker);
-			sRet = true;
-		}
-	}
-#else
-	die(EX_SOFTWARE, "%s", "Cannot Dilithium_do_verify");
-#endif
-	return sRet;
-}
-
-static bool verify_mldsa_87_signature(const char *moniker, const unsigned char *dgst,
-				       int dgst_len, const mldsa_signature_t sig_raw, const mldsa_key_t key_raw)
-{
-	bool sRet = false;
-#ifdef ADD_DILITHIUM
-	mlca_ctx_t sCtx;
-	MLCA_RC    sMlRc = 0;
-
-	sMlRc = mlca_init(&sCtx,1,0);
-	if (sMlRc)
-	{
-		printf("**** ERROR : Failed mlca_init : %d\n", sMlRc);
-	}
-	if (0 == sMlRc)
-	{
-		sMlRc = mlca_set_alg(&sCtx, MLCA_ALGORITHM_SIG_MLDSA_87, OPT_LEVEL_AUTO);
-		if (sMlRc)
-		{
-			printf("**** ERROR : Failed mlca_set_alg : %d\n", sMlRc);
-		}
-	}
-	if (0 == sMlRc)
-	{
-		sMlRc = mlca_set_encoding_by_idx(&sCtx, 0);
-		if (sMlRc)
-		{
-			printf("**** ERROR : Failed mlca_set_encoding_by_name_oid : %d\n", sMlRc);
-		}
-	}
-	if (0 == sMlRc)
-	{
-		printf("Verifying MLDSA-87 signature ...\n");
-		sMlRc = mlca_sig_verify(&sCtx, dgst, dgst_len, sig_raw, sizeof(mldsa_signature_t), key_raw);
-		if (1 != sMlRc)
-		{
-			if (verbose) printf("%s signature FAILED to verify.\n", moniker);
-			sRet = false;
-		}
-		else
-		{
-			if (verbose) printf("%s signature is good: VERIFIED ./\n", moniker);
-			sRet = true;
-		}
-	}
-#else
-	die(EX_SOFTWARE, "%s", "Cannot mldsa_do_verify");
-#endif
-	return sRet;
-}
-
-static bool getPayloadHash(int fdin, uint64_t pl_sz_expected, unsigned char *md, int container_version,
-			   uint8_t hash_alg)
-{
-	struct stat st;
-	void *file;
-	int r;
-	void *p;
-
-	r = fstat(fdin, &st);
-	if (r != 0)
-		die(EX_NOINPUT, "Cannot stat payload file at descriptor: %d (%s)", fdin,
-				strerror(errno));
-
-	uint64_t pl_sz_actual = 0;
-	if (container_version == 1)
-	{
-		pl_sz_actual = max(0, st.st_size - SECURE_BOOT_HEADERS_SIZE);
-	}
-	else if (container_version == 2)
-	{
-		pl_sz_actual = max(0, st.st_size - SECURE_BOOT_HEADERS_V2_SIZE);
-	}
-        else
-        {
-		pl_sz_actual = max(0, st.st_size - SECURE_BOOT_HEADERS_V3_SIZE);
-        }
-	if (verbose && (pl_sz_expected != pl_sz_actual))
-		printf("Payload expected size = %lu, actual size = %lu\n\n",
-				pl_sz_expected, pl_sz_actual);
-
-	file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fdin, 0);
-	if (file == MAP_FAILED)
-		die(EX_OSERR, "Cannot mmap file at fd: %d, size: %lu (%s)", fdin,
-				st.st_size, strerror(errno));
-
-	if (container_version == 1)
-	{
-		p = SHA512(file + SECURE_BOOT_HEADERS_SIZE,
-			   (params.ignore_remainder ?
-			    min(pl_sz_actual, pl_sz_expected) : pl_sz_actual), md);
-	} else if (container_version == 2) {
-		p = calc_hash(HASH_ALG_SHA3_512, file + SECURE_BOOT_HEADERS_V2_SIZE,
-			     (params.ignore_remainder ?
-			      min(pl_sz_actual, pl_sz_expected) : pl_sz_actual), md);
-	} else {
-		p = calc_hash(hash_alg, file + SECURE_BOOT_HEADERS_V3_SIZE,
-			     (params.ignore_remainder ?
-			      min(pl_sz_actual, pl_sz_expected) : pl_sz_actual), md);
-	}
-	if (!p)
-		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
-
-	return true;
-}
-
 static bool getVerificationHash(char *input, unsigned char *md, int len)
 {
 	if (len < 0)
@@ -1260,13 +664,26 @@ __attribute__((__noreturn__)) static void usage (int status)
 			" -d, --debug             show additional debug output\n"
 			" -w, --wrap              column at which to wrap long output (wrap=0 => unlimited)\n"
 			" -s, --stats             additionally print container stats\n"
-			" -I, --imagefile         containerized image to display (input)\n"
+			" -I, --imagefile         containerized image to display (input), or - for\n"
+			"                         stdin. a container read from a pipe is validated\n"
+			"                         in one pass, as it is read. may be given more\n"
+			"                         than once, a payload found in an earlier\n"
+			"                         container then not being hashed again\n"
 			"     --validate          perform all checks to ensure is container valid for secure boot\n"
 			"     --validate-ignore-remainder\n"
 			"                         use the payload size in the container header when calculating\n"
 			"                         payload hash, and ignore any trailing bytes or padding.\n"
 			"     --verify            value, or filename containing value, of the HW Keys hash to\n"
 			"                         verify the container against. must be valid 64 byte hexascii.\n"
+			"     --timings           print the time spent in each phase, the bytes hashed,\n"
+			"                         peak RSS and page faults to stderr\n"
+			"     --timings-json      same as --timings, as one line of JSON\n"
+			"     --arena             validate with OpenSSL's working memory in a buffer\n"
+			"                         allocated up front, counted in --timings\n"
+			"     --io-strategy       how the payload is read to hash it: auto (default),\n"
+			"                         mmap, madvise, populate, fadvise, direct or\n"
+			"                         uring, with fadvise, populate and uring taking a\n"
+			"                         window, e.g. fadvise,16M\n"
 			"\n");
 	};
 	exit(status);
@@ -1285,23 +702,150 @@ static struct option const opts[] = {
 	{ "no-print",         no_argument,       0,  '2' },
 	{ "print",            no_argument,       0,  '3' },
 	{ "validate-ignore-remainder", no_argument, 0, '4' },
+	{ "timings",          no_argument,       0,  '5' },
+	{ "timings-json",     no_argument,       0,  '6' },
+	{ "arena",            no_argument,       0,  '7' },
+	{ "io-strategy",      required_argument, 0,  '8' },
 	{ NULL, 0, NULL, 0 }
 };
 #endif
 
+#define PREFETCH_SIZE	(64 * 1024 * 1024)
 
-int main(int argc, char* argv[])
+/*
+ * Have the kernel start reading the next container of a batch while this
+ * one is hashed, so that its first reads come from the page cache.
+ */
+static void prefetch_container(const char *fn)
+{
+#ifdef POSIX_FADV_WILLNEED
+	int fd;
+
+	if (!strcmp(fn, "-"))
+		return;
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+	close(fd);
+#endif
+}
+
+/*
+ * Print, validate and verify one container, returns 1 if a check failed.
+ */
+static int process_container(char *fn)
 {
 	int r;
 	struct stat st;
 	void *container;
-	struct parsed_stb_container c;
-	struct parsed_stb_container_v2 c_v2;
-        struct parsed_stb_container_v3 c_v3;
+	size_t size;
+	bool streaming, kept = false;
+	struct stb_container c;
 	int container_status = EX_OK;
 	int validate_status = UNATTEMPTED;
 	int verify_status = UNATTEMPTED;
-	int mldsa_pure_mode = false;
+	int t;
+
+	params.imagefn = fn;
+	if (params.nimages > 1)
+		printf("%s:\n", fn);
+
+	int fdin = strcmp(params.imagefn, "-") ? open(params.imagefn, O_RDONLY)
+					       : STDIN_FILENO;
+	if (fdin < 0)
+		die(EX_NOINPUT, "Cannot open container file: %s (%s)", params.imagefn,
+				strerror(errno));
+
+	r = fstat(fdin, &st);
+	if (r != 0)
+		die(EX_NOINPUT, "Cannot stat container file: %s (%s)", params.imagefn,
+				strerror(errno));
+
+	// A pipe is read once: the header now, the payload as it is validated.
+	streaming = !S_ISREG(st.st_mode);
+	if (streaming) {
+		t = timings_begin("read header");
+		container = read_header(fdin, &size);
+		timings_end(t, size);
+		if (size == 0)
+			die(EX_NOINPUT, "%s", "Container is empty, nothing to do.");
+	} else {
+		size = st.st_size;
+		if (st.st_size == 0)
+			die(EX_NOINPUT, "%s", "Container file is empty, nothing to do.");
+
+		if (st.st_size < SECURE_BOOT_HEADERS_SIZE)
+			fprintf(stderr,
+					"Warning: container file \"%s\" smaller than minimum header size, file may be incomplete.\n",
+					params.imagefn);
+
+		container = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fdin, 0);
+		if (container == MAP_FAILED)
+			die(EX_OSERR, "Cannot mmap file at fd: %d, size: %lu (%s)", fdin,
+					st.st_size, strerror(errno));
+	}
+
+	t = timings_begin("parse");
+	r = stb_parse(stb, container, size, &c);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	timings_end(t, 0);
+
+	if (c.version != 1) {
+#ifndef ADD_DILITHIUM
+		die(EX_SOFTWARE, "print-container must be built with ADD_DILITHIUM for v%d containers",
+		    c.version);
+#elif OPENSSL_VERSION_NUMBER < 0x10100000L
+		die(EX_NOINPUT, "Invalid container version due to downlevel openssl version : %d",
+		    c.version);
+#endif
+	}
+
+	if (params.print_container) {
+		t = timings_begin("print");
+		if (c.version == 1)
+			display_container(&c);
+		else
+			display_container_v2(&c);
+		timings_end(t, 0);
+	}
+
+	if (params.validate)
+		validate_status = validate_container(&c, fn, fdin, container,
+						     size, streaming, &kept);
+
+	if (params.verify)
+		verify_status = verify_container(&c, params.verify);
+
+	if ((validate_status != UNATTEMPTED) || (verify_status != UNATTEMPTED)) {
+		printf("Container validity check %s. Container verification check %s.\n\n",
+				(validate_status == UNATTEMPTED) ?
+						"not attempted" :
+						((validate_status == PASSED) ? "PASSED" : "FAILED"),
+				(verify_status == UNATTEMPTED) ?
+						"not attempted" :
+						((verify_status == PASSED) ? "PASSED" : "FAILED"));
+
+		if ((validate_status == FAILED) || (verify_status == FAILED))
+			container_status = 1;
+	}
+
+	if (streaming)
+		free(container);
+	else
+		munmap(container, size);
+	if (!kept)
+		close(fdin);
+	return container_status;
+}
+
+int main(int argc, char* argv[])
+{
+	int r, i;
+	int container_status = EX_OK;
+	struct stb_arena arena;
+	void *arena_buf = NULL;
 
 	params.print_container = true;
 
@@ -1311,6 +855,11 @@ int main(int argc, char* argv[])
 	else
 		progname = argv[0];
 
+	/* Before anything has OpenSSL allocate. */
+	if (stb_alloc_hooks_install())
+		timings.alloc_counts = alloc_counts;
+	timings_init(progname);
+
 #ifdef _AIX
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(*(argv + i), "--help")) {
@@ -1335,6 +884,14 @@ int main(int argc, char* argv[])
 			*(argv + i) = "-3";
 		} else if (!strcmp(*(argv + i), "--validate-ignore-remainder")) {
 			*(argv + i) = "-4";
+		} else if (!strcmp(*(argv + i), "--timings")) {
+			*(argv + i) = "-5";
+		} else if (!strcmp(*(argv + i), "--timings-json")) {
+			*(argv + i) = "-6";
+		} else if (!strcmp(*(argv + i), "--arena")) {
+			*(argv + i) = "-7";
+		} else if (!strcmp(*(argv + i), "--io-strategy")) {
+			*(argv + i) = "-8";
 		} else if (!strncmp(*(argv + i), "--", 2)) {
 			fprintf(stderr, "%s: unrecognized option \'%s\'\n", progname,
 					*(argv + i));
@@ -1346,9 +903,9 @@ int main(int argc, char* argv[])
 	while (1) {
 		int opt;
 #ifdef _AIX
-		opt = getopt(argc, argv, "??hvdw:sI:01:23");
+		opt = getopt(argc, argv, "??hvdw:sI:01:235678:");
 #else
-		opt = getopt_long(argc, argv, "?hvdw:sI:01:23", opts, NULL);
+		opt = getopt_long(argc, argv, "?hvdw:sI:01:235678:", opts, NULL);
 #endif
 		if (opt == -1)
 			break;
@@ -1374,7 +931,11 @@ int main(int argc, char* argv[])
 			print_stats = true;
 			break;
 		case 'I':
-			params.imagefn = optarg;
+			params.imagefns = (char **) realloc(params.imagefns,
+					(params.nimages + 1) * sizeof(char *));
+			if (!params.imagefns)
+				die(EX_OSERR, "%s", "Cannot allocate memory");
+			params.imagefns[params.nimages++] = optarg;
 			break;
 		case '0':
 			params.validate = true;
@@ -1391,121 +952,63 @@ int main(int argc, char* argv[])
 		case '4':
 			params.ignore_remainder = true;
 			break;
+		case '5':
+			timings_enable(TIMINGS_TABLE);
+			break;
+		case '6':
+			timings_enable(TIMINGS_JSON);
+			break;
+		case '7':
+			params.arena = true;
+			break;
+		case '8':
+			params.io_strategy = optarg;
+			break;
 		default:
 			usage(EX_USAGE);
 		}
 	}
 
-	if (!params.imagefn) {
+	if (!params.nimages) {
 		fprintf(stderr, "No --imagefile provided, nothing to do.\n");
 		usage(EX_USAGE);
 	}
-	int fdin = open(params.imagefn, O_RDONLY);
-	if (fdin <= 0)
-		die(EX_NOINPUT, "Cannot open container file: %s (%s)", params.imagefn,
-				strerror(errno));
-
-	r = fstat(fdin, &st);
-	if (r != 0)
-		die(EX_NOINPUT, "Cannot stat container file: %s (%s)", params.imagefn,
-				strerror(errno));
-
-	if (st.st_size == 0)
-		die(EX_NOINPUT, "%s", "Container file is empty, nothing to do.");
-
-	if (st.st_size < SECURE_BOOT_HEADERS_SIZE)
-		fprintf(stderr,
-				"Warning: container file \"%s\" smaller than minimum header size, file may be incomplete.\n",
-				params.imagefn);
-
-	container = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fdin, 0);
-	if (container == MAP_FAILED)
-		die(EX_OSERR, "Cannot mmap file at fd: %d, size: %lu (%s)", fdin,
-				st.st_size, strerror(errno));
-
-	if (!stb_is_container(container, st.st_size))
-		die(EX_DATAERR, "%s", "Not a container, missing magic number");
 
-	if (!stb_is_v2_container(container, st.st_size) && !stb_is_v3_container(container, st.st_size))
-	{
-		if (parse_stb_container(container, SECURE_BOOT_HEADERS_SIZE, &c) != 0)
-			die(EX_DATAERR, "%s", "Failed to parse container");
-
-		if (params.print_container)
-			display_container(c);
-
-		if (params.validate)
-			validate_status = validate_container(c, fdin);
-
-		if (params.verify)
-			verify_status = verify_container(c, params.verify);
+	stb = stb_ctx_new();
+	if (!stb)
+		die(EX_OSERR, "%s", "Cannot allocate container context");
+	if (params.io_strategy) {
+		size_t window;
+		int io = stb_io_parse(params.io_strategy, &window);
 
+		if (io < 0 || stb_ctx_set_io(stb, io, window))
+			die(EX_USAGE, "Invalid input for io-strategy: %s",
+			    params.io_strategy);
 	}
-	else if (stb_is_v2_container(container, st.st_size))
-	{
-#ifndef ADD_DILITHIUM
-		die(EX_SOFTWARE, "%s", "print-container must be built with ADD_DILITHIUM for v2 containers");
-#elif OPENSSL_VERSION_NUMBER < 0x10100000L
-		die(EX_NOINPUT, "Invalid container version due to downlevel openssl version : %d", 2);
-#endif
-		if (parse_stb_container_v2(container, SECURE_BOOT_HEADERS_V2_SIZE, &c_v2) != 0)
-			die(EX_DATAERR, "%s", "Failed to parse container");
-
-		if (params.print_container)
-			display_container_v2(c_v2);
-
-		if (params.validate)
-			validate_status = validate_container_v2(c_v2, fdin);
-
-		if (params.verify)
-			verify_status = verify_container_v2(c_v2, params.verify);
+	if (params.arena) {
+		arena_buf = malloc(ARENA_SIZE);
+		if (!arena_buf)
+			die(EX_OSERR, "%s", "Cannot allocate arena");
+		stb_arena_init(&arena, arena_buf, ARENA_SIZE);
+		r = stb_ctx_set_arena(stb, &arena);
+		if (r)
+			die(stb_sysexit(r), "%s", stb_ctx_error(stb));
 	}
-	else if (stb_is_v3_container(container, st.st_size))
-	{
-#ifndef ADD_DILITHIUM
-		die(EX_SOFTWARE, "%s", "print-container must be built with ADD_DILITHIUM for v3 containers");
-#elif OPENSSL_VERSION_NUMBER < 0x10100000L
-		die(EX_NOINPUT, "Invalid container version due to downlevel openssl version : %d", 3);
-#endif
-		if (parse_stb_container_v3(container, SECURE_BOOT_HEADERS_V3_SIZE, &c_v3) != 0)
-			die(EX_DATAERR, "%s", "Failed to parse container");
-
-		if ((c_v3.ph->ver_alg.hash_alg == HASH_ALG_SHA512 &&
-		     c_v3.ph->ver_alg.sig_alg  != SIG_ALG_SHA512_ECDSA_MLDSA &&
-		     c_v3.ph->ver_alg.sig_alg  != SIG_ALG_SHA512_ECDSA_MLDSA_PURE_MODE) ||
-		    (c_v3.ph->ver_alg.hash_alg == HASH_ALG_SHA3_512 &&
-                     c_v3.ph->ver_alg.sig_alg  != SIG_ALG_SHA3_512_ECDSA_MLDSA))
-			die(EX_DATAERR,
-			    "There's an inconsistency between the hash used by "
-			    "hash_alg '%u' and sig_alg '%u'\n",
-			    c_v3.ph->ver_alg.hash_alg, c_v3.ph->ver_alg.sig_alg);
-
-		mldsa_pure_mode = (c_v3.ph->ver_alg.sig_alg == SIG_ALG_SHA512_ECDSA_MLDSA_PURE_MODE);
 
-		if (params.print_container)
-			display_container_v3(c_v3, c_v3.ph->ver_alg.hash_alg);
-
-		if (params.validate)
-			validate_status = validate_container_v3(c_v3, fdin, c_v3.ph->ver_alg.hash_alg,
-			                                        mldsa_pure_mode);
-
-		if (params.verify)
-			verify_status = verify_container_v3(c_v3, params.verify,
-							    c_v3.ph->ver_alg.hash_alg);
-	}
-	if ((validate_status != UNATTEMPTED) || (verify_status != UNATTEMPTED)) {
-		printf("Container validity check %s. Container verification check %s.\n\n",
-				(validate_status == UNATTEMPTED) ?
-						"not attempted" :
-						((validate_status == PASSED) ? "PASSED" : "FAILED"),
-				(verify_status == UNATTEMPTED) ?
-						"not attempted" :
-						((verify_status == PASSED) ? "PASSED" : "FAILED"));
-
-		if ((validate_status == FAILED) || (verify_status == FAILED))
+	for (i = 0; i < params.nimages; i++) {
+		if (i + 1 < params.nimages)
+			prefetch_container(params.imagefns[i + 1]);
+		if (process_container(params.imagefns[i]))
 			container_status = 1;
 	}
 
-	close(fdin);
+	for (i = 0; i < nhashed_payloads; i++)
+		close(hashed_payloads[i].fd);
+	free(hashed_payloads);
+	free(params.imagefns);
+	stb_ctx_free(stb);
+	// What OpenSSL still keeps in the arena is freed at exit, from it.
+	if (arena_buf && !arena.live)
+		free(arena_buf);
 	return container_status;
 }
@@ -0,0 +1,825 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Indexed archive of signing artifacts, for --archiveIn/--archiveOut of
+ * crtSignedContainer.sh.
+ *
+ * The manifest (name, mode, mtime, size, offset and SHA-256 of each member)
+ * is at the front of the archive, and each member is stored, or compressed
+ * with zstd, on its own. Listing the archive only reads the manifest, and
+ * extracting a member only reads (and decompresses) that member. Members
+ * are compressed in parallel, by workers spread over the NUMA nodes, each
+ * pinned to its node so that the members it reads land in its memory.
+ *
+ * Layout, all integers big endian:
+ *   header    magic "SBARCHV1", be32 flags, be32 count, be64 manifest size
+ *   manifest  count * (struct sba_entry, name)
+ *   data      the members, in manifest order
+ */
+
+/* For the CPU sets of numa_nodes.h. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <config.h>
+
+#ifndef _AIX
+#include <getopt.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ccan/endian/endian.h"
+#include "container.c"
+#include "container.h"
+#include "numa_nodes.h"
+#include "timings.h"
+
+#define SBA_MAGIC		"SBARCHV1"
+#define SBA_MAGIC_SIZE		8
+#define SBA_MAX_NAME		PATH_MAX
+#define SBA_MAX_THREADS		64
+
+#define SBA_STORED		0
+#define SBA_ZSTD		1
+
+char *progname;
+
+bool verbose, debug;
+int wrap = 100;
+
+typedef struct {
+	char magic[SBA_MAGIC_SIZE];
+	be32 flags;
+	be32 count;
+	be64 manifest_size;
+}__attribute__((packed)) sba_header_raw;
+
+typedef struct {
+	be64 offset;
+	be64 size;
+	be64 stored_size;
+	be64 mtime;
+	be32 mode;
+	uint8_t compression;
+	uint8_t reserved;
+	be16 name_len;
+	uint8_t sha256[SHA256_DIGEST_LENGTH];
+	/* followed by name_len bytes of name, not terminated */
+}__attribute__((packed)) sba_entry_raw;
+
+struct sba_member {
+	char *name;
+	char *path;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t stored_size;
+	uint64_t mtime;
+	uint32_t mode;
+	uint8_t compression;
+	uint8_t sha256[SHA256_DIGEST_LENGTH];
+	unsigned char *data;
+};
+
+static struct {
+	char *archive;
+	char *directory;
+	int level;
+	int threads;
+	int strip;
+	bool no_numa;
+	char mode;
+} params;
+
+static struct sba_member *members;
+static int nmembers, maxmembers;
+
+static struct {
+	pthread_mutex_t lock;
+	int next;
+} work = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+__attribute__((__noreturn__)) void usage (int status)
+{
+	if (status != 0) {
+		fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+	}
+	else {
+		printf("Usage: %s -c|-t|-x -f ARCHIVE [options] [MEMBER...]\n", progname);
+		printf(
+			"\n"
+			"Options:\n"
+			" -h, --help              display this message and exit\n"
+			" -v, --verbose           show verbose output\n"
+			"     --debug             show additional debug output\n"
+			" -c, --create            create ARCHIVE from the files and directories given\n"
+			" -t, --list              list the members of ARCHIVE\n"
+			" -x, --extract           extract the members given (all by default) from\n"
+			"                          ARCHIVE, a member ending in '/' selects all the\n"
+			"                          members under it\n"
+			" -f, --file              archive file\n"
+			" -C, --directory         change to this directory first\n"
+			" -z, --level             zstd compression level, 0 to store the members\n"
+			"                          (default 3)\n"
+			" -j, --threads           number of members compressed in parallel\n"
+			"                          (default: number of online CPUs)\n"
+			"     --strip-components  remove this many leading path components of\n"
+			"                          the members on extraction\n"
+			"     --no-numa           do not pin the threads to the NUMA nodes\n"
+			"\n");
+#ifndef HAVE_ZSTD
+		printf("Built without zstd, members are always stored.\n\n");
+#endif
+	};
+	exit(status);
+}
+
+#ifndef _AIX
+static struct option const opts[] = {
+	{ "help",             no_argument,       0,  'h' },
+	{ "verbose",          no_argument,       0,  'v' },
+	{ "debug",            no_argument,       0,  '4' },
+	{ "create",           no_argument,       0,  'c' },
+	{ "list",             no_argument,       0,  't' },
+	{ "extract",          no_argument,       0,  'x' },
+	{ "file",             required_argument, 0,  'f' },
+	{ "directory",        required_argument, 0,  'C' },
+	{ "level",            required_argument, 0,  'z' },
+	{ "threads",          required_argument, 0,  'j' },
+	{ "strip-components", required_argument, 0,  '5' },
+	{ "no-numa",          no_argument,       0,  '6' },
+	{ NULL, 0, NULL, 0 }
+};
+#endif
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+	return p;
+}
+
+static void read_full(int fd, void *buf, size_t len, off_t off, const char *fn)
+{
+	unsigned char *p = (unsigned char *) buf;
+
+	while (len) {
+		ssize_t r = pread(fd, p, len, off);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			die(EX_IOERR, "Cannot read %s: %s", fn,
+			    r ? strerror(errno) : "unexpected end of file");
+		p += r;
+		off += r;
+		len -= r;
+	}
+}
+
+static void write_full(int fd, const void *buf, size_t len, const char *fn)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+
+	while (len) {
+		ssize_t r = write(fd, p, len);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			die(EX_IOERR, "Cannot write %s: %s", fn, strerror(errno));
+		p += r;
+		len -= r;
+	}
+}
+
+static void add_member(const char *path, const struct stat *st)
+{
+	struct sba_member *m;
+	const char *name = path;
+
+	// Archive relative names, as tar does.
+	while (*name == '/')
+		name++;
+	while (!strncmp(name, "./", 2))
+		name += 2;
+
+	if (strlen(name) >= SBA_MAX_NAME)
+		die(EX_DATAERR, "Name too long: %s", name);
+
+	if (nmembers == maxmembers) {
+		maxmembers = maxmembers ? maxmembers * 2 : 64;
+		members = (struct sba_member *) realloc(members,
+					maxmembers * sizeof(*members));
+		if (!members)
+			die(EX_OSERR, "%s", "Cannot allocate memory");
+	}
+	m = &members[nmembers++];
+	memset(m, 0, sizeof(*m));
+	m->path = strdup(path);
+	m->name = strdup(name);
+	m->size = st->st_size;
+	m->mtime = st->st_mtime;
+	m->mode = st->st_mode & 07777;
+	debug_msg("Adding %s (%llu bytes)", m->name, (unsigned long long) m->size);
+}
+
+static void add_path(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0)
+		die(EX_NOINPUT, "Cannot stat %s: %s", path, strerror(errno));
+
+	if (S_ISREG(st.st_mode)) {
+		add_member(path, &st);
+	} else if (S_ISDIR(st.st_mode)) {
+		DIR *dp = opendir(path);
+		struct dirent *de;
+		size_t len = strlen(path);
+
+		if (!dp)
+			die(EX_NOINPUT, "Cannot open %s: %s", path, strerror(errno));
+
+		while ((de = readdir(dp))) {
+			char *sub;
+
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			sub = (char *) xmalloc(len + strlen(de->d_name) + 2);
+			if (len && path[len - 1] == '/')
+				sprintf(sub, "%s%s", path, de->d_name);
+			else
+				sprintf(sub, "%s/%s", path, de->d_name);
+			add_path(sub);
+			free(sub);
+		}
+		closedir(dp);
+	} else {
+		fprintf(stderr, "%s: %s is not a regular file, skipped\n",
+			progname, path);
+	}
+}
+
+/*
+ * Read a member, hash it and compress it, unless compression does not
+ * make it smaller. Runs in the worker threads, the buffers allocated and
+ * first touched here so that they are on the worker's node.
+ */
+static void pack_member(struct sba_member *m)
+{
+	unsigned char *raw = (unsigned char *) xmalloc(m->size);
+	int fd = open(m->path, O_RDONLY);
+
+	if (fd < 0)
+		die(EX_NOINPUT, "Cannot open %s: %s", m->path, strerror(errno));
+	read_full(fd, raw, m->size, 0, m->path);
+	close(fd);
+
+	SHA256(raw, m->size, m->sha256);
+
+	m->data = raw;
+	m->stored_size = m->size;
+	m->compression = SBA_STORED;
+
+#ifdef HAVE_ZSTD
+	if (params.level > 0 && m->size > 0) {
+		size_t bound = ZSTD_compressBound(m->size);
+		unsigned char *z = (unsigned char *) xmalloc(bound);
+		size_t zlen = ZSTD_compress(z, bound, raw, m->size, params.level);
+
+		if (ZSTD_isError(zlen))
+			die(EX_SOFTWARE, "Cannot compress %s: %s", m->name,
+			    ZSTD_getErrorName(zlen));
+
+		if (zlen < m->size) {
+			free(raw);
+			m->data = z;
+			m->stored_size = zlen;
+			m->compression = SBA_ZSTD;
+		} else {
+			free(z);
+		}
+	}
+#endif
+}
+
+/* arg is the NUMA node to run on, or -1. */
+static void *pack_worker(void *arg)
+{
+	int node = (int) (intptr_t) arg;
+
+	if (node >= 0 && !numa_pin(node))
+		debug_msg("Cannot pin a thread to NUMA node %d",
+			  numa_nodes.nodes[node].id);
+
+	while (1) {
+		int i;
+
+		pthread_mutex_lock(&work.lock);
+		i = work.next++;
+		pthread_mutex_unlock(&work.lock);
+
+		if (i >= nmembers)
+			break;
+		pack_member(&members[i]);
+	}
+	return NULL;
+}
+
+static void create_archive(int argc, char *argv[])
+{
+	pthread_t threads[SBA_MAX_THREADS];
+	sba_header_raw hdr;
+	unsigned char *manifest, *p;
+	uint64_t manifest_size = 0, offset, total = 0;
+	int nthreads, nnodes = 1, fd, t;
+
+	if (!argc)
+		die(EX_USAGE, "%s", "No files given to archive");
+
+	t = timings_begin("scan files");
+	for (int i = 0; i < argc; i++)
+		add_path(argv[i]);
+	timings_end(t, 0);
+
+	t = timings_begin("pack");
+	nthreads = params.threads < nmembers ? params.threads : nmembers;
+	// On one node the threads are left to the scheduler.
+	if (nthreads > 1 && !params.no_numa)
+		nnodes = numa_init();
+	if (nnodes > 1)
+		verbose_msg("Packing with %d threads over %d NUMA nodes", nthreads,
+			    nnodes);
+	for (int i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, pack_worker,
+				   (void *) (intptr_t) (nnodes > 1 ? i % nnodes : -1)))
+			die(EX_OSERR, "%s", "Cannot create thread");
+	if (!nthreads)
+		pack_worker((void *) (intptr_t) -1);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	for (int i = 0; i < nmembers; i++)
+		total += members[i].size;
+	timings_end(t, total);
+
+	// Lay out the manifest, then the members behind it.
+	for (int i = 0; i < nmembers; i++)
+		manifest_size += sizeof(sba_entry_raw) + strlen(members[i].name);
+
+	offset = sizeof(hdr) + manifest_size;
+	manifest = p = (unsigned char *) xmalloc(manifest_size);
+
+	for (int i = 0; i < nmembers; i++) {
+		struct sba_member *m = &members[i];
+		sba_entry_raw e;
+		size_t len = strlen(m->name);
+
+		m->offset = offset;
+		offset += m->stored_size;
+
+		memset(&e, 0, sizeof(e));
+		e.offset = cpu_to_be64(m->offset);
+		e.size = cpu_to_be64(m->size);
+		e.stored_size = cpu_to_be64(m->stored_size);
+		e.mtime = cpu_to_be64(m->mtime);
+		e.mode = cpu_to_be32(m->mode);
+		e.compression = m->compression;
+		e.name_len = cpu_to_be16(len);
+		memcpy(e.sha256, m->sha256, sizeof(e.sha256));
+
+		memcpy(p, &e, sizeof(e));
+		memcpy(p + sizeof(e), m->name, len);
+		p += sizeof(e) + len;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SBA_MAGIC, SBA_MAGIC_SIZE);
+	hdr.count = cpu_to_be32(nmembers);
+	hdr.manifest_size = cpu_to_be64(manifest_size);
+
+	t = timings_begin("write archive");
+	fd = open(params.archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(EX_CANTCREAT, "Cannot create archive: %s: %s", params.archive,
+		    strerror(errno));
+
+	write_full(fd, &hdr, sizeof(hdr), params.archive);
+	write_full(fd, manifest, manifest_size, params.archive);
+	for (int i = 0; i < nmembers; i++) {
+		write_full(fd, members[i].data, members[i].stored_size, params.archive);
+		free(members[i].data);
+		members[i].data = NULL;
+	}
+
+	if (close(fd) != 0)
+		die(EX_IOERR, "Cannot write archive: %s: %s", params.archive,
+		    strerror(errno));
+	timings_end(t, offset);
+	free(manifest);
+
+	verbose_msg("Archived %d files, %llu bytes in %llu bytes", nmembers,
+		    (unsigned long long) total, (unsigned long long) offset);
+}
+
+/*
+ * Read the header and the manifest only.
+ */
+static int open_archive(void)
+{
+	sba_header_raw hdr;
+	unsigned char *manifest, *p, *end;
+	uint64_t manifest_size;
+	struct stat st;
+	int fd, count;
+
+	fd = open(params.archive, O_RDONLY);
+	if (fd < 0)
+		die(EX_NOINPUT, "Cannot open archive: %s: %s", params.archive,
+		    strerror(errno));
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(hdr))
+		die(EX_DATAERR, "Not an archive: %s", params.archive);
+
+	read_full(fd, &hdr, sizeof(hdr), 0, params.archive);
+	if (memcmp(hdr.magic, SBA_MAGIC, SBA_MAGIC_SIZE))
+		die(EX_DATAERR, "Not an archive: %s", params.archive);
+
+	count = be32_to_cpu(hdr.count);
+	manifest_size = be64_to_cpu(hdr.manifest_size);
+	if (manifest_size > (uint64_t) st.st_size - sizeof(hdr))
+		die(EX_DATAERR, "Truncated archive: %s", params.archive);
+
+	manifest = p = (unsigned char *) xmalloc(manifest_size);
+	end = manifest + manifest_size;
+	read_full(fd, manifest, manifest_size, sizeof(hdr), params.archive);
+
+	members = (struct sba_member *) xmalloc(count * sizeof(*members));
+	for (nmembers = 0; nmembers < count; nmembers++) {
+		struct sba_member *m = &members[nmembers];
+		sba_entry_raw e;
+		size_t len;
+
+		if (end - p < (ptrdiff_t) sizeof(e))
+			die(EX_DATAERR, "Corrupt manifest: %s", params.archive);
+		memcpy(&e, p, sizeof(e));
+		p += sizeof(e);
+
+		len = be16_to_cpu(e.name_len);
+		if (!len || end - p < (ptrdiff_t) len)
+			die(EX_DATAERR, "Corrupt manifest: %s", params.archive);
+
+		memset(m, 0, sizeof(*m));
+		m->name = (char *) xmalloc(len + 1);
+		memcpy(m->name, p, len);
+		m->name[len] = '\0';
+		p += len;
+
+		m->offset = be64_to_cpu(e.offset);
+		m->size = be64_to_cpu(e.size);
+		m->stored_size = be64_to_cpu(e.stored_size);
+		m->mtime = be64_to_cpu(e.mtime);
+		m->mode = be32_to_cpu(e.mode);
+		m->compression = e.compression;
+		memcpy(m->sha256, e.sha256, sizeof(m->sha256));
+
+		if (m->offset > (uint64_t) st.st_size ||
+		    m->stored_size > (uint64_t) st.st_size - m->offset)
+			die(EX_DATAERR, "Corrupt manifest entry %s: %s", m->name,
+			    params.archive);
+	}
+	free(manifest);
+
+	debug_msg("%s: %d members, manifest %llu bytes", params.archive, nmembers,
+		  (unsigned long long) manifest_size);
+	return fd;
+}
+
+static void list_archive(void)
+{
+	int fd = open_archive();
+
+	for (int i = 0; i < nmembers; i++) {
+		struct sba_member *m = &members[i];
+
+		if (verbose)
+			printf("%04o %10llu %10llu %-6s %s\n", m->mode,
+			       (unsigned long long) m->size,
+			       (unsigned long long) m->stored_size,
+			       m->compression == SBA_ZSTD ? "zstd" : "stored",
+			       m->name);
+		else
+			printf("%s\n", m->name);
+	}
+	close(fd);
+}
+
+static bool selected(const char *name, int argc, char *argv[])
+{
+	if (!argc)
+		return true;
+
+	for (int i = 0; i < argc; i++) {
+		size_t len = strlen(argv[i]);
+
+		if (len && argv[i][len - 1] == '/') {
+			if (!strncmp(name, argv[i], len))
+				return true;
+		} else if (!strcmp(name, argv[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * The name the member is extracted to, NULL if nothing is left of it once
+ * stripped. Names escaping the target directory are refused.
+ */
+static const char *output_name(const char *name)
+{
+	const char *p = name;
+
+	if (*name == '/' || !strcmp(name, "..") || !strncmp(name, "../", 3) ||
+	    strstr(name, "/../") ||
+	    (strlen(name) >= 3 && !strcmp(name + strlen(name) - 3, "/..")))
+		die(EX_DATAERR, "Unsafe member name: %s", name);
+
+	for (int i = 0; i < params.strip; i++) {
+		p = strchr(p, '/');
+		if (!p)
+			return NULL;
+		while (*p == '/')
+			p++;
+	}
+	return *p ? p : NULL;
+}
+
+static void make_parents(const char *fn)
+{
+	char *dir = strdup(fn);
+
+	for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+			die(EX_CANTCREAT, "Cannot create directory %s: %s", dir,
+			    strerror(errno));
+		*p = '/';
+	}
+	free(dir);
+}
+
+static void extract_member(int fd, struct sba_member *m, const char *fn)
+{
+	unsigned char *stored = (unsigned char *) xmalloc(m->stored_size);
+	unsigned char *raw = stored;
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	struct timeval times[2];
+	int out;
+	int t = timings_begin("extract");
+
+	read_full(fd, stored, m->stored_size, m->offset, params.archive);
+
+	if (m->compression == SBA_ZSTD) {
+#ifdef HAVE_ZSTD
+		size_t r;
+
+		raw = (unsigned char *) xmalloc(m->size);
+		r = ZSTD_decompress(raw, m->size, stored, m->stored_size);
+		if (ZSTD_isError(r) || r != m->size)
+			die(EX_DATAERR, "Cannot decompress %s: %s", m->name,
+			    ZSTD_isError(r) ? ZSTD_getErrorName(r) : "wrong size");
+		free(stored);
+#else
+		die(EX_UNAVAILABLE, "%s is zstd compressed, %s built without zstd",
+		    m->name, progname);
+#endif
+	} else if (m->compression != SBA_STORED || m->stored_size != m->size) {
+		die(EX_DATAERR, "Unsupported compression for %s", m->name);
+	}
+
+	SHA256(raw, m->size, md);
+	if (memcmp(md, m->sha256, sizeof(md)))
+		die(EX_DATAERR, "Checksum mismatch for %s", m->name);
+
+	make_parents(fn);
+	unlink(fn);
+	out = open(fn, O_WRONLY | O_CREAT | O_TRUNC, m->mode & 0777);
+	if (out < 0)
+		die(EX_CANTCREAT, "Cannot create %s: %s", fn, strerror(errno));
+	write_full(out, raw, m->size, fn);
+	if (close(out) != 0)
+		die(EX_IOERR, "Cannot write %s: %s", fn, strerror(errno));
+	free(raw);
+
+	// Keep the timestamps, as tar does, the cache relies on them.
+	times[0].tv_sec = times[1].tv_sec = m->mtime;
+	times[0].tv_usec = times[1].tv_usec = 0;
+	utimes(fn, times);
+	timings_end(t, m->size);
+
+	verbose_msg("Extracted %s", fn);
+}
+
+static void extract_archive(int argc, char *argv[])
+{
+	int t = timings_begin("read manifest");
+	int fd = open_archive();
+	timings_end(t, 0);
+	int n = 0;
+
+	for (int i = 0; i < nmembers; i++) {
+		const char *fn;
+
+		if (!selected(members[i].name, argc, argv))
+			continue;
+		fn = output_name(members[i].name);
+		if (!fn)
+			continue;
+		extract_member(fd, &members[i], fn);
+		n++;
+	}
+	close(fd);
+
+	if (argc && !n)
+		die(EX_NOINPUT, "No matching members in %s", params.archive);
+}
+
+int main(int argc, char* argv[])
+{
+	long ncpus;
+
+	progname = strrchr(argv[0], '/');
+	if (progname != NULL)
+		++progname;
+	else
+		progname = argv[0];
+
+	timings_init(progname);
+
+	params.level = 3;
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	params.threads = ncpus > 0 ? (ncpus < SBA_MAX_THREADS ? ncpus : SBA_MAX_THREADS) : 1;
+
+#ifdef _AIX
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(*(argv + i), "--help")) {
+			*(argv + i) = "-h";
+		} else if (!strcmp(*(argv + i), "--verbose")) {
+			*(argv + i) = "-v";
+		} else if (!strcmp(*(argv + i), "--debug")) {
+			*(argv + i) = "-4";
+		} else if (!strcmp(*(argv + i), "--create")) {
+			*(argv + i) = "-c";
+		} else if (!strcmp(*(argv + i), "--list")) {
+			*(argv + i) = "-t";
+		} else if (!strcmp(*(argv + i), "--extract")) {
+			*(argv + i) = "-x";
+		} else if (!strcmp(*(argv + i), "--file")) {
+			*(argv + i) = "-f";
+		} else if (!strcmp(*(argv + i), "--directory")) {
+			*(argv + i) = "-C";
+		} else if (!strcmp(*(argv + i), "--level")) {
+			*(argv + i) = "-z";
+		} else if (!strcmp(*(argv + i), "--threads")) {
+			*(argv + i) = "-j";
+		} else if (!strcmp(*(argv + i), "--strip-components")) {
+			*(argv + i) = "-5";
+		} else if (!strcmp(*(argv + i), "--no-numa")) {
+			*(argv + i) = "-6";
+		} else if (!strncmp(*(argv + i), "--", 2)) {
+			fprintf(stderr, "%s: unrecognized option \'%s\'\n", progname,
+					*(argv + i));
+			usage(EX_OK);
+		}
+	}
+#endif
+
+	while (1) {
+		int opt;
+#ifdef _AIX
+		opt = getopt(argc, argv, "?hv4ctxf:C:z:j:5:6");
+#else
+		opt = getopt_long(argc, argv, "?hv4ctxf:C:z:j:5:6", opts, NULL);
+#endif
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'h':
+			usage(EX_OK);
+			break;
+		case '?':
+			usage(EX_USAGE);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case '4':
+			debug = true;
+			break;
+		case 'c':
+		case 't':
+		case 'x':
+			if (params.mode && params.mode != opt)
+				die(EX_USAGE, "%s", "Only one of -c, -t and -x may be given");
+			params.mode = opt;
+			break;
+		case 'f':
+			params.archive = optarg;
+			break;
+		case 'C':
+			params.directory = optarg;
+			break;
+		case 'z':
+			params.level = atoi(optarg);
+			if (params.level < 0)
+				die(EX_USAGE, "Invalid compression level: %s", optarg);
+			break;
+		case 'j':
+			params.threads = atoi(optarg);
+			if (params.threads < 1 || params.threads > SBA_MAX_THREADS)
+				die(EX_USAGE, "Threads must be 1 to %d", SBA_MAX_THREADS);
+			break;
+		case '5':
+			params.strip = atoi(optarg);
+			if (params.strip < 0)
+				die(EX_USAGE, "Invalid strip-components: %s", optarg);
+			break;
+		case '6':
+			params.no_numa = true;
+			break;
+		default:
+			usage(EX_USAGE);
+		}
+	}
+
+	if (!params.mode || !params.archive)
+		usage(EX_USAGE);
+
+	// The archive is named relative to the initial directory, as in tar.
+	if (params.directory && params.archive[0] != '/') {
+		char cwd[PATH_MAX];
+		char *fn;
+
+		if (!getcwd(cwd, sizeof(cwd)))
+			die(EX_OSERR, "Cannot get current directory: %s", strerror(errno));
+		fn = (char *) xmalloc(strlen(cwd) + strlen(params.archive) + 2);
+		sprintf(fn, "%s/%s", cwd, params.archive);
+		params.archive = fn;
+	}
+
+	if (params.directory && chdir(params.directory) != 0)
+		die(EX_NOINPUT, "Cannot change to %s: %s", params.directory,
+		    strerror(errno));
+
+	switch (params.mode) {
+	case 'c':
+		create_archive(argc - optind, argv + optind);
+		break;
+	case 't':
+		list_archive();
+		break;
+	case 'x':
+		extract_archive(argc - optind, argv + optind);
+		break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+#!/bin/bash
+#
+# Script to submit many signframework signing requests as one batch.
+# Bundles the digests listed in one or more request lists into a single
+# sf_client submission, then demultiplexes the returned signatures.
+#
+
+# Defaults, initial values
+P=${0##*/}
+
+: "${SF_BATCH_PROJECT:=sign_batch}"
+
+SF_DEBUG_ARGS=""
+SF_COMMON_ARGS=""
+
+RC=0
+
+#
+# Functions
+#
+usage () {
+    echo ""
+    echo "	Options:"
+    echo "	-h, --help              display this message and exit"
+    echo "	-v, --verbose           show verbose output"
+    echo "	-d, --debug             show additional debug output"
+    echo "	-l, --list              request list file(s), comma separated.  Each line holds"
+    echo "	                        \"<project> <input file> <output file>\""
+    echo "	-j, --project           signframework batch project (default: $SF_BATCH_PROJECT)"
+    echo "	-u, --user              signer userid"
+    echo "	-k, --sshKey            signer ssh key file"
+    echo "	-e, --epwd              signer ePWD file"
+    echo "	-S, --server            signframework server hostname"
+    echo "	-P, --password          ENV variable containing the sf_client password"
+    echo "	    --keep              keep the request list(s) after a successful submission"
+    echo ""
+    echo "	The user, sshKey, epwd and server values default to the environment"
+    echo "	variables SF_USER, SF_SSHKEY, SF_EPWD and SF_SERVER."
+    echo ""
+    exit 1
+}
+
+die () {
+    echo "$P: $*" 1>&2
+    exit 1
+}
+
+is_cmd_available () {
+    command -v "$1" &>/dev/null
+}
+
+#
+# Main
+#
+
+# Convert long options to short
+for arg in "$@"; do
+  shift
+  case "$arg" in
+    "--help")       set -- "$@" "-h" ;;
+    "--verbose")    set -- "$@" "-v" ;;
+    "--debug")      set -- "$@" "-d" ;;
+    "--list")       set -- "$@" "-l" ;;
+    "--project")    set -- "$@" "-j" ;;
+    "--user")       set -- "$@" "-u" ;;
+    "--sshKey")     set -- "$@" "-k" ;;
+    "--epwd")       set -- "$@" "-e" ;;
+    "--server")     set -- "$@" "-S" ;;
+    "--password")   set -- "$@" "-P" ;;
+    "--keep")       set -- "$@" "-K" ;;
+    *)              set -- "$@" "$arg"
+  esac
+done
+
+# Process command-line arguments
+while getopts -- ?hdvl:j:u:k:e:S:P:K opt
+do
+  case "${opt:?}" in
+    v) SB_VERBOSE="TRUE";;
+    d) SB_DEBUG="TRUE";;
+    l) LISTS="$OPTARG";;
+    j) SF_BATCH_PROJECT="$OPTARG";;
+    u) SF_USER="$OPTARG";;
+    k) SF_SSHKEY="$OPTARG";;
+    e) SF_EPWD="$OPTARG";;
+    S) SF_SERVER="$OPTARG";;
+    P) SF_PWD_ENV="$OPTARG";;
+    K) SB_KEEP_LIST="TRUE";;
+    h|\?) usage;;
+  esac
+done
+
+# Check required programs
+for p in tar sf_client
+do
+    is_cmd_available $p || \
+        die "Required command \"$p\" not available or not found in PATH"
+done
+
+test -z "$LISTS" && die "No request list provided"
+test -z "$SF_USER" && die "No signer userid provided"
+test -z "$SF_SSHKEY" && die "No signer ssh key provided"
+test -z "$SF_EPWD" && die "No signer ePWD provided"
+test -z "$SF_SERVER" && die "No signframework server provided"
+
+test "$SB_VERBOSE" && SF_DEBUG_ARGS=" -v"
+test "$SB_DEBUG" && SF_DEBUG_ARGS="$SF_DEBUG_ARGS -d -stdout"
+test "$SF_PWD_ENV" && SF_COMMON_ARGS="$SF_COMMON_ARGS --password $SF_PWD_ENV"
+
+B=$(mktemp -d) || die "Cannot create batch work dir"
+mkdir "$B/req" "$B/rsp"
+
+#
+# Bundle the requests.  Each request gets an id, its input is stored in the
+# batch as <id>.bin and the manifest maps the id to the signing project.
+#
+echo "# sb-signing-utils batch request v1" > "$B/req/manifest"
+: > "$B/outputs"
+: > "$B/index"
+
+N=0
+IFS=","
+for LIST in $LISTS
+do
+    unset IFS
+    test ! -f "$LIST" && die "Can't open request list: $LIST"
+
+    while read -r project input output
+    do
+        case "$project" in ''|\#*) continue ;; esac
+        test ! -f "$input" && die "Can't open request input: $input"
+
+        # Identical requests (e.g. the prefix header of every container
+        # using the same SW keys) are signed only once.
+        sum=$(sha256sum < "$input" | cut -d' ' -f1)
+        id=$(awk -v p="$project" -v s="$sum" \
+                 '$1 == p && $2 == s { print $3; exit }' "$B/index")
+
+        if [ -z "$id" ]; then
+            N=$((N + 1))
+            id=$(printf "req_%04d" $N)
+            cp -p "$input" "$B/req/$id.bin"
+            echo "$id $project" >> "$B/req/manifest"
+            echo "$project $sum $id" >> "$B/index"
+        fi
+        echo "$id $output" >> "$B/outputs"
+        test "$SB_VERBOSE" && echo "--> $P: $id: $project ($input)"
+    done < "$LIST"
+done
+unset IFS
+
+if [ $N -eq 0 ]; then
+    echo "--> $P: No signing requests pending."
+    rm -rf "$B"
+    exit 0
+fi
+
+(cd "$B/req" && tar -cf ../request.tar manifest req_*.bin) || \
+    die "Cannot create batch request"
+
+#
+# Submit the batch as a single request.
+#
+echo "--> $P: Submitting $N signing requests to $SF_BATCH_PROJECT..."
+sf_client $SF_DEBUG_ARGS $SF_COMMON_ARGS \
+          -p "$SF_BATCH_PROJECT" \
+          -e "$SF_EPWD" \
+          -c "Batch of $N signing requests" \
+          -u sftp://$SF_USER@$SF_SERVER \
+          -k "$SF_SSHKEY" \
+          -i "$B/request.tar" \
+          -o "$B/response.tar"
+rc=$?
+test $rc -ne 0 && die "Call to sf_client failed with error: $rc"
+
+tar -xf "$B/response.tar" -C "$B/rsp" || die "Cannot unpack batch response"
+test ! -f "$B/rsp/manifest" && die "Batch response has no manifest"
+
+#
+# Demultiplex the signatures to their requested output files.
+#
+while read -r id output
+do
+    status=$(awk -v id="$id" '$1 == id { print $2 }' "$B/rsp/manifest")
+
+    if [ "$status" == ok ] && [ -s "$B/rsp/$id.raw" ]; then
+        cp "$B/rsp/$id.raw" "$output" || RC=1
+        test "$SB_VERBOSE" && echo "--> $P: $id: signature saved to $output"
+    else
+        echo "--> $P: $id: no signature returned (${status:-missing})" 1>&2
+        RC=1
+    fi
+done < "$B/outputs"
+
+if [ $RC -eq 0 ]; then
+    echo "--> $P: Retrieved $N signatures for $(wc -l < "$B/outputs") requests."
+    if [ -z "$SB_KEEP_LIST" ]; then
+        IFS=","
+        for LIST in $LISTS; do rm -f "$LIST"; done
+        unset IFS
+    fi
+fi
+
+rm -rf "$B"
+exit $RC
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# Reference sign helper for "create-container --sign-helper", signing with
+# local private keys. Reads "<key> <digest>" requests on stdin and answers
+# "<key> <signature>" on stdout, both in hexascii, e.g.:
+#
+#   create-container -a hw_key_a.key ... --sign-helper \
+#       "sign-helper-local-keys.sh -a hw_key_a.key -b hw_key_b.key ..."
+#
+# The digest is signed as is (it already is the header hash), so no
+# intermediate files are written.
+
+P=${0##*/}
+
+usage () {
+    echo ""
+    echo "	Options:"
+    echo "	-h, --help              display this message and exit"
+    echo "	-a, --hwKeyA            file containing HW key A private key in PEM format"
+    echo "	-b, --hwKeyB            file containing HW key B private key in PEM format"
+    echo "	-c, --hwKeyC            file containing HW key C private key in PEM format"
+    echo "	-p, --swKeyP            file containing SW key P private key in PEM format"
+    echo "	-q, --swKeyQ            file containing SW key Q private key in PEM format"
+    echo "	-r, --swKeyR            file containing SW key R private key in PEM format"
+    echo ""
+    exit 1
+}
+
+die () {
+    echo "$P: $*" 1>&2
+    exit 1
+}
+
+for arg in "$@"; do
+  shift
+  case "$arg" in
+    "--help")   set -- "$@" "-h" ;;
+    "--hwKeyA") set -- "$@" "-a" ;;
+    "--hwKeyB") set -- "$@" "-b" ;;
+    "--hwKeyC") set -- "$@" "-c" ;;
+    "--swKeyP") set -- "$@" "-p" ;;
+    "--swKeyQ") set -- "$@" "-q" ;;
+    "--swKeyR") set -- "$@" "-r" ;;
+    *)          set -- "$@" "$arg"
+  esac
+done
+
+while getopts -- ?ha:b:c:p:q:r: opt
+do
+  case "$opt" in
+    a|b|c|p|q|r) declare "KEY_$opt=$OPTARG";;
+    h|\?) usage;;
+  esac
+done
+
+while read -r KEY DIGEST
+do
+    test -z "$KEY" && continue
+    varname=KEY_$KEY; KEYFILE=${!varname}
+
+    if [ ! -f "$KEYFILE" ]; then
+        echo "$KEY error no private key for key $KEY"
+        continue
+    fi
+
+    SIG=$(echo "$DIGEST" | xxd -r -p | \
+          openssl pkeyutl -sign -inkey "$KEYFILE" | xxd -p | tr -d '\n')
+
+    if [ "$SIG" ]; then
+        echo "$KEY $SIG"
+    else
+        echo "$KEY error signing failed for key $KEY"
+    fi
+done
@@ -0,0 +1,642 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Finalize independent mode containers as their signatures arrive.
+ *
+ * crtSignedContainer.sh --sig-watch leaves, in each container subdir of the
+ * cache, a "pending.sigs" file listing the signatures still missing, one
+ * "<create-container option> <file> [<alternate file>...]" line each, and
+ * a "finalize.sh" script building the container from the cached headers.
+ * A file starting with "./" is only looked for in the container subdir,
+ * other files anywhere in the cache, as crtSignedContainer.sh does.
+ *
+ * The cache dir and its subdirs are watched with inotify, and as soon as
+ * the last signature of a container is written, finalize.sh is run with
+ * the "<option> <file>" pairs found, and pending.sigs renamed to
+ * pending.sigs.done. If finalize.sh fails, the container is only tried
+ * again once its subdir, or that of one of its signatures, changes. Linux
+ * only.
+ */
+
+#include <config.h>
+
+#include <getopt.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "container.c"
+#include "container.h"
+#include "metrics.h"
+
+#define PENDING_FILE	"pending.sigs"
+#define FINALIZE_FILE	"finalize.sh"
+#define MAX_ALTS	4
+
+char *progname;
+
+bool verbose, debug;
+int wrap = 100;
+
+struct pending_sig {
+	char *option;
+	char *names[MAX_ALTS];
+	int nnames;
+	char *found;
+};
+
+struct watched_dir {
+	char *path;
+	int wd;
+	struct pending_sig *sigs;
+	int nsigs;
+	bool pending;
+	bool failed;		/* finalize.sh failed, nothing changed since */
+};
+
+static struct {
+	char *topdir;
+	int timeout;
+	bool follow;
+} params;
+
+static int ifd;
+static int top_wd;
+static struct watched_dir *dirs;
+static int ndirs, maxdirs;
+
+__attribute__((__noreturn__)) void usage (int status)
+{
+	if (status != 0) {
+		fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+	}
+	else {
+		printf("Usage: %s [options] CACHEDIR\n", progname);
+		printf(
+			"\n"
+			"Options:\n"
+			" -h, --help              display this message and exit\n"
+			" -v, --verbose           show verbose output\n"
+			"     --debug             show additional debug output\n"
+			" -f, --follow            keep watching for new containers once all\n"
+			"                          pending ones are finalized\n"
+			" -t, --timeout           give up after this many seconds without\n"
+			"                          finalizing a container (default: never)\n"
+			"     --metrics           write Prometheus metrics of the pending and\n"
+			"                          finalized containers to this file, every\n"
+			"                          $STB_METRICS_INTERVAL seconds and at exit\n"
+			"     --metrics-socket    serve the metrics to scrapes on this Unix socket\n"
+			"\n"
+			"CACHEDIR is the cache dir of crtSignedContainer.sh (SIGNTOOL_<id>).\n"
+			"Exits 0 once every container with pending signatures is finalized.\n"
+			"\n");
+	};
+	exit(status);
+}
+
+static struct option const opts[] = {
+	{ "help",             no_argument,       0,  'h' },
+	{ "verbose",          no_argument,       0,  'v' },
+	{ "debug",            no_argument,       0,  '4' },
+	{ "follow",           no_argument,       0,  'f' },
+	{ "timeout",          required_argument, 0,  't' },
+	{ "metrics",          required_argument, 0,  '1' },
+	{ "metrics-socket",   required_argument, 0,  '2' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static char *join_path(const char *dir, const char *name)
+{
+	char *fn = (char *) malloc(strlen(dir) + strlen(name) + 2);
+
+	if (!fn)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+	sprintf(fn, "%s/%s", dir, name);
+	return fn;
+}
+
+static void free_sigs(struct watched_dir *d)
+{
+	for (int i = 0; i < d->nsigs; i++) {
+		free(d->sigs[i].option);
+		for (int j = 0; j < d->sigs[i].nnames; j++)
+			free(d->sigs[i].names[j]);
+		free(d->sigs[i].found);
+	}
+	free(d->sigs);
+	d->sigs = NULL;
+	d->nsigs = 0;
+	d->pending = false;
+	d->failed = false;
+}
+
+/*
+ * (Re)read the pending signatures of a container subdir, if any.
+ */
+static void load_pending(struct watched_dir *d)
+{
+	char line[PATH_MAX * 2];
+	char *fn = join_path(d->path, PENDING_FILE);
+	FILE *fp = fopen(fn, "r");
+	int max = 0;
+
+	free_sigs(d);
+
+	if (!fp) {
+		if (errno != ENOENT)
+			fprintf(stderr, "%s: Cannot open %s: %s\n", progname, fn,
+				strerror(errno));
+		free(fn);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct pending_sig *s;
+		char *tok = strtok(line, " \t\n");
+
+		if (!tok || *tok == '#')
+			continue;
+
+		if (d->nsigs == max) {
+			max = max ? max * 2 : 8;
+			d->sigs = (struct pending_sig *) realloc(d->sigs,
+						max * sizeof(*d->sigs));
+			if (!d->sigs)
+				die(EX_OSERR, "%s", "Cannot allocate memory");
+		}
+		s = &d->sigs[d->nsigs];
+		memset(s, 0, sizeof(*s));
+		s->option = strdup(tok);
+
+		while ((tok = strtok(NULL, " \t\n")) && s->nnames < MAX_ALTS)
+			s->names[s->nnames++] = strdup(tok);
+
+		if (!s->nnames) {
+			fprintf(stderr, "%s: %s: no file given for %s, ignored\n",
+				progname, fn, s->option);
+			free(s->option);
+			continue;
+		}
+		d->nsigs++;
+	}
+	fclose(fp);
+
+	d->pending = d->nsigs > 0;
+	verbose_msg("%s: %d pending signature(s)", d->path, d->nsigs);
+	free(fn);
+}
+
+static struct watched_dir *find_dir(int wd)
+{
+	for (int i = 0; i < ndirs; i++)
+		if (dirs[i].wd == wd)
+			return &dirs[i];
+	return NULL;
+}
+
+static void add_dir(const char *name)
+{
+	struct watched_dir *d;
+	char *path = join_path(params.topdir, name);
+	int wd;
+
+	wd = inotify_add_watch(ifd, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0) {
+		fprintf(stderr, "%s: Cannot watch %s: %s\n", progname, path,
+			strerror(errno));
+		free(path);
+		return;
+	}
+
+	// The same subdir, reported twice (by the scan and by inotify).
+	if (find_dir(wd)) {
+		free(path);
+		return;
+	}
+
+	if (ndirs == maxdirs) {
+		maxdirs = maxdirs ? maxdirs * 2 : 16;
+		dirs = (struct watched_dir *) realloc(dirs, maxdirs * sizeof(*dirs));
+		if (!dirs)
+			die(EX_OSERR, "%s", "Cannot allocate memory");
+	}
+	d = &dirs[ndirs++];
+	memset(d, 0, sizeof(*d));
+	d->path = path;
+	d->wd = wd;
+	debug_msg("Watching %s", path);
+
+	// Anything written before the watch was added is picked up here.
+	load_pending(d);
+}
+
+static void scan_topdir(void)
+{
+	DIR *dp = opendir(params.topdir);
+	struct dirent *de;
+	struct stat st;
+
+	if (!dp)
+		die(EX_NOINPUT, "Cannot open cache dir: %s: %s", params.topdir,
+		    strerror(errno));
+
+	while ((de = readdir(dp))) {
+		char *path;
+
+		if (de->d_name[0] == '.')
+			continue;
+		path = join_path(params.topdir, de->d_name);
+		if (!stat(path, &st) && S_ISDIR(st.st_mode))
+			add_dir(de->d_name);
+		free(path);
+	}
+	closedir(dp);
+}
+
+/*
+ * Look for a signature file, in the container subdir first, then, unless
+ * it starts with "./", in the other subdirs of the cache.
+ */
+static char *locate(struct watched_dir *d, const char *name)
+{
+	struct stat st;
+	char *fn;
+	bool local = !strncmp(name, "./", 2);
+
+	if (local)
+		name += 2;
+
+	fn = join_path(d->path, name);
+	if (!stat(fn, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+		return fn;
+	free(fn);
+
+	if (local)
+		return NULL;
+
+	for (int i = 0; i < ndirs; i++) {
+		if (&dirs[i] == d)
+			continue;
+		fn = join_path(dirs[i].path, name);
+		if (!stat(fn, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+			return fn;
+		free(fn);
+	}
+	return NULL;
+}
+
+static bool resolve(struct watched_dir *d)
+{
+	bool all = true;
+
+	for (int i = 0; i < d->nsigs; i++) {
+		struct pending_sig *s = &d->sigs[i];
+
+		for (int j = 0; !s->found && j < s->nnames; j++) {
+			s->found = locate(d, s->names[j]);
+			if (s->found) {
+				char label[METRICS_LABELS_LEN];
+
+				verbose_msg("%s: found %s", d->path, s->found);
+				metrics_count("stb_signatures_arrived_total",
+					      "Signatures found, by option",
+					      metrics_label(label, sizeof(label),
+							    "option", s->option), 1);
+			}
+		}
+		if (!s->found)
+			all = false;
+	}
+	return all;
+}
+
+static bool finalize(struct watched_dir *d)
+{
+	char **argv = (char **) calloc(2 * d->nsigs + 3, sizeof(char *));
+	char *done_fn, *pending_fn;
+	uint64_t started = metrics_now();
+	pid_t pid;
+	int status, n = 0;
+
+	if (!argv)
+		die(EX_OSERR, "%s", "Cannot allocate memory");
+
+	argv[n++] = (char *) "sh";
+	argv[n++] = (char *) FINALIZE_FILE;
+	for (int i = 0; i < d->nsigs; i++) {
+		argv[n++] = d->sigs[i].option;
+		argv[n++] = d->sigs[i].found;
+	}
+	argv[n] = NULL;
+
+	printf("%s: Finalizing %s\n", progname, d->path);
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		die(EX_OSERR, "Cannot fork: %s", strerror(errno));
+	if (pid == 0) {
+		if (chdir(d->path) != 0) {
+			fprintf(stderr, "%s: Cannot enter %s: %s\n", progname,
+				d->path, strerror(errno));
+			_exit(EX_OSERR);
+		}
+		execv("/bin/sh", argv);
+		_exit(EX_OSERR);
+	}
+	free(argv);
+
+	if (waitpid(pid, &status, 0) < 0)
+		die(EX_OSERR, "Cannot wait for %s: %s", FINALIZE_FILE, strerror(errno));
+	metrics_observe(metrics_get(METRICS_LATENCY, "stb_finalize",
+				    "Time to run finalize.sh", NULL),
+			metrics_now() - started);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: %s/%s failed (status %d), will retry on change\n",
+			progname, d->path, FINALIZE_FILE, status);
+		metrics_count("stb_finalized_total", "Containers finalized, by result",
+			      "result=\"failed\"", 1);
+		d->failed = true;
+		return false;
+	}
+
+	pending_fn = join_path(d->path, PENDING_FILE);
+	done_fn = join_path(d->path, PENDING_FILE ".done");
+	if (rename(pending_fn, done_fn) != 0)
+		die(EX_CANTCREAT, "Cannot rename %s: %s", pending_fn, strerror(errno));
+	free(pending_fn);
+	free(done_fn);
+
+	free_sigs(d);
+	metrics_count("stb_finalized_total", "Containers finalized, by result",
+		      "result=\"ok\"", 1);
+	printf("%s: Finalized %s\n", progname, d->path);
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Something was written to the subdir changed: the containers that failed
+ * to finalize with it, or with a signature in it, are tried again, all
+ * their signatures looked for again, as one of them may be replaced.
+ */
+static void retry_failed(const struct watched_dir *changed)
+{
+	size_t len = strlen(changed->path);
+	struct watched_dir *d;
+	bool retry;
+
+	for (int i = 0; i < ndirs; i++) {
+		d = &dirs[i];
+		if (!d->failed)
+			continue;
+		retry = d == changed;
+		for (int j = 0; !retry && j < d->nsigs; j++)
+			retry = d->sigs[j].found
+				&& !strncmp(d->sigs[j].found, changed->path, len)
+				&& d->sigs[j].found[len] == '/';
+		if (!retry)
+			continue;
+		debug_msg("%s: changed, trying again", d->path);
+		for (int j = 0; j < d->nsigs; j++) {
+			free(d->sigs[j].found);
+			d->sigs[j].found = NULL;
+		}
+		d->failed = false;
+	}
+}
+
+/*
+ * Finalize every container whose signatures are all available, and that
+ * did not fail to with those, return the number of containers still
+ * pending.
+ */
+static int check_all(int *finalized)
+{
+	int pending = 0, missing = 0;
+
+	for (int i = 0; i < ndirs; i++) {
+		if (!dirs[i].pending)
+			continue;
+		if (!dirs[i].failed && resolve(&dirs[i]) && finalize(&dirs[i])) {
+			(*finalized)++;
+			continue;
+		}
+		pending++;
+		for (int j = 0; j < dirs[i].nsigs; j++)
+			if (!dirs[i].sigs[j].found)
+				missing++;
+	}
+	metrics_gauge("stb_pending_containers",
+		      "Containers waiting for signatures", NULL, pending);
+	metrics_gauge("stb_pending_signatures",
+		      "Signatures the pending containers wait for", NULL, missing);
+	return pending;
+}
+
+static bool handle_events(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+
+	len = read(ifd, buf, sizeof(buf));
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return false;
+		die(EX_OSERR, "Cannot read inotify events: %s", strerror(errno));
+	}
+
+	for (char *ptr = buf; ptr < buf + len; ) {
+		const struct inotify_event *ev = (const struct inotify_event *) ptr;
+		struct watched_dir *d;
+
+		ptr += sizeof(struct inotify_event) + ev->len;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			// Events were lost, rescan everything.
+			scan_topdir();
+			for (int i = 0; i < ndirs; i++)
+				load_pending(&dirs[i]);
+			changed = true;
+			continue;
+		}
+
+		if (!ev->len)
+			continue;
+
+		debug_msg("Event %#x on %s", ev->mask, ev->name);
+
+		if (ev->wd == top_wd) {
+			if (ev->mask & IN_ISDIR)
+				add_dir(ev->name);
+			changed = true;
+			continue;
+		}
+
+		d = find_dir(ev->wd);
+		if (!d)
+			continue;
+		if (!strcmp(ev->name, PENDING_FILE))
+			load_pending(d);
+		else
+			retry_failed(d);
+		changed = true;
+	}
+	return changed;
+}
+
+int main(int argc, char* argv[])
+{
+	int pending, finalized = 0;
+	time_t deadline = 0;
+
+	progname = strrchr(argv[0], '/');
+	if (progname != NULL)
+		++progname;
+	else
+		progname = argv[0];
+
+	metrics_init(progname);
+
+	while (1) {
+		int opt;
+		opt = getopt_long(argc, argv, "?hv4ft:1:2:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'h':
+			usage(EX_OK);
+			break;
+		case '?':
+			usage(EX_USAGE);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case '4':
+			debug = true;
+			break;
+		case 'f':
+			params.follow = true;
+			break;
+		case 't':
+			params.timeout = atoi(optarg);
+			if (params.timeout < 1)
+				die(EX_USAGE, "Invalid timeout: %s", optarg);
+			break;
+		case '1':
+			metrics.file = optarg;
+			break;
+		case '2':
+			metrics.socket = optarg;
+			break;
+		default:
+			usage(EX_USAGE);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(EX_USAGE);
+	params.topdir = argv[optind];
+	if (!metrics_start())
+		die(EX_OSERR, "Cannot serve metrics: %s", strerror(errno));
+
+	// Stdout is often a pipe or a log, keep the messages in order.
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd < 0)
+		die(EX_OSERR, "Cannot initialize inotify: %s", strerror(errno));
+
+	// Watch before scanning, so that nothing is missed in between.
+	top_wd = inotify_add_watch(ifd, params.topdir,
+				   IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+	if (top_wd < 0)
+		die(EX_NOINPUT, "Cannot watch %s: %s", params.topdir, strerror(errno));
+	scan_topdir();
+
+	if (params.timeout)
+		deadline = time(NULL) + params.timeout;
+
+	pending = check_all(&finalized);
+
+	while (pending || params.follow) {
+		struct pollfd pfd = { ifd, POLLIN, 0 };
+		int timeout = -1;
+		int r;
+
+		if (deadline) {
+			time_t left = deadline - time(NULL);
+
+			if (left <= 0)
+				break;
+			timeout = left * 1000;
+		}
+
+		r = poll(&pfd, 1, timeout);
+		if (r < 0 && errno != EINTR)
+			die(EX_OSERR, "Cannot poll: %s", strerror(errno));
+		if (r <= 0)
+			continue;
+
+		if (handle_events()) {
+			int before = finalized;
+
+			pending = check_all(&finalized);
+			if (finalized != before && params.timeout)
+				deadline = time(NULL) + params.timeout;
+		}
+	}
+
+	verbose_msg("%d container(s) finalized, %d pending", finalized, pending);
+
+	if (pending) {
+		for (int i = 0; i < ndirs; i++) {
+			if (!dirs[i].pending)
+				continue;
+			if (dirs[i].failed)
+				fprintf(stderr, "%s: %s: %s failed\n", progname,
+					dirs[i].path, FINALIZE_FILE);
+			for (int j = 0; j < dirs[i].nsigs; j++)
+				if (!dirs[i].sigs[j].found)
+					fprintf(stderr, "%s: %s: still missing %s\n",
+						progname, dirs[i].path,
+						dirs[i].sigs[j].names[0]);
+		}
+		die(EX_TEMPFAIL, "Timed out with %d container(s) pending", pending);
+	}
+
+	close(ifd);
+	return 0;
+}
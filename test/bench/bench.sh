@@ -0,0 +1,301 @@
+#!/bin/bash
+
+# Benchmark container build, validate and verify for each container version
+# over synthetic payloads, plus the per-primitive costs measured by
+# stbbench, and write the results as JSON to compare between releases.
+#
+# For each payload size and container version the payload is generated
+# (once per size), the headers are dumped and signed with the
+# test keys, and the timed steps are:
+#
+#   build      create-container with the signatures, i.e. hashing the
+#              payload and writing the container
+#   sign       signing the dumped headers, openssl for ECDSA and gendilsig
+#              for Dilithium and ML-DSA-87
+#   validate   print-container --validate
+#   verify     print-container --verify <HW keys hash>
+#
+# v2 and v3 containers need gendilsig, and print-container and stbbench
+# built with ADD_DILITHIUM (make -f Makefile.v2 bench), and are skipped
+# otherwise.
+
+P=${0##*/}
+D=$(cd "${0%/*}" && pwd)
+K=$(cd "$D/.." && pwd)
+
+usage () {
+    echo ""
+    echo "	Options:"
+    echo "	-h, --help              display this message and exit"
+    echo "	-B, --bindir            directory holding create-container, print-container,"
+    echo "	                        hashkeys and test/bench/stbbench (default: PATH)"
+    echo "	-d, --workdir           directory for payloads and containers, payloads"
+    echo "	                        already there are reused (default: a temporary dir)"
+    echo "	-s, --sizes             comma separated payload sizes, with K, M or G suffix"
+    echo "	                        (default 4K,1M,64M,1G,4G)"
+    echo "	-V, --versions          comma separated container versions to run, from"
+    echo "	                        v1,v2,v3,v3-sha512,v3-pure (default all)"
+    echo "	-n, --runs              runs per timed step, the minimum and median are"
+    echo "	                        reported (default 3)"
+    echo "	-o, --output            JSON output file (default stdout)"
+    echo "	-k, --keep              keep the generated payloads and containers"
+    echo ""
+    exit 1
+}
+
+die () {
+    echo "$P: $*" 1>&2
+    exit 1
+}
+
+msg () {
+    echo "--> $P: $*" 1>&2
+}
+
+for arg in "$@"; do
+  shift
+  case "$arg" in
+    "--help")     set -- "$@" "-h" ;;
+    "--bindir")   set -- "$@" "-B" ;;
+    "--workdir")  set -- "$@" "-d" ;;
+    "--sizes")    set -- "$@" "-s" ;;
+    "--versions") set -- "$@" "-V" ;;
+    "--runs")     set -- "$@" "-n" ;;
+    "--output")   set -- "$@" "-o" ;;
+    "--keep")     set -- "$@" "-k" ;;
+    *)            set -- "$@" "$arg"
+  esac
+done
+
+while getopts -- ?hB:d:s:V:n:o:k opt
+do
+  case "$opt" in
+    B) BINDIR="$OPTARG";;
+    d) WORKDIR="$OPTARG";;
+    s) SIZES="$OPTARG";;
+    V) VERSIONS="$OPTARG";;
+    n) RUNS="$OPTARG";;
+    o) OUTPUT="$OPTARG";;
+    k) KEEP=true;;
+    h|\?) usage;;
+  esac
+done
+
+: "${SIZES:=4K,1M,64M,1G,4G}"
+: "${VERSIONS:=v1,v2,v3,v3-sha512,v3-pure}"
+: "${RUNS:=3}"
+
+test "$BINDIR" && PATH="$(cd "$BINDIR" && pwd):$(cd "$BINDIR" && pwd)/test/bench:$PATH"
+for p in create-container print-container hashkeys stbbench openssl
+do
+    command -v $p >/dev/null || die "Required command \"$p\" not found"
+done
+command -v gendilsig >/dev/null && HAVE_GENDILSIG=true
+
+if [ "$WORKDIR" ]; then
+    mkdir -p "$WORKDIR" || die "Cannot create work dir $WORKDIR"
+else
+    WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/stbbench.XXXXXX") || die "Cannot create work dir"
+fi
+
+to_bytes () {
+    local n=${1%[KkMmGg]}
+    case "$1" in
+        *[Kk]) echo $((n << 10)) ;;
+        *[Mm]) echo $((n << 20)) ;;
+        *[Gg]) echo $((n << 30)) ;;
+        *)     echo $((n)) ;;
+    esac
+}
+
+now_ns () {
+    date +%s%N
+}
+
+# Run a command $RUNS times, set MIN and MEDIAN to the elapsed ns.
+time_runs () {
+    local i t0 t1 times=()
+    for ((i = 0; i < RUNS; i++))
+    do
+        t0=$(now_ns)
+        "$@" >/dev/null 2>"$WORKDIR/err" || {
+            cat "$WORKDIR/err" 1>&2
+            die "Failed: $*"
+        }
+        t1=$(now_ns)
+        times+=($((t1 - t0)))
+    done
+    read -r -a times <<< "$(printf '%s\n' "${times[@]}" | sort -n | tr '\n' ' ')"
+    MIN=${times[0]}
+    MEDIAN=${times[$((RUNS / 2))]}
+}
+
+# Pseudo-random payload, generated with AES-CTR as /dev/urandom is too slow
+# for GiB sizes.
+gen_payload () {
+    local f="$WORKDIR/payload.$1" bytes
+    bytes=$(to_bytes "$1")
+    if [ "$(stat -c %s "$f" 2>/dev/null)" != "$bytes" ]; then
+        msg "Generating $1 payload..."
+        head -c "$bytes" /dev/zero | \
+            openssl enc -aes-128-ctr -nosalt -pbkdf2 -pass pass:stbbench \
+            > "$f" || die "Cannot generate payload $f"
+    fi
+    PAYLOAD=$f
+}
+
+# Set the create-container, signing and hashkeys arguments of a version.
+setup_version () {
+    local v2k="$K/v2_keys" v3k="$K/v3_keys"
+    HASH=sha512; PURE=""; DIL=""
+    case "$1" in
+    v1)
+        KEYS="-a $K/keys/hw_key_a.key -b $K/keys/hw_key_b.key -c $K/keys/hw_key_c.key -p $K/keys/sw_key_p.key"
+        HW_ECC="a:$K/keys/hw_key_a.key b:$K/keys/hw_key_b.key c:$K/keys/hw_key_c.key"
+        SW_ECC="p:$K/keys/sw_key_p.key"
+        VERSION_ARGS="-V 1"
+        HASHKEYS_ARGS="-a $K/keys/hw_key_a.key -b $K/keys/hw_key_b.key -c $K/keys/hw_key_c.key"
+        ;;
+    v2|v3|v3-sha512|v3-pure)
+        local kd=$v3k
+        test "$1" == v2 && kd=$v2k
+        DIL=true
+        KEYS="-a $kd/boot_hw_key_a.key --hw_key_d $kd/boot_hw_key_d.pub -p $kd/boot_sw_key_p.key --sw_key_s $kd/boot_sw_key_s.pub"
+        HW_ECC="a:$kd/boot_hw_key_a.key"
+        SW_ECC="p:$kd/boot_sw_key_p.key"
+        HW_DIL="$kd/boot_hw_key_d.key"
+        SW_DIL="$kd/boot_sw_key_s.key"
+        HASH=sha3-512
+        case "$1" in
+        v2)         VERSION_ARGS="-V 2" ;;
+        v3)         VERSION_ARGS="-V 3 --hash sha3-512" ;;
+        v3-sha512)  VERSION_ARGS="-V 3 --hash sha512"; HASH=sha512 ;;
+        v3-pure)    VERSION_ARGS="-V 3 --hash sha512 --pure"; HASH=sha512; PURE=true ;;
+        esac
+        HASHKEYS_ARGS="-a $kd/boot_hw_key_a.key -d $kd/boot_hw_key_d.pub -V ${VERSION_ARGS:3:1}"
+        test "$1" == v2 || HASHKEYS_ARGS="$HASHKEYS_ARGS --hash $HASH"
+        ;;
+    *)
+        die "Unknown container version \"$1\""
+    esac
+}
+
+# Sign the dumped headers, writing the signature arguments to SIG_ARGS.
+sign_headers () {
+    local w=$1 kf k dilin
+    SIG_ARGS=""
+    for kf in $HW_ECC; do
+        k=${kf%%:*}
+        openssl dgst -$HASH -sign "${kf#*:}" "$w/prefix_hdr" > "$w/hw_sig_$k" || return 1
+        SIG_ARGS="$SIG_ARGS -${k^^} $w/hw_sig_$k"
+    done
+    for kf in $SW_ECC; do
+        k=${kf%%:*}
+        openssl dgst -$HASH -sign "${kf#*:}" "$w/software_hdr" > "$w/sw_sig_$k" || return 1
+        SIG_ARGS="$SIG_ARGS -${k^^} $w/sw_sig_$k"
+    done
+    test "$DIL" || return 0
+
+    dilin=.md.bin
+    test "$PURE" && dilin=.bin
+    gendilsig -k "$HW_DIL" -i "$w/prefix_hdr$dilin" -o "$w/hw_sig_d" ${PURE:+--pure} || return 1
+    gendilsig -k "$SW_DIL" -i "$w/software_hdr$dilin" -o "$w/sw_sig_s" ${PURE:+--pure} || return 1
+    SIG_ARGS="$SIG_ARGS --hw_sig_d $w/hw_sig_d --sw_sig_s $w/sw_sig_s"
+}
+
+sign_step () {
+    sign_headers "$1" && echo "$SIG_ARGS" > "$1/sig_args"
+}
+
+RESULTS=()
+CONTAINERS=()
+
+for size in ${SIZES//,/ }
+do
+    gen_payload "$size"
+    for ver in ${VERSIONS//,/ }
+    do
+        setup_version "$ver"
+        entry="\"version\": \"$ver\", \"size\": $(to_bytes "$size")"
+
+        if [ "$DIL" ] && [ ! "$HAVE_GENDILSIG" ]; then
+            msg "Skipping $ver $size: gendilsig not found"
+            RESULTS+=("{ $entry, \"skipped\": \"gendilsig not found\" }")
+            continue
+        fi
+
+        w="$WORKDIR/$ver.$size"
+        mkdir -p "$w"
+        out="$w/container"
+        msg "Running $ver $size..."
+
+        # Dump the headers to sign, untimed.
+        create-container $VERSION_ARGS $KEYS --payload "$PAYLOAD" \
+            --imagefile "$out" --dumpPrefixHdr "$w/prefix_hdr" \
+            --dumpSwHdr "$w/software_hdr" >/dev/null 2>"$w/err" || {
+            cat "$w/err" 1>&2; die "Cannot dump headers for $ver"; }
+
+        time_runs sign_step "$w"
+        sign_min=$MIN; sign_median=$MEDIAN
+        SIG_ARGS=$(cat "$w/sig_args")
+
+        time_runs create-container $VERSION_ARGS $KEYS $SIG_ARGS \
+            --payload "$PAYLOAD" --imagefile "$out"
+        build_min=$MIN; build_median=$MEDIAN
+
+        if print-container -I "$out" --no-print 2>&1 | grep -q ADD_DILITHIUM; then
+            msg "Skipping $ver $size validation: print-container lacks ADD_DILITHIUM"
+            RESULTS+=("{ $entry, \"build_ns\": { \"min\": $build_min, \"median\": $build_median }, \"sign_ns\": { \"min\": $sign_min, \"median\": $sign_median }, \"skipped\": \"print-container built without ADD_DILITHIUM\" }")
+            continue
+        fi
+
+        print-container -I "$out" --no-print --validate >/dev/null || \
+            die "Container $out failed validation"
+        time_runs print-container -I "$out" --no-print --validate
+        validate_min=$MIN; validate_median=$MEDIAN
+
+        keyshash=$(hashkeys $HASHKEYS_ARGS 2>/dev/null) || die "hashkeys failed for $ver"
+        time_runs print-container -I "$out" --no-print --verify "$keyshash"
+        verify_min=$MIN; verify_median=$MEDIAN
+
+        RESULTS+=("{ $entry, \"build_ns\": { \"min\": $build_min, \"median\": $build_median }, \"sign_ns\": { \"min\": $sign_min, \"median\": $sign_median }, \"validate_ns\": { \"min\": $validate_min, \"median\": $validate_median }, \"verify_ns\": { \"min\": $verify_min, \"median\": $verify_median } }")
+
+        # The smallest payload of each version for the primitive costs.
+        [[ " ${CONTAINERS[*]} " == *" $ver:"* ]] || CONTAINERS+=("$ver:$out")
+    done
+done
+
+msg "Running stbbench..."
+STBBENCH_ARGS=()
+for c in "${CONTAINERS[@]}"; do
+    STBBENCH_ARGS+=(-I "${c#*:}")
+done
+# The I/O strategies of payload hashing, over the last payload size.
+STBBENCH_ARGS+=(--io "$PAYLOAD")
+# Hashing from local, interleaved and remote memory on each NUMA node.
+STBBENCH_ARGS+=(--numa 64M)
+PRIMITIVES=$(stbbench "${STBBENCH_ARGS[@]}") || die "stbbench failed"
+
+{
+    echo "{"
+    echo "  \"meta\": {"
+    echo "    \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "    \"revision\": \"$(git -C "$K/.." describe --always --dirty 2>/dev/null)\","
+    echo "    \"host\": \"$(uname -srm)\","
+    echo "    \"cpus\": $(getconf _NPROCESSORS_ONLN),"
+    echo "    \"openssl\": \"$(openssl version)\","
+    echo "    \"runs\": $RUNS"
+    echo "  },"
+    echo "  \"files\": ["
+    for ((i = 0; i < ${#RESULTS[@]}; i++)); do
+        echo "    ${RESULTS[$i]}$( ((i + 1 < ${#RESULTS[@]})) && echo ,)"
+    done
+    echo "  ],"
+    echo "  \"primitives\": $(echo "$PRIMITIVES" | sed '2,$s/^/  /')"
+    echo "}"
+} > "${OUTPUT:-/dev/stdout}"
+
+test "$KEEP" || {
+    rm -rf "$WORKDIR"/v*.* "$WORKDIR"/payload.* "$WORKDIR/err"
+    rmdir "$WORKDIR" 2>/dev/null
+}
@@ -0,0 +1,863 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-primitive benchmarks: the header/payload hash per algorithm and size,
+ * and each signature verification and full validation of the containers
+ * given, through libstbcontainer. With --corpus, the parse throughput of
+ * the container parsers over the headers of a corpus, in memory, such as
+ * test/corpus/gencorpus makes. With --numa, the hash throughput of one
+ * thread per CPU, each pinned to its NUMA node, with its buffer on that
+ * node, interleaved over the nodes, or on another node. Results are written
+ * as JSON on stdout, see bench.sh for building the containers and timing
+ * the tools.
+ */
+
+/* For the CPU sets of numa_nodes.h. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <config.h>
+
+#ifndef _AIX
+#include <getopt.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "container.c"
+#include "container.h"
+#include "libstbcontainer.h"
+#include "numa_nodes.h"
+
+#define MAX_CONTAINERS	16
+#define MAX_SIZES	16
+#define MAX_THREADS	256
+
+char *progname;
+
+bool verbose, debug;
+int wrap = 100;
+
+struct stb_ctx *stb;
+
+static struct {
+	char *imagefn[MAX_CONTAINERS];
+	int imagefn_count;
+	size_t sizes[MAX_SIZES];
+	int size_count;
+	int iterations;
+	double min_time;
+	char *corpus;
+	size_t arena_size;
+	char *io_file;
+	size_t numa_size;
+} params;
+
+static const char *hash_name(uint8_t alg)
+{
+	return (alg == HASH_ALG_SHA3_512) ? "sha3-512" : "sha512";
+}
+
+static const char *sig_type_name(int type)
+{
+	switch (type) {
+	case STB_SIG_ECDSA_P521:	return "ecdsa-p521";
+	case STB_SIG_DILITHIUM_R2_8x7:	return "dilithium-r2-8x7";
+	case STB_SIG_MLDSA_87:		return "mldsa-87";
+	default:			return "unknown";
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Parse a size like 4096, 4K, 16M or 1G. */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	unsigned long long v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		v <<= 10;
+		end++;
+		break;
+	}
+	if (end == s || *end || !v)
+		die(EX_USAGE, "Invalid size: %s", s);
+	return v;
+}
+
+/* Allocations by OpenSSL so far, and of those, from the arena. */
+static void alloc_counts(uint64_t *allocs, uint64_t *arena_allocs)
+{
+	struct stb_alloc_stats as;
+
+	stb_alloc_stats(&as);
+	*allocs = as.allocs;
+	*arena_allocs = as.arena_allocs;
+}
+
+/*
+ * Run op until both the minimum iterations and the minimum time are
+ * reached, returns the mean time per op. A first untimed run warms up
+ * caches and the crypto library's algorithm lookups.
+ */
+#define BENCH(iters, op) ({						\
+	uint64_t __start, __elapsed;					\
+	int __n = 0;							\
+	do { op; } while (0);						\
+	__start = now_ns();						\
+	do {								\
+		op;							\
+		__n++;							\
+		__elapsed = now_ns() - __start;				\
+	} while (__n < params.iterations				\
+		 || __elapsed < params.min_time * 1e9);			\
+	*(iters) = __n;							\
+	(double) __elapsed / __n;					\
+})
+
+static void bench_hash(bool *first)
+{
+	const uint8_t algs[] = { HASH_ALG_SHA512, HASH_ALG_SHA3_512 };
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	size_t max_size = 0;
+	uint8_t *buf;
+	int i, j, n;
+
+	for (i = 0; i < params.size_count; i++)
+		max_size = max(max_size, params.sizes[i]);
+	buf = (uint8_t *) malloc(max_size);
+	if (!buf)
+		die(EX_OSERR, "Cannot allocate %lu bytes", (unsigned long) max_size);
+	for (size_t k = 0; k < max_size; k++)
+		buf[k] = (uint8_t) (k * 2654435761U >> 24);
+
+	for (i = 0; i < params.size_count; i++) {
+		for (j = 0; j < (int) (sizeof(algs) / sizeof(algs[0])); j++) {
+			double ns = BENCH(&n,
+				if (!stb_calc_hash(algs[j], buf, params.sizes[i], md))
+					die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512"));
+
+			printf("%s\n    { \"alg\": \"%s\", \"size\": %lu, \"iterations\": %d, "
+			       "\"ns_per_op\": %.0f, \"mib_per_s\": %.1f }",
+			       *first ? "" : ",", hash_name(algs[j]),
+			       (unsigned long) params.sizes[i], n, ns,
+			       params.sizes[i] / (ns / 1e9) / (1 << 20));
+			*first = false;
+			verbose_msg("hash %s %lu: %.0f ns", hash_name(algs[j]),
+				    (unsigned long) params.sizes[i], ns);
+		}
+	}
+	free(buf);
+}
+
+/* The prefix and SW headers, what the HW and SW keys sign. */
+static void signed_headers(const struct stb_container *c,
+			   const uint8_t **ph, size_t *ph_sz,
+			   const uint8_t **sh, size_t *sh_sz)
+{
+	if (c->version == 1) {
+		*ph = (const uint8_t *) c->v1.ph;
+		*ph_sz = sizeof(ROM_prefix_header_raw);
+		*sh = (const uint8_t *) c->v1.sh;
+		*sh_sz = sizeof(ROM_sw_header_raw);
+	} else if (c->version == 2) {
+		*ph = (const uint8_t *) c->v2.ph;
+		*ph_sz = sizeof(ROM_prefix_header_v2_raw);
+		*sh = (const uint8_t *) c->v2.sh;
+		*sh_sz = sizeof(ROM_sw_header_v2_raw);
+	} else {
+		*ph = (const uint8_t *) c->v3.ph;
+		*ph_sz = sizeof(ROM_prefix_header_v3_raw);
+		*sh = (const uint8_t *) c->v3.sh;
+		*sh_sz = sizeof(ROM_sw_header_v3_raw);
+	}
+}
+
+static void bench_sigs(const char *fn, const struct stb_container *c,
+		       const struct stb_sig_check *k, int count,
+		       const unsigned char *md, const uint8_t *hdr,
+		       size_t hdr_sz, bool *first)
+{
+	const unsigned char *dgst;
+	size_t dgst_len;
+	uint64_t allocs, arena_allocs, a0, aa0;
+	bool good = false;
+	int r = STB_OK, n;
+	double ns;
+
+	for (; count > 0; k++, count--) {
+		if (k->result == STB_CHECK_SKIPPED)
+			continue;
+
+		if (c->mldsa_pure_mode && k->type == STB_SIG_MLDSA_87) {
+			dgst = hdr;
+			dgst_len = hdr_sz;
+		} else {
+			dgst = md;
+			dgst_len = SHA512_DIGEST_LENGTH;
+		}
+
+		alloc_counts(&a0, &aa0);
+		switch (k->type) {
+		case STB_SIG_ECDSA_P521:
+			ns = BENCH(&n, r = stb_verify_ecdsa(stb, dgst, dgst_len,
+					k->sig, k->key, &good); if (r) break);
+			break;
+		case STB_SIG_DILITHIUM_R2_8x7:
+			ns = BENCH(&n, r = stb_verify_dilithium(stb, dgst, dgst_len,
+					k->sig, k->key, &good); if (r) break);
+			break;
+		default:
+			ns = BENCH(&n, r = stb_verify_mldsa_87(stb, dgst, dgst_len,
+					k->sig, k->key, &good); if (r) break);
+			break;
+		}
+		if (r)
+			die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+		alloc_counts(&allocs, &arena_allocs);
+
+		/* BENCH runs op once more, untimed. */
+		printf("%s\n    { \"container\": \"%s\", \"version\": %d, \"hash_alg\": \"%s\", "
+		       "\"pure\": %s, \"key\": \"%s\", \"type\": \"%s\", \"good\": %s, "
+		       "\"iterations\": %d, \"ns_per_op\": %.0f, \"allocs_per_op\": %.1f }",
+		       *first ? "" : ",", fn, c->version, hash_name(c->hash_alg),
+		       c->mldsa_pure_mode ? "true" : "false", k->name,
+		       sig_type_name(k->type), good ? "true" : "false", n, ns,
+		       (double) (allocs - a0) / (n + 1));
+		*first = false;
+		verbose_msg("%s %s %s: %.0f ns", fn, k->name,
+			    sig_type_name(k->type), ns);
+	}
+}
+
+/*
+ * Time each signature verification of a container, or with validate its
+ * full validation, through stb_validate().
+ */
+static void bench_container(const char *fn, bool validate, bool *first)
+{
+	struct stb_container c;
+	struct stb_validation v;
+	struct stat st;
+	const uint8_t *ph, *sh;
+	size_t ph_sz, sh_sz, hdr_sz;
+	uint64_t allocs, arena_allocs, a0, aa0;
+	void *buf;
+	int fd, r, n;
+	double ns;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		die(EX_NOINPUT, "Cannot open container file: %s (%s)", fn,
+		    strerror(errno));
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+		die(EX_NOINPUT, "Cannot stat container file: %s", fn);
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die(EX_OSERR, "Cannot mmap file: %s (%s)", fn, strerror(errno));
+	close(fd);
+
+	r = stb_parse(stb, buf, st.st_size, &c);
+	if (r)
+		die(stb_sysexit(r), "%s: %s", fn, stb_ctx_error(stb));
+	hdr_sz = stb_header_size(c.version);
+
+	/* Validate once for the keys present, and the header hashes. */
+	r = stb_validate(stb, &c, (const uint8_t *) buf + hdr_sz,
+			 st.st_size - hdr_sz, false, &v);
+	if (r)
+		die(stb_sysexit(r), "%s: %s", fn, stb_ctx_error(stb));
+
+	if (!validate) {
+		signed_headers(&c, &ph, &ph_sz, &sh, &sh_sz);
+		bench_sigs(fn, &c, v.hw_sigs, v.hw_sig_count, v.prefix_hdr_hash,
+			   ph, ph_sz, first);
+		bench_sigs(fn, &c, v.sw_sigs, v.sw_sig_count, v.sw_hdr_hash,
+			   sh, sh_sz, first);
+		munmap(buf, st.st_size);
+		return;
+	}
+
+	alloc_counts(&a0, &aa0);
+	ns = BENCH(&n, r = stb_validate(stb, &c, (const uint8_t *) buf + hdr_sz,
+					st.st_size - hdr_sz, false, &v); if (r) break);
+	if (r)
+		die(stb_sysexit(r), "%s: %s", fn, stb_ctx_error(stb));
+	alloc_counts(&allocs, &arena_allocs);
+
+	printf("%s\n    { \"container\": \"%s\", \"version\": %d, \"hash_alg\": \"%s\", "
+	       "\"pure\": %s, \"size\": %lu, \"valid\": %s, \"iterations\": %d, "
+	       "\"ns_per_op\": %.0f, \"allocs_per_op\": %.1f, "
+	       "\"arena_allocs_per_op\": %.1f }",
+	       *first ? "" : ",", fn, c.version, hash_name(c.hash_alg),
+	       c.mldsa_pure_mode ? "true" : "false", (unsigned long) st.st_size,
+	       v.valid ? "true" : "false", n, ns,
+	       (double) (allocs - a0) / (n + 1),
+	       (double) (arena_allocs - aa0) / (n + 1));
+	*first = false;
+
+	munmap(buf, st.st_size);
+}
+
+/*
+ * Time hashing a payload file with each I/O strategy, from the page cache
+ * (warm) and with its pages dropped before each run (cold), as far as
+ * POSIX_FADV_DONTNEED drops them. The file is mapped each run, as the tools
+ * map it once, whether the strategy hashes the mapping or not.
+ */
+static double hash_io(int fd, size_t size, int io, bool cold, int *n)
+{
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	void *map;
+
+	stb_ctx_set_io(stb, io, 0);
+	return BENCH(n,
+		if (cold)
+			posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			die(EX_OSERR, "Cannot mmap file: %s (%s)", params.io_file,
+			    strerror(errno));
+		if (!stb_calc_hash_file(stb, HASH_ALG_SHA512, fd, 0, map, size,
+					md, NULL))
+			die(EX_SOFTWARE, "%s", "Cannot get SHA512");
+		munmap(map, size));
+}
+
+static void bench_io(bool *first)
+{
+	struct stat st;
+	int fd, io, n, cold;
+	double ns;
+
+	fd = open(params.io_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+		die(EX_NOINPUT, "Cannot open payload file: %s", params.io_file);
+
+	for (io = 0; io < STB_IO_COUNT; io++) {
+		for (cold = 0; cold < 2; cold++) {
+			ns = hash_io(fd, st.st_size, io, cold, &n);
+			printf("%s\n    { \"file\": \"%s\", \"size\": %lu, "
+			       "\"strategy\": \"%s\", \"used\": \"%s\", "
+			       "\"cache\": \"%s\", \"iterations\": %d, "
+			       "\"ns_per_op\": %.0f, \"mib_per_s\": %.1f }",
+			       *first ? "" : ",", params.io_file,
+			       (unsigned long) st.st_size, stb_io_name(io),
+			       stb_io_name(stb_io_choose(stb, st.st_size,
+							 true)),
+			       cold ? "cold" : "warm", n, ns,
+			       st.st_size / (ns / 1e9) / (1 << 20));
+			*first = false;
+			verbose_msg("io %s %s: %.0f ns", stb_io_name(io),
+				    cold ? "cold" : "warm", ns);
+		}
+	}
+	stb_ctx_set_io(stb, STB_IO_AUTO, 0);
+	close(fd);
+}
+
+struct numa_worker {
+	pthread_t thread;
+	int node;		/* runs on */
+	int mem;		/* the memory is on, -1 for interleaved */
+	bool placed;
+	int n;
+	double ns;
+};
+
+static pthread_barrier_t numa_start;
+
+static void *numa_worker(void *arg)
+{
+	struct numa_worker *w = (struct numa_worker *) arg;
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	uint8_t *buf;
+
+	numa_pin(w->node);
+	buf = (uint8_t *) mmap(NULL, params.numa_size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		die(EX_OSERR, "Cannot allocate %lu bytes",
+		    (unsigned long) params.numa_size);
+	w->placed = numa_place(buf, params.numa_size, w->mem);
+	memset(buf, 0x5a, params.numa_size);
+
+	// All the threads hash at once, for the memory bandwidth they share.
+	pthread_barrier_wait(&numa_start);
+	w->ns = BENCH(&w->n,
+		if (!stb_calc_hash(HASH_ALG_SHA512, buf, params.numa_size, md))
+			die(EX_SOFTWARE, "%s", "Cannot get SHA512"));
+	munmap(buf, params.numa_size);
+	return NULL;
+}
+
+/*
+ * Time SHA512 over a buffer in each of one thread per CPU, the threads
+ * spread over the NUMA nodes and pinned, with the buffers local to the
+ * thread, interleaved over the nodes, and, with more than one node, on the
+ * next node. The throughput is the sum over the threads. Where the memory
+ * cannot be placed, "placed" is false and it comes from where the thread
+ * touches it first, its node.
+ */
+static void bench_numa(bool *first)
+{
+	static const char *const placements[] = { "local", "interleaved", "remote" };
+	struct numa_worker workers[MAX_THREADS];
+	struct numa_worker *w;
+	int nnodes = numa_init(), nthreads = 0, placement, i, j;
+	double mib_per_s;
+	bool placed, more = true;
+
+	// One thread per CPU, taken from each node in turn.
+	for (j = 0; more && nthreads < MAX_THREADS; j++) {
+		more = false;
+		for (i = 0; i < nnodes && nthreads < MAX_THREADS; i++) {
+			if (j >= numa_nodes.nodes[i].ncpus)
+				continue;
+			workers[nthreads++].node = i;
+			more = true;
+		}
+	}
+
+	for (placement = 0; placement < 3; placement++) {
+		if (placement == 2 && nnodes < 2)
+			break;
+		pthread_barrier_init(&numa_start, NULL, nthreads);
+		for (i = 0; i < nthreads; i++) {
+			w = &workers[i];
+			w->mem = placement == 0 ? w->node
+				: placement == 1 ? -1 : (w->node + 1) % nnodes;
+			if (pthread_create(&w->thread, NULL, numa_worker, w))
+				die(EX_OSERR, "%s", "Cannot create thread");
+		}
+		mib_per_s = 0;
+		placed = true;
+		for (i = 0; i < nthreads; i++) {
+			w = &workers[i];
+			pthread_join(w->thread, NULL);
+			mib_per_s += params.numa_size / (w->ns / 1e9) / (1 << 20);
+			placed = placed && w->placed;
+		}
+		pthread_barrier_destroy(&numa_start);
+
+		printf("%s\n    { \"placement\": \"%s\", \"placed\": %s, "
+		       "\"nodes\": %d, \"threads\": %d, \"size\": %lu, "
+		       "\"iterations\": %d, \"mib_per_s\": %.1f }",
+		       *first ? "" : ",", placements[placement],
+		       placed ? "true" : "false", nnodes, nthreads,
+		       (unsigned long) params.numa_size, workers[0].n, mib_per_s);
+		*first = false;
+		verbose_msg("numa %s: %.1f MiB/s", placements[placement], mib_per_s);
+	}
+}
+
+/* Container headers of the corpus, in memory. */
+struct corpus_entry {
+	uint8_t *buf;
+	size_t size;
+	int version;
+};
+
+static int load_corpus(const char *dir, struct corpus_entry **corpus)
+{
+	char fn[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	int fd, n = 0, size = 0;
+	ssize_t len;
+	uint8_t *buf;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		die(EX_NOINPUT, "Cannot open corpus directory: %s (%s)", dir,
+		    strerror(errno));
+	*corpus = NULL;
+	while ((de = readdir(d))) {
+		snprintf(fn, sizeof(fn), "%s/%s", dir, de->d_name);
+		if (stat(fn, &st) || !S_ISREG(st.st_mode))
+			continue;
+		fd = open(fn, O_RDONLY);
+		if (fd < 0)
+			die(EX_NOINPUT, "Cannot open file: %s (%s)", fn, strerror(errno));
+
+		// The parsers only look at the headers, at most 15K.
+		buf = (uint8_t *) malloc(SECURE_BOOT_HEADERS_V2_SIZE);
+		if (!buf)
+			die(EX_OSERR, "%s", "Cannot allocate corpus");
+		len = read(fd, buf, SECURE_BOOT_HEADERS_V2_SIZE);
+		close(fd);
+		if (len < 0)
+			die(EX_IOERR, "Cannot read file: %s (%s)", fn, strerror(errno));
+		if (!stb_is_container(buf, len)) {
+			free(buf);
+			continue;
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			*corpus = (struct corpus_entry *) realloc(*corpus,
+					size * sizeof(struct corpus_entry));
+			if (!*corpus)
+				die(EX_OSERR, "%s", "Cannot allocate corpus");
+		}
+		(*corpus)[n].buf = buf;
+		(*corpus)[n].size = len;
+		(*corpus)[n].version = stb_is_v3_container(buf, len) ? 3
+				     : stb_is_v2_container(buf, len) ? 2 : 1;
+		n++;
+	}
+	closedir(d);
+	return n;
+}
+
+enum parser {
+	PARSER_IS_CONTAINER = 0,	/* stb_is_*container(), all versions */
+	PARSER_V1,
+	PARSER_V2,
+	PARSER_V3,
+	PARSER_STB_PARSE,		/* all versions */
+};
+
+static const char *parser_names[] = {
+	"stb_is_container", "parse_stb_container", "parse_stb_container_v2",
+	"parse_stb_container_v3", "stb_parse",
+};
+
+/*
+ * Time a pass of a parser over the containers of the corpus of the version
+ * it parses, in containers per second.
+ */
+static void bench_parser(int parser, const struct corpus_entry *corpus,
+			 int count, bool *first)
+{
+	const char *name = parser_names[parser];
+	int version = (parser >= PARSER_V1 && parser <= PARSER_V3) ? parser : 0;
+	struct parsed_stb_container v1;
+	struct parsed_stb_container_v2 v2;
+	struct parsed_stb_container_v3 v3;
+	struct stb_container c;
+	int i, n, containers = 0;
+	int r = 0;
+	double ns;
+
+	for (i = 0; i < count; i++)
+		if (!version || corpus[i].version == version)
+			containers++;
+	if (!containers)
+		return;
+
+	ns = BENCH(&n,
+		for (i = 0; i < count; i++) {
+			const struct corpus_entry *e = &corpus[i];
+
+			switch (parser) {
+			case PARSER_IS_CONTAINER:
+				r |= !(stb_is_v3_container(e->buf, e->size)
+				       || stb_is_v2_container(e->buf, e->size)
+				       || stb_is_container(e->buf, e->size));
+				break;
+			case PARSER_V1:
+				if (e->version == 1)
+					r |= parse_stb_container(e->buf, e->size, &v1);
+				break;
+			case PARSER_V2:
+				if (e->version == 2)
+					r |= parse_stb_container_v2(e->buf, e->size, &v2);
+				break;
+			case PARSER_V3:
+				if (e->version == 3)
+					r |= parse_stb_container_v3(e->buf, e->size, &v3);
+				break;
+			default:
+				r |= stb_parse(stb, e->buf, e->size, &c);
+			}
+		});
+	if (r)
+		verbose_msg("%s: some containers failed to parse", name);
+
+	printf("%s\n    { \"parser\": \"%s\", \"containers\": %d, "
+	       "\"iterations\": %d, \"ns_per_container\": %.1f, "
+	       "\"containers_per_s\": %.0f }",
+	       *first ? "" : ",", name, containers, n, ns / containers,
+	       containers / (ns / 1e9));
+	*first = false;
+	verbose_msg("parse %s: %.0f containers/s", name, containers / (ns / 1e9));
+}
+
+static void bench_parse(bool *first)
+{
+	struct corpus_entry *corpus;
+	int i, count;
+
+	count = load_corpus(params.corpus, &corpus);
+	if (!count)
+		die(EX_NOINPUT, "No container in corpus: %s", params.corpus);
+	verbose_msg("corpus %s: %d containers", params.corpus, count);
+
+	for (i = PARSER_IS_CONTAINER; i <= PARSER_STB_PARSE; i++)
+		bench_parser(i, corpus, count, first);
+
+	for (i = 0; i < count; i++)
+		free(corpus[i].buf);
+	free(corpus);
+}
+
+__attribute__((__noreturn__)) void usage (int status)
+{
+	if (status != 0) {
+		fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+	}
+	else {
+		printf("Usage: %s [options]\n", progname);
+		printf(
+			"\n"
+			"Options:\n"
+			" -h, --help              display this message and exit\n"
+			" -v, --verbose           show progress on stderr\n"
+			" -I, --imagefile         container to benchmark verification and validation\n"
+			"                         of, may be repeated (up to 16)\n"
+			" -s, --sizes             comma separated hash sizes, with K, M or G suffix\n"
+			"                         (default 4K,64K,1M,16M,256M)\n"
+			" -n, --iterations        minimum iterations per measurement (default 10)\n"
+			" -t, --min-time          minimum seconds per measurement (default 0.2)\n"
+			" -C, --corpus            directory of containers to time the parsers over,\n"
+			"                         e.g. from test/corpus/gencorpus\n"
+			" -A, --arena             validate with an arena of that size, with K or M\n"
+			"                         suffix, for OpenSSL's working memory\n"
+			" -F, --io                payload file to time hashing of with each I/O\n"
+			"                         strategy, from the page cache and from disk\n"
+			" -N, --numa              size, with K, M or G suffix, to hash in one thread\n"
+			"                         per CPU with the memory local to, interleaved\n"
+			"                         over and remote from the thread's NUMA node\n"
+			"\n");
+	};
+	exit(status);
+}
+
+#ifndef _AIX
+static struct option const opts[] = {
+	{ "help",             no_argument,       0,  'h' },
+	{ "verbose",          no_argument,       0,  'v' },
+	{ "imagefile",        required_argument, 0,  'I' },
+	{ "sizes",            required_argument, 0,  's' },
+	{ "iterations",       required_argument, 0,  'n' },
+	{ "min-time",         required_argument, 0,  't' },
+	{ "corpus",           required_argument, 0,  'C' },
+	{ "arena",            required_argument, 0,  'A' },
+	{ "io",               required_argument, 0,  'F' },
+	{ "numa",             required_argument, 0,  'N' },
+	{ NULL, 0, NULL, 0 }
+};
+#endif
+
+int main(int argc, char* argv[])
+{
+	char default_sizes[] = "4K,64K,1M,16M,256M";
+	char *sizes = default_sizes;
+	struct stb_arena arena;
+	void *arena_buf = NULL;
+	bool first;
+	int i, r;
+
+	/* Before anything has OpenSSL allocate, to count its allocations. */
+	if (!stb_alloc_hooks_install())
+		fprintf(stderr, "%s: cannot count allocations\n", argv[0]);
+
+	params.iterations = 10;
+	params.min_time = 0.2;
+
+	progname = strrchr(argv[0], '/');
+	if (progname != NULL)
+		++progname;
+	else
+		progname = argv[0];
+
+#ifdef _AIX
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(*(argv + i), "--help")) {
+			*(argv + i) = "-h";
+		} else if (!strcmp(*(argv + i), "--verbose")) {
+			*(argv + i) = "-v";
+		} else if (!strcmp(*(argv + i), "--imagefile")) {
+			*(argv + i) = "-I";
+		} else if (!strcmp(*(argv + i), "--sizes")) {
+			*(argv + i) = "-s";
+		} else if (!strcmp(*(argv + i), "--iterations")) {
+			*(argv + i) = "-n";
+		} else if (!strcmp(*(argv + i), "--min-time")) {
+			*(argv + i) = "-t";
+		} else if (!strcmp(*(argv + i), "--corpus")) {
+			*(argv + i) = "-C";
+		} else if (!strcmp(*(argv + i), "--arena")) {
+			*(argv + i) = "-A";
+		} else if (!strcmp(*(argv + i), "--io")) {
+			*(argv + i) = "-F";
+		} else if (!strcmp(*(argv + i), "--numa")) {
+			*(argv + i) = "-N";
+		} else if (!strncmp(*(argv + i), "--", 2)) {
+			fprintf(stderr, "%s: unrecognized option \'%s\'\n", progname,
+					*(argv + i));
+			usage(EX_OK);
+		}
+	}
+#endif
+
+	while (1) {
+		int opt;
+#ifdef _AIX
+		opt = getopt(argc, argv, "??hvI:s:n:t:C:A:F:N:");
+#else
+		opt = getopt_long(argc, argv, "?hvI:s:n:t:C:A:F:N:", opts, NULL);
+#endif
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'h':
+			usage(EX_OK);
+			break;
+		case '?':
+			usage(EX_USAGE);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'I':
+			if (params.imagefn_count == MAX_CONTAINERS)
+				die(EX_USAGE, "At most %d containers", MAX_CONTAINERS);
+			params.imagefn[params.imagefn_count++] = optarg;
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 'n':
+			params.iterations = atoi(optarg);
+			break;
+		case 't':
+			params.min_time = atof(optarg);
+			break;
+		case 'C':
+			params.corpus = optarg;
+			break;
+		case 'A':
+			params.arena_size = parse_size(optarg);
+			break;
+		case 'F':
+			params.io_file = optarg;
+			break;
+		case 'N':
+			params.numa_size = parse_size(optarg);
+			break;
+		default:
+			usage(EX_USAGE);
+		}
+	}
+
+	for (char *s = strtok(sizes, ","); s; s = strtok(NULL, ",")) {
+		if (params.size_count == MAX_SIZES)
+			die(EX_USAGE, "At most %d sizes", MAX_SIZES);
+		params.sizes[params.size_count++] = parse_size(s);
+	}
+	if (params.iterations < 1)
+		params.iterations = 1;
+
+	stb = stb_ctx_new();
+	if (!stb)
+		die(EX_OSERR, "%s", "Cannot allocate container context");
+	if (params.arena_size) {
+		arena_buf = malloc(params.arena_size);
+		if (!arena_buf)
+			die(EX_OSERR, "%s", "Cannot allocate arena");
+		stb_arena_init(&arena, arena_buf, params.arena_size);
+		r = stb_ctx_set_arena(stb, &arena);
+		if (r)
+			die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	}
+
+	printf("{\n  \"hash\": [");
+	first = true;
+	bench_hash(&first);
+
+	printf("\n  ],\n  \"verify\": [");
+	first = true;
+	for (i = 0; i < params.imagefn_count; i++)
+		bench_container(params.imagefn[i], false, &first);
+
+	printf("\n  ],\n  \"validate\": [");
+	first = true;
+	for (i = 0; i < params.imagefn_count; i++)
+		bench_container(params.imagefn[i], true, &first);
+
+	printf("\n  ],\n  \"io\": [");
+	first = true;
+	if (params.io_file)
+		bench_io(&first);
+
+	printf("\n  ],\n  \"numa\": [");
+	first = true;
+	if (params.numa_size)
+		bench_numa(&first);
+
+	printf("\n  ],\n  \"parse\": [");
+	first = true;
+	if (params.corpus)
+		bench_parse(&first);
+	printf("\n  ]\n}\n");
+
+	if (arena_buf)
+		verbose_msg("arena: %lu of %lu bytes used, %llu allocations, "
+			    "%llu misses, %llu rewinds skipped",
+			    (unsigned long) arena.peak, (unsigned long) arena.size,
+			    (unsigned long long) arena.allocs,
+			    (unsigned long long) arena.misses,
+			    (unsigned long long) arena.pinned);
+	stb_ctx_free(stb);
+	// What OpenSSL still keeps in the arena is freed at exit, from it.
+	if (arena_buf && !arena.live)
+		free(arena_buf);
+	return 0;
+}
@@ -0,0 +1,1253 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Synthetic container corpus, for load and regression testing of container
+ * validation.
+ *
+ * Generates any number of containers signed with the test keys, of mixed
+ * versions, hash algorithms, ML-DSA pure and pre-hash modes, with and
+ * without an unprotected payload region, and a share of them deliberately
+ * corrupted. Everything about a container but the ECDSA signatures, which
+ * OpenSSL randomizes, follows from the seed and its index, so a corpus is
+ * the same whatever the number of jobs generating it.
+ *
+ * manifest.tsv lists each container with the checks expected to fail, and
+ * --check validates the corpus against it through libstbcontainer, as
+ * print-container --validate-ignore-remainder would, reporting the
+ * containers validated per second. OpenSSL's working memory comes from an
+ * arena rewound for each container, and the allocations per container are
+ * reported too.
+ *
+ * With --metrics or --metrics-socket, the jobs count and time their signing,
+ * hashing and validation into Prometheus metrics, see metrics.h.
+ */
+
+#include <config.h>
+
+#ifndef _AIX
+#include <getopt.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include "container.c"
+#include "container.h"
+#include "libstbcontainer.h"
+#include "metrics.h"
+
+#ifdef ADD_DILITHIUM
+#include "dilutils.h"
+#include "mlca2.h"
+#include "pqalgs.h"
+#endif
+
+#define MANIFEST	"manifest.tsv"
+#define PQ_BUF_SIZE	8000
+
+char *progname;
+
+bool verbose, debug;
+int wrap = 100;
+
+struct stb_ctx *stb;
+
+/* Containers not yet generated or checked, shared by the jobs. */
+static struct metrics_series *queue_depth;
+
+static struct {
+	char *outdir;
+	char *keydir;
+	unsigned int count;
+	uint64_t seed;
+	int jobs;
+	int versions[3];
+	int version_count;
+	unsigned int corrupt_pct;
+	unsigned int unprotected_pct;
+	size_t max_payload;
+	bool check;
+} params;
+
+enum corruption {
+	CORRUPT_NONE = 0,
+	CORRUPT_HW_SIG,		/* a byte of a HW signature */
+	CORRUPT_SW_SIG,		/* a byte of a SW signature */
+	CORRUPT_PREFIX_HDR,	/* the prefix header flags, signed by HW keys */
+	CORRUPT_SW_HDR,		/* the SW header flags, signed by SW keys */
+	CORRUPT_SW_KEY,		/* a byte of a SW key */
+	CORRUPT_PAYLOAD,	/* a byte of the protected payload */
+	CORRUPT_TRUNCATED,	/* the payload cut short */
+	CORRUPT_UNPROTECTED,	/* a byte of the unprotected payload, still valid */
+	CORRUPT_COUNT,
+};
+
+static const char *corruption_names[CORRUPT_COUNT] = {
+	"none", "hw-sig", "sw-sig", "prefix-hdr", "sw-hdr", "sw-key",
+	"payload", "truncated", "unprotected",
+};
+
+static const char *labels[] = {
+	"PAYLOAD", "BOOTKERN", "HBB", "HBI", "HBD", "SBE", "OCC", "CAPP",
+};
+
+/* What to generate for a container, all drawn from the seed and index. */
+struct plan {
+	unsigned int index;
+	int version;
+	uint8_t hash_alg;
+	uint8_t sig_alg;
+	bool pure;
+	int keyset;		/* enum keyset */
+	size_t payload_size;
+	size_t unprotected_size;
+	int corruption;		/* enum corruption */
+	int slot;		/* the signature or key corrupted */
+	uint64_t corrupt_at;
+	uint64_t data_seed;
+	const char *label;
+	uint8_t security_version;
+};
+
+enum keyset {
+	KEYSET_V1 = 0,
+	KEYSET_V2_BOOT,
+	KEYSET_V2_RUNTIME,
+	KEYSET_V3_BOOT,
+	KEYSET_V3_RUNTIME,
+	KEYSET_COUNT,
+};
+
+struct pq_key {
+	uint8_t *priv;
+	size_t priv_len;
+	uint8_t *pub;
+	size_t pub_len;
+};
+
+struct keyset_keys {
+	bool loaded;
+	EC_KEY *hw[3];		/* A, B, C; only A past v1 */
+	ecc_key_t hw_pub[3];
+	EC_KEY *sw_p;
+	ecc_key_t sw_p_pub;
+	struct pq_key hw_d;	/* v2 and v3 */
+	struct pq_key sw_s;
+};
+
+static struct keyset_keys keysets[KEYSET_COUNT];
+
+/* Stats a job hands back to the parent, through shared memory. */
+struct job_result {
+	unsigned int containers;
+	unsigned int mismatches;
+	uint64_t bytes;
+	uint64_t allocs;	/* by OpenSSL, with --check */
+	uint64_t arena_allocs;
+};
+
+/* Enough for the OpenSSL working memory of validating any container. */
+#define ARENA_SIZE	(256 * 1024)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t splitmix64(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t rnd(uint64_t *state, uint64_t n)
+{
+	return splitmix64(state) % n;
+}
+
+/* Parse a size like 4096, 4K, 16M or 1G. */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	unsigned long long v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		v <<= 10;
+		end++;
+		break;
+	}
+	if (end == s || *end || !v)
+		die(EX_USAGE, "Invalid size: %s", s);
+	return v;
+}
+
+static const char *hash_name(uint8_t alg)
+{
+	return (alg == HASH_ALG_SHA3_512) ? "sha3-512" : "sha512";
+}
+
+static const char *keyset_name(int keyset)
+{
+	switch (keyset) {
+	case KEYSET_V1:		return "keys";
+	case KEYSET_V2_BOOT:
+	case KEYSET_V3_BOOT:	return "boot";
+	default:		return "runtime";
+	}
+}
+
+static void make_plan(unsigned int index, struct plan *p)
+{
+	uint64_t s = params.seed ^ ((uint64_t) index * 0xd1b54a32d192ed03ULL);
+	int kinds[CORRUPT_COUNT], nkinds = 0, k;
+
+	memset(p, 0, sizeof(*p));
+	splitmix64(&s);
+	p->index = index;
+	p->version = params.versions[rnd(&s, params.version_count)];
+
+	switch (p->version) {
+	case 1:
+		p->hash_alg = HASH_ALG_SHA512;
+		p->sig_alg = SIG_ALG_SHA512_ECDSA;
+		p->keyset = KEYSET_V1;
+		break;
+	case 2:
+		p->hash_alg = HASH_ALG_SHA3_512;
+		p->sig_alg = SIG_ALG_SHA3_512_ECDSA_DIL;
+		p->keyset = KEYSET_V2_BOOT + rnd(&s, 2);
+		break;
+	default:
+		switch (rnd(&s, 3)) {
+		case 0:
+			p->hash_alg = HASH_ALG_SHA3_512;
+			p->sig_alg = SIG_ALG_SHA3_512_ECDSA_MLDSA;
+			break;
+		case 1:
+			p->hash_alg = HASH_ALG_SHA512;
+			p->sig_alg = SIG_ALG_SHA512_ECDSA_MLDSA;
+			break;
+		default:
+			p->hash_alg = HASH_ALG_SHA512;
+			p->sig_alg = SIG_ALG_SHA512_ECDSA_MLDSA_PURE_MODE;
+			p->pure = true;
+		}
+		p->keyset = KEYSET_V3_BOOT + rnd(&s, 2);
+	}
+
+	p->payload_size = 1 + rnd(&s, params.max_payload);
+	// Only v2 and v3 have an unprotected payload size in the SW header.
+	if (p->version > 1 && rnd(&s, 100) < params.unprotected_pct)
+		p->unprotected_size = 1 + rnd(&s, 4096);
+	p->label = labels[rnd(&s, sizeof(labels) / sizeof(labels[0]))];
+	p->security_version = rnd(&s, 4);
+
+	if (rnd(&s, 100) < params.corrupt_pct) {
+		for (k = CORRUPT_NONE + 1; k < CORRUPT_COUNT; k++)
+			if (k != CORRUPT_UNPROTECTED || p->unprotected_size)
+				kinds[nkinds++] = k;
+		p->corruption = kinds[rnd(&s, nkinds)];
+	}
+	switch (p->corruption) {
+	case CORRUPT_HW_SIG:
+		p->slot = rnd(&s, p->version == 1 ? 3 : 2);
+		break;
+	case CORRUPT_SW_SIG:
+	case CORRUPT_SW_KEY:
+		p->slot = rnd(&s, p->version == 1 ? 1 : 2);
+		break;
+	}
+	p->corrupt_at = splitmix64(&s);
+	p->data_seed = splitmix64(&s);
+}
+
+static const char *hw_check_name(int version, int slot)
+{
+	static const char *v1[] = { "HW_key_A", "HW_key_B", "HW_key_C" };
+	static const char *v2[] = { "HW_key_A", "HW_key_D" };
+
+	return version == 1 ? v1[slot] : v2[slot];
+}
+
+static const char *sw_check_name(int version, int slot)
+{
+	(void) version;
+	return slot ? "SW_key_S" : "SW_key_P";
+}
+
+static void append(char *buf, size_t len, const char *name)
+{
+	size_t n = strlen(buf);
+
+	snprintf(buf + n, len - n, "%s%s", n ? "," : "", name);
+}
+
+/*
+ * The checks a container is expected to fail, in the order stb_validate()
+ * runs them, or "valid".
+ */
+static void expected_failures(const struct plan *p, char *buf, size_t len)
+{
+	int i, hw_count = p->version == 1 ? 3 : 2;
+	int sw_count = p->version == 1 ? 1 : 2;
+
+	buf[0] = '\0';
+	switch (p->corruption) {
+	case CORRUPT_HW_SIG:
+		append(buf, len, hw_check_name(p->version, p->slot));
+		break;
+	case CORRUPT_SW_SIG:
+		append(buf, len, sw_check_name(p->version, p->slot));
+		break;
+	case CORRUPT_PREFIX_HDR:
+		for (i = 0; i < hw_count; i++)
+			append(buf, len, hw_check_name(p->version, i));
+		break;
+	case CORRUPT_SW_HDR:
+		for (i = 0; i < sw_count; i++)
+			append(buf, len, sw_check_name(p->version, i));
+		break;
+	case CORRUPT_SW_KEY:
+		append(buf, len, sw_check_name(p->version, p->slot));
+		append(buf, len, "sw_keys_hash");
+		break;
+	case CORRUPT_PAYLOAD:
+	case CORRUPT_TRUNCATED:
+		append(buf, len, "payload_hash");
+		break;
+	}
+	if (!buf[0])
+		snprintf(buf, len, "valid");
+}
+
+static EC_KEY *read_ecdsa_key(const char *fn, ecc_key_t *pub)
+{
+	EVP_PKEY *pkey;
+	EC_KEY *key;
+	FILE *fp;
+	int r;
+
+	fp = fopen(fn, "r");
+	if (!fp)
+		die(EX_NOINPUT, "Cannot open key file: %s (%s)", fn, strerror(errno));
+	pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (!pkey)
+		die(EX_DATAERR, "Cannot read private key: %s", fn);
+	key = EVP_PKEY_get1_EC_KEY(pkey);
+	EVP_PKEY_free(pkey);
+	if (!key)
+		die(EX_DATAERR, "Not an EC key: %s", fn);
+
+	r = stb_get_public_key_raw(stb, fn, pub);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	return key;
+}
+
+#ifdef ADD_DILITHIUM
+static void read_pq_key(const char *prefix, size_t priv_len, size_t pub_len,
+			struct pq_key *k)
+{
+	char fn[PATH_MAX];
+	int r;
+
+	k->priv = (uint8_t *) malloc(PQ_BUF_SIZE);
+	k->pub = (uint8_t *) malloc(PQ_BUF_SIZE);
+	if (!k->priv || !k->pub)
+		die(EX_OSERR, "%s", "Cannot allocate key buffers");
+
+	snprintf(fn, sizeof(fn), "%s.key", prefix);
+	k->priv_len = PQ_BUF_SIZE;
+	r = stb_read_file(stb, fn, k->priv, &k->priv_len);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	if (k->priv_len != priv_len)
+		die(EX_DATAERR, "Not a raw private key of %lu bytes: %s",
+		    (unsigned long) priv_len, fn);
+
+	snprintf(fn, sizeof(fn), "%s.pub", prefix);
+	k->pub_len = PQ_BUF_SIZE;
+	r = stb_read_file(stb, fn, k->pub, &k->pub_len);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	if (k->pub_len != pub_len)
+		die(EX_DATAERR, "Not a raw public key of %lu bytes: %s",
+		    (unsigned long) pub_len, fn);
+}
+#endif
+
+static void load_keyset(int keyset)
+{
+	struct keyset_keys *ks = &keysets[keyset];
+	char fn[PATH_MAX];
+
+	if (ks->loaded)
+		return;
+
+	if (keyset == KEYSET_V1) {
+		for (int i = 0; i < 3; i++) {
+			snprintf(fn, sizeof(fn), "%s/keys/hw_key_%c.key",
+				 params.keydir, 'a' + i);
+			ks->hw[i] = read_ecdsa_key(fn, &ks->hw_pub[i]);
+		}
+		snprintf(fn, sizeof(fn), "%s/keys/sw_key_p.key", params.keydir);
+		ks->sw_p = read_ecdsa_key(fn, &ks->sw_p_pub);
+	} else {
+		int version = keyset <= KEYSET_V2_RUNTIME ? 2 : 3;
+		const char *set = keyset_name(keyset);
+
+		snprintf(fn, sizeof(fn), "%s/v%d_keys/%s_hw_key_a.key",
+			 params.keydir, version, set);
+		ks->hw[0] = read_ecdsa_key(fn, &ks->hw_pub[0]);
+		snprintf(fn, sizeof(fn), "%s/v%d_keys/%s_sw_key_p.key",
+			 params.keydir, version, set);
+		ks->sw_p = read_ecdsa_key(fn, &ks->sw_p_pub);
+#ifdef ADD_DILITHIUM
+		size_t priv_len = version == 2 ? RawDilithiumR28x7PrivateKeySize
+					       : RawMldsa87PrivateKeySize;
+		size_t pub_len = version == 2 ? DILITHIUM_PUB_KEY_LENGTH
+					      : MLDSA_87_PUB_KEY_LENGTH;
+
+		snprintf(fn, sizeof(fn), "%s/v%d_keys/%s_hw_key_d",
+			 params.keydir, version, set);
+		read_pq_key(fn, priv_len, pub_len, &ks->hw_d);
+		snprintf(fn, sizeof(fn), "%s/v%d_keys/%s_sw_key_s",
+			 params.keydir, version, set);
+		read_pq_key(fn, priv_len, pub_len, &ks->sw_s);
+#endif
+	}
+	ks->loaded = true;
+}
+
+static void sign_ecdsa(EC_KEY *key, const unsigned char *md, uint8_t *sig)
+{
+	unsigned char der[256], *p = der;
+	ecc_signature_t raw;
+	ECDSA_SIG *s;
+	int len, r;
+
+	s = ECDSA_do_sign(md, SHA512_DIGEST_LENGTH, key);
+	if (!s)
+		die(EX_SOFTWARE, "%s", "Cannot ECDSA_do_sign");
+	len = i2d_ECDSA_SIG(s, NULL);
+	if (len <= 0 || len > (int) sizeof(der))
+		die(EX_SOFTWARE, "%s", "Cannot i2d_ECDSA_SIG");
+	i2d_ECDSA_SIG(s, &p);
+	ECDSA_SIG_free(s);
+
+	r = stb_sig_to_raw(stb, der, len, &raw);
+	if (r)
+		die(stb_sysexit(r), "%s", stb_ctx_error(stb));
+	memcpy(sig, raw, sizeof(ecc_signature_t));
+}
+
+/*
+ * Sign tbs with a Dilithium r2 8/7 (v2) or ML-DSA-87 (v3) key, as gendilsig
+ * does: tbs is the header hash, or the header itself in pure mode.
+ */
+static void sign_pq(const struct pq_key *k, int version, const uint8_t *tbs,
+		    size_t tbs_len, uint8_t *sig, size_t sig_len)
+{
+#ifdef ADD_DILITHIUM
+	unsigned char buf[PQ_BUF_SIZE];
+	const char *oid = version == 2 ? MLCA_ALGORITHM_SIG_DILITHIUM_R2_8x7_OID
+				       : MLCA_ALGORITHM_SIG_MLDSA_87_OID;
+	size_t oid_len = version == 2 ? 13 : 11;
+	int r;
+
+	r = mlca_sign(buf, sizeof(buf), tbs, tbs_len, k->priv, k->priv_len,
+		      NULL, (const unsigned char *) oid, oid_len);
+	if (r != (int) sig_len)
+		die(EX_SOFTWARE, "Failure during signature generation : %d", r);
+	memcpy(sig, buf, sig_len);
+#else
+	(void) k; (void) version; (void) tbs; (void) tbs_len; (void) sig;
+	(void) sig_len;
+	die(EX_SOFTWARE, "%s", "Dilithium support not built in (ADD_DILITHIUM)");
+#endif
+}
+
+/* Fill the container header of a v1 plan into hdr, as create-container does. */
+static void build_v1(const struct plan *p, const struct keyset_keys *ks,
+		     uint8_t *hdr)
+{
+	ROM_container_raw *c = (ROM_container_raw *) hdr;
+	ROM_prefix_header_raw *ph;
+	ROM_prefix_data_raw *pd;
+	ROM_sw_header_raw *swh;
+
+	c->magic_number = cpu_to_be32(ROM_MAGIC_NUMBER);
+	c->version = cpu_to_be16(1);
+	c->container_size = cpu_to_be64(SECURE_BOOT_HEADERS_SIZE + p->payload_size);
+	c->target_hrmor = 0;
+	c->stack_pointer = 0;
+	memcpy(c->hw_pkey_a, ks->hw_pub[0], sizeof(ecc_key_t));
+	memcpy(c->hw_pkey_b, ks->hw_pub[1], sizeof(ecc_key_t));
+	memcpy(c->hw_pkey_c, ks->hw_pub[2], sizeof(ecc_key_t));
+
+	ph = (ROM_prefix_header_raw *) (hdr + sizeof(ROM_container_raw));
+	ph->ver_alg.version = cpu_to_be16(1);
+	ph->ver_alg.hash_alg = p->hash_alg;
+	ph->ver_alg.sig_alg = p->sig_alg;
+	ph->flags = cpu_to_be32(0x80000000);
+	ph->sw_key_count = 1;
+	ph->payload_size = cpu_to_be64(sizeof(ecc_key_t));
+	ph->ecid_count = 0;
+
+	pd = (ROM_prefix_data_raw *) ph->ecid;
+	memcpy(pd->sw_pkey_p, ks->sw_p_pub, sizeof(ecc_key_t));
+	stb_calc_hash(p->hash_alg, pd->sw_pkey_p, sizeof(ecc_key_t),
+		      ph->payload_hash);
+
+	swh = (ROM_sw_header_raw *) (((uint8_t *) pd) + sizeof(ecc_signature_t) * 3
+				     + sizeof(ecc_key_t));
+	swh->ver_alg.version = cpu_to_be16(1);
+	swh->ver_alg.hash_alg = p->hash_alg;
+	swh->ver_alg.sig_alg = p->sig_alg;
+	memcpy(&swh->reserved, p->label, strlen(p->label));
+	swh->security_version = p->security_version;
+	swh->payload_size = cpu_to_be64(p->payload_size);
+	swh->ecid_count = 0;
+}
+
+/*
+ * v2 and v3 only differ in the size of the Dilithium or ML-DSA keys and
+ * signatures, so share the build through this macro.
+ */
+#define BUILD_V2_V3(p, ks, hdr, ver, container_t, pq_key_t)			\
+do {										\
+	container_t *c = (container_t *) (hdr);					\
+										\
+	c->magic_number = cpu_to_be32(ROM_MAGIC_NUMBER);			\
+	c->version = cpu_to_be16(ver);						\
+	c->container_size = cpu_to_be64(stb_header_size(ver)			\
+			+ (p)->payload_size + (p)->unprotected_size);		\
+	memcpy(c->hw_pkey_a, (ks)->hw_pub[0], sizeof(ecc_key_t));		\
+	if ((ks)->hw_d.pub)							\
+		memcpy(c->hw_pkey_d, (ks)->hw_d.pub, sizeof(pq_key_t));		\
+										\
+	c->prefix.ver_alg.version = cpu_to_be16(ver);				\
+	c->prefix.ver_alg.hash_alg = (p)->hash_alg;				\
+	c->prefix.ver_alg.sig_alg = (p)->sig_alg;				\
+	c->prefix.flags = cpu_to_be32(0x80000000);				\
+	c->prefix.sw_key_count = 2;						\
+	c->prefix.payload_size = cpu_to_be64(sizeof(ecc_key_t)			\
+					     + sizeof(pq_key_t));		\
+	memcpy(c->prefix_data.sw_pkey_p, (ks)->sw_p_pub, sizeof(ecc_key_t));	\
+	if ((ks)->sw_s.pub)							\
+		memcpy(c->prefix_data.sw_pkey_s, (ks)->sw_s.pub,		\
+		       sizeof(pq_key_t));					\
+	stb_calc_hash((p)->hash_alg, c->prefix_data.sw_pkey_p,			\
+		      sizeof(ecc_key_t) + sizeof(pq_key_t),			\
+		      c->prefix.payload_hash);					\
+										\
+	c->swheader.ver_alg.version = cpu_to_be16(ver);				\
+	c->swheader.ver_alg.hash_alg = (p)->hash_alg;				\
+	c->swheader.ver_alg.sig_alg = (p)->sig_alg;				\
+	memcpy(&c->swheader.component_id, (p)->label, strlen((p)->label));	\
+	c->swheader.security_version = (p)->security_version;			\
+	c->swheader.payload_size = cpu_to_be64((p)->payload_size);		\
+	c->swheader.unprotected_payload_size =					\
+		cpu_to_be64((p)->unprotected_size);				\
+\
+} while (0)
+
+/*
+ * Sign the headers of a built container, parsed into c, with the keys of
+ * each slot of its layout.
+ */
+static void sign_metrics(const char *key, uint64_t started)
+{
+	char label[METRICS_LABELS_LEN];
+
+	metrics_label(label, sizeof(label), "key", key);
+	metrics_observe(metrics_get(METRICS_LATENCY, "stb_sign",
+				    "Time to sign a header", label),
+			metrics_now() - started);
+	metrics_count("stb_signatures_total", "Signatures made, by key", label, 1);
+}
+
+static void sign_headers(const struct plan *p, const struct keyset_keys *ks,
+			 const struct stb_container *c)
+{
+	const struct stb_layout *l = c->layout;
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	const struct stb_slot *slot;
+	const uint8_t *hdr;
+	uint64_t started;
+	size_t hdr_sz;
+	uint8_t *sig;
+	int i;
+
+	hdr = c->region[STB_REGION_PREFIX_HDR];
+	hdr_sz = l->region_size[STB_REGION_PREFIX_HDR];
+	if (!stb_calc_hash(p->hash_alg, hdr, hdr_sz, md))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	for (i = 0; i < l->hw_slot_count; i++) {
+		slot = &l->hw_slots[i];
+		sig = (uint8_t *) stb_field_ptr(c, &slot->sig);
+		started = metrics_now();
+		if (slot->type == STB_SIG_ECDSA_P521)
+			sign_ecdsa(ks->hw[i], md, sig);
+		else
+			sign_pq(&ks->hw_d, p->version, p->pure ? hdr : md,
+				p->pure ? hdr_sz : sizeof(md), sig, slot->sig.size);
+		sign_metrics(hw_check_name(p->version, i), started);
+	}
+
+	hdr = c->region[STB_REGION_SW_HDR];
+	hdr_sz = l->region_size[STB_REGION_SW_HDR];
+	if (!stb_calc_hash(p->hash_alg, hdr, hdr_sz, md))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	for (i = 0; i < l->sw_slot_count; i++) {
+		slot = &l->sw_slots[i];
+		sig = (uint8_t *) stb_field_ptr(c, &slot->sig);
+		if (l->sw_keys_counted && !stb_sw_slot_used(c, i))
+			break;
+		started = metrics_now();
+		if (slot->type == STB_SIG_ECDSA_P521)
+			sign_ecdsa(ks->sw_p, md, sig);
+		else
+			sign_pq(&ks->sw_s, p->version, p->pure ? hdr : md,
+				p->pure ? hdr_sz : sizeof(md), sig, slot->sig.size);
+		sign_metrics(sw_check_name(p->version, i), started);
+	}
+}
+
+/* Flip a byte of a field of a built container. */
+static void corrupt(const struct stb_container *c, const struct stb_field *f,
+		    uint64_t at, uint8_t flip)
+{
+	((uint8_t *) stb_field_ptr(c, f))[at % f->size] ^= flip;
+}
+
+static void fill(uint8_t *buf, size_t len, uint64_t seed)
+{
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		v = splitmix64(&seed);
+		memcpy(buf + i, &v, 8);
+	}
+	v = splitmix64(&seed);
+	memcpy(buf + i, &v, len - i);
+}
+
+/* Build, sign, corrupt and write container index, returns its size. */
+static size_t generate(unsigned int index)
+{
+	struct keyset_keys *ks;
+	struct stb_container c;
+	const struct stb_layout *l;
+	struct plan p;
+	uint8_t *buf, *payload, flip;
+	size_t hdr_sz, size;
+	char fn[PATH_MAX];
+	uint64_t started;
+	int fd;
+
+	make_plan(index, &p);
+	ks = &keysets[p.keyset];
+	hdr_sz = stb_header_size(p.version);
+	size = hdr_sz + p.payload_size + p.unprotected_size;
+	buf = (uint8_t *) calloc(1, size);
+	if (!buf)
+		die(EX_OSERR, "Cannot allocate %lu bytes", (unsigned long) size);
+	payload = buf + hdr_sz;
+	fill(payload, p.payload_size + p.unprotected_size, p.data_seed);
+
+	if (p.version == 1)
+		build_v1(&p, ks, buf);
+	else if (p.version == 2)
+		BUILD_V2_V3(&p, ks, buf, 2, ROM_container_v2_raw, dilithium_key_t);
+	else
+		BUILD_V2_V3(&p, ks, buf, 3, ROM_container_v3_raw, mldsa_key_t);
+
+	// Sign and corrupt through the layout of the container just built.
+	if (stb_parse(stb, buf, size, &c))
+		die(EX_SOFTWARE, "%s", stb_ctx_error(stb));
+	l = c.layout;
+	started = metrics_now();
+	if (!stb_calc_hash(p.hash_alg, payload, p.payload_size,
+			   (unsigned char *) stb_field_ptr(&c, &l->payload_hash)))
+		die(EX_SOFTWARE, "%s", "Cannot get SHA3-512/SHA512");
+	metrics_observe(metrics_get(METRICS_LATENCY, "stb_hash",
+				    "Time to hash a payload", NULL),
+			metrics_now() - started);
+	metrics_count("stb_hashed_bytes_total", "Bytes hashed", NULL,
+		      p.payload_size);
+	sign_headers(&p, ks, &c);
+
+	// Any non-zero xor changes the byte.
+	flip = 1 + (p.corrupt_at >> 56) % 255;
+	switch (p.corruption) {
+	case CORRUPT_HW_SIG:
+		corrupt(&c, &l->hw_slots[p.slot].sig, p.corrupt_at, flip);
+		break;
+	case CORRUPT_SW_SIG:
+		corrupt(&c, &l->sw_slots[p.slot].sig, p.corrupt_at, flip);
+		break;
+	case CORRUPT_PREFIX_HDR:
+		corrupt(&c, &l->hw_flags, p.corrupt_at, flip);
+		break;
+	case CORRUPT_SW_HDR:
+		corrupt(&c, &l->sw_flags, p.corrupt_at, flip);
+		break;
+	case CORRUPT_SW_KEY:
+		corrupt(&c, &l->sw_slots[p.slot].key, p.corrupt_at, flip);
+		break;
+	case CORRUPT_PAYLOAD:
+		payload[p.corrupt_at % p.payload_size] ^= flip;
+		break;
+	case CORRUPT_TRUNCATED:
+		size = hdr_sz + p.corrupt_at % p.payload_size;
+		break;
+	case CORRUPT_UNPROTECTED:
+		payload[p.payload_size + p.corrupt_at % p.unprotected_size] ^= flip;
+		break;
+	}
+
+	snprintf(fn, sizeof(fn), "%s/%06u.img", params.outdir, index);
+	fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(EX_CANTCREAT, "Cannot create file: %s (%s)", fn, strerror(errno));
+	if (write(fd, buf, size) != (ssize_t) size)
+		die(EX_IOERR, "Cannot write file: %s (%s)", fn, strerror(errno));
+	close(fd);
+	free(buf);
+
+	debug_msg("%s: v%d %s %s%s, %s", fn, p.version, hash_name(p.hash_alg),
+		  p.pure ? "pure " : "", keyset_name(p.keyset),
+		  corruption_names[p.corruption]);
+	return size;
+}
+
+static void write_manifest(void)
+{
+	char fn[PATH_MAX], expected[128];
+	struct plan p;
+	FILE *fp;
+
+	snprintf(fn, sizeof(fn), "%s/%s", params.outdir, MANIFEST);
+	fp = fopen(fn, "w");
+	if (!fp)
+		die(EX_CANTCREAT, "Cannot create file: %s (%s)", fn, strerror(errno));
+
+	fprintf(fp, "#file\tversion\thash\tmode\tkeys\tpayload\tunprotected"
+		"\tcorruption\texpected\n");
+	for (unsigned int i = 0; i < params.count; i++) {
+		make_plan(i, &p);
+		expected_failures(&p, expected, sizeof(expected));
+		fprintf(fp, "%06u.img\t%d\t%s\t%s\t%s\t%lu\t%lu\t%s\t%s\n", i,
+			p.version, hash_name(p.hash_alg),
+			p.pure ? "pure" : "prehash", keyset_name(p.keyset),
+			(unsigned long) p.payload_size,
+			(unsigned long) p.unprotected_size,
+			corruption_names[p.corruption], expected);
+	}
+	if (fclose(fp))
+		die(EX_IOERR, "Cannot write file: %s (%s)", fn, strerror(errno));
+}
+
+/* Validate one container of the corpus, false if not as expected. */
+static bool check(const char *file, const char *expected, uint64_t *bytes)
+{
+	char fn[PATH_MAX], got[128], label[32];
+	struct stb_container c;
+	struct stb_validation v;
+	struct stat st;
+	uint64_t started;
+	size_t hdr_sz;
+	void *buf;
+	int fd, r, i;
+
+	snprintf(fn, sizeof(fn), "%s/%s", params.outdir, file);
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		die(EX_NOINPUT, "Cannot open container file: %s (%s)", fn,
+		    strerror(errno));
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+		die(EX_NOINPUT, "Cannot stat container file: %s", fn);
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die(EX_OSERR, "Cannot mmap file: %s (%s)", fn, strerror(errno));
+	close(fd);
+	*bytes += st.st_size;
+
+	got[0] = '\0';
+	r = stb_parse(stb, buf, st.st_size, &c);
+	if (!r) {
+		hdr_sz = stb_header_size(c.version);
+		started = metrics_now();
+		r = stb_validate(stb, &c, (const uint8_t *) buf + hdr_sz,
+				 st.st_size - hdr_sz, true, &v);
+		snprintf(label, sizeof(label), "version=\"%d\"", c.version);
+		metrics_observe(metrics_get(METRICS_LATENCY, "stb_validate",
+					    "Time to validate a container", label),
+				metrics_now() - started);
+		metrics_count("stb_hashed_bytes_total", "Bytes hashed", NULL,
+			      st.st_size);
+	}
+	if (r) {
+		snprintf(got, sizeof(got), "error (%s)", stb_ctx_error(stb));
+	} else {
+		for (i = 0; i < v.hw_sig_count; i++)
+			if (v.hw_sigs[i].result == STB_CHECK_FAILED)
+				append(got, sizeof(got), v.hw_sigs[i].name);
+		for (i = 0; i < v.sw_sig_count; i++)
+			if (v.sw_sigs[i].result == STB_CHECK_FAILED)
+				append(got, sizeof(got), v.sw_sigs[i].name);
+		if (!v.payload_hash_ok)
+			append(got, sizeof(got), "payload_hash");
+		if (!v.sw_keys_hash_ok)
+			append(got, sizeof(got), "sw_keys_hash");
+		if (!got[0])
+			snprintf(got, sizeof(got), "valid");
+	}
+	munmap(buf, st.st_size);
+
+	if (strcmp(got, expected)) {
+		fprintf(stderr, "%s: expected %s, got %s\n", file, expected, got);
+		metrics_count("stb_validations_total",
+			      "Containers checked, by outcome",
+			      "result=\"unexpected\"", 1);
+		return false;
+	}
+	verbose_msg("%s: %s", file, got);
+	metrics_count("stb_validations_total", "Containers checked, by outcome",
+		      "result=\"expected\"", 1);
+	return true;
+}
+
+static char **manifest_files, **manifest_expected;
+
+static unsigned int read_manifest(void)
+{
+	char fn[PATH_MAX], line[1024], *tab;
+	unsigned int n = 0, size = 0;
+	FILE *fp;
+
+	snprintf(fn, sizeof(fn), "%s/%s", params.outdir, MANIFEST);
+	fp = fopen(fn, "r");
+	if (!fp)
+		die(EX_NOINPUT, "Cannot open manifest: %s (%s)", fn, strerror(errno));
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#' || !line[0])
+			continue;
+		tab = strrchr(line, '\t');
+		if (!tab)
+			die(EX_DATAERR, "Malformed manifest line: %s", line);
+		*tab = '\0';
+		if (n == size) {
+			size = size ? size * 2 : 1024;
+			manifest_files = (char **) realloc(manifest_files,
+							  size * sizeof(char *));
+			manifest_expected = (char **) realloc(manifest_expected,
+							     size * sizeof(char *));
+			if (!manifest_files || !manifest_expected)
+				die(EX_OSERR, "%s", "Cannot allocate manifest");
+		}
+		manifest_expected[n] = strdup(tab + 1);
+		*strchr(line, '\t') = '\0';
+		manifest_files[n] = strdup(line);
+		if (!manifest_files[n] || !manifest_expected[n])
+			die(EX_OSERR, "%s", "Cannot allocate manifest");
+		n++;
+	}
+	fclose(fp);
+	return n;
+}
+
+/*
+ * Run the containers 0..count-1 through jobs processes, container i in job
+ * i % jobs, and add up their results.
+ */
+static void run_jobs(unsigned int count, struct job_result *total)
+{
+	struct job_result *results;
+	struct stb_alloc_stats as0, as;
+	pid_t pid;
+	int j, status;
+
+	results = (struct job_result *) mmap(NULL,
+			params.jobs * sizeof(struct job_result),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED)
+		die(EX_OSERR, "Cannot mmap job results (%s)", strerror(errno));
+	memset(results, 0, params.jobs * sizeof(struct job_result));
+	queue_depth = metrics_get(METRICS_GAUGE, "stb_queue_depth",
+				  "Containers not yet done", NULL);
+	metrics_set(queue_depth, count);
+
+	fflush(NULL);
+	for (j = 0; j < params.jobs; j++) {
+		pid = fork();
+		if (pid < 0)
+			die(EX_OSERR, "Cannot fork (%s)", strerror(errno));
+		if (pid)
+			continue;
+
+		stb_alloc_stats(&as0);
+		for (unsigned int i = j; i < count; i += params.jobs) {
+			if (params.check) {
+				if (!check(manifest_files[i], manifest_expected[i],
+					   &results[j].bytes))
+					results[j].mismatches++;
+			} else {
+				results[j].bytes += generate(i);
+			}
+			results[j].containers++;
+			metrics_add(queue_depth, -1);
+		}
+		stb_alloc_stats(&as);
+		results[j].allocs = as.allocs - as0.allocs;
+		results[j].arena_allocs = as.arena_allocs - as0.arena_allocs;
+		exit(EX_OK);
+	}
+
+	memset(total, 0, sizeof(*total));
+	while ((pid = wait(&status)) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EX_OK)
+			die(WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE,
+			    "Job %d failed", (int) pid);
+	for (j = 0; j < params.jobs; j++) {
+		total->containers += results[j].containers;
+		total->mismatches += results[j].mismatches;
+		total->bytes += results[j].bytes;
+		total->allocs += results[j].allocs;
+		total->arena_allocs += results[j].arena_allocs;
+	}
+	munmap(results, params.jobs * sizeof(struct job_result));
+}
+
+__attribute__((__noreturn__)) void usage (int status)
+{
+	if (status != 0) {
+		fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+	}
+	else {
+		printf("Usage: %s [options] -o DIR\n", progname);
+		printf(
+			"\n"
+			"Options:\n"
+			" -h, --help              display this message and exit\n"
+			" -v, --verbose           show progress on stderr\n"
+			" -d, --debug             show each container generated\n"
+			" -o, --outdir            directory of the corpus and its manifest.tsv\n"
+			" -n, --count             number of containers (default 1000)\n"
+			" -S, --seed              seed the corpus is generated from (default 1)\n"
+			" -j, --jobs              parallel jobs (default the number of CPUs)\n"
+			" -V, --versions          comma separated container versions to mix\n"
+#ifdef ADD_DILITHIUM
+			"                         (default 1,2,3)\n"
+#else
+			"                         (default 1, 2 and 3 need ADD_DILITHIUM)\n"
+#endif
+			" -k, --keydir            directory of the keys, v2_keys and v3_keys test\n"
+			"                         key directories (default test)\n"
+			" -c, --corrupt           percentage of containers corrupted (default 20)\n"
+			" -u, --unprotected       percentage of v2 and v3 containers with an\n"
+			"                         unprotected payload (default 25)\n"
+			" -m, --max-payload       maximum payload size, with K, M or G suffix\n"
+			"                         (default 64K)\n"
+			" -C, --check             validate the corpus in --outdir against its\n"
+			"                         manifest, instead of generating one\n"
+			"     --metrics           write Prometheus metrics of the run to this file,\n"
+			"                         every $STB_METRICS_INTERVAL seconds and at exit\n"
+			"     --metrics-socket    serve the metrics to scrapes on this Unix socket\n"
+			"\n");
+	};
+	exit(status);
+}
+
+#ifndef _AIX
+static struct option const opts[] = {
+	{ "help",             no_argument,       0,  'h' },
+	{ "verbose",          no_argument,       0,  'v' },
+	{ "debug",            no_argument,       0,  'd' },
+	{ "outdir",           required_argument, 0,  'o' },
+	{ "count",            required_argument, 0,  'n' },
+	{ "seed",             required_argument, 0,  'S' },
+	{ "jobs",             required_argument, 0,  'j' },
+	{ "versions",         required_argument, 0,  'V' },
+	{ "keydir",           required_argument, 0,  'k' },
+	{ "corrupt",          required_argument, 0,  'c' },
+	{ "unprotected",      required_argument, 0,  'u' },
+	{ "max-payload",      required_argument, 0,  'm' },
+	{ "check",            no_argument,       0,  'C' },
+	{ "metrics",          required_argument, 0,  '1' },
+	{ "metrics-socket",   required_argument, 0,  '2' },
+	{ NULL, 0, NULL, 0 }
+};
+#endif
+
+int main(int argc, char* argv[])
+{
+#ifdef ADD_DILITHIUM
+	char default_versions[] = "1,2,3";
+#else
+	char default_versions[] = "1";
+#endif
+	char *versions = default_versions;
+	struct job_result total;
+	struct stb_arena arena;
+	void *arena_buf = NULL;
+	uint64_t start;
+	double secs;
+	int i, r;
+
+	params.keydir = (char *) "test";
+	params.count = 1000;
+	params.seed = 1;
+	params.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	params.corrupt_pct = 20;
+	params.unprotected_pct = 25;
+	params.max_payload = 64 << 10;
+
+	progname = strrchr(argv[0], '/');
+	if (progname != NULL)
+		++progname;
+	else
+		progname = argv[0];
+
+	/* Before anything has OpenSSL allocate, for the arena of --check. */
+	stb_alloc_hooks_install();
+	metrics_init(progname);
+
+#ifdef _AIX
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(*(argv + i), "--help")) {
+			*(argv + i) = "-h";
+		} else if (!strcmp(*(argv + i), "--verbose")) {
+			*(argv + i) = "-v";
+		} else if (!strcmp(*(argv + i), "--debug")) {
+			*(argv + i) = "-d";
+		} else if (!strcmp(*(argv + i), "--outdir")) {
+			*(argv + i) = "-o";
+		} else if (!strcmp(*(argv + i), "--count")) {
+			*(argv + i) = "-n";
+		} else if (!strcmp(*(argv + i), "--seed")) {
+			*(argv + i) = "-S";
+		} else if (!strcmp(*(argv + i), "--jobs")) {
+			*(argv + i) = "-j";
+		} else if (!strcmp(*(argv + i), "--versions")) {
+			*(argv + i) = "-V";
+		} else if (!strcmp(*(argv + i), "--keydir")) {
+			*(argv + i) = "-k";
+		} else if (!strcmp(*(argv + i), "--corrupt")) {
+			*(argv + i) = "-c";
+		} else if (!strcmp(*(argv + i), "--unprotected")) {
+			*(argv + i) = "-u";
+		} else if (!strcmp(*(argv + i), "--max-payload")) {
+			*(argv + i) = "-m";
+		} else if (!strcmp(*(argv + i), "--check")) {
+			*(argv + i) = "-C";
+		} else if (!strcmp(*(argv + i), "--metrics")) {
+			*(argv + i) = "-1";
+		} else if (!strcmp(*(argv + i), "--metrics-socket")) {
+			*(argv + i) = "-2";
+		} else if (!strncmp(*(argv + i), "--", 2)) {
+			fprintf(stderr, "%s: unrecognized option \'%s\'\n", progname,
+					*(argv + i));
+			usage(EX_OK);
+		}
+	}
+#endif
+
+	while (1) {
+		int opt;
+#ifdef _AIX
+		opt = getopt(argc, argv, "??hvdo:n:S:j:V:k:c:u:m:C1:2:");
+#else
+		opt = getopt_long(argc, argv, "?hvdo:n:S:j:V:k:c:u:m:C1:2:", opts, NULL);
+#endif
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'h':
+			usage(EX_OK);
+			break;
+		case '?':
+			usage(EX_USAGE);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'd':
+			debug = true;
+			break;
+		case 'o':
+			params.outdir = optarg;
+			break;
+		case 'n':
+			params.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			params.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			params.jobs = atoi(optarg);
+			break;
+		case 'V':
+			versions = optarg;
+			break;
+		case 'k':
+			params.keydir = optarg;
+			break;
+		case 'c':
+			params.corrupt_pct = atoi(optarg);
+			break;
+		case 'u':
+			params.unprotected_pct = atoi(optarg);
+			break;
+		case 'm':
+			params.max_payload = parse_size(optarg);
+			break;
+		case 'C':
+			params.check = true;
+			break;
+		case '1':
+			metrics.file = optarg;
+			break;
+		case '2':
+			metrics.socket = optarg;
+			break;
+		default:
+			usage(EX_USAGE);
+		}
+	}
+
+	if (!params.outdir)
+		die(EX_USAGE, "%s", "Corpus directory (--outdir) required");
+	if (params.jobs < 1)
+		params.jobs = 1;
+	if (params.corrupt_pct > 100 || params.unprotected_pct > 100)
+		die(EX_USAGE, "%s", "Percentages must be between 0 and 100");
+	if (!metrics_start())
+		die(EX_OSERR, "Cannot serve metrics: %s", strerror(errno));
+
+	for (char *s = strtok(versions, ","); s; s = strtok(NULL, ",")) {
+		int v = atoi(s);
+
+		if (v < 1 || v > 3)
+			die(EX_USAGE, "Invalid container version: %s", s);
+#ifndef ADD_DILITHIUM
+		if (v > 1)
+			die(EX_USAGE, "Container version %d needs Dilithium "
+			    "support, build with ADD_DILITHIUM", v);
+#endif
+		if (params.version_count == 3)
+			die(EX_USAGE, "%s", "At most 3 versions");
+		params.versions[params.version_count++] = v;
+	}
+	if (!params.version_count)
+		die(EX_USAGE, "%s", "No container version");
+
+	stb = stb_ctx_new();
+	if (!stb)
+		die(EX_OSERR, "%s", "Cannot allocate container context");
+
+	if (params.check) {
+		params.count = read_manifest();
+		arena_buf = malloc(ARENA_SIZE);
+		if (!arena_buf)
+			die(EX_OSERR, "%s", "Cannot allocate arena");
+		stb_arena_init(&arena, arena_buf, ARENA_SIZE);
+		r = stb_ctx_set_arena(stb, &arena);
+		if (r)
+			verbose_msg("Validating without an arena: %s",
+				    stb_ctx_error(stb));
+		start = now_ns();
+		run_jobs(params.count, &total);
+		secs = (now_ns() - start) / 1e9;
+		printf("%u containers, %u not as expected, %.3f s, "
+		       "%.1f containers/s, %.1f MB/s, %d jobs\n",
+		       total.containers, total.mismatches, secs,
+		       total.containers / secs, total.bytes / secs / 1e6,
+		       params.jobs);
+		if (total.containers)
+			printf("%.1f allocations per container, %.1f from the "
+			       "arena\n", (double) total.allocs / total.containers,
+			       (double) total.arena_allocs / total.containers);
+		stb_ctx_free(stb);
+		free(arena_buf);
+		return total.mismatches ? EX_DATAERR : EX_OK;
+	}
+
+	if (mkdir(params.outdir, 0755) && errno != EEXIST)
+		die(EX_CANTCREAT, "Cannot create directory: %s (%s)", params.outdir,
+		    strerror(errno));
+
+	// Load the keys once, the jobs inherit them.
+	for (i = 0; i < params.version_count; i++) {
+		if (params.versions[i] == 1) {
+			load_keyset(KEYSET_V1);
+		} else if (params.versions[i] == 2) {
+			load_keyset(KEYSET_V2_BOOT);
+			load_keyset(KEYSET_V2_RUNTIME);
+		} else {
+			load_keyset(KEYSET_V3_BOOT);
+			load_keyset(KEYSET_V3_RUNTIME);
+		}
+	}
+
+	start = now_ns();
+	run_jobs(params.count, &total);
+	write_manifest();
+	secs = (now_ns() - start) / 1e9;
+	verbose_msg("%u containers, %.1f MB, in %.3f s, %.1f containers/s, "
+		    "%d jobs", total.containers, total.bytes / 1e6, secs,
+		    total.containers / secs, params.jobs);
+
+	stb_ctx_free(stb);
+	return 0;
+}
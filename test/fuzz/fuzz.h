@@ -0,0 +1,46 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Shared by the libFuzzer harnesses of the container parsers. A parser
+ * only hands back pointers into the input, so a harness reads every byte
+ * of each struct they point to: AddressSanitizer then reports any pointer
+ * the parser let past the end of the input.
+ */
+
+#ifndef __STB_FUZZ_H
+#define __STB_FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libstbcontainer.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static volatile uint8_t fuzz_sink;
+
+static inline void touch(const void *p, size_t len)
+{
+	const volatile uint8_t *b = (const volatile uint8_t *) p;
+	uint8_t x = 0;
+
+	for (size_t i = 0; i < len; i++)
+		x ^= b[i];
+	fuzz_sink ^= x;
+}
+
+#endif /* __STB_FUZZ_H */
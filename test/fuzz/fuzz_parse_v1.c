@@ -0,0 +1,36 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* libFuzzer harness of parse_stb_container(). */
+
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct parsed_stb_container c;
+
+	if (parse_stb_container(data, size, &c))
+		return 0;
+
+	touch(c.c, sizeof(ROM_container_raw));
+	// The ECID and SW key counts size the prefix and SW headers.
+	touch(c.ph, sizeof(ROM_prefix_header_raw) + c.ph->ecid_count * ECID_SIZE);
+	touch(c.pd, 3 * sizeof(ecc_signature_t)
+	      + c.ph->sw_key_count * sizeof(ecc_key_t));
+	touch(c.sh, sizeof(ROM_sw_header_raw) + c.sh->ecid_count * ECID_SIZE);
+	touch(c.ssig, sizeof(ROM_sw_sig_raw));
+	return 0;
+}
@@ -0,0 +1,34 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* libFuzzer harness of parse_stb_container_v2(). */
+
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct parsed_stb_container_v2 c;
+
+	if (parse_stb_container_v2(data, size, &c))
+		return 0;
+
+	touch(c.c, sizeof(ROM_container_v2_raw));
+	touch(c.ph, sizeof(ROM_prefix_header_v2_raw));
+	touch(c.pd, sizeof(ROM_prefix_data_v2_raw));
+	touch(c.sh, sizeof(ROM_sw_header_v2_raw));
+	touch(c.ssig, sizeof(ROM_sw_sig_v2_raw));
+	return 0;
+}
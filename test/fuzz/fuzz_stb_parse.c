@@ -0,0 +1,51 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libFuzzer harness of the stb_is_*container() checks, stb_parse() and
+ * stb_validate(), which reads the keys, signatures and headers that
+ * stb_parse() points at.
+ */
+
+#include <stdlib.h>
+
+#include "fuzz.h"
+
+static struct stb_ctx *ctx;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct stb_container c;
+	struct stb_validation v;
+	size_t hdr_sz;
+
+	if (!ctx) {
+		ctx = stb_ctx_new();
+		if (!ctx)
+			abort();
+	}
+
+	fuzz_sink ^= stb_is_container(data, size);
+	fuzz_sink ^= stb_is_v2_container(data, size);
+	fuzz_sink ^= stb_is_v3_container(data, size);
+
+	if (stb_parse(ctx, data, size, &c))
+		return 0;
+
+	hdr_sz = stb_header_size(c.version);
+	stb_validate(ctx, &c, data + hdr_sz, size - hdr_sz, true, &v);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# Build the seed corpora of the container parser fuzzers from the test
+# keys: small valid and corrupted containers from test/corpus/gencorpus,
+# sorted by version into v1, v2 and v3 for the fuzz_parse_v* harnesses,
+# and all of them in all for fuzz_stb_parse.
+#
+# v2 and v3 seeds need gencorpus built with ADD_DILITHIUM, only v1 seeds
+# are made otherwise.
+
+P=${0##*/}
+D=$(cd "${0%/*}" && pwd)
+K=$(cd "$D/.." && pwd)
+
+usage () {
+    echo ""
+    echo "	Options:"
+    echo "	-h, --help              display this message and exit"
+    echo "	-B, --bindir            directory holding test/corpus/gencorpus (default: PATH)"
+    echo "	-o, --outdir            directory of the seed corpora (default test/fuzz/seeds)"
+    echo "	-n, --count             containers generated (default 64)"
+    echo ""
+    exit 1
+}
+
+die () {
+    echo "$P: $*" 1>&2
+    exit 1
+}
+
+for arg in "$@"; do
+  shift
+  case "$arg" in
+    "--help")     set -- "$@" "-h" ;;
+    "--bindir")   set -- "$@" "-B" ;;
+    "--outdir")   set -- "$@" "-o" ;;
+    "--count")    set -- "$@" "-n" ;;
+    *)            set -- "$@" "$arg"
+  esac
+done
+
+while getopts -- ?hB:o:n: opt
+do
+  case "$opt" in
+    B) BINDIR="$OPTARG";;
+    o) OUTDIR="$OPTARG";;
+    n) COUNT="$OPTARG";;
+    h|\?) usage;;
+  esac
+done
+
+: "${OUTDIR:=$D/seeds}"
+: "${COUNT:=64}"
+
+test "$BINDIR" && PATH="$(cd "$BINDIR" && pwd)/test/corpus:$PATH"
+command -v gencorpus >/dev/null || die "Required command \"gencorpus\" not found"
+
+GEN="$OUTDIR/gen"
+rm -rf "$GEN" && mkdir -p "$OUTDIR"/{v1,v2,v3,all} || die "Cannot create $OUTDIR"
+
+# Small payloads: the parsers only look at the headers.
+GENARGS=(--outdir "$GEN" --keydir "$K" --count "$COUNT" --seed 1
+         --corrupt 50 --unprotected 50 --max-payload 256)
+gencorpus "${GENARGS[@]}" --versions 1,2,3 2>/dev/null ||
+    gencorpus "${GENARGS[@]}" --versions 1 ||
+    die "gencorpus failed"
+
+while IFS=$'\t' read -r file version rest; do
+    case "$file" in "#"*) continue;; esac
+    cp "$GEN/$file" "$OUTDIR/v$version/$file" &&
+        cp "$GEN/$file" "$OUTDIR/all/$file" || die "Cannot copy $file"
+done < "$GEN/manifest.tsv"
+rm -rf "$GEN"
+
+echo "$P: seeds in $OUTDIR/{v1,v2,v3,all}" 1>&2
@@ -0,0 +1,88 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs a harness over the files, or the files in the directories, given,
+ * for compilers without libFuzzer: to replay a crash, or to check the seed
+ * corpus under AddressSanitizer.
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int run_file(const char *fn)
+{
+	struct stat st;
+	uint8_t *buf;
+	FILE *fp;
+
+	fp = fopen(fn, "rb");
+	if (!fp || fstat(fileno(fp), &st)) {
+		fprintf(stderr, "Cannot open %s\n", fn);
+		return 1;
+	}
+	// Exactly the size of the input, for AddressSanitizer to catch overreads.
+	buf = (uint8_t *) malloc(st.st_size ? st.st_size : 1);
+	if (!buf || fread(buf, 1, st.st_size, fp) != (size_t) st.st_size) {
+		fprintf(stderr, "Cannot read %s\n", fn);
+		fclose(fp);
+		free(buf);
+		return 1;
+	}
+	fclose(fp);
+	LLVMFuzzerTestOneInput(buf, st.st_size);
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char fn[4096];
+	struct dirent *de;
+	struct stat st;
+	int i, n = 0, r = 0;
+	DIR *d;
+
+	for (i = 1; i < argc; i++) {
+		if (stat(argv[i], &st) || !S_ISDIR(st.st_mode)) {
+			r |= run_file(argv[i]);
+			n++;
+			continue;
+		}
+		d = opendir(argv[i]);
+		if (!d) {
+			fprintf(stderr, "Cannot open %s\n", argv[i]);
+			r = 1;
+			continue;
+		}
+		while ((de = readdir(d))) {
+			snprintf(fn, sizeof(fn), "%s/%s", argv[i], de->d_name);
+			if (stat(fn, &st) || !S_ISREG(st.st_mode))
+				continue;
+			r |= run_file(fn);
+			n++;
+		}
+		closedir(d);
+	}
+	fprintf(stderr, "%s: ran %d inputs\n", argv[0], n);
+	return r;
+}
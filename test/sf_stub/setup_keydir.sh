@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Populate a key directory for the sf_client stand-in, mapping the default
+# signframework project names used by crtSignedContainer.sh to the imprint
+# test keys in test/keys.
+#
+# Usage: setup_keydir.sh [keydir]    (default: test/sf_stub/keydir)
+#
+
+HERE=$(cd "${0%/*}" && pwd)
+KEYS=$(cd "$HERE/../keys" && pwd)
+KEYDIR=${1:-$HERE/keydir}
+
+: "${SF_HW_SIGNING_PROJECT_BASE:=sign_ecc_pwr_hw_key}"
+: "${SF_FW_SIGNING_PROJECT_BASE:=sign_ecc_pwr_fw_key_op_bld}"
+
+mkdir -p "$KEYDIR" || exit 1
+
+for KEY in a b c; do
+    ln -sf "$KEYS/hw_key_$KEY.key" "$KEYDIR/${SF_HW_SIGNING_PROJECT_BASE}_$KEY.key"
+done
+
+# Only one sample SW key is provided, use it for P, Q and R.
+for KEY in p q r; do
+    ln -sf "$KEYS/sw_key_p.key" "$KEYDIR/${SF_FW_SIGNING_PROJECT_BASE}_$KEY.key"
+done
+
+echo "Key directory ready: $KEYDIR"
+echo "Use: export SF_STUB_KEYDIR=$KEYDIR PATH=$HERE:\$PATH"
@@ -0,0 +1,148 @@
+#!/bin/bash
+
+# Set up a SoftHSM token holding the test keys, as a local stand-in for the
+# production PKCS#11 HSM, and benchmark signatures per second through
+# "openssl dgst -engine pkcs11" (one process, session and login per
+# signature) and through p11sign (one login, a pool of sessions).
+#
+# The token is left in place so it can be used with crtSignedContainer.sh,
+# the variables to export are printed at the end.
+
+P=${0##*/}
+D=$(cd "${0%/*}" && pwd)
+
+usage () {
+    echo ""
+    echo "	Options:"
+    echo "	-h, --help              display this message and exit"
+    echo "	-m, --module            SoftHSM PKCS#11 module"
+    echo "	-t, --tokendir          directory to create the token in (default $D/tokens)"
+    echo "	-n, --count             number of signatures per run (default 200)"
+    echo "	-s, --sessions          comma separated session counts for p11sign (default 1,2,4,8)"
+    echo "	-e, --engine-count      number of signatures via the openssl engine (default 20,"
+    echo "	                        0 to skip)"
+    echo ""
+    exit 1
+}
+
+die () {
+    echo "$P: $*" 1>&2
+    exit 1
+}
+
+for arg in "$@"; do
+  shift
+  case "$arg" in
+    "--help")         set -- "$@" "-h" ;;
+    "--module")       set -- "$@" "-m" ;;
+    "--tokendir")     set -- "$@" "-t" ;;
+    "--count")        set -- "$@" "-n" ;;
+    "--sessions")     set -- "$@" "-s" ;;
+    "--engine-count") set -- "$@" "-e" ;;
+    *)                set -- "$@" "$arg"
+  esac
+done
+
+while getopts -- ?hm:t:n:s:e: opt
+do
+  case "${opt,,}" in
+    m) MODULE="$OPTARG";;
+    t) TOKENDIR="$OPTARG";;
+    n) COUNT="$OPTARG";;
+    s) SESSIONS="$OPTARG";;
+    e) ENGINE_COUNT="$OPTARG";;
+    h|\?) usage;;
+  esac
+done
+
+for m in "$MODULE" /usr/lib64/pkcs11/libsofthsm2.so \
+         /usr/lib/softhsm/libsofthsm2.so /usr/lib/x86_64-linux-gnu/softhsm/libsofthsm2.so
+do
+    test -f "$m" && MODULE="$m" && break
+done
+test -f "$MODULE" || die "SoftHSM module not found, use --module"
+
+: "${TOKENDIR:=$D/tokens}"
+: "${COUNT:=200}"
+: "${SESSIONS:=1,2,4,8}"
+: "${ENGINE_COUNT:=20}"
+: "${SB_PKCS11_TOKEN:=P9Signing}"
+: "${SB_PKCS11_PIN:=1234}"
+: "${SF_HW_SIGNING_PROJECT_BASE:=sign_ecc_pwr_hw_key}"
+: "${SF_FW_SIGNING_PROJECT_BASE:=sign_ecc_pwr_fw_key_op_bld}"
+
+KEYS=$(cd "$D/../keys" && pwd)
+
+command -v softhsm2-util &>/dev/null || die "softhsm2-util not found in PATH"
+command -v p11sign &>/dev/null || die "p11sign not found in PATH"
+
+export SOFTHSM2_CONF="$TOKENDIR/softhsm2.conf"
+export SB_PKCS11_PIN
+
+#
+# Create the token and import the test keys, labeled as the signing
+# projects crtSignedContainer.sh asks for.
+#
+if [ ! -f "$SOFTHSM2_CONF" ]
+then
+    mkdir -p "$TOKENDIR"
+    echo "directories.tokendir = $TOKENDIR" > "$SOFTHSM2_CONF"
+
+    softhsm2-util --init-token --free --label "$SB_PKCS11_TOKEN" \
+                  --so-pin "$SB_PKCS11_PIN" --pin "$SB_PKCS11_PIN" >/dev/null || \
+        die "Cannot create token"
+
+    id=1
+    for k in hw_key_a:${SF_HW_SIGNING_PROJECT_BASE}_a \
+             hw_key_b:${SF_HW_SIGNING_PROJECT_BASE}_b \
+             hw_key_c:${SF_HW_SIGNING_PROJECT_BASE}_c \
+             sw_key_p:${SF_FW_SIGNING_PROJECT_BASE}_p
+    do
+        openssl pkcs8 -topk8 -nocrypt -in "$KEYS/${k%%:*}.key" \
+                -out "$TOKENDIR/key.p8" || die "Cannot convert ${k%%:*}"
+        softhsm2-util --import "$TOKENDIR/key.p8" --token "$SB_PKCS11_TOKEN" \
+                      --label "${k##*:}" --id "$(printf %04x $id)" \
+                      --pin "$SB_PKCS11_PIN" >/dev/null || \
+            die "Cannot import ${k%%:*}"
+        id=$((id + 1))
+    done
+    rm -f "$TOKENDIR/key.p8"
+    echo "--> $P: Created token $SB_PKCS11_TOKEN in $TOKENDIR"
+fi
+
+LABEL="${SF_HW_SIGNING_PROJECT_BASE}_a"
+
+#
+# One signature per openssl process, as crtSignedContainer.sh does without
+# the native signer.
+#
+if [ "$ENGINE_COUNT" -gt 0 ]
+then
+    head -c 4096 /dev/urandom > "$TOKENDIR/prefix_hdr"
+    start=$(date +%s.%N)
+    for i in $(seq "$ENGINE_COUNT"); do
+        PKCS11_MODULE_PATH="$MODULE" openssl dgst -engine pkcs11 -keyform engine \
+            -sign "pkcs11:token=$SB_PKCS11_TOKEN;object=$LABEL;pin-value=$SB_PKCS11_PIN" \
+            -sha512 -out "$TOKENDIR/prefix_hdr.sig" "$TOKENDIR/prefix_hdr" \
+            &>/dev/null || { echo "--> $P: openssl pkcs11 engine not usable, skipped"; break; }
+    done
+    end=$(date +%s.%N)
+    test -f "$TOKENDIR/prefix_hdr.sig" && \
+        echo "$ENGINE_COUNT $end $start" | \
+        awk '{ printf "%d signatures, openssl engine: %.3f s, %.1f signatures/s\n",
+               $1, $2 - $3, $1 / ($2 - $3) }'
+    rm -f "$TOKENDIR/prefix_hdr" "$TOKENDIR/prefix_hdr.sig"
+fi
+
+IFS=","
+for s in $SESSIONS; do
+    p11sign -m "$MODULE" -t "$SB_PKCS11_TOKEN" -k "$LABEL" -s "$s" --bench "$COUNT" || \
+        die "p11sign benchmark failed"
+done
+unset IFS
+
+echo ""
+echo "To sign with this token:"
+echo "    export SOFTHSM2_CONF=$SOFTHSM2_CONF SB_PKCS11_PIN=$SB_PKCS11_PIN"
+echo "    export SB_PKCS11_MODULE=$MODULE SB_PKCS11_TOKEN=$SB_PKCS11_TOKEN"
+echo "    export SB_PKCS11_NATIVE=true"
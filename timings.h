@@ -0,0 +1,326 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-phase timings of the command line tools (--timings, --timings-json).
+ *
+ * A tool brackets each phase with timings_begin() and timings_end(); the
+ * phases of the same name add up. At exit the phases, with the bytes each
+ * one hashed or wrote, are reported to stderr along with the CPU time, peak
+ * RSS and page faults of the process, as a table or as one line of JSON.
+ *
+ * Scripts running the tools (crtSignedContainer.sh, the p11sign server) get
+ * the same report by setting STB_TIMINGS to "table" or "json" in the
+ * environment, and STB_TIMINGS_FILE to append the reports to a file.
+ *
+ * A tool whose crypto library counts its allocations sets alloc_counts, and
+ * the report includes them.
+ *
+ * With STB_TRACE_FILE set, each phase, and the process as a whole, is also
+ * appended to that file as a Chrome trace event, for chrome://tracing or
+ * Perfetto. Any number of processes may share one trace file: the first
+ * one starts the JSON array, which trace viewers accept unterminated, and
+ * each event is a single append. Timestamps are wall clock microseconds,
+ * so that the spans crtSignedContainer.sh writes line up with them.
+ */
+
+#ifndef __STB_TIMINGS_H
+#define __STB_TIMINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMINGS_MAX_PHASES 32
+
+enum timings_format {
+	TIMINGS_OFF = 0,
+	TIMINGS_TABLE,
+	TIMINGS_JSON,
+};
+
+struct timings_phase {
+	const char *name;
+	unsigned int count;
+	uint64_t ns;
+	uint64_t bytes;
+	uint64_t started;	/* 0 unless the phase is running */
+	uint64_t started_us;	/* wall clock, for the trace */
+};
+
+struct timings {
+	int format;
+	const char *tool;
+	uint64_t started;
+	uint64_t started_us;
+	bool tracing;
+	int trace_fd;
+	int nphases;
+	struct timings_phase phases[TIMINGS_MAX_PHASES];
+	void (*alloc_counts)(uint64_t *allocs, uint64_t *bytes,
+			     uint64_t *arena_allocs);
+};
+
+struct timings timings;
+
+void timings_enable(int format);
+void timings_report(void);
+void timings_end(int phase, uint64_t bytes);
+void timings_trace_open(const char *fn);
+
+uint64_t timings_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t timings_wall_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/*
+ * Start the clock, and pick up STB_TIMINGS and STB_TRACE_FILE from the
+ * environment.
+ */
+void timings_init(const char *tool)
+{
+	const char *env = getenv("STB_TIMINGS");
+	const char *trace = getenv("STB_TRACE_FILE");
+
+	timings.tool = tool;
+	timings.started = timings_now();
+	timings.started_us = timings_wall_us();
+	if (env && !strcmp(env, "json"))
+		timings_enable(TIMINGS_JSON);
+	else if (env && *env && strcmp(env, "0"))
+		timings_enable(TIMINGS_TABLE);
+	if (trace && *trace)
+		timings_trace_open(trace);
+}
+
+void timings_enable(int format)
+{
+	if (timings.format == TIMINGS_OFF)
+		atexit(timings_report);
+	timings.format = format;
+}
+
+/* Returns the phase to pass to timings_end(), -1 when not timing. */
+int timings_begin(const char *name)
+{
+	int i;
+
+	if (timings.format == TIMINGS_OFF && !timings.tracing)
+		return -1;
+
+	for (i = 0; i < timings.nphases; i++)
+		if (!strcmp(timings.phases[i].name, name))
+			break;
+	if (i == TIMINGS_MAX_PHASES)
+		return -1;
+	if (i == timings.nphases) {
+		timings.phases[i].name = name;
+		timings.nphases++;
+	}
+	timings.phases[i].started = timings_now();
+	timings.phases[i].started_us = timings_wall_us();
+	return i;
+}
+
+void timings_trace_event(const char *name, uint64_t ts_us, uint64_t dur_us,
+			 uint64_t bytes)
+{
+	char buf[256];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"cat\":\"%s\","
+		     "\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,"
+		     "\"tid\":%d,\"args\":{\"bytes\":%llu}},\n", name,
+		     timings.tool, (unsigned long long) ts_us,
+		     (unsigned long long) dur_us, (int) getpid(), (int) getpid(),
+		     (unsigned long long) bytes);
+	if (n > 0 && n < (int) sizeof(buf) && write(timings.trace_fd, buf, n) != n)
+		timings.tracing = false;
+}
+
+/* The span of the whole process, at exit. */
+static void timings_trace_close(void)
+{
+	int i;
+
+	for (i = 0; i < timings.nphases; i++)
+		if (timings.phases[i].started)
+			timings_end(i, 0);
+	timings_trace_event(timings.tool, timings.started_us,
+			    (timings_now() - timings.started) / 1000, 0);
+	close(timings.trace_fd);
+	timings.tracing = false;
+}
+
+void timings_trace_open(const char *fn)
+{
+	char buf[256];
+	int fd, n;
+
+	fd = open(fn, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+	if (fd >= 0) {
+		if (write(fd, "[\n", 2) != 2) {
+			close(fd);
+			return;
+		}
+	} else {
+		fd = open(fn, O_WRONLY | O_APPEND);
+		if (fd < 0)
+			return;
+	}
+	timings.trace_fd = fd;
+	timings.tracing = true;
+
+	n = snprintf(buf, sizeof(buf), "{\"name\":\"process_name\",\"ph\":\"M\","
+		     "\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+		     (int) getpid(), timings.tool);
+	if (n > 0 && n < (int) sizeof(buf) && write(fd, buf, n) != n)
+		timings.tracing = false;
+	atexit(timings_trace_close);
+}
+
+void timings_end(int phase, uint64_t bytes)
+{
+	struct timings_phase *tp;
+	uint64_t ns;
+
+	if (phase < 0)
+		return;
+
+	tp = &timings.phases[phase];
+	ns = timings_now() - tp->started;
+	tp->ns += ns;
+	tp->bytes += bytes;
+	tp->count++;
+	tp->started = 0;
+	if (timings.tracing)
+		timings_trace_event(tp->name, tp->started_us, ns / 1000, bytes);
+}
+
+static double timings_ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+static double timings_tv_ms(struct timeval tv)
+{
+	return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+void timings_report(void)
+{
+	const char *fn = getenv("STB_TIMINGS_FILE");
+	FILE *fp = stderr;
+	struct rusage ru;
+	uint64_t total = timings_now() - timings.started;
+	uint64_t allocs = 0, alloc_bytes = 0, arena_allocs = 0;
+	int i;
+
+	if (timings.format == TIMINGS_OFF)
+		return;
+
+	/* A phase left running was cut short by an exit. */
+	for (i = 0; i < timings.nphases; i++)
+		if (timings.phases[i].started)
+			timings_end(i, 0);
+
+	memset(&ru, 0, sizeof(ru));
+	getrusage(RUSAGE_SELF, &ru);
+	if (timings.alloc_counts)
+		timings.alloc_counts(&allocs, &alloc_bytes, &arena_allocs);
+
+	if (fn && *fn) {
+		fp = fopen(fn, "a");
+		if (!fp)
+			fp = stderr;
+	}
+
+	if (timings.format == TIMINGS_JSON) {
+		fprintf(fp, "{\"tool\":\"%s\",\"total_ms\":%.3f,"
+			"\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld,"
+			"\"minor_faults\":%ld,\"major_faults\":%ld,",
+			timings.tool, timings_ms(total),
+			timings_tv_ms(ru.ru_utime), timings_tv_ms(ru.ru_stime),
+			(long) ru.ru_maxrss, (long) ru.ru_minflt,
+			(long) ru.ru_majflt);
+		if (timings.alloc_counts)
+			fprintf(fp, "\"allocs\":%llu,\"alloc_bytes\":%llu,"
+				"\"arena_allocs\":%llu,",
+				(unsigned long long) allocs,
+				(unsigned long long) alloc_bytes,
+				(unsigned long long) arena_allocs);
+		fprintf(fp, "\"phases\":[");
+		for (i = 0; i < timings.nphases; i++)
+			fprintf(fp, "%s{\"name\":\"%s\",\"count\":%u,"
+				"\"ms\":%.3f,\"bytes\":%llu}",
+				i ? "," : "", timings.phases[i].name,
+				timings.phases[i].count,
+				timings_ms(timings.phases[i].ns),
+				(unsigned long long) timings.phases[i].bytes);
+		fprintf(fp, "]}\n");
+	} else {
+		fprintf(fp, "%s timings:\n", timings.tool);
+		fprintf(fp, "  %-20s %6s %12s %14s %10s\n", "phase", "count",
+			"time (ms)", "bytes", "MB/s");
+		for (i = 0; i < timings.nphases; i++) {
+			struct timings_phase *tp = &timings.phases[i];
+
+			fprintf(fp, "  %-20s %6u %12.3f", tp->name, tp->count,
+				timings_ms(tp->ns));
+			if (tp->bytes && tp->ns)
+				fprintf(fp, " %14llu %10.1f\n",
+					(unsigned long long) tp->bytes,
+					tp->bytes * 1e3 / tp->ns);
+			else
+				fprintf(fp, " %14s %10s\n", "-", "-");
+		}
+		fprintf(fp, "  %-20s %6s %12.3f\n", "total", "",
+			timings_ms(total));
+		fprintf(fp, "  cpu user %.3f ms, sys %.3f ms, peak RSS %ld KB, "
+			"page faults %ld minor, %ld major\n",
+			timings_tv_ms(ru.ru_utime), timings_tv_ms(ru.ru_stime),
+			(long) ru.ru_maxrss, (long) ru.ru_minflt,
+			(long) ru.ru_majflt);
+		if (timings.alloc_counts)
+			fprintf(fp, "  allocations %llu (%llu bytes), %llu from "
+				"the arena\n", (unsigned long long) allocs,
+				(unsigned long long) alloc_bytes,
+				(unsigned long long) arena_allocs);
+	}
+
+	if (fp != stderr)
+		fclose(fp);
+}
+
+#endif /* __STB_TIMINGS_H */
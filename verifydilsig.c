@@ -15,6 +15,7 @@
  */
 
 #include "dilutils.h"
+#include "timings.h"
 #include "mlca2.h"
 #include "pqalgs.h"
 
@@ -38,6 +39,9 @@ int main(int argc, char** argv)
     const char* sDigestFile      = NULL;
     const char* sSigFile         = NULL;
     bool        sPrintHelp       = false;
+    int         sTiming          = -1;
+
+    timings_init("verifydilsig");
 
     for(sIdx = 1; sIdx < argc; sIdx++)
     {
@@ -60,6 +64,14 @@ int main(int argc, char** argv)
             sIdx++;
             sSigFile = argv[sIdx];
         }
+        else if(strcmp(argv[sIdx], "--timings") == 0)
+        {
+            timings_enable(TIMINGS_TABLE);
+        }
+        else if(strcmp(argv[sIdx], "--timings-json") == 0)
+        {
+            timings_enable(TIMINGS_JSON);
+        }
         else
         {
             printf("**** ERROR : Unknown parameter : %s\n", argv[sIdx]);
@@ -76,6 +88,8 @@ int main(int argc, char** argv)
     if(sPrintHelp)
     {
         printf("\nverifydilsig -i <input digest> -k <public key> -s <signature filename>\n");
+        printf("  --timings        print the time spent in each phase, peak RSS and page faults\n");
+        printf("  --timings-json   same as --timings, as one line of JSON\n");
         exit(0);
     }
 
@@ -92,6 +106,7 @@ int main(int argc, char** argv)
         exit(1);
     }
 
+    sTiming = timings_begin("read files");
     sRc = readFile(sDigest, &sDigestBytes, sDigestFile);
     if(0 == sRc && SHA3_512_DigestSize != sDigestBytes)
     {
@@ -108,7 +123,9 @@ int main(int argc, char** argv)
     {
         sRc = readFile(sSignature, &sSignatureBytes, sSigFile);
     }
+    timings_end(sTiming, sRc ? 0 : sDigestBytes + sWirePubKeyBytes + sSignatureBytes);
 
+    sTiming = timings_begin("key decode");
     if(0 == sRc)
     {
         // Raw public key size for dilithium r2 8/7
@@ -149,6 +166,9 @@ int main(int argc, char** argv)
         }
     }
 
+    timings_end(sTiming, 0);
+
+    sTiming = timings_begin("mlca init");
     if(0 == sRc)
     {
         sMlRc = mlca_init(&sCtx, 1, 0);
@@ -176,10 +196,14 @@ int main(int argc, char** argv)
             sRc = 1;
         }
     }
+    timings_end(sTiming, 0);
+
     if(0 == sRc)
     {
         printf("Verifying %s signature ...\n", gAlgname);
+        sTiming = timings_begin("verify");
         sMlRc = mlca_sig_verify(&sCtx, sDigest, sDigestBytes, sSignature, sSignatureBytes, sPubKey);
+        timings_end(sTiming, sDigestBytes);
         if(1 != sMlRc)
         {
             printf("**** ERROR: Signature verification failure : %d\n", sMlRc);